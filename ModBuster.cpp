@@ -12,6 +12,19 @@
 #include <cstdio>       // _popen, _pclose
 #include <thread>       // std::this_thread::sleep_for
 #include <cerrno>       // errno
+#include <vector>
+#include <map>
+#include <set>
+#include <queue>        // std::priority_queue
+#include <functional>   // std::function
+#include <mutex>
+#include <atomic>
+#include <memory>       // std::unique_ptr, std::shared_ptr
+#include <array>
+#include <bitset>
+#if defined(_M_X64) || defined(__SSE2__)
+#include <emmintrin.h>  // SSE2（スナップショットの差分）
+#endif
 
 extern "C" {
 #include "libmodbus/modbus.h"
@@ -19,10 +32,46 @@ extern "C" {
 
 // ===== 設定用 define =====
 
+// 通信方式（0: Modbus TCP, 1: Modbus RTU）
+#define MODBUS_USE_RTU     0
+// 1: Modbus TCP の代わりに Modbus/UDP で接続先と通信する（接続・再接続が不要、
+//    応答がなければ同じトランザクション ID で再送する）
+#define MODBUS_USE_UDP     0
+
 // Modbus 接続先
 #define MODBUS_SERVER_IP   "192.168.3.201"
 #define MODBUS_SERVER_PORT 502
 #define MODBUS_SLAVE_ID    1
+// 1: 接続先ゲートウェイの奥にある複数のユニットを、1本の TCP 接続を共有して
+//    ユニットごとのスレッドで並列にポーリングする（表示・送信は MODBUS_SLAVE_ID のもの）
+#define MODBUS_TCP_MULTI_UNIT    0
+#define MODBUS_TCP_UNIT_IDS      { MODBUS_SLAVE_ID, 2, 3 }
+// ゲートウェイが応答を返す前に受け付ける要求の数
+#define MODBUS_TCP_MAX_IN_FLIGHT 4
+
+// Modbus RTU 接続先（MODBUS_USE_RTU = 1 のとき）
+#define MODBUS_RTU_DEVICE    "COM3"
+#define MODBUS_RTU_BAUD      19200
+#define MODBUS_RTU_PARITY    'E'
+#define MODBUS_RTU_DATA_BIT  8
+#define MODBUS_RTU_STOP_BIT  1
+// 同じバス上でポーリングするスレーブ（表示・送信は MODBUS_SLAVE_ID のもの）
+#define MODBUS_RTU_SLAVE_IDS { MODBUS_SLAVE_ID }
+// 1: 他のマスターが使っているバスを受信のみで監視する（送信・時刻書き込みはしない）
+#define MODBUS_RTU_SNIFFER   0
+// 1: 複数のシリアルポートをポートごとのスレッドで並列にポーリングする
+#define MODBUS_RTU_MULTI_PORT 0
+// ポートごとのデバイスとスレーブ（表示・送信は先頭ポートの MODBUS_SLAVE_ID）
+#define MODBUS_RTU_PORTS { { "COM3", { MODBUS_SLAVE_ID } }, { "COM4", { 1 } } }
+// ポートの異常（EIO・EBADF・ETIMEDOUT）で要求がこの回数続けて失敗したらポートを開き直す
+#define MODBUS_RTU_MAX_LINK_ERRORS  5
+// ポートを開き直すまでの待ち時間（続けて失敗するたびに2倍にし、上限で止める）
+#define MODBUS_RTU_RECONNECT_MS     3000
+#define MODBUS_RTU_RECONNECT_MAX_MS 60000
+// 1: MODBUS_RTU_PORTS のスレーブを Modbus TCP で公開するゲートウェイとして動く
+#define MODBUS_RTU_GATEWAY   0
+#define MODBUS_GATEWAY_PORT  502
+#define MODBUS_GATEWAY_MAX_CLIENTS 16
 
 // 読み取り範囲
 #define MODBUS_READ_START_ADDR  200
@@ -47,6 +96,58 @@ extern "C" {
 #define CURL_SEND_INTERVAL_MS       30000   // 30sごとに curl 送信
 #define TIME_WRITE_INTERVAL_MS      10000   // 10sごとに時刻を書き込み
 
+// タグごとのスキャンクラス（MODBUS_SLAVE_ID の読み取り。タグの割り当ては TAG_SCANS）
+// 1: タグごとの周期で必要なレジスタだけを読む（0: 読み取り範囲全体を 0.5s ごとに読む）
+#define MODBUS_SCAN_CLASSES         1
+#define SCAN_FAST_MS                100     // エラーフラグ
+#define SCAN_NORMAL_MS              1000    // 流量・比率
+#define SCAN_SLOW_MS                10000   // 積算値、タグのない表示用のレジスタ
+// この数以下の使わないレジスタを挟むだけなら、分けずに1回の要求で読む
+#define SCAN_MAX_GAP                4
+
+// 適応スキャン周期（スレーブごと）
+// 1: 応答が遅い・失敗が多い・要求が期限切れになるスレーブは周期を延ばし、戻れば縮める
+#define MODBUS_ADAPTIVE_SCAN_RATE   1
+#define SCAN_RATE_MAX_INTERVAL_MS   5000    // 延ばす上限（下限は MODBUS_SAMPLE_INTERVAL_MS）
+#define SCAN_RATE_SLOW_RESPONSE_MS  200     // 1トランザクションの応答時間がこれを超えたら延ばす
+#define SCAN_RATE_MAX_ERROR_PCT     10      // 失敗の割合（%）がこれを超えたら延ばす
+#define SCAN_RATE_RECOVER_SCANS     5       // 問題のないスキャンがこの回数続いたら縮める
+// スレーブごとの下限・上限 { スレーブ ID, 下限 ms, 上限 ms }（例: { { 2, 1000, 10000 } }）
+#define MODBUS_SCAN_RATE_LIMITS     { }
+
+// RTU の時刻同期
+// 1: バス上の全スレーブを対象に、時刻がずれたスレーブにだけ書き込む
+#define MODBUS_RTU_FLEET_TIME_SYNC  0
+// 1: ブロードキャスト（ユニット 0）で時刻を書き込む（バス全体で2フレーム、応答なし）
+#define MODBUS_RTU_TIME_BROADCAST   1
+// ブロードキャストを受け付けないスレーブ（#242〜262 をまとめた FC16 で個別に書く）
+#define MODBUS_RTU_UNICAST_TIME_IDS { }
+#define TIME_SYNC_MAX_DRIFT_S       2       // このずれ（秒）を超えたら書き込む
+#define MODBUS_RTU_BROADCAST_DELAY_MS 100   // ブロードキャスト後にスレーブの処理を待つ時間
+
+// 書き込みのまとめ
+// 1: 隣接する書き込みを1回の FC16 に、書き込みをスキャンの読み取りと FC23 に
+//    まとめて送り、往復の回数を減らす（スレーブが FC23 に応答するのを確かめてから 1 にする）
+#define MODBUS_FUSE_WRITES          0
+// FC23（Read/Write Multiple registers）に対応していないスレーブ
+// （例外 01 が返ったスレーブは自動的に分けて送るようになる）
+#define MODBUS_NO_FC23_IDS          { }
+
+// 変化の配信（同じ PC の HMI・ヒストリアンなどへ。形式は libmodbus/modbus-feed.h）
+// 1: 読み取った値の変化を Unix ドメインソケットで配る
+#define MODBUS_FEED                 1
+#define MODBUS_FEED_PATH            "C:\\Users\\Farosystem\\FaroSystem\\modbuster.sock"
+#define MODBUS_FEED_MAX_SUBSCRIBERS 32
+// 購読者ごとの未送信の上限（バイト）。超えた購読者は変化を捨ててスナップショットから送り直す
+#define MODBUS_FEED_BUFFER_BYTES    (64 * 1024)
+
+// 共有メモリのレジスタイメージ（同じ PC のプロセスがシステムコールなしで最新値を読む。
+// 読む側は libmodbus/modbus-shm-reader.h だけを使う）
+// 1: スレーブごとの最新のスナップショットを名前付き共有メモリに置く
+#define MODBUS_SHARED_IMAGE         1
+#define MODBUS_SHARED_IMAGE_NAME    "Local\\ModBusterImage"
+#define MODBUS_SHARED_IMAGE_MAX_DEVICES 32
+
 // ===== ヘルパ関数群 =====
 
 // レジスタ一覧を整形して出力
@@ -85,12 +186,11 @@ static void print_now_local()
         << "\n\n";
 }
 
-// 現在時刻を UTC で「YYYY-MM-DDTHH:MM:SSZ」形式にする（JSON 用）
-static std::string current_timestamp_utc_iso8601()
+// 時刻を UTC で「YYYY-MM-DDTHH:MM:SSZ」形式にする（JSON 用）
+static std::string timestamp_utc_iso8601(std::chrono::system_clock::time_point at)
 {
     using clock = std::chrono::system_clock;
-    auto now = clock::now();
-    std::time_t t = clock::to_time_t(now);
+    std::time_t t = clock::to_time_t(at);
     std::tm tm_utc{};
 #if defined(_WIN32)
     gmtime_s(&tm_utc, &t);
@@ -102,6 +202,12 @@ static std::string current_timestamp_utc_iso8601()
     return std::string(buf);
 }
 
+// 1970-01-01 UTC からのミリ秒（ローカルの購読者向け）
+static uint64_t epoch_ms(std::chrono::system_clock::time_point at)
+{
+    return std::chrono::duration_cast<std::chrono::milliseconds>(at.time_since_epoch()).count();
+}
+
 // トークンファイルを読み込む（1行目をそのまま使用）
 static std::string read_token_from_file(const std::string& path)
 {
@@ -140,11 +246,17 @@ static int make_error_flag_from_registers(const uint16_t* regs, int low_addr)
     return (raw > 0) ? 1 : 0;
 }
 
+// JSON に使うレジスタ（#200〜241）
+constexpr int PAYLOAD_START_ADDR = 200;
+constexpr int PAYLOAD_COUNT = 42;
+
 // JSON文字列を生成（Modbusレジスタから）
 // ※ 測定値はすべて uint32_t 整数として扱う
-static std::string build_json_payload(const uint16_t* regs)
+// acquired: 値を読み終えた時刻（plcTimestamp）
+static std::string build_json_payload(const uint16_t* regs,
+    std::chrono::system_clock::time_point acquired)
 {
-    std::string timestamp = current_timestamp_utc_iso8601();
+    std::string timestamp = timestamp_utc_iso8601(acquired);
 
     // --- measurements (uint32_t) ---
     uint32_t lAfSupplyVolume = make_u32_from_registers(regs, 200);
@@ -225,7 +337,8 @@ static std::string escape_for_cmd_double_quoted(const std::string& s)
 }
 
 // curl を使ってサーバーに POST ＆ ログ記録
-static void send_payload_via_curl(const uint16_t* regs)
+static void send_payload_via_curl(const uint16_t* regs,
+    std::chrono::system_clock::time_point acquired)
 {
     std::string token = read_token_from_file(TOKEN_FILE_PATH);
     if (token.empty()) {
@@ -234,7 +347,7 @@ static void send_payload_via_curl(const uint16_t* regs)
     }
 
     // 送信する JSON を生成
-    std::string json = build_json_payload(regs);
+    std::string json = build_json_payload(regs, acquired);
 
     // コマンドライン用に JSON をエスケープ
     std::string json_escaped = escape_for_cmd_double_quoted(json);
@@ -306,8 +419,9 @@ static void send_payload_via_curl(const uint16_t* regs)
     }
 }
 
-// 10sごとに PC 時刻をスレーブへ書き込む（#242〜253, #262）
-static bool write_pc_time_to_slave(modbus_t* ctx, uint16_t* regs)
+// PC 時刻を #242〜253 の 12 レジスタ分に並べる
+// 下位ワードに値、上位ワードは 0 のペア（年, 月, 日, 時, 分, 秒）
+static void make_pc_time_registers(uint16_t* buf)
 {
     using clock = std::chrono::system_clock;
     auto now = clock::now();
@@ -326,8 +440,6 @@ static bool write_pc_time_to_slave(modbus_t* ctx, uint16_t* regs)
     int minute = local_tm.tm_min;
     int second = local_tm.tm_sec;
 
-    // 下位ワードに値、上位ワードは 0 のペアをまとめて書く
-    uint16_t buf[12];
     buf[0] = static_cast<uint16_t>(year);
     buf[1] = 0;
     buf[2] = static_cast<uint16_t>(month);
@@ -340,95 +452,2199 @@ static bool write_pc_time_to_slave(modbus_t* ctx, uint16_t* regs)
     buf[9] = 0;
     buf[10] = static_cast<uint16_t>(second);
     buf[11] = 0;
+}
 
-    // #242〜#253 に 12 レジスタ分書き込み
-    int rc = modbus_write_registers(ctx, 242, 12, buf);
-    if (rc == -1) {
-        std::cerr << "[WARN] Failed to write time registers (242-253): "
-            << modbus_strerror(errno) << "\n";
-        return false;
+// ===== スキャンのスナップショット =====
+// 1回のスキャンで読んだ値を、取得の開始・終了時刻（単調時計と実時刻）とチャンクごとの
+// 成否と一緒に1つのオブジェクトにする。公開したスナップショットは書き換えないので、表示・
+// JSON は読み取りの途中の値や、別々の時刻のチャンクを黙って混ぜた値を見ることはない。
+// スキャンは予備のバッファに読み、終わったら表と予備を入れ替えて公開する（公開と読む側
+// ではコピーしない）。予備のバッファをまだ読む側が持っているときだけ新しく確保する。
+
+struct ScanChunk {
+    int addr;
+    int nb;
+    bool ok;
+    std::chrono::steady_clock::time_point acquired;     // 応答（または失敗）の時刻
+};
+
+struct RegisterRange {
+    int addr;
+    int nb;
+};
+
+struct ScanSnapshot {
+    std::array<uint16_t, 400> regs{};
+    uint64_t sequence = 0;              // 公開した順の番号（0 はまだ何も読んでいない）
+    std::chrono::steady_clock::time_point started;
+    std::chrono::steady_clock::time_point finished;
+    std::chrono::system_clock::time_point wall_started;
+    std::chrono::system_clock::time_point wall_finished;
+    std::vector<ScanChunk> chunks;      // このスキャンで要求したチャンク
+    std::array<uint64_t, 400> read_in{};    // 最後に読めたスキャンの番号（0 は未読）
+    std::bitset<400> failed;            // 最後の読み取りが失敗した（値はそれより前のもの）
+    std::bitset<400> first_read;        // このスキャンで初めて読めた
+    // 1つ前のスナップショットから値の変わった（または初めて読めた）レジスタと、
+    // それを続いた範囲にまとめたもの
+    std::bitset<400> changed;
+    std::vector<RegisterRange> changed_ranges;
+    int nb_changed = 0;
+    uint64_t total_changed = 0;         // 起動からの変化の合計（1スキャンあたりの平均用）
+
+    // addr から nb 個がすべて読めていて、最後の読み取りも成功しているか
+    bool valid(int addr, int nb) const
+    {
+        for (int a = addr; a < addr + nb; ++a) {
+            if (read_in[a] == 0 || failed[a]) return false;
+        }
+        return true;
     }
+};
 
-    // #262 に 0 を書き込み
-    rc = modbus_write_register(ctx, 262, 0);
-    if (rc == -1) {
-        std::cerr << "[WARN] Failed to write register 262: "
-            << modbus_strerror(errno) << "\n";
-        return false;
+// 前のスナップショットと比べて next.changed / changed_ranges / nb_changed を作る。
+// 8 レジスタずつまとめて比べ、変化のない 8 個は1回の比較で飛ばす。初めて読めたレジスタは
+// 値が初期値の 0 のままでも変化に含める（購読者が値を知らないので）
+static void diff_snapshot(const ScanSnapshot& previous, ScanSnapshot& next)
+{
+    static_assert(std::tuple_size<decltype(ScanSnapshot::regs)>::value % 8 == 0,
+        "registers are compared 8 at a time");
+    const uint16_t* before = previous.regs.data();
+    const uint16_t* after = next.regs.data();
+
+    next.changed.reset();
+    next.changed_ranges.clear();
+    next.nb_changed = 0;
+    const bool first_read = next.first_read.any();
+    for (int addr = 0; addr < static_cast<int>(next.regs.size()); addr += 8) {
+        unsigned mask = 0;  // 変わったレジスタ（1 レジスタ 1 ビット）
+#if defined(_M_X64) || defined(__SSE2__)
+        __m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i*>(before + addr));
+        __m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i*>(after + addr));
+        unsigned equal = static_cast<unsigned>(_mm_movemask_epi8(_mm_cmpeq_epi16(a, b)));
+        if (equal == 0xFFFF && !first_read) continue;
+        for (int i = 0; i < 8; ++i) {
+            if ((equal & (1u << (2 * i))) == 0) mask |= 1u << i;
+        }
+#else
+        for (int i = 0; i < 8; ++i) {
+            if (before[addr + i] != after[addr + i]) mask |= 1u << i;
+        }
+#endif
+        if (first_read) {
+            for (int i = 0; i < 8; ++i) {
+                if (next.first_read[addr + i]) mask |= 1u << i;
+            }
+        }
+        if (mask == 0) continue;
+        std::vector<RegisterRange>& ranges = next.changed_ranges;
+        for (int i = 0; i < 8; ++i) {
+            if ((mask & (1u << i)) == 0) continue;
+            int changed = addr + i;
+            next.changed[changed] = true;
+            next.nb_changed++;
+            if (!ranges.empty() && ranges.back().addr + ranges.back().nb == changed) {
+                ranges.back().nb++;
+            }
+            else {
+                ranges.push_back({ changed, 1 });
+            }
+        }
     }
+    next.total_changed = previous.total_changed + next.nb_changed;
+}
+
+// 1台のスレーブのスナップショットの表と予備。begin() 〜 publish() はスキャンする
+// スレッドだけが呼び、latest() はどのスレッドからも呼べる
+class SnapshotBuffer {
+public:
+    SnapshotBuffer()
+        : front_(std::make_shared<ScanSnapshot>()), back_(std::make_shared<ScanSnapshot>())
+    {
+    }
+
+    // 次のスキャンを始め、読み取り先を返す（最新のスナップショットの値から始まる）
+    uint16_t* begin()
+    {
+        // 表から外れたバッファを読む側が新たに取ることはないので、参照が自分だけなら使い回せる
+        if (back_.use_count() != 1) {
+            back_ = std::make_shared<ScanSnapshot>();
+        }
+        ScanSnapshot& next = *back_;
+        next.regs = front_->regs;
+        next.read_in = front_->read_in;
+        next.failed = front_->failed;
+        next.first_read.reset();
+        next.chunks.clear();
+        next.sequence = front_->sequence + 1;
+        next.started = std::chrono::steady_clock::now();
+        next.wall_started = std::chrono::system_clock::now();
+        return next.regs.data();
+    }
+
+    uint16_t* regs() { return back_->regs.data(); }
+
+    // チャンクの読み取り結果（スキャン要求の done から呼ぶ）
+    void record_chunk(int addr, int nb, bool ok)
+    {
+        ScanSnapshot& next = *back_;
+        next.chunks.push_back({ addr, nb, ok, std::chrono::steady_clock::now() });
+        for (int a = addr; a < addr + nb; ++a) {
+            if (ok && next.read_in[a] == 0) next.first_read[a] = true;
+            if (ok) next.read_in[a] = next.sequence;
+            next.failed[a] = !ok;
+        }
+    }
+
+    // このスキャンで何か読んだか
+    bool scanned() const { return !back_->chunks.empty(); }
+
+    // 値の変わったスナップショット（changes_only = false なら毎回）を公開したときに、
+    // スキャンするスレッドから呼ばれる（変わった範囲は changed_ranges。ほかのスレッドと
+    // 共有する状態は各自で守る）
+    void subscribe(std::function<void(const ScanSnapshot&)> subscriber, bool changes_only = true)
+    {
+        subscribers_.push_back({ std::move(subscriber), changes_only });
+    }
+
+    void publish()
+    {
+        back_->finished = std::chrono::steady_clock::now();
+        back_->wall_finished = std::chrono::system_clock::now();
+        diff_snapshot(*front_, *back_);
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            front_.swap(back_);
+        }
+        for (const Subscriber& subscriber : subscribers_) {
+            if (front_->nb_changed != 0 || !subscriber.changes_only) {
+                subscriber.on_snapshot(*front_);
+            }
+        }
+    }
+
+    std::shared_ptr<const ScanSnapshot> latest() const
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return front_;
+    }
+
+private:
+    struct Subscriber {
+        std::function<void(const ScanSnapshot&)> on_snapshot;
+        bool changes_only;
+    };
+
+    mutable std::mutex mutex_;      // front_ の入れ替えと読み出し
+    std::shared_ptr<ScanSnapshot> front_;
+    std::shared_ptr<ScanSnapshot> back_;
+    std::vector<Subscriber> subscribers_;
+};
+
+// ===== RTU バススケジューラ =====
+// 1ポート上の全スレーブへの要求をキューに溜め、優先度の高い順、同じ優先度なら
+// 期限の早い順に1つずつ実行する。1件ごとにキューから選び直すので、長いスキャンの
+// 途中（MY_MAX_READ_REGS ごとの要求の間）に入った書き込みやアラームの読み取りは
+// 残りのスキャンより先に実行される。submit() は他のスレッドからも呼べる。
+// フレーム間の無音時間（t3.5）は libmodbus 側で
+// 単調時計を使って必要な分だけ待つので、ここでは sleep しない。
+// MODBUS_FUSE_WRITES のときは実行前に書き込みを FC16 / FC23 にまとめる
+// （TCP でも往復が減るので同じスケジューラを使う）。
+
+enum class BusOp {
+    ReadHolding,    // FC03
+    WriteMultiple,  // FC16
+    WriteSingle,    // FC06
+    WriteRead       // FC23（書き込みのあとに読み取り）
+};
+
+// 優先度（大きいほど先に実行）
+constexpr int PRIORITY_BACKFILL = 0;    // 後回しでよいまとまった読み取り（表示だけのレジスタなど）
+constexpr int PRIORITY_SCAN = 1;        // 周期的な読み取り
+constexpr int PRIORITY_ALARM = 2;       // エラーフラグなどアラームの読み取り
+constexpr int PRIORITY_WRITE = 3;       // 設定値・時刻などの書き込み
+constexpr int PRIORITY_COMMAND = 4;     // アラームなどをきっかけにすぐ送るコマンド
+constexpr int PRIORITY_COUNT = 5;
+
+static const char* const PRIORITY_NAMES[PRIORITY_COUNT] = {
+    "backfill", "scan", "alarm", "write", "command"
+};
+
+struct BusRequest {
+    int slave = MODBUS_SLAVE_ID;
+    BusOp op = BusOp::ReadHolding;
+    int addr = 0;
+    int nb = 0;
+    uint16_t* dest = nullptr;          // 読み取り先（dest[0] が addr）
+    std::vector<uint16_t> values;      // 書き込み値
+    int write_addr = 0;                // WriteRead の書き込み先（addr は読み取り先）
+    int priority = PRIORITY_SCAN;      // 大きいほど先に実行
+    std::chrono::steady_clock::time_point deadline;
+    std::function<void(bool ok)> done; // 完了通知（省略可）
+    std::function<void(bool ok)> write_done; // WriteRead の書き込み側の完了通知
+    uint64_t seq = 0;                  // 投入順（同条件のときの順序）
+    std::chrono::steady_clock::time_point queued;   // 投入時刻（待ち時間の計測用）
+};
+
+// スレーブごとの応答時間と失敗数（take_health() を呼んでからの分）
+struct SlaveHealth {
+    uint64_t requests = 0;
+    uint64_t failed = 0;
+    uint64_t expired = 0;       // 実行する前に期限が切れて捨てた読み取り
+    double response_ms = 0.0;   // 応答時間の合計
+};
+
+// 優先度ごとの投入から完了までの時間（直近 LATENCY_SAMPLES 件、ミリ秒）
+struct LatencyStats {
+    size_t count = 0;
+    double p50 = 0.0;
+    double p95 = 0.0;
+    double p99 = 0.0;
+    double max = 0.0;
+};
+
+class RtuBusScheduler {
+public:
+    explicit RtuBusScheduler(modbus_t* ctx) : ctx_(ctx)
+    {
+        const std::vector<int> no_fc23 = MODBUS_NO_FC23_IDS;
+        no_fc23_.insert(no_fc23.begin(), no_fc23.end());
+    }
+
+    void submit(BusRequest req)
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        req.seq = next_seq_++;
+        req.queued = std::chrono::steady_clock::now();
+        queue_.push(std::move(req));
+    }
+
+    // キューが空になるまで実行し、失敗した要求の数を返す
+    int run_all()
+    {
+        int nb_failed = 0;
+        BusRequest req;
+
+        while (next(req)) {
+            // ポートの異常が続いたら残りは送らずに失敗にする（呼び出し側がポートを開き直す）
+            if (link_lost()) {
+                ++nb_failed;
+                if (req.write_done) req.write_done(false);
+                if (req.done) req.done(false);
+                continue;
+            }
+            if (std::chrono::steady_clock::now() > req.deadline) {
+                ++deadline_missed_;
+                // 期限切れの読み取りは古い値になるだけなので捨てる（書き込みは実行）
+                if (req.op == BusOp::ReadHolding) {
+                    record_expired(req);
+                    if (req.done) req.done(false);
+                    continue;
+                }
+            }
+
+            auto started = std::chrono::steady_clock::now();
+            bool write_ok = true;
+            bool ok = execute(req, write_ok);
+            int error = errno;
+            ++executed_;
+            if (!ok || !write_ok) {
+                ++failed_;
+                ++nb_failed;
+            }
+            if (ok && write_ok) {
+                link_errors_ = 0;
+            }
+            else if (error == EIO || error == EBADF || error == ETIMEDOUT) {
+                ++link_errors_;
+            }
+            else {
+                link_errors_ = 0;   // 応答はあった（例外・CRC エラーなど）
+            }
+            record_latency(req);
+            record_health(req, ok && write_ok, started);
+            if (req.write_done) req.write_done(write_ok);
+            if (req.done) req.done(ok);
+        }
+        return nb_failed;
+    }
+
+    LatencyStats latency(int priority) const
+    {
+        std::vector<float> samples;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            samples = latency_ms_[priority];
+        }
+
+        LatencyStats stats;
+        if (samples.empty()) return stats;
+        std::sort(samples.begin(), samples.end());
+        auto percentile = [&samples](double p) {
+            return samples[std::min(samples.size() - 1, static_cast<size_t>(p * samples.size()))];
+        };
+        stats.count = samples.size();
+        stats.p50 = percentile(0.50);
+        stats.p95 = percentile(0.95);
+        stats.p99 = percentile(0.99);
+        stats.max = samples.back();
+        return stats;
+    }
+
+    // 前回呼んでからのスレーブの応答時間と失敗数
+    SlaveHealth take_health(int slave)
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        SlaveHealth health;
+        auto it = health_.find(slave);
+        if (it != health_.end()) {
+            health = it->second;
+            health_.erase(it);
+        }
+        return health;
+    }
+
+    uint64_t executed() const { return executed_; }
+    uint64_t failed() const { return failed_; }
+    uint64_t fused() const { return fused_; }     // まとめて省いたトランザクション数
+    uint64_t deadline_missed() const { return deadline_missed_; }
+
+    // ポートの異常で続けて失敗した要求の数（0 以外の limit に届くと run_all() は残りを送らない）
+    void set_link_error_limit(int limit) { link_error_limit_ = limit; }
+    int link_errors() const { return link_errors_; }
+    bool link_lost() const { return link_error_limit_ != 0 && link_errors_ >= link_error_limit_; }
+    void clear_link_errors() { link_errors_ = 0; }
+
+    // バス使用率（%）
+    float utilization() const
+    {
+        modbus_rtu_bus_stats_t stats;
+        if (modbus_rtu_get_bus_stats(ctx_, &stats) == -1) {
+            return 0.0f;
+        }
+        return stats.utilization;
+    }
+
+private:
+    // 優先度が高いほど、期限が早いほど、投入が早いほど先
+    struct Order {
+        bool operator()(const BusRequest& a, const BusRequest& b) const
+        {
+            if (a.priority != b.priority) return a.priority < b.priority;
+            if (a.deadline != b.deadline) return a.deadline > b.deadline;
+            return a.seq > b.seq;
+        }
+    };
+
+    static constexpr size_t LATENCY_SAMPLES = 1000;
+
+    // 次に実行する要求を取り出す。書き込みのまとめはキュー全体に対して毎回やり直し、
+    // まとめた結果もキューに戻してから一番先のものを選ぶ
+    bool next(BusRequest& req)
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (queue_.empty()) return false;
+
+        if (MODBUS_FUSE_WRITES && queue_.size() > 1) {
+            std::vector<BusRequest> batch;
+            while (!queue_.empty()) {
+                batch.push_back(queue_.top());
+                queue_.pop();
+            }
+            merge_adjacent_writes(batch);
+            fuse_writes_into_reads(batch);
+            for (BusRequest& pending : batch) {
+                queue_.push(std::move(pending));
+            }
+        }
+
+        req = queue_.top();
+        queue_.pop();
+        return true;
+    }
+
+    void record_latency(const BusRequest& req)
+    {
+        float ms = std::chrono::duration<float, std::milli>(
+            std::chrono::steady_clock::now() - req.queued).count();
+        int priority = std::clamp(req.priority, 0, PRIORITY_COUNT - 1);
+
+        std::lock_guard<std::mutex> lock(mutex_);
+        std::vector<float>& samples = latency_ms_[priority];
+        if (samples.size() < LATENCY_SAMPLES) {
+            samples.push_back(ms);
+        }
+        else {
+            samples[latency_next_[priority]] = ms;
+        }
+        latency_next_[priority] = (latency_next_[priority] + 1) % LATENCY_SAMPLES;
+    }
+
+    void record_health(const BusRequest& req, bool ok,
+        std::chrono::steady_clock::time_point started)
+    {
+        if (req.slave == MODBUS_BROADCAST_ADDRESS) return;
+        double ms = std::chrono::duration<double, std::milli>(
+            std::chrono::steady_clock::now() - started).count();
+
+        std::lock_guard<std::mutex> lock(mutex_);
+        SlaveHealth& health = health_[req.slave];
+        health.requests++;
+        health.response_ms += ms;
+        if (!ok) health.failed++;
+    }
+
+    void record_expired(const BusRequest& req)
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        health_[req.slave].expired++;
+    }
+
+    // WriteRead の書き込み側の結果は write_ok に返す
+    bool execute(const BusRequest& req, bool& write_ok)
+    {
+        if (req.slave == MODBUS_BROADCAST_ADDRESS) {
+            return broadcast(req);
+        }
+
+        if (modbus_set_slave(ctx_, req.slave) == -1) {
+            return false;
+        }
+
+        int rc = -1;
+        switch (req.op) {
+        case BusOp::ReadHolding:
+            rc = modbus_read_registers(ctx_, req.addr, req.nb, req.dest);
+            break;
+        case BusOp::WriteMultiple:
+            rc = modbus_write_registers(ctx_, req.addr, static_cast<int>(req.values.size()),
+                req.values.data());
+            break;
+        case BusOp::WriteSingle:
+            rc = modbus_write_register(ctx_, req.addr, req.values.empty() ? 0 : req.values[0]);
+            break;
+        case BusOp::WriteRead:
+            // 同じ周期で先に FC23 非対応と分かったスレーブは最初から分けて送る
+            if (no_fc23_.count(req.slave) != 0) {
+                errno = EMBXILFUN;
+            }
+            else {
+                rc = modbus_write_and_read_registers(ctx_, req.write_addr,
+                    static_cast<int>(req.values.size()), req.values.data(),
+                    req.addr, req.nb, req.dest);
+            }
+            if (rc == -1 && errno == EMBXILFUN && no_fc23_.count(req.slave) == 0) {
+                // FC23 非対応: 以後このスレーブには分けて送る
+                std::cerr << "[INFO] Slave " << req.slave
+                    << " doesn't support FC23, writes are sent separately\n";
+                no_fc23_.insert(req.slave);
+            }
+            if (rc == -1 && (errno == ETIMEDOUT || (errno > MODBUS_ENOBASE &&
+                errno < MODBUS_ENOBASE + MODBUS_EXCEPTION_MAX))) {
+                // 例外が書き込みと読み取りのどちらのものか分からないので分けてやり直す
+                // （FC23 に応答せずに捨てるスレーブもあるので無応答のときも）
+                bool timed_out = errno == ETIMEDOUT;
+                if (modbus_write_registers(ctx_, req.write_addr,
+                    static_cast<int>(req.values.size()), req.values.data()) == -1) {
+                    std::cerr << "[WARN] Slave " << req.slave << " addr " << req.write_addr
+                        << ": " << modbus_strerror(errno) << "\n";
+                    write_ok = false;
+                }
+                rc = modbus_read_registers(ctx_, req.addr, req.nb, req.dest);
+                if (timed_out && write_ok && rc != -1 && no_fc23_.count(req.slave) == 0) {
+                    // 分ければ応答する: 以後このスレーブには分けて送る
+                    std::cerr << "[INFO] Slave " << req.slave
+                        << " doesn't answer FC23, writes are sent separately\n";
+                    no_fc23_.insert(req.slave);
+                }
+            }
+            else if (rc == -1) {
+                write_ok = false;
+            }
+            break;
+        }
 
-    // ローカルコピー regs[] も更新しておく（表示・JSONで使えるように）
-    regs[242] = buf[0];
-    regs[243] = buf[1];
-    regs[244] = buf[2];
-    regs[245] = buf[3];
-    regs[246] = buf[4];
-    regs[247] = buf[5];
-    regs[248] = buf[6];
-    regs[249] = buf[7];
-    regs[250] = buf[8];
-    regs[251] = buf[9];
-    regs[252] = buf[10];
-    regs[253] = buf[11];
-    regs[262] = 0;
-
-    return true;
-}
-
-// 最大 MY_MAX_READ_REGS ごとに分割して連続領域をまとめて読む
-static bool read_registers_chunked(modbus_t* ctx,
-    uint16_t* regs,
-    int start_addr,
-    int nb)
-{
-    int addr = start_addr;
-    int remaining = nb;
-
-    while (remaining > 0) {
-        int to_read = remaining;
-        if (to_read > MY_MAX_READ_REGS) {
-            to_read = MY_MAX_READ_REGS;
-        }
-
-        int rc = modbus_read_registers(ctx, addr, to_read, &regs[addr]);
         if (rc == -1) {
-            std::cerr << "[ERROR] modbus_read_registers failed at addr "
-                << addr << " count " << to_read << ": "
+            std::cerr << "[WARN] Slave " << req.slave << " addr " << req.addr
+                << ": " << modbus_strerror(errno) << "\n";
+            return false;
+        }
+        return true;
+    }
+
+    static bool is_write(const BusRequest& req)
+    {
+        return req.op == BusOp::WriteMultiple || req.op == BusOp::WriteSingle;
+    }
+
+    // 同じスレーブへの連続した書き込みで、アドレスが続いているものを1つの FC16 にする。
+    // 間に同じスレーブへの別の要求があればそこで止める（順序を変えない）。
+    void merge_adjacent_writes(std::vector<BusRequest>& batch)
+    {
+        for (size_t i = 0; i < batch.size(); ++i) {
+            BusRequest& first = batch[i];
+            if (!is_write(first) || first.slave == MODBUS_BROADCAST_ADDRESS) continue;
+
+            for (size_t j = i + 1; j < batch.size();) {
+                BusRequest& next = batch[j];
+                if (next.slave != first.slave) {
+                    ++j;
+                    continue;
+                }
+                if (!is_write(next) ||
+                    next.addr != first.addr + static_cast<int>(first.values.size()) ||
+                    first.values.size() + next.values.size() > MODBUS_MAX_WR_WRITE_REGISTERS) {
+                    break;
+                }
+
+                first.op = BusOp::WriteMultiple;
+                first.values.insert(first.values.end(), next.values.begin(), next.values.end());
+                first.done = chain(std::move(first.done), std::move(next.done));
+                first.deadline = std::min(first.deadline, next.deadline);
+                first.queued = std::min(first.queued, next.queued);
+                first.priority = std::max(first.priority, next.priority);
+                batch.erase(batch.begin() + j);
+                ++fused_;
+            }
+        }
+    }
+
+    // 書き込みを同じスレーブへの次の読み取りに FC23 で載せる。書き込み同士の順序は
+    // 保ち、読み取り以外の要求が来たらそれより前に残りの書き込みを戻す。
+    void fuse_writes_into_reads(std::vector<BusRequest>& batch)
+    {
+        std::vector<BusRequest> out;
+        std::map<int, std::vector<BusRequest>> pending;
+
+        for (BusRequest& req : batch) {
+            std::vector<BusRequest>& writes = pending[req.slave];
+
+            if (is_write(req) && req.slave != MODBUS_BROADCAST_ADDRESS &&
+                no_fc23_.count(req.slave) == 0 &&
+                req.values.size() <= MODBUS_MAX_WR_WRITE_REGISTERS) {
+                writes.push_back(std::move(req));
+                continue;
+            }
+
+            if (req.op == BusOp::ReadHolding && !writes.empty() &&
+                req.nb <= MODBUS_MAX_WR_READ_REGISTERS) {
+                BusRequest& write = writes.front();
+                req.op = BusOp::WriteRead;
+                req.write_addr = write.addr;
+                req.values = std::move(write.values);
+                // 待ち時間は優先度の高いほう（ふつうは書き込み）の投入時刻から測る
+                if (write.priority > req.priority) {
+                    req.queued = write.queued;
+                }
+                req.priority = std::max(req.priority, write.priority);
+                req.deadline = std::min(req.deadline, write.deadline);
+                // 書き込みの順番を引き継ぐ（同じスレーブへの後の書き込みを追い越さない）
+                req.seq = std::min(req.seq, write.seq);
+                req.write_done = std::move(write.done);
+                writes.erase(writes.begin());
+                out.push_back(std::move(req));
+                ++fused_;
+                continue;
+            }
+
+            for (BusRequest& write : writes) {
+                out.push_back(std::move(write));
+            }
+            writes.clear();
+            out.push_back(std::move(req));
+        }
+
+        // 載せる読み取りがなかった書き込みはそのまま送る
+        for (auto& writes : pending) {
+            for (BusRequest& write : writes.second) {
+                out.push_back(std::move(write));
+            }
+        }
+        batch = std::move(out);
+    }
+
+    static std::function<void(bool)> chain(std::function<void(bool)> a,
+        std::function<void(bool)> b)
+    {
+        if (!a) return b;
+        if (!b) return a;
+        return [a, b](bool ok) {
+            a(ok);
+            b(ok);
+        };
+    }
+
+    // ブロードキャストには応答がないので送るだけにして、スレーブの処理時間だけ待つ
+    // （libmodbus の書き込み関数だと応答タイムアウトまで待ってしまう）
+    bool broadcast(const BusRequest& req)
+    {
+        std::vector<uint8_t> raw = { MODBUS_BROADCAST_ADDRESS };
+
+        switch (req.op) {
+        case BusOp::WriteMultiple:
+            raw.push_back(MODBUS_FC_WRITE_MULTIPLE_REGISTERS);
+            raw.push_back(static_cast<uint8_t>(req.addr >> 8));
+            raw.push_back(static_cast<uint8_t>(req.addr & 0xFF));
+            raw.push_back(static_cast<uint8_t>(req.values.size() >> 8));
+            raw.push_back(static_cast<uint8_t>(req.values.size() & 0xFF));
+            raw.push_back(static_cast<uint8_t>(req.values.size() * 2));
+            for (uint16_t value : req.values) {
+                raw.push_back(static_cast<uint8_t>(value >> 8));
+                raw.push_back(static_cast<uint8_t>(value & 0xFF));
+            }
+            break;
+        case BusOp::WriteSingle:
+            raw.push_back(MODBUS_FC_WRITE_SINGLE_REGISTER);
+            raw.push_back(static_cast<uint8_t>(req.addr >> 8));
+            raw.push_back(static_cast<uint8_t>(req.addr & 0xFF));
+            raw.push_back(static_cast<uint8_t>((req.values.empty() ? 0 : req.values[0]) >> 8));
+            raw.push_back(static_cast<uint8_t>((req.values.empty() ? 0 : req.values[0]) & 0xFF));
+            break;
+        default:
+            return false;   // 読み取りはブロードキャストできない
+        }
+
+        if (modbus_send_raw_request(ctx_, raw.data(), static_cast<int>(raw.size())) == -1) {
+            std::cerr << "[WARN] RTU broadcast addr " << req.addr << ": "
                 << modbus_strerror(errno) << "\n";
             return false;
         }
-        if (rc != to_read) {
-            std::cerr << "[WARN] modbus_read_registers read " << rc
-                << " registers (expected " << to_read
-                << ") at addr " << addr << "\n";
-            // 必要なら return false にしてもよい
+        std::this_thread::sleep_for(std::chrono::milliseconds(MODBUS_RTU_BROADCAST_DELAY_MS));
+        return true;
+    }
+
+    modbus_t* ctx_;
+    mutable std::mutex mutex_;      // キューと待ち時間（submit は他のスレッドからも呼べる）
+    std::priority_queue<BusRequest, std::vector<BusRequest>, Order> queue_;
+    std::array<std::vector<float>, PRIORITY_COUNT> latency_ms_;
+    std::array<size_t, PRIORITY_COUNT> latency_next_{};
+    std::map<int, SlaveHealth> health_;
+    uint64_t next_seq_ = 0;
+    uint64_t executed_ = 0;
+    uint64_t failed_ = 0;
+    uint64_t deadline_missed_ = 0;
+    uint64_t fused_ = 0;
+    int link_errors_ = 0;
+    int link_error_limit_ = 0;      // 0: 数えるだけ
+    std::set<int> no_fc23_;         // FC23 を使わないスレーブ
+};
+
+static int scan_chunk_length(int addr, int end);
+
+// 読み取り範囲を MY_MAX_READ_REGS 以下の要求に分けてキューに入れる（タグの途中では分けない）
+// nb_read を渡すと読み取れたレジスタ数を加算し、snapshot を渡すとチャンクの成否を記録する
+static void submit_scan(RtuBusScheduler& bus, int slave, uint16_t* regs,
+    int start_addr, int nb, int priority,
+    std::chrono::steady_clock::time_point deadline,
+    uint64_t* nb_read = nullptr, SnapshotBuffer* snapshot = nullptr)
+{
+    for (int addr = start_addr; addr < start_addr + nb;) {
+        BusRequest req;
+        req.slave = slave;
+        req.op = BusOp::ReadHolding;
+        req.addr = addr;
+        req.nb = scan_chunk_length(addr, start_addr + nb);
+        req.dest = &regs[addr];
+        req.priority = priority;
+        req.deadline = deadline;
+        if (nb_read != nullptr || snapshot != nullptr) {
+            int count = req.nb;
+            req.done = [nb_read, snapshot, addr, count](bool ok) {
+                if (ok && nb_read != nullptr) *nb_read += count;
+                if (snapshot != nullptr) snapshot->record_chunk(addr, count, ok);
+            };
+        }
+        addr += req.nb;
+        bus.submit(std::move(req));
+    }
+}
+
+// PC 時刻の書き込み（#242〜253, #262）を通常の読み取りより優先してキューに入れる
+static void submit_pc_time_write(RtuBusScheduler& bus, uint16_t* regs,
+    std::chrono::steady_clock::time_point deadline, int slave = MODBUS_SLAVE_ID)
+{
+    BusRequest time_req;
+    time_req.slave = slave;
+    time_req.op = BusOp::WriteMultiple;
+    time_req.addr = 242;
+    time_req.values.resize(12);
+    make_pc_time_registers(time_req.values.data());
+    time_req.priority = PRIORITY_WRITE;
+    time_req.deadline = deadline;
+
+    // ローカルコピー regs[] も更新しておく（表示・JSONで使えるように）
+    std::vector<uint16_t> values = time_req.values;
+    time_req.done = [regs, values](bool ok) {
+        if (ok) std::copy(values.begin(), values.end(), &regs[242]);
+    };
+    bus.submit(std::move(time_req));
+
+    BusRequest flag_req;
+    flag_req.slave = slave;
+    flag_req.op = BusOp::WriteSingle;
+    flag_req.addr = 262;
+    flag_req.values = { 0 };
+    flag_req.priority = PRIORITY_WRITE;
+    flag_req.deadline = deadline;
+    flag_req.done = [regs](bool ok) {
+        if (ok) regs[262] = 0;
+    };
+    bus.submit(std::move(flag_req));
+}
+
+// ===== 書き込みキュー =====
+// 1台の装置への書き込みを周期ごとに溜めてからまとめて送る。
+// ・送る前の同じアドレスへの書き込みは最後の値だけを残す
+// ・1回の write() の値がすべて装置の値（スキャンで読んだ値か、応答のあった書き込みの値）
+//   と同じなら送らない。1つでも違えばまとめて送る（時刻のような組を分けない）
+// ・アドレスの続く書き込みは1回の FC16 にまとめる（アドレス順に送る）
+// ・コマンドは値が同じでも送り、書き込みより先、書き込みはスキャンより先に実行する
+
+class WriteQueue {
+public:
+    // image: 装置の値（0〜399、スキャンの読み取り先と同じ配列）
+    WriteQueue(int slave, uint16_t* image) : slave_(slave), image_(image), known_(400, false) {}
+
+    void write(int addr, const uint16_t* values, int nb)
+    {
+        ++requested_;
+        if (is_unchanged(addr, values, nb)) {
+            return;
+        }
+        for (int i = 0; i < nb; ++i) {
+            Pending& pending = pending_[addr + i];
+            pending.value = values[i];
+            pending.priority = std::max(pending.priority, PRIORITY_WRITE);
+        }
+    }
+
+    void write(int addr, uint16_t value) { write(addr, &value, 1); }
+
+    // スキャンの読み取り先が変わったとき（スナップショットの予備のバッファ）
+    void set_image(uint16_t* image) { image_ = image; }
+
+    // アラームなどのコマンド。装置の値と同じでも送る
+    void command(int addr, const uint16_t* values, int nb)
+    {
+        ++requested_;
+        for (int i = 0; i < nb; ++i) {
+            Pending& pending = pending_[addr + i];
+            pending.value = values[i];
+            pending.priority = PRIORITY_COMMAND;
+        }
+    }
+
+    // スキャンで読めた範囲は image の値を装置の値として扱う
+    void mark_known(int addr, int nb)
+    {
+        for (int i = addr; i < addr + nb && i < static_cast<int>(known_.size()); ++i) {
+            known_[i] = true;
+        }
+    }
+
+    // 溜まった書き込みをスケジューラに入れる
+    void submit(RtuBusScheduler& bus, std::chrono::steady_clock::time_point deadline)
+    {
+        BusRequest req;
+        bool open = false;
+
+        for (auto it = pending_.begin(); it != pending_.end(); ++it) {
+            int addr = it->first;
+            const Pending& pending = it->second;
+
+            if (open && (addr != req.addr + static_cast<int>(req.values.size()) ||
+                req.values.size() == MODBUS_MAX_WR_WRITE_REGISTERS)) {
+                submit_request(bus, std::move(req));
+                req = BusRequest();
+                open = false;
+            }
+            if (!open) {
+                req.slave = slave_;
+                req.addr = addr;
+                req.deadline = deadline;
+                req.priority = PRIORITY_SCAN;
+                open = true;
+            }
+            req.values.push_back(pending.value);
+            req.priority = std::max(req.priority, pending.priority);
+        }
+        if (open) {
+            submit_request(bus, std::move(req));
+        }
+
+        saved_ += requested_ - std::min(requested_, queued_);
+        requested_ = 0;
+        queued_ = 0;
+        pending_.clear();
+    }
+
+    uint64_t sent() const { return sent_; }     // 送った書き込みトランザクション数
+    uint64_t saved() const { return saved_; }   // まとめ・省略で減らした数
+
+private:
+    struct Pending {
+        uint16_t value = 0;
+        int priority = PRIORITY_SCAN;
+    };
+
+    // 送信待ちがなく、すべて装置の値と同じか
+    bool is_unchanged(int addr, const uint16_t* values, int nb) const
+    {
+        for (int i = 0; i < nb; ++i) {
+            int a = addr + i;
+            if (a < 0 || a >= static_cast<int>(known_.size()) || !known_[a] ||
+                image_[a] != values[i] || pending_.count(a) != 0) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    void submit_request(RtuBusScheduler& bus, BusRequest req)
+    {
+        req.op = (req.values.size() == 1) ? BusOp::WriteSingle : BusOp::WriteMultiple;
+
+        // 応答があった値を装置の値として覚える
+        uint16_t* image = image_;
+        std::vector<bool>* known = &known_;
+        int addr = req.addr;
+        std::vector<uint16_t> values = req.values;
+        req.done = [image, known, addr, values](bool ok) {
+            if (!ok) return;
+            for (size_t i = 0; i < values.size(); ++i) {
+                if (addr + i < known->size()) {
+                    image[addr + i] = values[i];
+                    (*known)[addr + i] = true;
+                }
+            }
+        };
+
+        bus.submit(std::move(req));
+        ++queued_;
+        ++sent_;
+    }
+
+    int slave_;
+    uint16_t* image_;
+    std::vector<bool> known_;
+    std::map<int, Pending> pending_;    // アドレス順
+    uint64_t requested_ = 0;            // この周期の write() / command() の呼び出し数
+    uint64_t queued_ = 0;               // この周期に送るトランザクション数
+    uint64_t sent_ = 0;
+    uint64_t saved_ = 0;
+};
+
+// PC 時刻（#242〜253）と #262 = 0 を書き込みキューに入れる
+static void queue_pc_time_write(WriteQueue& writes)
+{
+    uint16_t buf[12];
+    make_pc_time_registers(buf);
+    writes.write(242, buf, 12);
+    writes.write(262, 0);
+}
+
+// ===== タグごとのスキャンクラス =====
+// タグを周期の違うクラスに分け、クラスごとに読むレジスタを連続した要求にまとめておく。
+// 同じ時刻に期限の来たクラスは1つの要求の組にまとめる（隣り合う範囲は1回で読む）。
+// 随時クラスは request_on_demand() のあとの1回だけ読む（時刻書き込み後の読み返しなど）。
+// 高速クラス（アラーム）は PRIORITY_ALARM、低速クラスは PRIORITY_BACKFILL で入れるので、
+// 低速クラスのまとまった読み取りはアラームや書き込みの後に回る。
+
+enum ScanClass {
+    SCAN_FAST,
+    SCAN_NORMAL,
+    SCAN_SLOW,
+    SCAN_ON_DEMAND,
+    SCAN_CLASS_COUNT
+};
+
+struct TagScan {
+    const char* name;
+    int addr;
+    int nb;
+    ScanClass scan_class;
+};
+
+// build_json_payload のタグ。読み取り範囲のうちタグのないレジスタは SCAN_SLOW で読む
+static const TagScan TAG_SCANS[] = {
+    { "lAfSupplyVolume",              200, 2, SCAN_NORMAL },
+    { "lAfSupplyVolumeIntegral",      202, 2, SCAN_SLOW },
+    { "hAfSupplyVolume",              204, 2, SCAN_NORMAL },
+    { "hAfSupplyVolumeIntegral",      206, 2, SCAN_SLOW },
+    { "concreteSupplyVolume",         208, 2, SCAN_NORMAL },
+    { "concreteSupplyVolumeIntegral", 210, 2, SCAN_SLOW },
+    { "lHRatio",                      212, 2, SCAN_NORMAL },
+    { "lhConcreteRatio",              214, 2, SCAN_NORMAL },
+    { "errors",                       216, 26, SCAN_FAST },    // natomicLsaPumpError〜invError9
+    { "pcTime",                       242, 21, SCAN_ON_DEMAND }, // #242〜253, #262
+};
+
+// addr から end までを読む1回の要求の長さ。MY_MAX_READ_REGS で切ると複数レジスタの
+// タグが2つの要求にまたがる（別々の時刻の上位・下位ワードを組み合わせる）ときは、
+// そのタグの手前で切る
+static int scan_chunk_length(int addr, int end)
+{
+    int nb = std::min(MY_MAX_READ_REGS, end - addr);
+    bool moved = true;
+    while (moved && addr + nb < end) {
+        moved = false;
+        for (const TagScan& tag : TAG_SCANS) {
+            int cut = addr + nb;
+            if (tag.addr > addr && tag.addr < cut && tag.addr + tag.nb > cut) {
+                nb = tag.addr - addr;
+                moved = true;
+            }
+        }
+    }
+    return nb;
+}
+
+// クラスごとのスケジューラの優先度
+static int scan_class_priority(int scan_class)
+{
+    switch (scan_class) {
+    case SCAN_FAST: return PRIORITY_ALARM;
+    case SCAN_SLOW: return PRIORITY_BACKFILL;
+    default:        return PRIORITY_SCAN;
+    }
+}
+
+class TagScanner {
+public:
+    TagScanner() : periods_{ SCAN_FAST_MS, SCAN_NORMAL_MS, SCAN_SLOW_MS, 0 }
+    {
+        // 同じレジスタが複数のタグにあれば速いほうのクラスで読む
+        std::vector<int>& classes = classes_;
+        classes.assign(400, -1);
+        tag_start_.resize(400);
+        for (int addr = 0; addr < 400; ++addr) {
+            tag_start_[addr] = addr;
+        }
+        for (const TagScan& tag : TAG_SCANS) {
+            for (int addr = tag.addr; addr < tag.addr + tag.nb; ++addr) {
+                if (classes[addr] == -1 || tag.scan_class < classes[addr]) {
+                    classes[addr] = tag.scan_class;
+                }
+                tag_start_[addr] = std::min(tag_start_[addr], tag.addr);
+            }
+        }
+        for (int addr = MODBUS_READ_START_ADDR; addr < MODBUS_READ_START_ADDR + MODBUS_READ_COUNT; ++addr) {
+            if (classes[addr] == -1) {
+                classes[addr] = SCAN_SLOW;
+            }
+        }
+        for (int addr = 0; addr < 400; ++addr) {
+            if (classes[addr] != -1) {
+                registers_[classes[addr]].push_back(addr);
+            }
+        }
+        started_ = std::chrono::steady_clock::now();
+        next_due_.fill(started_);
+    }
+
+    void request_on_demand() { on_demand_ = true; }
+
+    // 各クラスの周期にかける倍率（適応スキャン周期で延ばしたとき）
+    void set_rate_scale(double scale) { rate_scale_ = scale; }
+
+    // 期限の来たクラスの要求を入れ、読む予定のレジスタ数を返す（何もなければ 0）
+    // 要求の期限は含むクラスのうち一番速いクラスの周期（次の読み取りまでに読めればよい）
+    // snapshot を渡すとチャンクの成否を記録する
+    int submit(RtuBusScheduler& bus, int slave, uint16_t* regs,
+        std::chrono::steady_clock::time_point now,
+        uint64_t* nb_read, WriteQueue* known, SnapshotBuffer* snapshot = nullptr)
+    {
+        int mask = 0;
+        for (int c = 0; c < SCAN_ON_DEMAND; ++c) {
+            if (now >= next_due_[c]) {
+                mask |= 1 << c;
+                // 遅れても次の期限をまとめて先送りするだけで、取り戻そうとはしない
+                next_due_[c] = std::max(next_due_[c] + period(c), now);
+            }
+        }
+        if (on_demand_) {
+            mask |= 1 << SCAN_ON_DEMAND;
+            on_demand_ = false;
+        }
+
+        int planned = 0;
+        for (const Block& block : plan(mask)) {
+            BusRequest req;
+            req.slave = slave;
+            req.op = BusOp::ReadHolding;
+            req.addr = block.addr;
+            req.nb = block.nb;
+            req.dest = &regs[block.addr];
+            req.priority = block.priority;
+            req.deadline = now + period(block.scan_class);
+            int addr = block.addr;
+            int count = block.nb;
+            req.done = [nb_read, known, snapshot, addr, count](bool ok) {
+                if (snapshot != nullptr) snapshot->record_chunk(addr, count, ok);
+                if (!ok) return;
+                if (nb_read != nullptr) *nb_read += count;
+                if (known != nullptr) known->mark_known(addr, count);
+            };
+            bus.submit(std::move(req));
+            planned += count;
+            requests_++;
+            registers_read_ += count;
+        }
+        return planned;
+    }
+
+    // 開始からの要求数・レジスタ数（1秒あたり）
+    double requests_per_sec() const { return requests_ / elapsed_s(); }
+    double registers_per_sec() const { return registers_read_ / elapsed_s(); }
+
+private:
+    struct Block {
+        int addr;
+        int nb;
+        int priority;   // 含むクラスのうち一番高い優先度
+        int scan_class; // 含むクラスのうち一番速いクラス（期限に使う）
+    };
+    using Blocks = std::vector<Block>;
+
+    // クラスの組み合わせごとの要求の組（初回に作って使い回す）
+    const Blocks& plan(int mask)
+    {
+        auto found = plans_.find(mask);
+        if (found != plans_.end()) return found->second;
+
+        std::vector<int> addrs;
+        for (int c = 0; c < SCAN_CLASS_COUNT; ++c) {
+            if (mask & (1 << c)) {
+                addrs.insert(addrs.end(), registers_[c].begin(), registers_[c].end());
+            }
+        }
+        std::sort(addrs.begin(), addrs.end());
+
+        Blocks blocks;
+        for (int addr : addrs) {
+            if (!blocks.empty()) {
+                Block& last = blocks.back();
+                int end = last.addr + last.nb;
+                if (addr - end <= SCAN_MAX_GAP) {
+                    if (addr + 1 - last.addr <= MY_MAX_READ_REGS) {
+                        last.nb = addr + 1 - last.addr;
+                        continue;
+                    }
+                    // 上限で分けるときはタグの途中ではなくタグの先頭で分ける
+                    int start = tag_start_[addr];
+                    if (start > last.addr && start < addr) {
+                        last.nb = start - last.addr;
+                        blocks.push_back({ start, addr + 1 - start, PRIORITY_BACKFILL, SCAN_ON_DEMAND });
+                        continue;
+                    }
+                }
+            }
+            blocks.push_back({ addr, 1, PRIORITY_BACKFILL, SCAN_ON_DEMAND });
+        }
+
+        // 要求の優先度と期限は含むクラスのうち一番高い・速いもの
+        auto it = addrs.begin();
+        for (Block& block : blocks) {
+            for (; it != addrs.end() && *it < block.addr + block.nb; ++it) {
+                block.priority = std::max(block.priority, scan_class_priority(classes_[*it]));
+                block.scan_class = std::min(block.scan_class, classes_[*it]);
+            }
+        }
+        return plans_[mask] = std::move(blocks);
+    }
+
+    // クラスの周期に適応スキャン周期の倍率をかけたもの（随時クラスは低速クラスの周期）
+    std::chrono::milliseconds period(int scan_class) const
+    {
+        int ms = (scan_class == SCAN_ON_DEMAND) ? periods_[SCAN_SLOW] : periods_[scan_class];
+        return std::chrono::milliseconds(static_cast<int>(ms * rate_scale_));
+    }
+
+    double elapsed_s() const
+    {
+        double s = std::chrono::duration<double>(std::chrono::steady_clock::now() - started_).count();
+        return (s > 0.0) ? s : 1.0;
+    }
+
+    std::array<int, SCAN_CLASS_COUNT> periods_;
+    std::vector<int> classes_;  // アドレスごとのクラス（-1 は読まない）
+    std::vector<int> tag_start_;    // アドレスを含むタグの先頭（タグがなければ自分）
+    std::array<std::vector<int>, SCAN_CLASS_COUNT> registers_;  // クラスごとのアドレス（昇順）
+    std::array<std::chrono::steady_clock::time_point, SCAN_CLASS_COUNT> next_due_;
+    std::map<int, Blocks> plans_;
+    bool on_demand_ = true;     // 起動直後は随時クラスも1回読む
+    double rate_scale_ = 1.0;
+    std::chrono::steady_clock::time_point started_;
+    uint64_t requests_ = 0;
+    uint64_t registers_read_ = 0;
+};
+
+// ===== 適応スキャン周期 =====
+// スレーブごとにスキャン周期を調整する。応答時間が SCAN_RATE_SLOW_RESPONSE_MS を超えたとき、
+// 失敗の割合が SCAN_RATE_MAX_ERROR_PCT を超えたとき、要求が実行前に期限切れになったとき
+// （キューが追いついていない）は周期を2倍にし、SCAN_RATE_RECOVER_SCANS 回続けて問題が
+// なければ 3/4 に縮める。周期は MODBUS_SCAN_RATE_LIMITS の下限・上限の範囲に収める。
+// 読み取りの期限はどれも今の周期（スキャンクラスは各クラスの周期に scale() をかけたもの）
+// なので、期限切れは次の読み取りまでに読めなかった（周期に追いついていない）ことを表す。
+
+struct ScanRateLimit {
+    int slave;
+    int min_ms;
+    int max_ms;
+};
+
+class ScanRateController {
+public:
+    explicit ScanRateController(int slave)
+        : slave_(slave), min_ms_(MODBUS_SAMPLE_INTERVAL_MS), max_ms_(SCAN_RATE_MAX_INTERVAL_MS)
+    {
+        const std::vector<ScanRateLimit> limits = MODBUS_SCAN_RATE_LIMITS;
+        for (const ScanRateLimit& limit : limits) {
+            if (limit.slave == slave) {
+                min_ms_ = limit.min_ms;
+                max_ms_ = std::max(limit.min_ms, limit.max_ms);
+            }
+        }
+        interval_ms_ = min_ms_;
+    }
+
+    // スキャンのあとにスケジューラの結果で周期を見直す
+    void update(const SlaveHealth& health)
+    {
+        if (health.requests == 0 && health.expired == 0) return;
+
+        if (health.requests != 0) {
+            // 1回の遅れで振れないよう、直近の傾向（指数移動平均）で判断する
+            double response = health.response_ms / health.requests;
+            double errors = 100.0 * health.failed / health.requests;
+            bool first = !measured_;
+            response_ms_ = first ? response : response_ms_ * 0.7 + response * 0.3;
+            error_pct_ = first ? errors : error_pct_ * 0.7 + errors * 0.3;
+            measured_ = true;
+        }
+        if (!MODBUS_ADAPTIVE_SCAN_RATE) return;
+
+        const char* reason = nullptr;
+        if (health.expired != 0) {
+            reason = "requests expired in the queue";
+        }
+        else if (response_ms_ > SCAN_RATE_SLOW_RESPONSE_MS) {
+            reason = "slow responses";
+        }
+        else if (error_pct_ > SCAN_RATE_MAX_ERROR_PCT) {
+            reason = "errors";
+        }
+
+        if (reason != nullptr) {
+            healthy_scans_ = 0;
+            if (interval_ms_ < max_ms_) {
+                set_interval(std::min(max_ms_, interval_ms_ * 2), reason);
+            }
+        }
+        else if (++healthy_scans_ >= SCAN_RATE_RECOVER_SCANS && interval_ms_ > min_ms_) {
+            healthy_scans_ = 0;
+            set_interval(std::max(min_ms_, interval_ms_ * 3 / 4), "recovered");
         }
+    }
+
+    int slave() const { return slave_; }
+    int interval_ms() const { return interval_ms_; }
+    double rate_hz() const { return 1000.0 / interval_ms_; }
+    double response_ms() const { return response_ms_; }
+    double error_pct() const { return error_pct_; }
+    // 下限の周期に対する今の周期の倍率（スキャンクラスの周期にかける）
+    double scale() const { return static_cast<double>(interval_ms_) / min_ms_; }
+
+private:
+    void set_interval(int ms, const char* reason)
+    {
+        // ポートのスレッドからも呼ぶので std::cout の書式は変えずに1回で書く
+        std::ostringstream line;
+        line << std::fixed << std::setprecision(1)
+            << "[INFO] Slave " << slave_ << ": scan interval " << interval_ms_ << " -> "
+            << ms << " ms (" << reason << ", response " << response_ms_ << " ms, errors "
+            << error_pct_ << "%)\n";
+        std::cout << line.str();
+        interval_ms_ = ms;
+    }
 
-        addr += to_read;
-        remaining -= to_read;
+    int slave_;
+    int min_ms_;
+    int max_ms_;
+    int interval_ms_;
+    int healthy_scans_ = 0;
+    bool measured_ = false;
+    double response_ms_ = 0.0;
+    double error_pct_ = 0.0;
+};
+
+// ===== バス単位の時刻同期 =====
+// スキャンで読んだ時刻レジスタ（#242〜253）と PC 時刻のずれが TIME_SYNC_MAX_DRIFT_S
+// を超えたスレーブだけを対象にする。ブロードキャスト対応のスレーブはバス全体で
+// 1回のブロードキャスト（#242〜253 と #262 の2フレーム）、非対応のスレーブは
+// #242〜262 を1回の FC16 にまとめる（#254〜261 は読み取った値をそのまま書き戻す）。
+
+struct TimeSyncStats {
+    uint64_t broadcasts = 0;    // ブロードキャストした回数
+    uint64_t unicasts = 0;      // 個別に書き込んだスレーブ数
+    uint64_t skipped = 0;       // ずれが小さく書き込まなかったスレーブ数
+};
+
+// 時刻レジスタと PC 時刻のずれ（秒）。時刻として読めないときは -1
+static long long clock_drift_seconds(const uint16_t* regs)
+{
+    if (regs[242] < 2000 || regs[244] < 1 || regs[244] > 12 || regs[246] < 1 ||
+        regs[246] > 31 || regs[248] > 23 || regs[250] > 59 || regs[252] > 60) {
+        return -1;
     }
 
-    return true;
+    std::tm device_tm{};
+    device_tm.tm_year = regs[242] - 1900;
+    device_tm.tm_mon = regs[244] - 1;
+    device_tm.tm_mday = regs[246];
+    device_tm.tm_hour = regs[248];
+    device_tm.tm_min = regs[250];
+    device_tm.tm_sec = regs[252];
+    device_tm.tm_isdst = -1;
+
+    std::time_t device = std::mktime(&device_tm);
+    if (device == static_cast<std::time_t>(-1)) {
+        return -1;
+    }
+    long long drift = static_cast<long long>(std::time(nullptr) - device);
+    return drift < 0 ? -drift : drift;
+}
+
+// slaves: バス上のスレーブ ID と、その読み取り結果（0〜399）
+static void submit_fleet_time_sync(RtuBusScheduler& bus,
+    const std::map<int, uint16_t*>& slaves,
+    std::chrono::steady_clock::time_point deadline,
+    TimeSyncStats& stats)
+{
+    const std::vector<int> unicast_ids = MODBUS_RTU_UNICAST_TIME_IDS;
+    std::vector<uint16_t> time_values(12);
+    make_pc_time_registers(time_values.data());
+    bool need_broadcast = false;
+
+    for (const auto& slave : slaves) {
+        uint16_t* regs = slave.second;
+        long long drift = clock_drift_seconds(regs);
+
+        if (drift >= 0 && drift <= TIME_SYNC_MAX_DRIFT_S) {
+            ++stats.skipped;
+            continue;
+        }
+
+        if (MODBUS_RTU_TIME_BROADCAST &&
+            std::find(unicast_ids.begin(), unicast_ids.end(), slave.first) == unicast_ids.end()) {
+            need_broadcast = true;
+            continue;
+        }
+
+        if (drift < 0) {
+            // まだ読めていない（#254〜261 の値が分からない）ので従来どおり2回に分ける
+            submit_pc_time_write(bus, regs, deadline, slave.first);
+            ++stats.unicasts;
+            continue;
+        }
+
+        // #242〜262 を1回で書く
+        BusRequest req;
+        req.slave = slave.first;
+        req.op = BusOp::WriteMultiple;
+        req.addr = 242;
+        req.values = time_values;
+        req.values.insert(req.values.end(), &regs[254], &regs[262]);
+        req.values.push_back(0);
+        req.priority = PRIORITY_WRITE;
+        req.deadline = deadline;
+        std::vector<uint16_t> values = req.values;
+        req.done = [regs, values](bool ok) {
+            if (ok) std::copy(values.begin(), values.end(), &regs[242]);
+        };
+        bus.submit(std::move(req));
+        ++stats.unicasts;
+    }
+
+    if (need_broadcast) {
+        // 応答がないので結果は次のスキャンで読み直して確認する
+        BusRequest time_req;
+        time_req.slave = MODBUS_BROADCAST_ADDRESS;
+        time_req.op = BusOp::WriteMultiple;
+        time_req.addr = 242;
+        time_req.values = time_values;
+        time_req.priority = PRIORITY_WRITE;
+        time_req.deadline = deadline;
+        bus.submit(std::move(time_req));
+
+        BusRequest flag_req;
+        flag_req.slave = MODBUS_BROADCAST_ADDRESS;
+        flag_req.op = BusOp::WriteSingle;
+        flag_req.addr = 262;
+        flag_req.values = { 0 };
+        flag_req.priority = PRIORITY_WRITE;
+        flag_req.deadline = deadline;
+        bus.submit(std::move(flag_req));
+        ++stats.broadcasts;
+    }
 }
 
 // 0.5sごとのスナップショット表示
-static void print_snapshot(const uint16_t* regs)
+static void print_snapshot(const ScanSnapshot& snapshot)
 {
     system("cls");
     print_now_local();
-    print_registers(regs, DISPLAY_START_ADDR, DISPLAY_COUNT);
-    std::cout << "\n(PC is Modbus TCP MASTER. "
-        "Slave " << MODBUS_SERVER_IP << " ID=" << MODBUS_SLAVE_ID
-        << " registers " << MODBUS_READ_START_ADDR << "-"
+    print_registers(snapshot.regs.data(), DISPLAY_START_ADDR, DISPLAY_COUNT);
+    // 読めなかったチャンクは前回以前の値のまま（その範囲を表示する）
+    if (!snapshot.chunks.empty()) {
+        size_t nb_ok = std::count_if(snapshot.chunks.begin(), snapshot.chunks.end(),
+            [](const ScanChunk& chunk) { return chunk.ok; });
+        std::cout << "\nScan #" << snapshot.sequence << ": " << std::fixed << std::setprecision(1)
+            << std::chrono::duration<double, std::milli>(snapshot.finished - snapshot.started).count()
+            << " ms, chunks " << nb_ok << "/" << snapshot.chunks.size() << " ok";
+        std::cout.unsetf(std::ios::fixed);
+        for (const ScanChunk& chunk : snapshot.chunks) {
+            if (!chunk.ok) {
+                std::cout << ", stale " << chunk.addr << "-" << (chunk.addr + chunk.nb - 1);
+            }
+        }
+        std::cout << ", changed " << snapshot.nb_changed << " regs in "
+            << snapshot.changed_ranges.size() << " ranges (avg " << std::fixed
+            << std::setprecision(1) << static_cast<double>(snapshot.total_changed) / snapshot.sequence
+            << " per scan)\n";
+        std::cout.unsetf(std::ios::fixed);
+    }
+    if (MODBUS_USE_RTU && MODBUS_RTU_SNIFFER) {
+        std::cout << "\n(PC is passive Modbus RTU MONITOR. "
+            "Port " << MODBUS_RTU_DEVICE << " ID=" << MODBUS_SLAVE_ID
+            << " registers seen on the bus.)\n";
+        return;
+    }
+    if (MODBUS_USE_RTU) {
+        std::cout << "\n(PC is Modbus RTU MASTER. "
+            "Port " << MODBUS_RTU_DEVICE << " ID=" << MODBUS_SLAVE_ID;
+    }
+    else {
+        std::cout << "\n(PC is Modbus TCP MASTER. "
+            "Slave " << MODBUS_SERVER_IP << " ID=" << MODBUS_SLAVE_ID;
+    }
+    std::cout << " registers " << MODBUS_READ_START_ADDR << "-"
         << (MODBUS_READ_START_ADDR + MODBUS_READ_COUNT - 1)
-        << " read in chunks of " << MY_MAX_READ_REGS << ".)\n";
+        << " read in chunks of up to " << MY_MAX_READ_REGS << ".)\n";
+}
+
+// ===== エラーフラグの変化 =====
+// スナップショットの変わった範囲に重なるエラーフラグ（#216〜241、JSON の errors）だけを
+// 調べ、立った・消えたときに1行記録する。変化がなければ何も調べない。
+
+static const char* const ERROR_FLAG_NAMES[] = {
+    "natomicLsaPumpError", "lsaFlowDecrease", "lsaTankLevelLow", "lsaTankLevelVeryLow",
+    "invError1", "invError2", "invError3", "invError4", "invError5",
+    "invError6", "invError7", "invError8", "invError9",
+};
+constexpr int ERROR_FLAG_START_ADDR = 216;     // 2 レジスタずつ
+constexpr int ERROR_FLAG_COUNT = sizeof(ERROR_FLAG_NAMES) / sizeof(ERROR_FLAG_NAMES[0]);
+
+class AlarmMonitor {
+public:
+    explicit AlarmMonitor(std::string device) : device_(std::move(device)) {}
+
+    void on_snapshot(const ScanSnapshot& snapshot)
+    {
+        for (const RegisterRange& range : snapshot.changed_ranges) {
+            if (range.addr + range.nb <= ERROR_FLAG_START_ADDR) continue;
+            int first = std::max(0, (range.addr - ERROR_FLAG_START_ADDR) / 2);
+            int last = std::min(ERROR_FLAG_COUNT - 1,
+                (range.addr + range.nb - 1 - ERROR_FLAG_START_ADDR) / 2);
+
+            for (int i = first; i <= last; ++i) {
+                int flag = make_error_flag_from_registers(snapshot.regs.data(),
+                    ERROR_FLAG_START_ADDR + 2 * i);
+                if (flag == flags_[i]) continue;
+                flags_[i] = flag;
+                // ポートのスレッドからも呼ぶので1回で書く
+                std::ostringstream line;
+                line << "[ALARM] " << device_ << ": " << ERROR_FLAG_NAMES[i]
+                    << (flag ? " raised" : " cleared") << " (scan #" << snapshot.sequence << ")\n";
+                std::cout << line.str();
+            }
+        }
+    }
+
+private:
+    std::string device_;
+    std::array<int, ERROR_FLAG_COUNT> flags_{};
+};
+
+// ===== 変化の配信 =====
+// スナップショットの変わったレジスタを、同じ PC のほかのプロセスへ Unix ドメインソケット
+// MODBUS_FEED_PATH で配る（各プロセスが PLC をポーリングしなくて済む）。購読者は接続すると
+// 全レジスタのスナップショットを受け取り、その後は変化だけを受け取る。送信はスキャンする
+// スレッドで待たずに行い、残りはこのクラスのスレッドが送る。読むのが遅い購読者の分は
+// 溜めずに捨て、最新の値のスナップショットで送り直す（スキャンもほかの購読者も待たない）。
+
+class FeedPublisher {
+public:
+    FeedPublisher()
+    {
+        if (!MODBUS_FEED) return;
+        feed_ = modbus_feed_new(MODBUS_FEED_PATH, MODBUS_FEED_MAX_SUBSCRIBERS,
+            MODBUS_FEED_BUFFER_BYTES);
+        if (feed_ == nullptr) {
+            std::cerr << "[WARN] Unable to publish on " << MODBUS_FEED_PATH << ": "
+                << modbus_strerror(errno) << "\n";
+            return;
+        }
+        thread_ = std::thread([this]() {
+            while (!stop_) {
+                modbus_feed_poll(feed_, 0, 200000);
+            }
+        });
+    }
+
+    ~FeedPublisher()
+    {
+        stop_ = true;
+        if (thread_.joinable()) thread_.join();
+        modbus_feed_free(feed_);
+    }
+
+    FeedPublisher(const FeedPublisher&) = delete;
+    FeedPublisher& operator=(const FeedPublisher&) = delete;
+
+    // device はポート番号 * 256 + スレーブ ID（1本の接続だけのときはスレーブ ID）。
+    // どのスキャンのスレッドから呼んでもよい
+    void on_snapshot(int device, const ScanSnapshot& snapshot)
+    {
+        if (feed_ == nullptr) return;
+        std::vector<uint16_t> addrs;
+        std::vector<uint16_t> values;
+        addrs.reserve(snapshot.nb_changed);
+        values.reserve(snapshot.nb_changed);
+        for (const RegisterRange& range : snapshot.changed_ranges) {
+            for (int addr = range.addr; addr < range.addr + range.nb; ++addr) {
+                addrs.push_back(static_cast<uint16_t>(addr));
+                values.push_back(snapshot.regs[addr]);
+            }
+        }
+        modbus_feed_publish(feed_, device, static_cast<int>(addrs.size()), addrs.data(),
+            values.data(), epoch_ms(snapshot.wall_finished));
+    }
+
+    // 配信していなければ false
+    bool stats(modbus_feed_stats_t& stats) const
+    {
+        return feed_ != nullptr && modbus_feed_get_stats(feed_, &stats) == 0;
+    }
+
+private:
+    modbus_feed_t* feed_ = nullptr;
+    std::thread thread_;
+    std::atomic<bool> stop_{ false };
+};
+
+// ===== 共有メモリのレジスタイメージ =====
+// スナップショットを公開するたびに（値が変わらなくても）、そのスレーブの 0〜399 の値と
+// 有効なレジスタ（読めていて最後の読み取りも成功したもの）、スキャンの番号と時刻を名前付き
+// 共有メモリ MODBUS_SHARED_IMAGE_NAME のスロットに書く。スロットは seqlock なので、読む側は
+// ロックもシステムコールもなく、書き込み中のスロットを読んだときだけ読み直す。
+
+class SharedImage {
+public:
+    SharedImage()
+    {
+        if (!MODBUS_SHARED_IMAGE) return;
+        shm_ = modbus_shm_new(MODBUS_SHARED_IMAGE_NAME, MODBUS_SHARED_IMAGE_MAX_DEVICES,
+            static_cast<int>(std::tuple_size<decltype(ScanSnapshot::regs)>::value));
+        if (shm_ == nullptr) {
+            std::cerr << "[WARN] Unable to create the shared image " << MODBUS_SHARED_IMAGE_NAME
+                << ": " << modbus_strerror(errno) << "\n";
+        }
+    }
+
+    ~SharedImage() { modbus_shm_free(shm_); }
+
+    SharedImage(const SharedImage&) = delete;
+    SharedImage& operator=(const SharedImage&) = delete;
+
+    // device は FeedPublisher と同じ。どのスキャンのスレッドから呼んでもよい
+    void on_snapshot(int device, const ScanSnapshot& snapshot)
+    {
+        if (shm_ == nullptr) return;
+        std::array<uint8_t, (std::tuple_size<decltype(ScanSnapshot::regs)>::value + 7) / 8> valid{};
+        for (size_t addr = 0; addr < snapshot.regs.size(); ++addr) {
+            if (snapshot.read_in[addr] != 0 && !snapshot.failed[addr]) {
+                valid[addr / 8] |= 1u << (addr % 8);
+            }
+        }
+        modbus_shm_publish(shm_, device, snapshot.regs.data(), valid.data(), snapshot.sequence,
+            epoch_ms(snapshot.wall_started), epoch_ms(snapshot.wall_finished));
+    }
+
+private:
+    modbus_shm_t* shm_ = nullptr;
+};
+
+// 最新のスナップショットを JSON で送る。JSON のレジスタに読めていない・最後の読み取りが
+// 失敗したものがあれば古い値を送らないよう見送る
+static void send_snapshot_via_curl(const ScanSnapshot& snapshot)
+{
+    if (!snapshot.valid(PAYLOAD_START_ADDR, PAYLOAD_COUNT)) {
+        std::cerr << "[WARN] Registers " << PAYLOAD_START_ADDR << "-"
+            << (PAYLOAD_START_ADDR + PAYLOAD_COUNT - 1)
+            << " are not read or stale in scan #" << snapshot.sequence << ". Skip sending.\n";
+        return;
+    }
+    send_payload_via_curl(snapshot.regs.data(), snapshot.wall_finished);
+}
+
+// 監視モード: 見えたスレーブの保持レジスタを regs に反映（未観測のアドレスはそのまま）。
+// 見えた範囲は読めたチャンクとしてスナップショットに記録する
+static void copy_sniffed_registers(modbus_sniffer_t* sniffer, uint16_t* regs,
+    SnapshotBuffer& snapshots)
+{
+    modbus_mapping_t* image = modbus_sniffer_get_mapping(sniffer, MODBUS_SLAVE_ID);
+    if (image == nullptr) return;
+
+    int seen_from = -1;     // 見えている範囲の先頭
+    for (int addr = 0; addr <= 400; ++addr) {
+        const uint16_t* value = (addr < 400)
+            ? modbus_mapping_get_registers(image, MODBUS_TABLE_REGISTERS, addr, 1) : nullptr;
+        if (value != nullptr) {
+            regs[addr] = *value;
+            if (seen_from < 0) seen_from = addr;
+        }
+        else if (seen_from >= 0) {
+            snapshots.record_chunk(seen_from, addr - seen_from, true);
+            seen_from = -1;
+        }
+    }
+}
+
+// 監視モードの状態表示
+static void print_sniffer_status(modbus_sniffer_t* sniffer)
+{
+    modbus_sniffer_stats_t stats;
+    modbus_sniffer_get_stats(sniffer, &stats);
+    std::cout << "RTU monitor: frames " << stats.nb_frames
+        << ", CRC errors " << stats.nb_crc_errors
+        << ", transactions " << stats.nb_transactions
+        << ", exceptions " << stats.nb_exceptions
+        << ", unanswered " << stats.nb_unanswered << "\n";
+}
+
+// RTU バスの状態表示
+static void print_bus_status(const RtuBusScheduler& bus, const TimeSyncStats& time_sync)
+{
+    std::cout << "RTU bus: utilization " << std::fixed << std::setprecision(1)
+        << bus.utilization() << "%, requests " << bus.executed()
+        << ", failed " << bus.failed()
+        << ", deadline missed " << bus.deadline_missed()
+        << ", fused " << bus.fused() << "\n";
+    std::cout.unsetf(std::ios::fixed);
+    if (MODBUS_RTU_FLEET_TIME_SYNC) {
+        std::cout << "Time sync: broadcasts " << time_sync.broadcasts
+            << ", unicast writes " << time_sync.unicasts
+            << ", skipped (drift <= " << TIME_SYNC_MAX_DRIFT_S << " s) "
+            << time_sync.skipped << "\n";
+    }
+}
+
+// 優先度ごとの投入から完了までの時間（書き込みが読み取りの後ろで待たされていないか）
+static void print_latency_status(const RtuBusScheduler& bus)
+{
+    std::cout << std::fixed << std::setprecision(1) << "Latency (ms, p50/p95/p99/max):";
+    for (int priority = PRIORITY_COUNT - 1; priority >= 0; --priority) {
+        LatencyStats stats = bus.latency(priority);
+        if (stats.count == 0) continue;
+        std::cout << " " << PRIORITY_NAMES[priority] << " " << stats.p50 << "/" << stats.p95
+            << "/" << stats.p99 << "/" << stats.max;
+    }
+    std::cout << "\n";
+    std::cout.unsetf(std::ios::fixed);
+}
+
+// スレーブごとの今のスキャン周期
+static void print_scan_rate_status(const std::map<int, ScanRateController>& rates)
+{
+    std::cout << std::fixed << std::setprecision(1) << "Scan rate:";
+    for (const auto& rate : rates) {
+        const ScanRateController& controller = rate.second;
+        std::cout << " slave " << controller.slave() << " " << controller.rate_hz() << "/s ("
+            << controller.interval_ms() << " ms, response " << controller.response_ms()
+            << " ms, errors " << controller.error_pct() << "%)";
+    }
+    std::cout << "\n";
+    std::cout.unsetf(std::ios::fixed);
+}
+
+// 書き込みキューの状態表示
+static void print_write_status(const WriteQueue& writes)
+{
+    std::cout << "Writes: " << writes.sent() << " transactions, saved "
+        << writes.saved() << " (coalesced or unchanged)\n";
+}
+
+// スキャンクラスの負荷と、読み取り範囲全体を毎回読んだときの負荷
+static void print_scan_status(const TagScanner& scanner)
+{
+    int chunks = (MODBUS_READ_COUNT + MY_MAX_READ_REGS - 1) / MY_MAX_READ_REGS;
+    double whole_per_sec = 1000.0 / MODBUS_SAMPLE_INTERVAL_MS;
+
+    std::cout << std::fixed << std::setprecision(1)
+        << "Scan classes: " << scanner.requests_per_sec() << " requests/s, "
+        << scanner.registers_per_sec() << " regs/s (whole range: "
+        << chunks * whole_per_sec << " requests/s, "
+        << MODBUS_READ_COUNT * whole_per_sec << " regs/s)\n";
+    std::cout.unsetf(std::ios::fixed);
+}
+
+// 購読者の数と、遅れてスナップショットから送り直した回数
+static void print_feed_status(const FeedPublisher& feed)
+{
+    modbus_feed_stats_t stats;
+    if (!feed.stats(stats)) return;
+    std::cout << "Feed: " << stats.nb_subscribers << " subscribers, "
+        << stats.nb_published << " publications, "
+        << stats.nb_bytes_sent / 1024 << " KB sent, "
+        << stats.nb_resyncs << " resyncs (" << stats.nb_bytes_dropped / 1024 << " KB dropped)\n";
+}
+
+// ===== 複数ポートの並列ポーリング =====
+// ポートごとに1スレッドが自分のバスのスレーブを巡回し、結果を共有ストアに置く。
+// 各バスは独立しているので、スキャン周期はポート数に比例せず並列に進む。
+
+struct RtuPortConfig {
+    const char* device;
+    std::vector<int> slaves;
+};
+
+// 全ポートの最新のスナップショット（ポート番号, スレーブ ID ごと）
+class RegisterStore {
+public:
+    void publish(int port, int slave, std::shared_ptr<const ScanSnapshot> snapshot)
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        data_[{ port, slave }] = std::move(snapshot);
+    }
+
+    // まだ何も公開されていなければ nullptr
+    std::shared_ptr<const ScanSnapshot> latest(int port, int slave) const
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto it = data_.find({ port, slave });
+        if (it == data_.end()) return nullptr;
+        return it->second;
+    }
+
+private:
+    mutable std::mutex mutex_;
+    std::map<std::pair<int, int>, std::shared_ptr<const ScanSnapshot>> data_;
+};
+
+struct PortStats {
+    std::string device;
+    bool connected = false;
+    uint64_t scans = 0;
+    uint64_t failed = 0;
+    double last_scan_ms = 0.0;  // 直近の1周の所要時間
+    double avg_scan_ms = 0.0;
+    double regs_per_sec = 0.0;  // 読み取れたレジスタ数 / 経過時間
+    float utilization = 0.0f;
+    TimeSyncStats time_sync;
+    uint64_t writes_sent = 0;   // 書き込みキュー（PC 時刻を書くポートのみ）
+    uint64_t writes_saved = 0;
+    std::map<int, int> scan_interval_ms;    // スレーブごとの今のスキャン周期
+};
+
+// make_ctx を渡すと RTU ポートの代わりにそのコンテキスト（ゲートウェイ配下のユニットなど）を使う
+class RtuPortWorker {
+public:
+    RtuPortWorker(int index, RtuPortConfig config, RegisterStore& store, FeedPublisher& feed,
+        SharedImage& image, std::function<modbus_t*()> make_ctx = nullptr)
+        : index_(index), config_(std::move(config)), store_(store), make_ctx_(std::move(make_ctx))
+    {
+        stats_.device = config_.device;
+        for (int slave : config_.slaves) {
+            rates_.emplace(slave, ScanRateController(slave));
+            AlarmMonitor& alarms = alarms_.emplace(slave,
+                AlarmMonitor(config_.device + std::string(" slave ") + std::to_string(slave))).first->second;
+            int device = index_ * 256 + slave;
+            snapshots_[slave].subscribe([&alarms, &feed, device](const ScanSnapshot& snapshot) {
+                alarms.on_snapshot(snapshot);
+                feed.on_snapshot(device, snapshot);
+            });
+            snapshots_[slave].subscribe([&image, device](const ScanSnapshot& snapshot) {
+                image.on_snapshot(device, snapshot);
+            }, false);
+        }
+    }
+
+    ~RtuPortWorker() { stop(); }
+
+    void start() { thread_ = std::thread(&RtuPortWorker::run, this); }
+
+    void stop()
+    {
+        stop_ = true;
+        if (thread_.joinable()) thread_.join();
+    }
+
+    PortStats stats() const
+    {
+        std::lock_guard<std::mutex> lock(stats_mutex_);
+        return stats_;
+    }
+
+private:
+    void run()
+    {
+        using steady_clock = std::chrono::steady_clock;
+
+        modbus_t* ctx = make_ctx_ ? make_ctx_()
+            : modbus_new_rtu(config_.device, MODBUS_RTU_BAUD, MODBUS_RTU_PARITY,
+                MODBUS_RTU_DATA_BIT, MODBUS_RTU_STOP_BIT);
+        if (ctx == nullptr) {
+            std::cerr << "Unable to create the libmodbus context for " << config_.device << "\n";
+            return;
+        }
+        modbus_set_response_timeout(ctx, 1, 0);
+
+        RtuBusScheduler bus(ctx);
+        bus.set_link_error_limit(MODBUS_RTU_MAX_LINK_ERRORS);
+        // PC 時刻は先頭ポートの MODBUS_SLAVE_ID にだけ書き込む
+        bool owns_clock = index_ == 0 && snapshots_.count(MODBUS_SLAVE_ID) != 0;
+        std::unique_ptr<WriteQueue> writes;
+        if (owns_clock) {
+            writes = std::make_unique<WriteQueue>(MODBUS_SLAVE_ID, snapshots_[MODBUS_SLAVE_ID].regs());
+        }
+        auto started = steady_clock::now();
+        auto next_time_write = started;
+        uint64_t nb_read = 0;
+        auto reconnect_delay = std::chrono::milliseconds(MODBUS_RTU_RECONNECT_MS);
+
+        while (!stop_) {
+            if (modbus_connect(ctx) == -1) {
+                std::cerr << "Connection to " << config_.device << " failed: "
+                    << modbus_strerror(errno) << "\n";
+                sleep_unless_stopped(steady_clock::now() + reconnect_delay);
+                reconnect_delay = std::min(reconnect_delay * 2,
+                    std::chrono::milliseconds(MODBUS_RTU_RECONNECT_MAX_MS));
+                continue;
+            }
+            set_connected(true);
+            bus.clear_link_errors();
+
+            std::map<int, steady_clock::time_point> next_scan;  // 初期値は「すぐ」
+
+            while (!stop_) {
+                auto scan_start = steady_clock::now();
+                auto deadline = scan_start + std::chrono::milliseconds(MODBUS_SAMPLE_INTERVAL_MS);
+                uint64_t nb_clock_read = 0;  // 時刻スレーブの分（書き込みの省略判定に使う）
+
+                // このスキャンの読み取り先（各スレーブのスナップショットの予備のバッファ）
+                std::map<int, uint16_t*> slaves;
+                for (auto& snapshot : snapshots_) {
+                    slaves[snapshot.first] = snapshot.second.begin();
+                }
+                if (writes) {
+                    writes->set_image(slaves[MODBUS_SLAVE_ID]);
+                }
+
+                // スレーブごとの周期で読む（遅いスレーブの読み取りは期限も周期に合わせて延ばす）
+                for (auto& slave_regs : slaves) {
+                    int slave = slave_regs.first;
+                    if (scan_start < next_scan[slave]) continue;
+                    bool clock_slave = owns_clock && slave == MODBUS_SLAVE_ID;
+                    auto scan_deadline = scan_start + std::chrono::milliseconds(rates_.at(slave).interval_ms());
+                    submit_scan(bus, slave, slave_regs.second,
+                        MODBUS_READ_START_ADDR, MODBUS_READ_COUNT, PRIORITY_SCAN, scan_deadline,
+                        clock_slave ? &nb_clock_read : &nb_read, &snapshots_.at(slave));
+                    next_scan[slave] = scan_deadline;
+                }
+                if (MODBUS_RTU_FLEET_TIME_SYNC && !make_ctx_ && scan_start >= next_time_write) {
+                    // 各ポートは独立したバスなので、ポートごとに全スレーブを合わせる
+                    submit_fleet_time_sync(bus, slaves, deadline, time_sync_);
+                    next_time_write = scan_start + std::chrono::milliseconds(TIME_WRITE_INTERVAL_MS);
+                }
+                else if (owns_clock && scan_start >= next_time_write) {
+                    queue_pc_time_write(*writes);
+                    next_time_write = scan_start + std::chrono::milliseconds(TIME_WRITE_INTERVAL_MS);
+                }
+                if (writes) {
+                    writes->submit(bus, deadline);
+                }
+
+                uint64_t executed = bus.executed();
+                bus.run_all();
+                for (auto& rate : rates_) {
+                    rate.second.update(bus.take_health(rate.first));
+                }
+
+                nb_read += nb_clock_read;
+                if (nb_clock_read == MODBUS_READ_COUNT) {
+                    writes->mark_known(MODBUS_READ_START_ADDR, MODBUS_READ_COUNT);
+                }
+
+                auto scan_end = steady_clock::now();
+                for (auto& snapshot : snapshots_) {
+                    if (snapshot.second.scanned() || bus.executed() != executed) {
+                        snapshot.second.publish();
+                        store_.publish(index_, snapshot.first, snapshot.second.latest());
+                    }
+                }
+                update_stats(bus, writes.get(), scan_end - scan_start, scan_end - started, nb_read);
+
+                // ポートが使えなくなった（USB 変換器を抜いたなど）ら閉じて開き直す
+                if (bus.link_lost()) {
+                    std::cerr << "[WARN] " << config_.device << ": " << MODBUS_RTU_MAX_LINK_ERRORS
+                        << " requests failed in a row, reopening the port\n";
+                    break;
+                }
+                if (bus.link_errors() == 0) {
+                    reconnect_delay = std::chrono::milliseconds(MODBUS_RTU_RECONNECT_MS);
+                }
+
+                // 次に読むスレーブの周期まで（延ばしていなければ 0.5s）
+                auto wake = deadline;
+                for (const auto& due : next_scan) {
+                    wake = std::min(wake, due.second);
+                }
+                sleep_unless_stopped(wake);
+            }
+
+            set_connected(false);
+            modbus_close(ctx);
+            if (!stop_) {
+                sleep_unless_stopped(steady_clock::now() + reconnect_delay);
+                reconnect_delay = std::min(reconnect_delay * 2,
+                    std::chrono::milliseconds(MODBUS_RTU_RECONNECT_MAX_MS));
+            }
+        }
+
+        modbus_free(ctx);
+    }
+
+    void sleep_unless_stopped(std::chrono::steady_clock::time_point until)
+    {
+        while (!stop_ && std::chrono::steady_clock::now() < until) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(20));
+        }
+    }
+
+    void set_connected(bool connected)
+    {
+        std::lock_guard<std::mutex> lock(stats_mutex_);
+        stats_.connected = connected;
+    }
+
+    void update_stats(const RtuBusScheduler& bus, const WriteQueue* writes,
+        std::chrono::steady_clock::duration scan,
+        std::chrono::steady_clock::duration elapsed, uint64_t nb_read)
+    {
+        double scan_ms = std::chrono::duration<double, std::milli>(scan).count();
+        double elapsed_s = std::chrono::duration<double>(elapsed).count();
+
+        std::lock_guard<std::mutex> lock(stats_mutex_);
+        stats_.scans++;
+        stats_.failed = bus.failed();
+        stats_.last_scan_ms = scan_ms;
+        // 直近の傾向を見たいので指数移動平均
+        stats_.avg_scan_ms = (stats_.scans == 1) ? scan_ms : stats_.avg_scan_ms * 0.9 + scan_ms * 0.1;
+        stats_.regs_per_sec = (elapsed_s > 0.0) ? nb_read / elapsed_s : 0.0;
+        stats_.utilization = bus.utilization();
+        stats_.time_sync = time_sync_;
+        if (writes != nullptr) {
+            stats_.writes_sent = writes->sent();
+            stats_.writes_saved = writes->saved();
+        }
+        for (const auto& rate : rates_) {
+            stats_.scan_interval_ms[rate.first] = rate.second.interval_ms();
+        }
+    }
+
+    int index_;
+    RtuPortConfig config_;
+    RegisterStore& store_;
+    std::function<modbus_t*()> make_ctx_;
+    std::map<int, SnapshotBuffer> snapshots_;   // スレーブごと（予備のバッファはこのスレッド専用）
+    std::map<int, AlarmMonitor> alarms_;
+    std::map<int, ScanRateController> rates_;
+    TimeSyncStats time_sync_;
+    std::thread thread_;
+    std::atomic<bool> stop_{ false };
+    mutable std::mutex stats_mutex_;
+    PortStats stats_;
+};
+
+// ポートごとのスキャン時間とスループット
+static void print_port_status(const std::vector<std::unique_ptr<RtuPortWorker>>& workers)
+{
+    double total = 0.0;
+
+    std::cout << std::fixed << std::setprecision(1);
+    for (const auto& worker : workers) {
+        PortStats stats = worker->stats();
+        std::cout << stats.device << ": " << (stats.connected ? "connected" : "disconnected")
+            << ", scan " << stats.last_scan_ms << " ms (avg " << stats.avg_scan_ms << " ms)"
+            << ", " << stats.regs_per_sec << " regs/s"
+            << ", utilization " << stats.utilization << "%"
+            << ", failed " << stats.failed;
+        if (MODBUS_RTU_FLEET_TIME_SYNC) {
+            std::cout << ", time sync " << stats.time_sync.broadcasts << " broadcasts / "
+                << stats.time_sync.unicasts << " unicasts / "
+                << stats.time_sync.skipped << " skipped";
+        }
+        if (stats.writes_sent != 0 || stats.writes_saved != 0) {
+            std::cout << ", writes " << stats.writes_sent << " sent / "
+                << stats.writes_saved << " saved";
+        }
+        // 下限より延ばしているスレーブだけ
+        for (const auto& interval : stats.scan_interval_ms) {
+            if (interval.second > MODBUS_SAMPLE_INTERVAL_MS) {
+                std::cout << ", slave " << interval.first << " every " << interval.second << " ms";
+            }
+        }
+        std::cout << "\n";
+        total += stats.regs_per_sec;
+    }
+    std::cout << "Total: " << total << " regs/s on " << workers.size() << " ports\n";
+    std::cout.unsetf(std::ios::fixed);
+}
+
+// 共有接続の要求数と、応答待ちの上限に達して待たされた回数
+static void print_mux_status(modbus_mux_t* mux)
+{
+    modbus_mux_stats_t stats;
+    if (modbus_mux_get_stats(mux, &stats) == -1) {
+        return;
+    }
+    std::cout << "Shared connection: " << stats.nb_requests << " requests, "
+        << stats.nb_responses << " responses, "
+        << stats.nb_dropped << " late, "
+        << "max " << stats.max_in_flight << "/" << MODBUS_TCP_MAX_IN_FLIGHT << " in flight, "
+        << stats.nb_waits << " waits, "
+        << stats.nb_connects << " connects\n";
+}
+
+// ワーカーの結果を表示し、curl 送信はこのスレッドで行う（mux は共有接続の表示用）
+static void display_workers(RegisterStore& store,
+    const std::vector<std::unique_ptr<RtuPortWorker>>& workers, modbus_mux_t* mux,
+    const FeedPublisher& feed)
+{
+    using steady_clock = std::chrono::steady_clock;
+
+    const ScanSnapshot empty;
+    auto next_sample_time = steady_clock::now();
+    auto next_curl_time = steady_clock::now();
+
+    while (true) {
+        auto now = steady_clock::now();
+
+        // 眠る前に手放す（持ったままだとスキャン側が予備のバッファを使い回せない）
+        {
+            std::shared_ptr<const ScanSnapshot> latest = store.latest(0, MODBUS_SLAVE_ID);
+            const ScanSnapshot& snapshot = latest ? *latest : empty;
+            print_snapshot(snapshot);
+            print_port_status(workers);
+            if (mux != nullptr) {
+                print_mux_status(mux);
+            }
+            print_feed_status(feed);
+
+            // 30sごとに curl 送信
+            if (now >= next_curl_time) {
+                send_snapshot_via_curl(snapshot);
+                next_curl_time = now + std::chrono::milliseconds(CURL_SEND_INTERVAL_MS);
+            }
+        }
+
+        next_sample_time += std::chrono::milliseconds(MODBUS_SAMPLE_INTERVAL_MS);
+        std::this_thread::sleep_until(next_sample_time);
+    }
+}
+
+// 複数ポートモード: ポートごとのスレッドを起動する
+static int run_multi_port()
+{
+    const std::vector<RtuPortConfig> ports = MODBUS_RTU_PORTS;
+    RegisterStore store;
+    FeedPublisher feed;     // ワーカーより後に破棄する
+    SharedImage image;
+    std::vector<std::unique_ptr<RtuPortWorker>> workers;
+
+    for (size_t i = 0; i < ports.size(); ++i) {
+        workers.push_back(std::make_unique<RtuPortWorker>(static_cast<int>(i), ports[i], store,
+            feed, image));
+        workers.back()->start();
+    }
+
+    display_workers(store, workers, nullptr, feed);
+    return 0;
+}
+
+// 複数ユニットモード: ユニットごとのスレッドが1本の TCP 接続を共有する。
+// 要求はトランザクション ID で区別されるので、あるユニットの応答を待つ間も
+// 他のユニットの要求を MODBUS_TCP_MAX_IN_FLIGHT まで送れる。
+static int run_multi_unit()
+{
+    std::vector<int> units = MODBUS_TCP_UNIT_IDS;
+    // PC 時刻の書き込みと表示は先頭ワーカーの MODBUS_SLAVE_ID が担当する
+    std::stable_partition(units.begin(), units.end(),
+        [](int unit) { return unit == MODBUS_SLAVE_ID; });
+
+    modbus_mux_t* mux = modbus_mux_new(MODBUS_SERVER_IP, MODBUS_SERVER_PORT,
+        MODBUS_TCP_MAX_IN_FLIGHT);
+    if (mux == nullptr) {
+        std::cerr << "Unable to create the shared connection: " << modbus_strerror(errno) << "\n";
+        return -1;
+    }
+
+    std::vector<std::string> names;
+    for (int unit : units) {
+        names.push_back(std::string(MODBUS_SERVER_IP) + " unit " + std::to_string(unit));
+    }
+
+    RegisterStore store;
+    FeedPublisher feed;
+    SharedImage image;
+    std::vector<std::unique_ptr<RtuPortWorker>> workers;
+
+    for (size_t i = 0; i < units.size(); ++i) {
+        int unit = units[i];
+        workers.push_back(std::make_unique<RtuPortWorker>(static_cast<int>(i),
+            RtuPortConfig{ names[i].c_str(), { unit } }, store, feed, image,
+            [mux, unit]() { return modbus_mux_new_device(mux, unit); }));
+        workers.back()->start();
+    }
+
+    display_workers(store, workers, mux, feed);
+
+    workers.clear();
+    modbus_mux_free(mux);
+    return 0;
+}
+
+// ===== RTU → TCP ゲートウェイ =====
+// TCP クライアントの要求を、ユニット ID に対応するポートのスレーブへ中継する。
+// 同時に届いた同じ・重なる範囲の読み取りは1回のシリアル通信にまとめ、
+// スレーブの無応答は例外 0x0B、ポートの異常は 0x0A で返す。
+
+static void print_gateway_status(modbus_server_t* server,
+    const std::vector<RtuPortConfig>& ports)
+{
+    system("cls");
+    print_now_local();
+    std::cout << "(PC is Modbus RTU -> TCP GATEWAY on port " << MODBUS_GATEWAY_PORT << ".)\n";
+    for (size_t i = 0; i < ports.size(); ++i) {
+        modbus_gateway_stats_t stats;
+        if (modbus_server_get_gateway_stats(server, static_cast<int>(i), &stats) == -1) {
+            continue;
+        }
+        std::cout << ports[i].device << ": requests " << stats.nb_requests
+            << ", serial transactions " << stats.nb_transactions
+            << ", coalesced " << stats.nb_coalesced
+            << ", timeouts " << stats.nb_timeouts
+            << ", errors " << stats.nb_errors
+            << ", reconnects " << stats.nb_reconnects << "\n";
+    }
+}
+
+static int run_gateway()
+{
+    using steady_clock = std::chrono::steady_clock;
+
+    const std::vector<RtuPortConfig> ports = MODBUS_RTU_PORTS;
+    std::vector<modbus_t*> rtu_ctxs;
+
+    modbus_t* ctx = modbus_new_tcp(nullptr, MODBUS_GATEWAY_PORT);
+    if (ctx == nullptr) {
+        std::cerr << "Unable to create the libmodbus context\n";
+        return -1;
+    }
+
+    int server_socket = modbus_tcp_listen(ctx, MODBUS_GATEWAY_MAX_CLIENTS);
+    modbus_server_t* server = (server_socket == -1)
+        ? nullptr : modbus_server_new(ctx, server_socket, MODBUS_GATEWAY_MAX_CLIENTS);
+    if (server == nullptr) {
+        std::cerr << "Unable to listen on port " << MODBUS_GATEWAY_PORT << ": "
+            << modbus_strerror(errno) << "\n";
+        modbus_free(ctx);
+        return -1;
+    }
+
+    // ポートを開き、そのポートのスレーブ ID をルーティングする
+    for (const auto& port : ports) {
+        modbus_t* rtu = modbus_new_rtu(port.device, MODBUS_RTU_BAUD, MODBUS_RTU_PARITY,
+            MODBUS_RTU_DATA_BIT, MODBUS_RTU_STOP_BIT);
+        if (rtu == nullptr) {
+            std::cerr << "Unable to create the libmodbus context for " << port.device << "\n";
+            continue;
+        }
+        if (modbus_connect(rtu) == -1) {
+            // 開けるまでそのポートの要求は 0x0A で返し、1秒ごとに開き直す
+            std::cerr << "Connection to " << port.device << " failed: "
+                << modbus_strerror(errno) << "\n";
+        }
+        modbus_set_response_timeout(rtu, 1, 0);
+        rtu_ctxs.push_back(rtu);
+
+        int index = modbus_server_add_gateway(server, rtu);
+        for (int slave : port.slaves) {
+            modbus_server_set_route(server, slave, index);
+        }
+    }
+
+    auto next_status_time = steady_clock::now();
+    while (true) {
+        if (modbus_server_poll(server, 0, 100000) == -1) {
+            std::cerr << "Gateway listening socket failed: " << modbus_strerror(errno) << "\n";
+            break;
+        }
+
+        auto now = steady_clock::now();
+        if (now >= next_status_time) {
+            print_gateway_status(server, ports);
+            next_status_time = now + std::chrono::milliseconds(MODBUS_SAMPLE_INTERVAL_MS);
+        }
+    }
+
+    modbus_server_free(server);
+    for (modbus_t* rtu : rtu_ctxs) {
+        modbus_close(rtu);
+        modbus_free(rtu);
+    }
+    // クライアントのソケットは閉じ済みなので待ち受けソケットを閉じる
+    modbus_set_socket(ctx, server_socket);
+    modbus_close(ctx);
+    modbus_free(ctx);
+    return -1;
 }
 
 // ===== メイン処理 =====
 int main()
 {
-    // Modbus TCP マスターとして初期化
-    modbus_t* ctx = modbus_new_tcp(MODBUS_SERVER_IP, MODBUS_SERVER_PORT);
+    // RTU スレーブを Modbus TCP で公開する
+    if (MODBUS_USE_RTU && MODBUS_RTU_GATEWAY) {
+        return run_gateway();
+    }
+
+    // 複数のシリアルポートを並列にポーリングする
+    if (MODBUS_USE_RTU && MODBUS_RTU_MULTI_PORT) {
+        return run_multi_port();
+    }
+
+    // ゲートウェイ配下の複数ユニットを1本の接続で並列にポーリングする
+    if (!MODBUS_USE_RTU && !MODBUS_USE_UDP && MODBUS_TCP_MULTI_UNIT) {
+        return run_multi_unit();
+    }
+
+    // Modbus TCP / UDP / RTU マスターとして初期化
+    modbus_t* ctx = MODBUS_USE_RTU
+        ? modbus_new_rtu(MODBUS_RTU_DEVICE, MODBUS_RTU_BAUD, MODBUS_RTU_PARITY,
+            MODBUS_RTU_DATA_BIT, MODBUS_RTU_STOP_BIT)
+        : MODBUS_USE_UDP
+        ? modbus_new_udp(MODBUS_SERVER_IP, MODBUS_SERVER_PORT)
+        : modbus_new_tcp(MODBUS_SERVER_IP, MODBUS_SERVER_PORT);
     if (ctx == nullptr) {
         std::cerr << "Unable to create the libmodbus context\n";
         return -1;
@@ -448,18 +2664,70 @@ int main()
         return -1;
     }
 
-    // レジスタ読み取り用バッファ（0〜399 用・全部 0 初期化）
-    uint16_t regs[400];
-    for (int i = 0; i < 400; ++i) {
-        regs[i] = 0;
+    // MODBUS_SLAVE_ID のスナップショット。regs はスキャン中の読み取り先（0〜399、予備のバッファ）で、
+    // 表示と JSON は公開したスナップショットから作る
+    SnapshotBuffer snapshots;
+    uint16_t* regs = snapshots.regs();
+    AlarmMonitor alarms("Slave " + std::to_string(MODBUS_SLAVE_ID));
+    FeedPublisher feed;
+    snapshots.subscribe([&alarms, &feed](const ScanSnapshot& snapshot) {
+        alarms.on_snapshot(snapshot);
+        feed.on_snapshot(MODBUS_SLAVE_ID, snapshot);
+    });
+    SharedImage image;
+    snapshots.subscribe([&image](const ScanSnapshot& snapshot) {
+        image.on_snapshot(MODBUS_SLAVE_ID, snapshot);
+    }, false);
+
+    // RTU で同じバスにいる他のスレーブの読み取り用バッファ
+    std::map<int, std::vector<uint16_t>> other_slave_regs;
+    for (int slave : MODBUS_RTU_SLAVE_IDS) {
+        if (slave != MODBUS_SLAVE_ID) {
+            other_slave_regs[slave].assign(400, 0);
+        }
+    }
+
+    RtuBusScheduler bus(ctx);
+    TimeSyncStats time_sync;
+    WriteQueue writes(MODBUS_SLAVE_ID, regs);
+    TagScanner scanner;
+    // スレーブごとのスキャン周期（RTU はバス上の全スレーブ、TCP / UDP は MODBUS_SLAVE_ID）
+    std::vector<int> scanned_slaves = { MODBUS_SLAVE_ID };
+    if (MODBUS_USE_RTU) {
+        scanned_slaves = MODBUS_RTU_SLAVE_IDS;
+    }
+    std::map<int, ScanRateController> rates;
+    std::map<int, std::chrono::steady_clock::time_point> next_scan;   // 初期値は「すぐ」
+    for (int slave : scanned_slaves) {
+        rates.emplace(slave, ScanRateController(slave));
+    }
+    // バス全体の時刻同期はスキャンで読んだ時刻レジスタを使うので、その場合は範囲全体を読む
+    const bool use_scan_classes = MODBUS_SCAN_CLASSES && !(MODBUS_USE_RTU && MODBUS_RTU_FLEET_TIME_SYNC);
+
+    // 監視モードのデコーダ
+    modbus_sniffer_t* sniffer = nullptr;
+    if (MODBUS_USE_RTU && MODBUS_RTU_SNIFFER) {
+        sniffer = modbus_sniffer_new(MODBUS_RTU_BAUD, MODBUS_RTU_PARITY,
+            MODBUS_RTU_DATA_BIT, MODBUS_RTU_STOP_BIT);
+        if (sniffer == nullptr) {
+            std::cerr << "Unable to create the RTU monitor\n";
+            modbus_free(ctx);
+            return -1;
+        }
     }
 
     using steady_clock = std::chrono::steady_clock;
 
     while (true) {
-        std::cout << "Connecting to Modbus TCP slave "
-            << MODBUS_SERVER_IP << ":" << MODBUS_SERVER_PORT
-            << " (ID=" << MODBUS_SLAVE_ID << ")...\n";
+        if (MODBUS_USE_RTU) {
+            std::cout << "Opening Modbus RTU port " << MODBUS_RTU_DEVICE
+                << " (" << MODBUS_RTU_BAUD << " baud)...\n";
+        }
+        else {
+            std::cout << "Connecting to Modbus " << (MODBUS_USE_UDP ? "UDP" : "TCP") << " slave "
+                << MODBUS_SERVER_IP << ":" << MODBUS_SERVER_PORT
+                << " (ID=" << MODBUS_SLAVE_ID << ")...\n";
+        }
 
         if (modbus_connect(ctx) == -1) {
             std::cerr << "Connection failed: " << modbus_strerror(errno) << "\n";
@@ -478,17 +2746,147 @@ int main()
         while (!need_reconnect) {
             auto now = steady_clock::now();
 
-            // 0.5sごとに Modbus 読み取り & 表示
-            if (now >= next_sample_time) {
-                if (!read_registers_chunked(ctx,
-                    regs,
-                    MODBUS_READ_START_ADDR,
-                    MODBUS_READ_COUNT)) {
+            regs = snapshots.begin();
+            writes.set_image(regs);
+            uint64_t executed = bus.executed();
+
+            // RTU 監視: 0.5s 受信してデコードした値を表示（送信は一切しない）
+            if (sniffer != nullptr) {
+                if (modbus_sniffer_listen(sniffer, ctx, MODBUS_SAMPLE_INTERVAL_MS) == -1) {
                     need_reconnect = true;
                 }
                 else {
-                    print_snapshot(regs);
-                    next_sample_time = now + std::chrono::milliseconds(MODBUS_SAMPLE_INTERVAL_MS);
+                    copy_sniffed_registers(sniffer, regs, snapshots);
+                    snapshots.publish();
+                    print_snapshot(*snapshots.latest());
+                    print_sniffer_status(sniffer);
+                    print_feed_status(feed);
+                }
+            }
+            // RTU: 読み取りと時刻書き込みをまとめてスケジューラで実行する
+            // （スレーブの無応答はバスの切断ではないので再接続しない）
+            else if (MODBUS_USE_RTU) {
+                auto sample_deadline = now + std::chrono::milliseconds(MODBUS_SAMPLE_INTERVAL_MS);
+                bool sampled = now >= next_sample_time;
+
+                uint64_t nb_read = 0;   // MODBUS_SLAVE_ID の分（書き込みの省略判定に使う）
+
+                // スレーブごとの周期で読む（遅いスレーブの読み取りは期限も周期に合わせて延ばす）
+                for (int slave : scanned_slaves) {
+                    if ((use_scan_classes && slave == MODBUS_SLAVE_ID) || now < next_scan[slave]) {
+                        continue;   // MODBUS_SLAVE_ID はタグごとの周期で下で読む
+                    }
+                    auto scan_deadline = now + std::chrono::milliseconds(rates.at(slave).interval_ms());
+                    uint16_t* dest = (slave == MODBUS_SLAVE_ID)
+                        ? regs : other_slave_regs[slave].data();
+                    submit_scan(bus, slave, dest, MODBUS_READ_START_ADDR,
+                        MODBUS_READ_COUNT, PRIORITY_SCAN, scan_deadline,
+                        (slave == MODBUS_SLAVE_ID) ? &nb_read : nullptr,
+                        (slave == MODBUS_SLAVE_ID) ? &snapshots : nullptr);
+                    next_scan[slave] = scan_deadline;
+                }
+                if (sampled) {
+                    next_sample_time = sample_deadline;
+                }
+                if (use_scan_classes) {
+                    scanner.set_rate_scale(rates.at(MODBUS_SLAVE_ID).scale());
+                    scanner.submit(bus, MODBUS_SLAVE_ID, regs, now, &nb_read, &writes, &snapshots);
+                }
+                if (now >= next_time_write) {
+                    if (MODBUS_RTU_FLEET_TIME_SYNC) {
+                        std::map<int, uint16_t*> slaves;
+                        for (int slave : MODBUS_RTU_SLAVE_IDS) {
+                            slaves[slave] = (slave == MODBUS_SLAVE_ID)
+                                ? regs : other_slave_regs[slave].data();
+                        }
+                        submit_fleet_time_sync(bus, slaves, sample_deadline, time_sync);
+                    }
+                    else {
+                        queue_pc_time_write(writes);
+                        scanner.request_on_demand();    // 書いた時刻を読み返す
+                    }
+                    next_time_write = now + std::chrono::milliseconds(TIME_WRITE_INTERVAL_MS);
+                }
+                writes.submit(bus, sample_deadline);
+
+                bus.run_all();
+                for (auto& rate : rates) {
+                    rate.second.update(bus.take_health(rate.first));
+                }
+                if (snapshots.scanned() || bus.executed() != executed) {
+                    snapshots.publish();
+                }
+
+                if (!use_scan_classes && nb_read == MODBUS_READ_COUNT) {
+                    writes.mark_known(MODBUS_READ_START_ADDR, MODBUS_READ_COUNT);
+                }
+                if (sampled) {
+                    print_snapshot(*snapshots.latest());
+                    print_bus_status(bus, time_sync);
+                    print_latency_status(bus);
+                    print_scan_rate_status(rates);
+                    print_write_status(writes);
+                    if (use_scan_classes) {
+                        print_scan_status(scanner);
+                    }
+                    print_feed_status(feed);
+                }
+            }
+            // 0.5sごとに Modbus 読み取り & 表示（スキャンクラスのときは各クラスの周期で読み、
+            // 表示だけ 0.5sごと）
+            // 時刻の書き込みもスケジューラ経由（MODBUS_FUSE_WRITES のときは読み取りに FC23 でまとめる）
+            else if (use_scan_classes || now >= next_scan[MODBUS_SLAVE_ID]) {
+                ScanRateController& rate = rates.at(MODBUS_SLAVE_ID);
+                // スキャンクラスの要求の期限は各クラスの周期に rate.scale() をかけたもの
+                auto sample_deadline = now + std::chrono::milliseconds(rate.interval_ms());
+                uint64_t nb_read = 0;
+                int planned = MODBUS_READ_COUNT;
+
+                if (now >= next_time_write) {
+                    queue_pc_time_write(writes);
+                    scanner.request_on_demand();
+                    next_time_write = now + std::chrono::milliseconds(TIME_WRITE_INTERVAL_MS);
+                }
+                writes.submit(bus, sample_deadline);
+                if (use_scan_classes) {
+                    scanner.set_rate_scale(rate.scale());
+                    planned = scanner.submit(bus, MODBUS_SLAVE_ID, regs, now,
+                        &nb_read, &writes, &snapshots);
+                }
+                else {
+                    submit_scan(bus, MODBUS_SLAVE_ID, regs, MODBUS_READ_START_ADDR,
+                        MODBUS_READ_COUNT, PRIORITY_SCAN, sample_deadline, &nb_read, &snapshots);
+                    next_scan[MODBUS_SLAVE_ID] = sample_deadline;
+                }
+                bus.run_all();
+                SlaveHealth health = bus.take_health(MODBUS_SLAVE_ID);
+                rate.update(health);
+                // 失敗したチャンクも印を付けて公開する
+                if (snapshots.scanned() || bus.executed() != executed) {
+                    snapshots.publish();
+                }
+
+                // 書き込みの失敗だけ、期限切れで読まなかっただけでは再接続しない
+                // （応答の遅い装置は周期を延ばして対応する）
+                bool complete = nb_read == static_cast<uint64_t>(planned);
+                if (!complete && health.failed != 0) {
+                    need_reconnect = true;
+                }
+                else {
+                    if (!use_scan_classes && complete) {
+                        writes.mark_known(MODBUS_READ_START_ADDR, MODBUS_READ_COUNT);
+                    }
+                    if (now >= next_sample_time) {
+                        print_snapshot(*snapshots.latest());
+                        print_latency_status(bus);
+                        print_scan_rate_status(rates);
+                        print_write_status(writes);
+                        if (use_scan_classes) {
+                            print_scan_status(scanner);
+                        }
+                        print_feed_status(feed);
+                        next_sample_time = now + std::chrono::milliseconds(MODBUS_SAMPLE_INTERVAL_MS);
+                    }
                 }
             }
 
@@ -496,21 +2894,14 @@ int main()
 
             // 30sごとに curl 送信
             if (now >= next_curl_time) {
-                send_payload_via_curl(regs);
+                send_snapshot_via_curl(*snapshots.latest());
                 next_curl_time = now + std::chrono::milliseconds(CURL_SEND_INTERVAL_MS);
             }
 
-            // 10sごとに PC 時刻を書き込み
-            if (now >= next_time_write) {
-                if (!write_pc_time_to_slave(ctx, regs)) {
-                    std::cerr << "[WARN] Failed to write PC time to slave.\n";
-                    // 書き込み失敗しても即座に再接続まではしない（必要に応じて変えてOK）
-                }
-                next_time_write = now + std::chrono::milliseconds(TIME_WRITE_INTERVAL_MS);
+            // 負荷軽減のため少し sleep（監視中は受信で待っているので不要）
+            if (sniffer == nullptr) {
+                std::this_thread::sleep_for(std::chrono::milliseconds(50));
             }
-
-            // 負荷軽減のため少し sleep
-            std::this_thread::sleep_for(std::chrono::milliseconds(50));
         }
 
         std::cerr << "Connection lost. Closing and will retry...\n";
@@ -518,6 +2909,7 @@ int main()
         std::this_thread::sleep_for(std::chrono::seconds(2));
     }
 
+    modbus_sniffer_free(sniffer);
     modbus_close(ctx);
     modbus_free(ctx);
 
@@ -0,0 +1,495 @@
+/*
+ * Copyright © Stéphane Raimbault <stephane.raimbault@gmail.com>
+ *
+ * SPDX-License-Identifier: LGPL-2.1-or-later
+ *
+ * Read-through cache of the registers of a client context, shared by the
+ * threads of a process. A read is served from the cache when all its
+ * registers were read less than max_age_ms ago, otherwise from the device.
+ * The context runs one transaction at a time: a read covered by the one in
+ * progress gets its result instead of sending its own. Writes go through the
+ * cache and drop the registers they overlap.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "modbus-private.h"
+#include "modbus-thread-private.h"
+
+#include "modbus-cache.h"
+
+/* Registers of a page, allocated when one of them is first read */
+#define _MODBUS_CACHE_PAGE_LENGTH 64
+
+typedef struct _modbus_cache_page {
+    /* Slave, table and first address, in this order of significance */
+    uint32_t key;
+    uint16_t values[_MODBUS_CACHE_PAGE_LENGTH];
+    /* Time the value was read, 0 when unknown or written since */
+    uint64_t read_us[_MODBUS_CACHE_PAGE_LENGTH];
+} modbus_cache_page_t;
+
+/* Transaction in progress on the context, freed by the last of its owner and
+   the reads sharing its result */
+typedef struct _modbus_cache_transaction {
+    int slave;
+    int function;
+    int addr;
+    int nb;
+    int done;
+    int rc;
+    int error;
+    int nb_refs;
+    uint16_t values[MODBUS_MAX_READ_REGISTERS];
+} modbus_cache_transaction_t;
+
+struct _modbus_cache {
+    modbus_t *ctx;
+    _modbus_lock_t lock;
+    /* Broadcast when a transaction is done */
+    _modbus_cond_t cond;
+    /* Sorted by key so a lookup is a binary search */
+    modbus_cache_page_t **pages;
+    int nb_pages;
+    int size;
+    modbus_cache_transaction_t *current;
+    modbus_cache_stats_t stats;
+};
+
+static uint32_t page_key(int slave, int function, int addr)
+{
+    uint32_t table = function == MODBUS_FC_READ_INPUT_REGISTERS ? 1 : 0;
+
+    return ((uint32_t) (slave & 0xFF) << 17) | (table << 16) |
+           (uint32_t) (addr & ~(_MODBUS_CACHE_PAGE_LENGTH - 1));
+}
+
+/* Returns the index of the page or, when missing, where to insert it */
+static int find_page(modbus_cache_t *cache, uint32_t key, int *found)
+{
+    int low = 0;
+    int high = cache->nb_pages;
+
+    while (low < high) {
+        int mid = (low + high) / 2;
+
+        if (cache->pages[mid]->key < key) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    *found = low < cache->nb_pages && cache->pages[low]->key == key;
+
+    return low;
+}
+
+static modbus_cache_page_t *get_page(modbus_cache_t *cache, uint32_t key)
+{
+    int found;
+    int i = find_page(cache, key, &found);
+
+    return found ? cache->pages[i] : NULL;
+}
+
+static modbus_cache_page_t *add_page(modbus_cache_t *cache, uint32_t key)
+{
+    modbus_cache_page_t *page;
+    int found;
+    int i = find_page(cache, key, &found);
+
+    if (found) {
+        return cache->pages[i];
+    }
+
+    if (cache->nb_pages == cache->size) {
+        int size = cache->size == 0 ? 16 : cache->size * 2;
+        modbus_cache_page_t **pages = realloc(cache->pages, size * sizeof(*pages));
+
+        if (pages == NULL) {
+            return NULL;
+        }
+        cache->pages = pages;
+        cache->size = size;
+    }
+
+    page = (modbus_cache_page_t *) calloc(1, sizeof(modbus_cache_page_t));
+    if (page == NULL) {
+        return NULL;
+    }
+    page->key = key;
+
+    memmove(cache->pages + i + 1, cache->pages + i, (cache->nb_pages - i) * sizeof(*cache->pages));
+    cache->pages[i] = page;
+    cache->nb_pages++;
+
+    return page;
+}
+
+/* Copies the registers to dest when all of them were read at or after
+   min_us */
+static int lookup(modbus_cache_t *cache,
+                  int slave,
+                  int function,
+                  int addr,
+                  int nb,
+                  uint16_t *dest,
+                  uint64_t min_us)
+{
+    int pass;
+
+    /* Checked first so dest is only written on a hit */
+    for (pass = 0; pass < 2; pass++) {
+        int i = 0;
+
+        while (i < nb) {
+            int a = addr + i;
+            int offset = a % _MODBUS_CACHE_PAGE_LENGTH;
+            int length = _MODBUS_CACHE_PAGE_LENGTH - offset;
+            modbus_cache_page_t *page = get_page(cache, page_key(slave, function, a));
+            int j;
+
+            if (page == NULL) {
+                return FALSE;
+            }
+            if (length > nb - i) {
+                length = nb - i;
+            }
+            for (j = 0; j < length; j++) {
+                if (pass == 0) {
+                    if (page->read_us[offset + j] == 0 ||
+                        page->read_us[offset + j] < min_us) {
+                        return FALSE;
+                    }
+                } else {
+                    dest[i + j] = page->values[offset + j];
+                }
+            }
+            i += length;
+        }
+    }
+
+    return TRUE;
+}
+
+static void
+store(modbus_cache_t *cache, int slave, int function, int addr, int nb, const uint16_t *src)
+{
+    uint64_t now_us = _modbus_monotonic_us();
+    int i = 0;
+
+    while (i < nb) {
+        int a = addr + i;
+        int offset = a % _MODBUS_CACHE_PAGE_LENGTH;
+        int length = _MODBUS_CACHE_PAGE_LENGTH - offset;
+        modbus_cache_page_t *page = add_page(cache, page_key(slave, function, a));
+        int j;
+
+        if (length > nb - i) {
+            length = nb - i;
+        }
+        /* Out of memory, not cached */
+        if (page != NULL) {
+            for (j = 0; j < length; j++) {
+                page->values[offset + j] = src[i + j];
+                page->read_us[offset + j] = now_us;
+            }
+        }
+        i += length;
+    }
+}
+
+static void invalidate(modbus_cache_t *cache, int slave, int addr, int nb)
+{
+    int i = 0;
+
+    while (i < nb) {
+        int a = addr + i;
+        int offset = a % _MODBUS_CACHE_PAGE_LENGTH;
+        int length = _MODBUS_CACHE_PAGE_LENGTH - offset;
+        modbus_cache_page_t *page =
+            get_page(cache, page_key(slave, MODBUS_FC_READ_HOLDING_REGISTERS, a));
+        int j;
+
+        if (length > nb - i) {
+            length = nb - i;
+        }
+        if (page != NULL) {
+            for (j = 0; j < length; j++) {
+                if (page->read_us[offset + j] != 0) {
+                    page->read_us[offset + j] = 0;
+                    cache->stats.nb_invalidated++;
+                }
+            }
+        }
+        i += length;
+    }
+}
+
+static void release(modbus_cache_transaction_t *t)
+{
+    if (--t->nb_refs == 0) {
+        free(t);
+    }
+}
+
+/* Waits until no transaction is in progress and starts one, with the lock
+   held */
+static modbus_cache_transaction_t *
+begin(modbus_cache_t *cache, int slave, int function, int addr, int nb)
+{
+    modbus_cache_transaction_t *t;
+
+    while (cache->current != NULL) {
+        _modbus_cond_wait_until(&cache->cond, &cache->lock, UINT64_MAX);
+    }
+
+    t = (modbus_cache_transaction_t *) malloc(sizeof(modbus_cache_transaction_t));
+    if (t == NULL) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    t->slave = slave;
+    t->function = function;
+    t->addr = addr;
+    t->nb = nb;
+    t->done = FALSE;
+    t->rc = -1;
+    t->error = 0;
+    t->nb_refs = 1;
+    cache->current = t;
+
+    return t;
+}
+
+static void end(modbus_cache_t *cache, modbus_cache_transaction_t *t, int rc, int error)
+{
+    t->done = TRUE;
+    t->rc = rc;
+    t->error = error;
+    cache->current = NULL;
+    cache->stats.nb_transactions++;
+    _modbus_cond_broadcast(&cache->cond);
+}
+
+static int read_registers(
+    modbus_cache_t *cache, int function, int addr, int nb, uint16_t *dest, int max_age_ms)
+{
+    modbus_cache_transaction_t *t;
+    uint64_t now_us;
+    uint64_t min_us;
+    int slave;
+    int error;
+    int rc;
+
+    if (cache == NULL || dest == NULL || max_age_ms < 0 || addr < 0 || nb < 1 ||
+        addr + nb > 0x10000) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (nb > MODBUS_MAX_READ_REGISTERS) {
+        errno = EMBMDATA;
+        return -1;
+    }
+
+    slave = modbus_get_slave(cache->ctx);
+    now_us = _modbus_monotonic_us();
+    min_us = now_us > (uint64_t) max_age_ms * 1000 ? now_us - (uint64_t) max_age_ms * 1000
+                                                   : 1;
+
+    _modbus_lock(&cache->lock);
+    cache->stats.nb_reads++;
+
+    for (;;) {
+        if (lookup(cache, slave, function, addr, nb, dest, min_us)) {
+            cache->stats.nb_hits++;
+            _modbus_unlock(&cache->lock);
+            return nb;
+        }
+
+        t = cache->current;
+        if (t == NULL) {
+            break;
+        }
+
+        if (t->slave == slave && t->function == function && t->addr <= addr &&
+            addr + nb <= t->addr + t->nb) {
+            /* Same registers on their way, their result is shared */
+            t->nb_refs++;
+            cache->stats.nb_shared++;
+            while (!t->done) {
+                _modbus_cond_wait_until(&cache->cond, &cache->lock, UINT64_MAX);
+            }
+            rc = t->rc;
+            error = t->error;
+            if (rc != -1) {
+                memcpy(dest, t->values + (addr - t->addr), nb * sizeof(uint16_t));
+                rc = nb;
+            }
+            release(t);
+            _modbus_unlock(&cache->lock);
+            errno = error;
+            return rc;
+        }
+
+        /* The cache may hold the registers once it's done */
+        _modbus_cond_wait_until(&cache->cond, &cache->lock, UINT64_MAX);
+    }
+
+    t = begin(cache, slave, function, addr, nb);
+    if (t == NULL) {
+        _modbus_unlock(&cache->lock);
+        return -1;
+    }
+    _modbus_unlock(&cache->lock);
+
+    if (function == MODBUS_FC_READ_INPUT_REGISTERS) {
+        rc = modbus_read_input_registers(cache->ctx, addr, nb, t->values);
+    } else {
+        rc = modbus_read_registers(cache->ctx, addr, nb, t->values);
+    }
+    error = errno;
+
+    _modbus_lock(&cache->lock);
+    if (rc == nb) {
+        store(cache, slave, function, addr, nb, t->values);
+        memcpy(dest, t->values, nb * sizeof(uint16_t));
+    }
+    end(cache, t, rc, error);
+    release(t);
+    _modbus_unlock(&cache->lock);
+
+    errno = error;
+    return rc;
+}
+
+static int write_registers(modbus_cache_t *cache, int addr, int nb, const uint16_t *src)
+{
+    modbus_cache_transaction_t *t;
+    int slave;
+    int error;
+    int rc;
+
+    if (cache == NULL || src == NULL || addr < 0 || nb < 1 || addr + nb > 0x10000) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    slave = modbus_get_slave(cache->ctx);
+
+    _modbus_lock(&cache->lock);
+    t = begin(cache, slave, MODBUS_FC_WRITE_MULTIPLE_REGISTERS, addr, nb);
+    if (t == NULL) {
+        _modbus_unlock(&cache->lock);
+        return -1;
+    }
+    /* Also dropped when the write fails, the device may have applied it */
+    invalidate(cache, slave, addr, nb);
+    _modbus_unlock(&cache->lock);
+
+    if (nb == 1) {
+        rc = modbus_write_register(cache->ctx, addr, src[0]);
+    } else {
+        rc = modbus_write_registers(cache->ctx, addr, nb, src);
+    }
+    error = errno;
+
+    _modbus_lock(&cache->lock);
+    end(cache, t, rc, error);
+    release(t);
+    _modbus_unlock(&cache->lock);
+
+    errno = error;
+    return rc;
+}
+
+/* The cache is used instead of the context by all the threads, the slave is
+   the one of the context */
+modbus_cache_t *modbus_cache_new(modbus_t *ctx)
+{
+    modbus_cache_t *cache;
+
+    if (ctx == NULL) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    cache = (modbus_cache_t *) calloc(1, sizeof(modbus_cache_t));
+    if (cache == NULL) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    cache->ctx = ctx;
+    _modbus_lock_init(&cache->lock, &cache->cond);
+
+    return cache;
+}
+
+int modbus_cache_read_registers(
+    modbus_cache_t *cache, int addr, int nb, uint16_t *dest, int max_age_ms)
+{
+    return read_registers(
+        cache, MODBUS_FC_READ_HOLDING_REGISTERS, addr, nb, dest, max_age_ms);
+}
+
+int modbus_cache_read_input_registers(
+    modbus_cache_t *cache, int addr, int nb, uint16_t *dest, int max_age_ms)
+{
+    return read_registers(cache, MODBUS_FC_READ_INPUT_REGISTERS, addr, nb, dest, max_age_ms);
+}
+
+int modbus_cache_write_register(modbus_cache_t *cache, int addr, uint16_t value)
+{
+    return write_registers(cache, addr, 1, &value);
+}
+
+int modbus_cache_write_registers(modbus_cache_t *cache, int addr, int nb, const uint16_t *src)
+{
+    return write_registers(cache, addr, nb, src);
+}
+
+/* Drops the holding registers written without the cache */
+void modbus_cache_invalidate(modbus_cache_t *cache, int addr, int nb)
+{
+    if (cache == NULL || addr < 0 || nb < 1 || addr + nb > 0x10000) {
+        return;
+    }
+
+    _modbus_lock(&cache->lock);
+    invalidate(cache, modbus_get_slave(cache->ctx), addr, nb);
+    _modbus_unlock(&cache->lock);
+}
+
+int modbus_cache_get_stats(modbus_cache_t *cache, modbus_cache_stats_t *stats)
+{
+    if (cache == NULL || stats == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    _modbus_lock(&cache->lock);
+    *stats = cache->stats;
+    _modbus_unlock(&cache->lock);
+
+    return 0;
+}
+
+/* The context isn't freed */
+void modbus_cache_free(modbus_cache_t *cache)
+{
+    int i;
+
+    if (cache == NULL) {
+        return;
+    }
+
+    for (i = 0; i < cache->nb_pages; i++) {
+        free(cache->pages[i]);
+    }
+    free(cache->pages);
+    _modbus_lock_destroy(&cache->lock, &cache->cond);
+    free(cache);
+}
@@ -0,0 +1,42 @@
+/*
+ * Copyright © Stéphane Raimbault <stephane.raimbault@gmail.com>
+ *
+ * SPDX-License-Identifier: LGPL-2.1-or-later
+ */
+
+#ifndef MODBUS_CACHE_H
+#define MODBUS_CACHE_H
+
+#include "modbus.h"
+
+MODBUS_BEGIN_DECLS
+
+typedef struct _modbus_cache modbus_cache_t;
+
+typedef struct _modbus_cache_stats {
+    uint32_t nb_reads;
+    /* Reads served from the cache */
+    uint32_t nb_hits;
+    /* Reads given the result of a transaction of another caller covering
+       them */
+    uint32_t nb_shared;
+    uint32_t nb_transactions;
+    /* Cached registers dropped because they were written */
+    uint32_t nb_invalidated;
+} modbus_cache_stats_t;
+
+MODBUS_API modbus_cache_t *modbus_cache_new(modbus_t *ctx);
+MODBUS_API int modbus_cache_read_registers(
+    modbus_cache_t *cache, int addr, int nb, uint16_t *dest, int max_age_ms);
+MODBUS_API int modbus_cache_read_input_registers(
+    modbus_cache_t *cache, int addr, int nb, uint16_t *dest, int max_age_ms);
+MODBUS_API int modbus_cache_write_register(modbus_cache_t *cache, int addr, uint16_t value);
+MODBUS_API int
+modbus_cache_write_registers(modbus_cache_t *cache, int addr, int nb, const uint16_t *src);
+MODBUS_API void modbus_cache_invalidate(modbus_cache_t *cache, int addr, int nb);
+MODBUS_API int modbus_cache_get_stats(modbus_cache_t *cache, modbus_cache_stats_t *stats);
+MODBUS_API void modbus_cache_free(modbus_cache_t *cache);
+
+MODBUS_END_DECLS
+
+#endif /* MODBUS_CACHE_H */
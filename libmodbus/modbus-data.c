@@ -4,6 +4,7 @@
  * SPDX-License-Identifier: LGPL-2.1-or-later
  */
 
+#include <errno.h>
 #include <stdlib.h>
 
 // clang-format off
@@ -290,3 +291,437 @@ void modbus_set_float(float f, uint16_t *dest)
     dest[0] = (uint16_t) i;
     dest[1] = (uint16_t) (i >> 16);
 }
+
+/* Decoding of register arrays. The big-endian bytes of a response and the
+   32-bit values of two registers only need their bytes permuted, so the
+   SIMD implementations shuffle 16 or 32 bytes per step; the remaining
+   values go through the scalar code. The fastest implementation is selected
+   at runtime. */
+
+// clang-format off
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+# define HAVE_DECODE_X86 1
+# if defined(_MSC_VER)
+#  include <intrin.h>
+#  define SSSE3_TARGET
+#  define AVX2_TARGET
+# else
+#  include <cpuid.h>
+#  define SSSE3_TARGET __attribute__((target("ssse3")))
+#  define AVX2_TARGET  __attribute__((target("avx2")))
+# endif
+# include <immintrin.h>
+#elif (defined(__ARM_NEON) || defined(_M_ARM64)) && \
+      (!defined(__BYTE_ORDER__) || __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__)
+# define HAVE_DECODE_NEON 1
+# if defined(_MSC_VER)
+#  include <arm64_neon.h>
+# else
+#  include <arm_neon.h>
+# endif
+#endif
+// clang-format on
+
+/* Permutation of each group of 4 bytes, from the big-endian bytes or the
+   host registers (little-endian on the CPUs with a SIMD implementation) to
+   the host 16 or 32-bit values, indexed by modbus_byte_order_t */
+static const uint8_t decode_masks[4][16] = {
+    /* ABCD: words swapped */
+    {2, 3, 0, 1, 6, 7, 4, 5, 10, 11, 8, 9, 14, 15, 12, 13},
+    /* DCBA: bytes of each word swapped, as the registers of a response */
+    {1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14},
+    /* BADC: the 4 bytes reversed */
+    {3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12},
+    /* CDAB: unchanged */
+    {0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15},
+};
+
+/* Shuffles the first bytes of src to dest and returns the number of bytes
+   done, a multiple of the vector size */
+typedef size_t (*decode_func_t)(uint8_t *dest,
+                                const uint8_t *src,
+                                size_t length,
+                                modbus_byte_order_t order);
+
+static size_t decode_scalar(uint8_t *dest,
+                            const uint8_t *src,
+                            size_t length,
+                            modbus_byte_order_t order)
+{
+    (void) dest;
+    (void) src;
+    (void) length;
+    (void) order;
+    return 0;
+}
+
+#ifdef HAVE_DECODE_X86
+static int has_cpuid_bit(unsigned int leaf, int reg, int bit)
+{
+    unsigned int regs[4];
+#if defined(_MSC_VER)
+    int info[4];
+
+    __cpuidex(info, 0, 0);
+    if ((unsigned int) info[0] < leaf) {
+        return FALSE;
+    }
+    __cpuidex(info, leaf, 0);
+    memcpy(regs, info, sizeof(regs));
+#else
+    if (!__get_cpuid_count(leaf, 0, &regs[0], &regs[1], &regs[2], &regs[3])) {
+        return FALSE;
+    }
+#endif
+
+    return (regs[reg] & (1u << bit)) != 0;
+}
+
+static int has_ssse3(void)
+{
+    /* CPUID.1:ECX.SSSE3 */
+    return has_cpuid_bit(1, 2, 9);
+}
+
+static int has_avx2(void)
+{
+    uint32_t xcr0;
+
+    /* CPUID.7:EBX.AVX2 and the YMM state saved by the OS (CPUID.1:ECX.OSXSAVE,
+       XCR0 bits 1 and 2) */
+    if (!has_cpuid_bit(7, 1, 5) || !has_cpuid_bit(1, 2, 27)) {
+        return FALSE;
+    }
+#if defined(_MSC_VER)
+    xcr0 = (uint32_t) _xgetbv(0);
+#else
+    {
+        uint32_t edx;
+        __asm__ volatile("xgetbv" : "=a"(xcr0), "=d"(edx) : "c"(0));
+    }
+#endif
+
+    return (xcr0 & 6) == 6;
+}
+
+static SSSE3_TARGET size_t decode_ssse3(uint8_t *dest,
+                                        const uint8_t *src,
+                                        size_t length,
+                                        modbus_byte_order_t order)
+{
+    const __m128i mask = _mm_loadu_si128((const __m128i *) decode_masks[order]);
+    size_t done = 0;
+
+    while (length - done >= 32) {
+        __m128i x0 = _mm_loadu_si128((const __m128i *) (src + done));
+        __m128i x1 = _mm_loadu_si128((const __m128i *) (src + done + 16));
+
+        _mm_storeu_si128((__m128i *) (dest + done), _mm_shuffle_epi8(x0, mask));
+        _mm_storeu_si128((__m128i *) (dest + done + 16), _mm_shuffle_epi8(x1, mask));
+        done += 32;
+    }
+    if (length - done >= 16) {
+        __m128i x = _mm_loadu_si128((const __m128i *) (src + done));
+
+        _mm_storeu_si128((__m128i *) (dest + done), _mm_shuffle_epi8(x, mask));
+        done += 16;
+    }
+
+    return done;
+}
+
+static AVX2_TARGET size_t decode_avx2(uint8_t *dest,
+                                      const uint8_t *src,
+                                      size_t length,
+                                      modbus_byte_order_t order)
+{
+    /* The shuffle works in each 128-bit lane so the mask is repeated */
+    const __m256i mask =
+        _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *) decode_masks[order]));
+    size_t done = 0;
+
+    while (length - done >= 64) {
+        __m256i x0 = _mm256_loadu_si256((const __m256i *) (src + done));
+        __m256i x1 = _mm256_loadu_si256((const __m256i *) (src + done + 32));
+
+        _mm256_storeu_si256((__m256i *) (dest + done), _mm256_shuffle_epi8(x0, mask));
+        _mm256_storeu_si256((__m256i *) (dest + done + 32), _mm256_shuffle_epi8(x1, mask));
+        done += 64;
+    }
+    if (length - done >= 32) {
+        __m256i x = _mm256_loadu_si256((const __m256i *) (src + done));
+
+        _mm256_storeu_si256((__m256i *) (dest + done), _mm256_shuffle_epi8(x, mask));
+        done += 32;
+    }
+    if (length - done >= 16) {
+        __m128i x = _mm_loadu_si128((const __m128i *) (src + done));
+
+        _mm_storeu_si128((__m128i *) (dest + done),
+                         _mm_shuffle_epi8(x, _mm256_castsi256_si128(mask)));
+        done += 16;
+    }
+
+    return done;
+}
+#endif
+
+#ifdef HAVE_DECODE_NEON
+static size_t decode_neon(uint8_t *dest,
+                          const uint8_t *src,
+                          size_t length,
+                          modbus_byte_order_t order)
+{
+    size_t done = 0;
+
+    for (; length - done >= 16; done += 16) {
+        uint8x16_t x = vld1q_u8(src + done);
+
+        switch (order) {
+        case MODBUS_ORDER_ABCD:
+            x = vreinterpretq_u8_u16(vrev32q_u16(vreinterpretq_u16_u8(x)));
+            break;
+        case MODBUS_ORDER_DCBA:
+            x = vrev16q_u8(x);
+            break;
+        case MODBUS_ORDER_BADC:
+            x = vrev32q_u8(x);
+            break;
+        default:
+            break;
+        }
+        vst1q_u8(dest + done, x);
+    }
+
+    return done;
+}
+#endif
+
+static decode_func_t decode_func = NULL;
+static int decode_impl = MODBUS_DECODE_AUTO;
+
+static decode_func_t decode_select(int impl)
+{
+    switch (impl) {
+    case MODBUS_DECODE_SCALAR:
+        return decode_scalar;
+#ifdef HAVE_DECODE_X86
+    case MODBUS_DECODE_SSSE3:
+        return has_ssse3() ? decode_ssse3 : NULL;
+    case MODBUS_DECODE_AVX2:
+        return has_avx2() ? decode_avx2 : NULL;
+#endif
+#ifdef HAVE_DECODE_NEON
+    case MODBUS_DECODE_NEON:
+        return decode_neon;
+#endif
+    case MODBUS_DECODE_AUTO:
+#ifdef HAVE_DECODE_X86
+        if (has_avx2()) {
+            return decode_avx2;
+        }
+        if (has_ssse3()) {
+            return decode_ssse3;
+        }
+#endif
+#ifdef HAVE_DECODE_NEON
+        return decode_neon;
+#endif
+        return decode_scalar;
+    default:
+        return NULL;
+    }
+}
+
+static decode_func_t decode_get_func(void)
+{
+    if (decode_func == NULL) {
+        decode_func = decode_select(MODBUS_DECODE_AUTO);
+    }
+
+    return decode_func;
+}
+
+/* Forces an implementation, e.g. to compare them, MODBUS_DECODE_AUTO
+   restores the detection. Returns -1 and sets errno to ENOTSUP if the CPU
+   doesn't support it. */
+int modbus_decode_set_implementation(int impl)
+{
+    decode_func_t func;
+
+    if (impl < MODBUS_DECODE_AUTO || impl > MODBUS_DECODE_NEON) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    func = decode_select(impl);
+    if (func == NULL) {
+        errno = ENOTSUP;
+        return -1;
+    }
+
+    decode_func = func;
+    decode_impl = impl;
+    return 0;
+}
+
+int modbus_decode_get_implementation(void)
+{
+    return decode_impl;
+}
+
+/* Sets nb registers from the big-endian bytes of a response. dest may be
+   the same buffer as src but must not partially overlap it. */
+void modbus_get_registers_from_bytes(uint16_t *dest, const uint8_t *src, int nb)
+{
+    int i;
+
+    if (nb <= 0) {
+        return;
+    }
+
+    i = (int) (decode_get_func()((uint8_t *) dest, src, 2 * (size_t) nb, MODBUS_ORDER_DCBA) /
+               2);
+    for (; i < nb; i++) {
+        dest[i] = (src[2 * i] << 8) | src[2 * i + 1];
+    }
+}
+
+/* Sets nb 32-bit values from 2 * nb registers */
+static int get_32bit_array(void *dest, const uint16_t *src, int nb, modbus_byte_order_t order)
+{
+    uint8_t *out = (uint8_t *) dest;
+    int i;
+
+    if (dest == NULL || src == NULL || nb < 0 || order < MODBUS_ORDER_ABCD ||
+        order > MODBUS_ORDER_CDAB) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    i = (int) (decode_get_func()(out, (const uint8_t *) src, 4 * (size_t) nb, order) / 4);
+    for (; i < nb; i++) {
+        uint16_t hi = src[2 * i];
+        uint16_t lo = src[2 * i + 1];
+        uint32_t value;
+
+        switch (order) {
+        case MODBUS_ORDER_ABCD:
+            value = ((uint32_t) hi << 16) | lo;
+            break;
+        case MODBUS_ORDER_DCBA:
+            value = ((uint32_t) bswap_16(lo) << 16) | bswap_16(hi);
+            break;
+        case MODBUS_ORDER_BADC:
+            value = ((uint32_t) bswap_16(hi) << 16) | bswap_16(lo);
+            break;
+        default:
+            value = ((uint32_t) lo << 16) | hi;
+            break;
+        }
+        memcpy(out + 4 * i, &value, 4);
+    }
+
+    return nb;
+}
+
+/* Gets nb floats from 2 * nb registers in the given order, as
+   modbus_get_float_abcd() and the like do for one value. dest may be the
+   same array as src. Returns nb or -1 (EINVAL). */
+int modbus_get_float_array(float *dest, const uint16_t *src, int nb, modbus_byte_order_t order)
+{
+    return get_32bit_array(dest, src, nb, order);
+}
+
+int modbus_get_uint32_array(uint32_t *dest,
+                            const uint16_t *src,
+                            int nb,
+                            modbus_byte_order_t order)
+{
+    return get_32bit_array(dest, src, nb, order);
+}
+
+int modbus_get_int32_array(int32_t *dest, const uint16_t *src, int nb, modbus_byte_order_t order)
+{
+    return get_32bit_array(dest, src, nb, order);
+}
+
+/* Typed accessors of a register view, addr is the address of the register
+   on the device. Return -1 and set errno to EINVAL when the value isn't in
+   the view. */
+int modbus_view_get_u16(const modbus_register_view_t *view, int addr, uint16_t *value)
+{
+    const uint8_t *p;
+
+    if (view == NULL || view->data == NULL || value == NULL || addr < view->addr ||
+        addr >= view->addr + view->nb) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    p = view->data + 2 * (addr - view->addr);
+    *value = (p[0] << 8) | p[1];
+
+    return 0;
+}
+
+int modbus_view_get_u32(const modbus_register_view_t *view,
+                        int addr,
+                        modbus_byte_order_t order,
+                        uint32_t *value)
+{
+    const uint8_t *p;
+    uint32_t a, b, c, d;
+
+    if (view == NULL || view->data == NULL || value == NULL || addr < view->addr ||
+        addr + 1 >= view->addr + view->nb) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    p = view->data + 2 * (addr - view->addr);
+    a = p[0];
+    b = p[1];
+    c = p[2];
+    d = p[3];
+
+    switch (order) {
+    case MODBUS_ORDER_ABCD:
+        *value = (a << 24) | (b << 16) | (c << 8) | d;
+        break;
+    case MODBUS_ORDER_DCBA:
+        *value = (d << 24) | (c << 16) | (b << 8) | a;
+        break;
+    case MODBUS_ORDER_BADC:
+        *value = (b << 24) | (a << 16) | (d << 8) | c;
+        break;
+    case MODBUS_ORDER_CDAB:
+        *value = (c << 24) | (d << 16) | (a << 8) | b;
+        break;
+    default:
+        errno = EINVAL;
+        return -1;
+    }
+
+    return 0;
+}
+
+int modbus_view_get_float(const modbus_register_view_t *view,
+                          int addr,
+                          modbus_byte_order_t order,
+                          float *value)
+{
+    uint32_t i;
+
+    if (value == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (modbus_view_get_u32(view, addr, order, &i) == -1) {
+        return -1;
+    }
+    memcpy(value, &i, sizeof(float));
+
+    return 0;
+}
@@ -0,0 +1,723 @@
+/*
+ * Copyright © Stéphane Raimbault <stephane.raimbault@gmail.com>
+ *
+ * SPDX-License-Identifier: LGPL-2.1-or-later
+ *
+ * Register changes published to many local subscribers on a Unix domain
+ * socket. A publication is encoded once and appended to the bounded buffer
+ * of each subscriber, then sent right away without blocking: the thread
+ * calling modbus_feed_publish() never waits for a subscriber. What a
+ * subscriber doesn't take is sent by modbus_feed_poll() when its socket is
+ * writable. A subscriber whose buffer is full loses its pending changes and
+ * gets the current image instead, so the intermediate values are coalesced
+ * rather than queued without limit.
+ */
+
+// clang-format off
+#if defined(_WIN32)
+# define OS_WIN32
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#ifndef _MSC_VER
+#include <unistd.h>
+#endif
+
+#if defined(_WIN32)
+# include <winsock2.h>
+/* Unix domain sockets since Windows 10 1803 */
+# include <afunix.h>
+# define close closesocket
+#else
+# include <sys/socket.h>
+# include <sys/select.h>
+# include <sys/ioctl.h>
+# include <sys/un.h>
+#endif
+
+#if !defined(MSG_NOSIGNAL)
+#define MSG_NOSIGNAL 0
+#endif
+// clang-format on
+
+#include "modbus-private.h"
+#include "modbus-thread-private.h"
+
+#include "modbus-feed.h"
+
+#define _MODBUS_FEED_MAX_MESSAGE_LENGTH                                                  \
+    (MODBUS_FEED_HEADER_LENGTH + MODBUS_FEED_MAX_ENTRIES * MODBUS_FEED_ENTRY_LENGTH)
+
+typedef struct _modbus_feed_device {
+    int device;
+    /* Image of the registers start to start + length - 1 */
+    int start;
+    int length;
+    uint16_t *values;
+    uint8_t *known;
+    int nb_known;
+    uint64_t timestamp_ms;
+} modbus_feed_device_t;
+
+typedef struct _modbus_feed_subscriber {
+    /* -1 when the slot is free */
+    int s;
+    /* Pending bytes from offset to length, message is the start of the
+       message being sent */
+    uint8_t *buf;
+    int offset;
+    int message;
+    int length;
+    /* The snapshot is queued as soon as it fits, the changes are dropped
+       until then */
+    int resync;
+    /* Send error, the socket is closed by the next poll */
+    int closing;
+} modbus_feed_subscriber_t;
+
+struct _modbus_feed {
+    int s;
+    char path[sizeof(((struct sockaddr_un *) 0)->sun_path)];
+    /* Publications and polls come from different threads */
+    _modbus_lock_t lock;
+    _modbus_cond_t cond;
+    modbus_feed_subscriber_t *subscribers;
+    int max_subscribers;
+    int buffer_length;
+    modbus_feed_device_t *devices;
+    int nb_devices;
+    /* Message of a publication, encoded once for all the subscribers */
+    uint8_t msg[_MODBUS_FEED_MAX_MESSAGE_LENGTH];
+    modbus_feed_stats_t stats;
+};
+
+#ifdef OS_WIN32
+static int init_win32(void)
+{
+    WSADATA wsaData;
+
+    if (WSAStartup(MAKEWORD(2, 2), &wsaData) != 0) {
+        errno = EIO;
+        return -1;
+    }
+    return 0;
+}
+#endif
+
+static int would_block(void)
+{
+#ifdef OS_WIN32
+    return WSAGetLastError() == WSAEWOULDBLOCK;
+#else
+    return errno == EAGAIN || errno == EWOULDBLOCK;
+#endif
+}
+
+static void set_nonblocking(int s)
+{
+#ifdef OS_WIN32
+    u_long option = 1;
+
+    ioctlsocket(s, FIONBIO, &option);
+#else
+    int option = 1;
+
+    ioctl(s, FIONBIO, &option);
+#endif
+}
+
+static void put_u16(uint8_t *p, uint16_t value)
+{
+    p[0] = value & 0xFF;
+    p[1] = value >> 8;
+}
+
+static void
+put_header(uint8_t *p, int type, int device, int nb, uint64_t timestamp_ms)
+{
+    int i;
+
+    p[0] = type;
+    p[1] = MODBUS_FEED_VERSION;
+    put_u16(p + 2, device);
+    put_u16(p + 4, nb);
+    put_u16(p + 6, 0);
+    for (i = 0; i < 8; i++) {
+        p[8 + i] = (timestamp_ms >> (8 * i)) & 0xFF;
+    }
+}
+
+static int message_length(const uint8_t *msg)
+{
+    return MODBUS_FEED_HEADER_LENGTH + (msg[4] + (msg[5] << 8)) * MODBUS_FEED_ENTRY_LENGTH;
+}
+
+/* Creates the socket at path, a file left by a previous run is replaced.
+   buffer_length is the limit of the pending bytes of each subscriber, it must
+   hold the snapshot of all the devices. */
+modbus_feed_t *modbus_feed_new(const char *path, int max_subscribers, int buffer_length)
+{
+    struct sockaddr_un addr;
+    modbus_feed_t *feed;
+    int flags = SOCK_STREAM;
+    int saved_errno;
+    int i;
+
+    if (path == NULL || strlen(path) >= sizeof(addr.sun_path) || max_subscribers < 1 ||
+        max_subscribers >= FD_SETSIZE || buffer_length < _MODBUS_FEED_MAX_MESSAGE_LENGTH) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+#ifdef OS_WIN32
+    if (init_win32() == -1) {
+        return NULL;
+    }
+#endif
+
+    feed = (modbus_feed_t *) calloc(1, sizeof(modbus_feed_t));
+    if (feed == NULL) {
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    feed->subscribers = (modbus_feed_subscriber_t *) calloc(
+        max_subscribers, sizeof(modbus_feed_subscriber_t));
+    if (feed->subscribers == NULL) {
+        free(feed);
+        errno = ENOMEM;
+        return NULL;
+    }
+    for (i = 0; i < max_subscribers; i++) {
+        feed->subscribers[i].s = -1;
+    }
+
+#ifdef SOCK_CLOEXEC
+    flags |= SOCK_CLOEXEC;
+#endif
+    feed->s = socket(AF_UNIX, flags, 0);
+    if (feed->s < 0) {
+        saved_errno = errno;
+        free(feed->subscribers);
+        free(feed);
+        errno = saved_errno;
+        return NULL;
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+    remove(path);
+    if (bind(feed->s, (struct sockaddr *) &addr, sizeof(addr)) == -1 ||
+        listen(feed->s, max_subscribers) == -1) {
+        saved_errno = errno;
+        close(feed->s);
+        free(feed->subscribers);
+        free(feed);
+        errno = saved_errno;
+        return NULL;
+    }
+    set_nonblocking(feed->s);
+
+    strcpy(feed->path, path);
+    feed->max_subscribers = max_subscribers;
+    feed->buffer_length = buffer_length;
+    _modbus_lock_init(&feed->lock, &feed->cond);
+
+    return feed;
+}
+
+static void close_subscriber(modbus_feed_t *feed, modbus_feed_subscriber_t *sub)
+{
+    close(sub->s);
+    free(sub->buf);
+    sub->s = -1;
+    sub->buf = NULL;
+    feed->stats.nb_subscribers--;
+    feed->stats.nb_closed++;
+}
+
+/* Closes the connections of the subscribers and removes the socket file */
+void modbus_feed_free(modbus_feed_t *feed)
+{
+    int i;
+
+    if (feed == NULL)
+        return;
+
+    for (i = 0; i < feed->max_subscribers; i++) {
+        if (feed->subscribers[i].s != -1) {
+            close_subscriber(feed, &feed->subscribers[i]);
+        }
+    }
+    close(feed->s);
+    remove(feed->path);
+
+    for (i = 0; i < feed->nb_devices; i++) {
+        free(feed->devices[i].values);
+        free(feed->devices[i].known);
+    }
+    free(feed->devices);
+    free(feed->subscribers);
+    _modbus_lock_destroy(&feed->lock, &feed->cond);
+    free(feed);
+}
+
+static modbus_feed_device_t *find_device(modbus_feed_t *feed, int device)
+{
+    modbus_feed_device_t *devices;
+    int i;
+
+    for (i = 0; i < feed->nb_devices; i++) {
+        if (feed->devices[i].device == device) {
+            return &feed->devices[i];
+        }
+    }
+
+    devices = (modbus_feed_device_t *) realloc(
+        feed->devices, (feed->nb_devices + 1) * sizeof(modbus_feed_device_t));
+    if (devices == NULL) {
+        return NULL;
+    }
+    feed->devices = devices;
+    memset(&devices[feed->nb_devices], 0, sizeof(modbus_feed_device_t));
+    devices[feed->nb_devices].device = device;
+
+    return &devices[feed->nb_devices++];
+}
+
+/* Extends the image of the device to the registers first to last */
+static int cover_registers(modbus_feed_device_t *dev, int first, int last)
+{
+    uint16_t *values;
+    uint8_t *known;
+    int start;
+    int length;
+
+    if (dev->length > 0) {
+        if (first >= dev->start && last < dev->start + dev->length) {
+            return 0;
+        }
+        if (dev->start < first) {
+            first = dev->start;
+        }
+        if (dev->start + dev->length - 1 > last) {
+            last = dev->start + dev->length - 1;
+        }
+    }
+    start = first;
+    length = last - first + 1;
+
+    values = (uint16_t *) calloc(length, sizeof(uint16_t));
+    known = (uint8_t *) calloc(length, sizeof(uint8_t));
+    if (values == NULL || known == NULL) {
+        free(values);
+        free(known);
+        return -1;
+    }
+    if (dev->length > 0) {
+        memcpy(values + dev->start - start, dev->values, dev->length * sizeof(uint16_t));
+        memcpy(known + dev->start - start, dev->known, dev->length);
+    }
+    free(dev->values);
+    free(dev->known);
+    dev->values = values;
+    dev->known = known;
+    dev->start = start;
+    dev->length = length;
+
+    return 0;
+}
+
+/* Returns where to write length bytes in the buffer of the subscriber or
+   NULL if they would exceed its limit */
+static uint8_t *reserve(modbus_feed_t *feed, modbus_feed_subscriber_t *sub, int length)
+{
+    uint8_t *p;
+
+    /* The message partly sent is kept whole */
+    if (sub->length - sub->message + length > feed->buffer_length) {
+        return NULL;
+    }
+
+    if (sub->length + length > feed->buffer_length) {
+        memmove(sub->buf, sub->buf + sub->message, sub->length - sub->message);
+        sub->offset -= sub->message;
+        sub->length -= sub->message;
+        sub->message = 0;
+    }
+
+    p = sub->buf + sub->length;
+    sub->length += length;
+
+    return p;
+}
+
+/* Drops the pending messages but the rest of the one partly sent, the
+   subscriber will get the snapshot instead */
+static void drop_pending(modbus_feed_t *feed, modbus_feed_subscriber_t *sub)
+{
+    int end = sub->offset;
+
+    if (sub->offset > sub->message) {
+        end = sub->message + message_length(sub->buf + sub->message);
+    }
+
+    feed->stats.nb_bytes_dropped += sub->length - end;
+    feed->stats.nb_resyncs++;
+    sub->length = end;
+    sub->resync = TRUE;
+}
+
+/* Queues the SNAPSHOT messages of all the devices and SYNC. Returns 1 if
+   queued, 0 if they don't fit in the buffer yet and -1 if they never will. */
+static int queue_snapshot(modbus_feed_t *feed, modbus_feed_subscriber_t *sub)
+{
+    uint64_t timestamp_ms = 0;
+    uint8_t *p;
+    int length = MODBUS_FEED_HEADER_LENGTH;
+    int i;
+
+    for (i = 0; i < feed->nb_devices; i++) {
+        const modbus_feed_device_t *dev = &feed->devices[i];
+        int nb_messages = (dev->nb_known + MODBUS_FEED_MAX_ENTRIES - 1) / MODBUS_FEED_MAX_ENTRIES;
+
+        length += nb_messages * MODBUS_FEED_HEADER_LENGTH +
+                  dev->nb_known * MODBUS_FEED_ENTRY_LENGTH;
+    }
+    if (length > feed->buffer_length) {
+        return -1;
+    }
+
+    p = reserve(feed, sub, length);
+    if (p == NULL) {
+        return 0;
+    }
+
+    for (i = 0; i < feed->nb_devices; i++) {
+        const modbus_feed_device_t *dev = &feed->devices[i];
+        uint8_t *header = NULL;
+        int nb = 0;
+        int j;
+
+        for (j = 0; j < dev->length; j++) {
+            if (!dev->known[j]) {
+                continue;
+            }
+            if (header == NULL) {
+                header = p;
+                p += MODBUS_FEED_HEADER_LENGTH;
+                nb = 0;
+            }
+            put_u16(p, dev->start + j);
+            put_u16(p + 2, dev->values[j]);
+            p += MODBUS_FEED_ENTRY_LENGTH;
+            if (++nb == MODBUS_FEED_MAX_ENTRIES) {
+                put_header(header, MODBUS_FEED_SNAPSHOT, dev->device, nb, dev->timestamp_ms);
+                header = NULL;
+            }
+        }
+        if (header != NULL) {
+            put_header(header, MODBUS_FEED_SNAPSHOT, dev->device, nb, dev->timestamp_ms);
+        }
+        if (dev->timestamp_ms > timestamp_ms) {
+            timestamp_ms = dev->timestamp_ms;
+        }
+    }
+    put_header(p, MODBUS_FEED_SYNC, 0, 0, timestamp_ms);
+    sub->resync = FALSE;
+
+    return 1;
+}
+
+/* Sends the pending bytes until the socket would block. Returns -1 and marks
+   the subscriber to be closed if the connection failed. */
+static int flush_subscriber(modbus_feed_t *feed, modbus_feed_subscriber_t *sub)
+{
+    for (;;) {
+        if (sub->resync && queue_snapshot(feed, sub) == -1) {
+            sub->closing = TRUE;
+            return -1;
+        }
+
+        while (sub->offset < sub->length) {
+            int rc = send(sub->s,
+                          (const char *) sub->buf + sub->offset,
+                          sub->length - sub->offset,
+                          MSG_NOSIGNAL);
+
+            if (rc <= 0) {
+                if (rc == -1 && would_block()) {
+                    return 0;
+                }
+                sub->closing = TRUE;
+                return -1;
+            }
+            sub->offset += rc;
+            feed->stats.nb_bytes_sent += rc;
+            while (sub->message < sub->length &&
+                   sub->message + message_length(sub->buf + sub->message) <= sub->offset) {
+                sub->message += message_length(sub->buf + sub->message);
+            }
+        }
+        sub->offset = 0;
+        sub->message = 0;
+        sub->length = 0;
+
+        /* The snapshot didn't fit behind the pending bytes */
+        if (!sub->resync) {
+            return 0;
+        }
+    }
+}
+
+/* Sets the nb registers addrs of the device to values, acquired at
+   timestamp_ms, and sends them to the subscribers in CHANGE messages. */
+int modbus_feed_publish(modbus_feed_t *feed,
+                        int device,
+                        int nb,
+                        const uint16_t *addrs,
+                        const uint16_t *values,
+                        uint64_t timestamp_ms)
+{
+    modbus_feed_device_t *dev;
+    int first;
+    int last;
+    int i;
+    int j;
+
+    if (feed == NULL || device < 0 || device > 0xFFFF || nb < 0 ||
+        (nb > 0 && (addrs == NULL || values == NULL))) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    _modbus_lock(&feed->lock);
+
+    dev = find_device(feed, device);
+    first = 0xFFFF;
+    last = 0;
+    for (i = 0; i < nb; i++) {
+        if (addrs[i] < first) {
+            first = addrs[i];
+        }
+        if (addrs[i] > last) {
+            last = addrs[i];
+        }
+    }
+    if (dev == NULL || (nb > 0 && cover_registers(dev, first, last) == -1)) {
+        _modbus_unlock(&feed->lock);
+        errno = ENOMEM;
+        return -1;
+    }
+    for (i = 0; i < nb; i++) {
+        int index = addrs[i] - dev->start;
+
+        if (!dev->known[index]) {
+            dev->known[index] = TRUE;
+            dev->nb_known++;
+        }
+        dev->values[index] = values[i];
+    }
+    dev->timestamp_ms = timestamp_ms;
+
+    for (first = 0; first < nb; first += MODBUS_FEED_MAX_ENTRIES) {
+        int nb_entries = nb - first < MODBUS_FEED_MAX_ENTRIES ? nb - first
+                                                              : MODBUS_FEED_MAX_ENTRIES;
+        int length = MODBUS_FEED_HEADER_LENGTH + nb_entries * MODBUS_FEED_ENTRY_LENGTH;
+
+        put_header(feed->msg, MODBUS_FEED_CHANGE, device, nb_entries, timestamp_ms);
+        for (j = 0; j < nb_entries; j++) {
+            uint8_t *entry =
+                feed->msg + MODBUS_FEED_HEADER_LENGTH + j * MODBUS_FEED_ENTRY_LENGTH;
+
+            put_u16(entry, addrs[first + j]);
+            put_u16(entry + 2, values[first + j]);
+        }
+
+        for (i = 0; i < feed->max_subscribers; i++) {
+            modbus_feed_subscriber_t *sub = &feed->subscribers[i];
+            uint8_t *p;
+
+            /* Resynchronized subscribers get the values with the snapshot */
+            if (sub->s == -1 || sub->closing || sub->resync) {
+                continue;
+            }
+
+            p = reserve(feed, sub, length);
+            if (p == NULL) {
+                drop_pending(feed, sub);
+            } else {
+                memcpy(p, feed->msg, length);
+            }
+        }
+    }
+
+    for (i = 0; i < feed->max_subscribers; i++) {
+        modbus_feed_subscriber_t *sub = &feed->subscribers[i];
+
+        if (sub->s != -1 && !sub->closing) {
+            flush_subscriber(feed, sub);
+        }
+    }
+    feed->stats.nb_published++;
+
+    _modbus_unlock(&feed->lock);
+
+    return 0;
+}
+
+static void accept_subscriber(modbus_feed_t *feed)
+{
+    modbus_feed_subscriber_t *sub = NULL;
+    int s;
+    int i;
+
+    s = accept(feed->s, NULL, NULL);
+    if (s < 0) {
+        return;
+    }
+
+    for (i = 0; i < feed->max_subscribers; i++) {
+        if (feed->subscribers[i].s == -1) {
+            sub = &feed->subscribers[i];
+            break;
+        }
+    }
+
+#ifdef OS_WIN32
+    if (sub == NULL) {
+#else
+    if (sub == NULL || s >= FD_SETSIZE) {
+#endif
+        close(s);
+        feed->stats.nb_rejected++;
+        return;
+    }
+
+    memset(sub, 0, sizeof(modbus_feed_subscriber_t));
+    sub->buf = (uint8_t *) malloc(feed->buffer_length);
+    if (sub->buf == NULL) {
+        close(s);
+        sub->s = -1;
+        feed->stats.nb_rejected++;
+        return;
+    }
+    set_nonblocking(s);
+    sub->s = s;
+    sub->resync = TRUE;
+    feed->stats.nb_subscribers++;
+    feed->stats.nb_accepted++;
+
+    /* The snapshot is sent at once */
+    if (flush_subscriber(feed, sub) == -1) {
+        close_subscriber(feed, sub);
+    }
+}
+
+/* Waits up to the timeout for subscribers, their disconnections and room in
+   their sockets then sends what they are waiting for. Returns the number of
+   subscribers or -1 if an error occurred on the listening socket. */
+int modbus_feed_poll(modbus_feed_t *feed, uint32_t to_sec, uint32_t to_usec)
+{
+    struct timeval tv;
+    fd_set rset;
+    fd_set wset;
+    int fdmax;
+    int rc;
+    int i;
+
+    if (feed == NULL || to_usec > 999999) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    /* The sockets are only closed by this function, they stay valid while
+       waiting without the lock */
+    _modbus_lock(&feed->lock);
+    FD_ZERO(&rset);
+    FD_ZERO(&wset);
+    FD_SET(feed->s, &rset);
+    fdmax = feed->s;
+    for (i = 0; i < feed->max_subscribers; i++) {
+        modbus_feed_subscriber_t *sub = &feed->subscribers[i];
+
+        if (sub->s == -1) {
+            continue;
+        }
+        if (sub->closing) {
+            close_subscriber(feed, sub);
+            continue;
+        }
+
+        FD_SET(sub->s, &rset);
+        if (sub->offset < sub->length || sub->resync) {
+            FD_SET(sub->s, &wset);
+        }
+        if (sub->s > fdmax) {
+            fdmax = sub->s;
+        }
+    }
+    _modbus_unlock(&feed->lock);
+
+    tv.tv_sec = to_sec;
+    tv.tv_usec = to_usec;
+    rc = select(fdmax + 1, &rset, &wset, NULL, &tv);
+    if (rc == -1) {
+        if (errno == EINTR) {
+            return 0;
+        }
+        return -1;
+    }
+
+    _modbus_lock(&feed->lock);
+    for (i = 0; rc > 0 && i < feed->max_subscribers; i++) {
+        modbus_feed_subscriber_t *sub = &feed->subscribers[i];
+
+        if (sub->s == -1) {
+            continue;
+        }
+
+        /* Nothing is expected from the subscribers but the end of file */
+        if (FD_ISSET(sub->s, &rset)) {
+            char discard[64];
+            int n = recv(sub->s, discard, sizeof(discard), 0);
+
+            if (n == 0 || (n == -1 && !would_block())) {
+                close_subscriber(feed, sub);
+                continue;
+            }
+        }
+
+        if (FD_ISSET(sub->s, &wset) && !sub->closing &&
+            flush_subscriber(feed, sub) == -1) {
+            close_subscriber(feed, sub);
+        }
+    }
+
+    if (rc > 0 && FD_ISSET(feed->s, &rset)) {
+        accept_subscriber(feed);
+    }
+    rc = feed->stats.nb_subscribers;
+    _modbus_unlock(&feed->lock);
+
+    return rc;
+}
+
+int modbus_feed_get_stats(modbus_feed_t *feed, modbus_feed_stats_t *stats)
+{
+    if (feed == NULL || stats == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    _modbus_lock(&feed->lock);
+    *stats = feed->stats;
+    _modbus_unlock(&feed->lock);
+
+    return 0;
+}
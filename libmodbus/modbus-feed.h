@@ -0,0 +1,79 @@
+/*
+ * Copyright © Stéphane Raimbault <stephane.raimbault@gmail.com>
+ *
+ * SPDX-License-Identifier: LGPL-2.1-or-later
+ */
+
+#ifndef MODBUS_FEED_H
+#define MODBUS_FEED_H
+
+#include "modbus.h"
+
+MODBUS_BEGIN_DECLS
+
+/* Register changes published to the local processes connected to a Unix
+   domain socket.
+
+   Each message is a header followed by nb entries, all fields little-endian:
+
+     uint8_t  type       MODBUS_FEED_SNAPSHOT, MODBUS_FEED_SYNC or
+                         MODBUS_FEED_CHANGE
+     uint8_t  version    MODBUS_FEED_VERSION
+     uint16_t device
+     uint16_t nb         at most MODBUS_FEED_MAX_ENTRIES
+     uint16_t reserved
+     uint64_t timestamp  acquisition time, ms since 1970-01-01 UTC
+
+   and for each register:
+
+     uint16_t addr
+     uint16_t value
+
+   A subscriber first receives the known registers of every device in
+   SNAPSHOT messages, then a SYNC message (device and nb 0) and then a CHANGE
+   message each time registers are published. The subscriber doesn't send
+   anything. When a subscriber doesn't read fast enough to keep its pending
+   messages under the buffer length, its pending changes are dropped and it
+   receives SNAPSHOT messages of the current values followed by SYNC again. */
+#define MODBUS_FEED_VERSION       1
+#define MODBUS_FEED_HEADER_LENGTH 16
+#define MODBUS_FEED_ENTRY_LENGTH  4
+#define MODBUS_FEED_MAX_ENTRIES   1024
+
+#define MODBUS_FEED_SNAPSHOT 1
+#define MODBUS_FEED_SYNC     2
+#define MODBUS_FEED_CHANGE   3
+
+typedef struct _modbus_feed modbus_feed_t;
+
+typedef struct _modbus_feed_stats {
+    uint32_t nb_subscribers;
+    uint32_t nb_accepted;
+    uint32_t nb_rejected;
+    uint32_t nb_closed;
+    /* Calls to modbus_feed_publish() */
+    uint32_t nb_published;
+    /* Subscribers that fell behind and were sent the snapshot again */
+    uint32_t nb_resyncs;
+    /* Pending bytes of the subscribers dropped by the resyncs */
+    uint32_t nb_bytes_dropped;
+    uint32_t nb_bytes_sent;
+} modbus_feed_stats_t;
+
+MODBUS_API modbus_feed_t *
+modbus_feed_new(const char *path, int max_subscribers, int buffer_length);
+MODBUS_API void modbus_feed_free(modbus_feed_t *feed);
+
+MODBUS_API int modbus_feed_publish(modbus_feed_t *feed,
+                                   int device,
+                                   int nb,
+                                   const uint16_t *addrs,
+                                   const uint16_t *values,
+                                   uint64_t timestamp_ms);
+MODBUS_API int modbus_feed_poll(modbus_feed_t *feed, uint32_t to_sec, uint32_t to_usec);
+
+MODBUS_API int modbus_feed_get_stats(modbus_feed_t *feed, modbus_feed_stats_t *stats);
+
+MODBUS_END_DECLS
+
+#endif /* MODBUS_FEED_H */
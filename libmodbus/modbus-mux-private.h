@@ -0,0 +1,65 @@
+/*
+ * Copyright © Stéphane Raimbault <stephane.raimbault@gmail.com>
+ *
+ * SPDX-License-Identifier: LGPL-2.1-or-later
+ */
+
+#ifndef MODBUS_MUX_PRIVATE_H
+#define MODBUS_MUX_PRIVATE_H
+
+#define _MODBUS_MUX_HEADER_LENGTH     7
+#define _MODBUS_MUX_PRESET_REQ_LENGTH 12
+#define _MODBUS_MUX_PRESET_RSP_LENGTH 8
+
+#define _MODBUS_MUX_CHECKSUM_LENGTH 0
+
+/* Delay before the connection is tried again after a failure, the requests
+   fail at once in the meantime */
+#define _MODBUS_MUX_RECONNECT_DELAY_US 1000000
+
+typedef struct _modbus_mux_device modbus_mux_device_t;
+
+struct _modbus_mux {
+    /* TCP context owning the socket, only used to connect and close */
+    modbus_t *tcp;
+    /* Protects everything below but rx, which belongs to the reader */
+    _modbus_lock_t lock;
+    /* Broadcast when a response is dispatched, a slot is freed or the reader
+       leaves */
+    _modbus_cond_t cond;
+    /* Transaction ID of the last request sent on the connection */
+    uint16_t t_id;
+    int max_in_flight;
+    int nb_in_flight;
+    modbus_mux_device_t **in_flight;
+    /* A device waiting for its response reads the socket for all of them */
+    int reading;
+    /* The connection has been shut down while being read, the reader closes
+       the socket */
+    int closing;
+    uint64_t next_connect_us;
+    /* Stream received by the reader, split in responses */
+    uint8_t rx[2 * MODBUS_TCP_MAX_ADU_LENGTH];
+    int rx_length;
+    modbus_mux_stats_t stats;
+};
+
+struct _modbus_mux_device {
+    /* Transaction ID of the requests built for this device, as in
+       modbus_tcp_t */
+    uint16_t t_id;
+    modbus_mux_t *mux;
+    /* Transaction ID of the pending request on the connection and the one it
+       was built with, given back in the response */
+    uint16_t wire_t_id;
+    uint8_t req_t_id[2];
+    int pending;
+    /* Set instead of the response when the connection was lost */
+    int error;
+    /* Response being read by _modbus_receive_msg() */
+    uint8_t rx[MODBUS_TCP_MAX_ADU_LENGTH];
+    int rx_length;
+    int rx_offset;
+};
+
+#endif /* MODBUS_MUX_PRIVATE_H */
@@ -0,0 +1,778 @@
+/*
+ * Copyright © Stéphane Raimbault <stephane.raimbault@gmail.com>
+ *
+ * SPDX-License-Identifier: LGPL-2.1-or-later
+ *
+ * Many devices behind one Modbus TCP gateway on a single connection. Each
+ * device is a modbus_t of its own, used from its own thread with the usual
+ * functions. Their requests are sent on the shared socket with a transaction
+ * ID unique on the connection and, up to the in-flight limit of the gateway,
+ * without waiting for the responses of the others. One of the threads waiting
+ * for a response reads the socket for all of them and hands each response to
+ * its device by transaction ID.
+ */
+
+// clang-format off
+#if defined(_WIN32)
+# define OS_WIN32
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#ifndef _MSC_VER
+#include <unistd.h>
+#endif
+#include <sys/types.h>
+
+#if defined(_WIN32)
+# include <winsock2.h>
+# include <ws2tcpip.h>
+# define SHUT_RDWR 2
+#else
+# include <sys/socket.h>
+#endif
+
+#if !defined(MSG_NOSIGNAL)
+#define MSG_NOSIGNAL 0
+#endif
+// clang-format on
+
+#include "modbus-private.h"
+#include "modbus-thread-private.h"
+
+#include "modbus-mux.h"
+#include "modbus-mux-private.h"
+
+static int would_block(void)
+{
+#ifdef OS_WIN32
+    return WSAGetLastError() == WSAEWOULDBLOCK;
+#else
+    return errno == EAGAIN || errno == EWOULDBLOCK;
+#endif
+}
+
+static int wait_socket(int s, int write, uint64_t deadline_us)
+{
+    uint64_t now_us = _modbus_monotonic_us();
+    uint64_t left_us = now_us < deadline_us ? deadline_us - now_us : 0;
+    struct timeval tv;
+    fd_set set;
+    int rc;
+
+    tv.tv_sec = (long) (left_us / 1000000);
+    tv.tv_usec = (long) (left_us % 1000000);
+    FD_ZERO(&set);
+    FD_SET(s, &set);
+    rc = select(s + 1,
+                write ? NULL : &set,
+                write ? &set : NULL,
+                NULL,
+                deadline_us == UINT64_MAX ? NULL : &tv);
+    if (rc == -1 && errno == EINTR) {
+        rc = 0;
+    }
+
+    return rc;
+}
+
+static int is_open(modbus_mux_t *mux)
+{
+    return mux->tcp->s >= 0 && !mux->closing;
+}
+
+/* Removes the pending request of the device from the connection, its
+   response will be dropped */
+static void cancel(modbus_mux_t *mux, modbus_mux_device_t *dev)
+{
+    int i;
+
+    if (!dev->pending) {
+        return;
+    }
+
+    for (i = 0; i < mux->nb_in_flight; i++) {
+        if (mux->in_flight[i] == dev) {
+            mux->in_flight[i] = mux->in_flight[--mux->nb_in_flight];
+            break;
+        }
+    }
+    dev->pending = FALSE;
+    _modbus_cond_broadcast(&mux->cond);
+}
+
+/* Fails the pending requests of all devices with error. The socket is only
+   shut down while a device is reading it, the reader closes it. */
+static void close_link(modbus_mux_t *mux, int error)
+{
+    int i;
+
+    for (i = 0; i < mux->nb_in_flight; i++) {
+        mux->in_flight[i]->pending = FALSE;
+        mux->in_flight[i]->error = error;
+    }
+    mux->nb_in_flight = 0;
+
+    if (mux->reading) {
+        shutdown(mux->tcp->s, SHUT_RDWR);
+        mux->closing = TRUE;
+    } else {
+        modbus_close(mux->tcp);
+    }
+    _modbus_cond_broadcast(&mux->cond);
+}
+
+static int connect_link(modbus_mux_t *mux, modbus_t *ctx)
+{
+    uint64_t now_us;
+
+    while (mux->closing) {
+        _modbus_cond_wait_until(&mux->cond, &mux->lock, UINT64_MAX);
+    }
+    if (mux->tcp->s >= 0) {
+        return 0;
+    }
+
+    now_us = _modbus_monotonic_us();
+    if (now_us < mux->next_connect_us) {
+        errno = ECONNREFUSED;
+        return -1;
+    }
+
+    /* Only one device connects, the others wait for the lock */
+    mux->tcp->debug = ctx->debug;
+    mux->tcp->response_timeout = ctx->response_timeout;
+    if (modbus_connect(mux->tcp) == -1) {
+        mux->next_connect_us = now_us + _MODBUS_MUX_RECONNECT_DELAY_US;
+        return -1;
+    }
+    mux->rx_length = 0;
+    mux->stats.nb_connects++;
+
+    return 0;
+}
+
+/* Unique among the requests in flight, a late response to a cancelled
+   request can't be taken for the response to a new one */
+static uint16_t next_t_id(modbus_mux_t *mux)
+{
+    int i;
+
+    for (;;) {
+        mux->t_id++;
+        for (i = 0; i < mux->nb_in_flight; i++) {
+            if (mux->in_flight[i]->wire_t_id == mux->t_id) {
+                break;
+            }
+        }
+        if (i == mux->nb_in_flight) {
+            return mux->t_id;
+        }
+    }
+}
+
+static int send_all(int s, const uint8_t *msg, int length, uint64_t deadline_us)
+{
+    int sent = 0;
+
+    while (sent < length) {
+        int rc = send(s, (const char *) msg + sent, length - sent, MSG_NOSIGNAL);
+
+        if (rc > 0) {
+            sent += rc;
+        } else if (rc == -1 && would_block()) {
+            if (wait_socket(s, TRUE, deadline_us) <= 0) {
+                errno = ETIMEDOUT;
+                return -1;
+            }
+        } else if (rc == -1 && errno == EINTR) {
+            continue;
+        } else {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+/* Hands the response to the device waiting for it with the transaction ID it
+   was built with */
+static void deliver(modbus_mux_t *mux, const uint8_t *msg, int length)
+{
+    uint16_t t_id = (msg[0] << 8) | msg[1];
+    int i;
+
+    for (i = 0; i < mux->nb_in_flight; i++) {
+        modbus_mux_device_t *dev = mux->in_flight[i];
+
+        if (dev->wire_t_id == t_id) {
+            memcpy(dev->rx, msg, length);
+            dev->rx[0] = dev->req_t_id[0];
+            dev->rx[1] = dev->req_t_id[1];
+            dev->rx_length = length;
+            dev->rx_offset = 0;
+            dev->pending = FALSE;
+            mux->in_flight[i] = mux->in_flight[--mux->nb_in_flight];
+            mux->stats.nb_responses++;
+            return;
+        }
+    }
+
+    mux->stats.nb_dropped++;
+}
+
+/* Splits the received stream in responses with their MBAP length, what's
+   left is the beginning of the next one */
+static int dispatch(modbus_mux_t *mux)
+{
+    int offset = 0;
+
+    while (mux->rx_length - offset >= _MODBUS_MUX_HEADER_LENGTH) {
+        const uint8_t *msg = mux->rx + offset;
+        int length = 6 + ((msg[4] << 8) | msg[5]);
+
+        if (msg[2] != 0 || msg[3] != 0 || length <= _MODBUS_MUX_HEADER_LENGTH ||
+            length > MODBUS_TCP_MAX_ADU_LENGTH) {
+            /* Lost framing, nothing else on the connection can be trusted */
+            errno = EMBBADDATA;
+            return -1;
+        }
+        if (mux->rx_length - offset < length) {
+            break;
+        }
+        deliver(mux, msg, length);
+        offset += length;
+    }
+
+    memmove(mux->rx, mux->rx + offset, mux->rx_length - offset);
+    mux->rx_length -= offset;
+
+    return 0;
+}
+
+/* Called by the reader without the lock. Returns the number of bytes
+   received, 0 if nothing came before deadline_us or -1. */
+static int receive_stream(modbus_mux_t *mux, int s, uint64_t deadline_us)
+{
+    int rc = wait_socket(s, FALSE, deadline_us);
+
+    if (rc <= 0) {
+        return rc;
+    }
+
+    /* A whole response always fits after an incomplete one */
+    rc = recv(s, (char *) mux->rx + mux->rx_length, sizeof(mux->rx) - mux->rx_length, 0);
+    if (rc == 0) {
+        errno = ECONNRESET;
+        return -1;
+    }
+    if (rc == -1) {
+        return would_block() ? 0 : -1;
+    }
+    mux->rx_length += rc;
+
+    return rc;
+}
+
+static int _modbus_set_slave(modbus_t *ctx, int slave)
+{
+    int max_slave = (ctx->quirks & MODBUS_QUIRK_MAX_SLAVE) ? 255 : 247;
+
+    /* Broadcast address is 0 (MODBUS_BROADCAST_ADDRESS) */
+    if (slave >= 0 && slave <= max_slave) {
+        ctx->slave = slave;
+    } else if (slave == MODBUS_TCP_SLAVE) {
+        ctx->slave = slave;
+    } else {
+        errno = EINVAL;
+        return -1;
+    }
+
+    return 0;
+}
+
+/* Builds a request header as in TCP, the transaction ID is replaced by one
+   of the connection when the request is sent */
+static int _modbus_mux_build_request_basis(
+    modbus_t *ctx, int function, int addr, int nb, uint8_t *req)
+{
+    modbus_mux_device_t *dev = ctx->backend_data;
+
+    if (dev->t_id < UINT16_MAX)
+        dev->t_id++;
+    else
+        dev->t_id = 0;
+
+    req[0] = dev->t_id >> 8;
+    req[1] = dev->t_id & 0x00ff;
+
+    /* Protocol Modbus */
+    req[2] = 0;
+    req[3] = 0;
+
+    /* Length will be defined later by _modbus_mux_send_msg_pre at offsets 4
+       and 5 */
+
+    req[6] = ctx->slave;
+    req[7] = function;
+    req[8] = addr >> 8;
+    req[9] = addr & 0x00ff;
+    req[10] = nb >> 8;
+    req[11] = nb & 0x00ff;
+
+    return _MODBUS_MUX_PRESET_REQ_LENGTH;
+}
+
+/* Builds a response header as in TCP */
+static int _modbus_mux_build_response_basis(sft_t *sft, uint8_t *rsp)
+{
+    rsp[0] = sft->t_id >> 8;
+    rsp[1] = sft->t_id & 0x00ff;
+
+    /* Protocol Modbus */
+    rsp[2] = 0;
+    rsp[3] = 0;
+
+    /* Length will be set later by send_msg (4 and 5) */
+
+    /* The slave ID is copied from the indication */
+    rsp[6] = sft->slave;
+    rsp[7] = sft->function;
+
+    return _MODBUS_MUX_PRESET_RSP_LENGTH;
+}
+
+static int _modbus_mux_prepare_response_tid(const uint8_t *req, int *req_length)
+{
+    (void) req_length;
+    return (req[0] << 8) + req[1];
+}
+
+static int _modbus_mux_send_msg_pre(uint8_t *req, int req_length)
+{
+    /* Subtract the header length to the message length */
+    int mbap_length = req_length - 6;
+
+    req[4] = mbap_length >> 8;
+    req[5] = mbap_length & 0x00FF;
+
+    return req_length;
+}
+
+/* Waits for a free in-flight slot, connects if the connection was lost and
+   sends the request with a transaction ID of the connection */
+static ssize_t _modbus_mux_send(modbus_t *ctx, const uint8_t *req, int req_length)
+{
+    modbus_mux_device_t *dev = ctx->backend_data;
+    modbus_mux_t *mux = dev->mux;
+    uint8_t msg[MODBUS_TCP_MAX_ADU_LENGTH];
+    uint64_t deadline_us;
+    int waited = FALSE;
+    int error;
+
+    if (req_length <= _MODBUS_MUX_HEADER_LENGTH || req_length > MODBUS_TCP_MAX_ADU_LENGTH) {
+        errno = EMBBADDATA;
+        return -1;
+    }
+
+    deadline_us = _modbus_monotonic_us() +
+                  (uint64_t) ctx->response_timeout.tv_sec * 1000000 +
+                  ctx->response_timeout.tv_usec;
+
+    _modbus_lock(&mux->lock);
+
+    /* A new transaction, the previous one is no longer waited for */
+    cancel(mux, dev);
+    dev->error = 0;
+    dev->rx_length = 0;
+    dev->rx_offset = 0;
+
+    while (mux->nb_in_flight == mux->max_in_flight) {
+        if (!waited) {
+            mux->stats.nb_waits++;
+            waited = TRUE;
+        }
+        if (!_modbus_cond_wait_until(&mux->cond, &mux->lock, deadline_us)) {
+            _modbus_unlock(&mux->lock);
+            errno = ETIMEDOUT;
+            return -1;
+        }
+    }
+
+    if (!is_open(mux) && connect_link(mux, ctx) == -1) {
+        error = errno;
+        _modbus_unlock(&mux->lock);
+        errno = error;
+        return -1;
+    }
+    ctx->s = mux->tcp->s;
+
+    memcpy(msg, req, req_length);
+    dev->req_t_id[0] = req[0];
+    dev->req_t_id[1] = req[1];
+    dev->wire_t_id = next_t_id(mux);
+    msg[0] = dev->wire_t_id >> 8;
+    msg[1] = dev->wire_t_id & 0x00ff;
+
+    mux->in_flight[mux->nb_in_flight++] = dev;
+    dev->pending = TRUE;
+    mux->stats.nb_requests++;
+    if (mux->nb_in_flight > mux->stats.max_in_flight) {
+        mux->stats.max_in_flight = mux->nb_in_flight;
+    }
+
+    if (send_all(mux->tcp->s, msg, req_length, deadline_us) == -1) {
+        /* A partial request would shift the stream of all devices */
+        error = errno;
+        close_link(mux, error);
+        _modbus_unlock(&mux->lock);
+        errno = error;
+        return -1;
+    }
+
+    _modbus_unlock(&mux->lock);
+
+    return req_length;
+}
+
+static int _modbus_mux_receive(modbus_t *ctx, uint8_t *req)
+{
+    return _modbus_receive_msg(ctx, req, MSG_INDICATION);
+}
+
+/* Hands out the response given by the reader */
+static ssize_t _modbus_mux_recv(modbus_t *ctx, uint8_t *rsp, int rsp_length)
+{
+    modbus_mux_device_t *dev = ctx->backend_data;
+    int length = dev->rx_length - dev->rx_offset;
+
+    if (length > rsp_length) {
+        length = rsp_length;
+    }
+    memcpy(rsp, dev->rx + dev->rx_offset, length);
+    dev->rx_offset += length;
+
+    return length;
+}
+
+static int _modbus_mux_check_integrity(modbus_t *ctx, uint8_t *msg, const int msg_length)
+{
+    (void) ctx;
+    (void) msg;
+    return msg_length;
+}
+
+static int _modbus_mux_pre_check_confirmation(modbus_t *ctx,
+                                              const uint8_t *req,
+                                              const uint8_t *rsp,
+                                              int rsp_length)
+{
+    unsigned int protocol_id;
+
+    (void) rsp_length;
+
+    /* Check transaction ID */
+    if (req[0] != rsp[0] || req[1] != rsp[1]) {
+        if (ctx->debug) {
+            fprintf(stderr,
+                    "Invalid transaction ID received 0x%X (not 0x%X)\n",
+                    (rsp[0] << 8) + rsp[1],
+                    (req[0] << 8) + req[1]);
+        }
+        errno = EMBBADDATA;
+        return -1;
+    }
+
+    /* Check protocol ID */
+    protocol_id = (rsp[2] << 8) + rsp[3];
+    if (protocol_id != 0x0) {
+        if (ctx->debug) {
+            fprintf(stderr, "Invalid protocol ID received 0x%X (not 0x0)\n", protocol_id);
+        }
+        errno = EMBBADDATA;
+        return -1;
+    }
+
+    return 0;
+}
+
+static int _modbus_mux_connect(modbus_t *ctx)
+{
+    modbus_mux_device_t *dev = ctx->backend_data;
+    modbus_mux_t *mux = dev->mux;
+    int error;
+    int rc;
+
+    _modbus_lock(&mux->lock);
+    rc = connect_link(mux, ctx);
+    error = errno;
+    ctx->s = mux->tcp->s;
+    _modbus_unlock(&mux->lock);
+
+    errno = error;
+    return rc;
+}
+
+/* A response already received is still readable once the connection is lost */
+static unsigned int _modbus_mux_is_connected(modbus_t *ctx)
+{
+    modbus_mux_device_t *dev = ctx->backend_data;
+    modbus_mux_t *mux = dev->mux;
+    unsigned int connected;
+
+    _modbus_lock(&mux->lock);
+    connected = is_open(mux) || (!dev->pending && dev->rx_offset < dev->rx_length);
+    _modbus_unlock(&mux->lock);
+
+    return connected;
+}
+
+/* Only the device lets go of the connection, the others keep using it */
+static void _modbus_mux_close(modbus_t *ctx)
+{
+    modbus_mux_device_t *dev = ctx->backend_data;
+
+    _modbus_lock(&dev->mux->lock);
+    cancel(dev->mux, dev);
+    dev->rx_length = 0;
+    dev->rx_offset = 0;
+    _modbus_unlock(&dev->mux->lock);
+}
+
+static int _modbus_mux_flush(modbus_t *ctx)
+{
+    modbus_mux_device_t *dev = ctx->backend_data;
+    int rc;
+
+    _modbus_lock(&dev->mux->lock);
+    cancel(dev->mux, dev);
+    rc = dev->rx_length - dev->rx_offset;
+    dev->rx_length = 0;
+    dev->rx_offset = 0;
+    _modbus_unlock(&dev->mux->lock);
+
+    return rc;
+}
+
+/* Waits for the response of the device. The first device waiting reads the
+   socket and dispatches what comes to all devices, the others sleep until a
+   response is dispatched or the reader leaves. */
+static int
+_modbus_mux_select(modbus_t *ctx, fd_set *rset, struct timeval *tv, int length_to_read)
+{
+    modbus_mux_device_t *dev = ctx->backend_data;
+    modbus_mux_t *mux = dev->mux;
+    uint64_t deadline_us = UINT64_MAX;
+    int error = 0;
+    int rc;
+
+    (void) rset;
+    (void) length_to_read;
+
+    if (tv != NULL) {
+        deadline_us = _modbus_monotonic_us() + (uint64_t) tv->tv_sec * 1000000 + tv->tv_usec;
+    }
+
+    _modbus_lock(&mux->lock);
+    for (;;) {
+        int s;
+
+        if (!dev->pending) {
+            if (dev->rx_offset < dev->rx_length) {
+                /* The response or the rest of it */
+                rc = 1;
+            } else if (dev->rx_length > 0) {
+                /* The response was shorter than its function requires */
+                error = EMBBADDATA;
+                rc = -1;
+            } else {
+                /* Lost connection or no request sent */
+                error = dev->error != 0 ? dev->error : ETIMEDOUT;
+                rc = -1;
+            }
+            break;
+        }
+
+        if (mux->reading) {
+            if (!_modbus_cond_wait_until(&mux->cond, &mux->lock, deadline_us)) {
+                cancel(mux, dev);
+                error = ETIMEDOUT;
+                rc = -1;
+                break;
+            }
+            continue;
+        }
+
+        if (_modbus_monotonic_us() >= deadline_us) {
+            cancel(mux, dev);
+            error = ETIMEDOUT;
+            rc = -1;
+            break;
+        }
+
+        /* A pending request means the connection is open */
+        s = mux->tcp->s;
+        mux->reading = TRUE;
+        _modbus_unlock(&mux->lock);
+
+        rc = receive_stream(mux, s, deadline_us);
+        error = errno;
+
+        _modbus_lock(&mux->lock);
+        mux->reading = FALSE;
+        if (mux->closing) {
+            modbus_close(mux->tcp);
+            mux->closing = FALSE;
+        } else if (rc == -1) {
+            close_link(mux, error);
+        } else if (rc > 0 && dispatch(mux) == -1) {
+            close_link(mux, errno);
+        }
+        /* Another device becomes the reader if this one is done */
+        _modbus_cond_broadcast(&mux->cond);
+    }
+    _modbus_unlock(&mux->lock);
+
+    if (rc == -1) {
+        errno = error;
+    }
+    return rc;
+}
+
+static void _modbus_mux_free(modbus_t *ctx)
+{
+    if (ctx->backend_data) {
+        _modbus_mux_close(ctx);
+        free(ctx->backend_data);
+    }
+    free(ctx);
+}
+
+// clang-format off
+const modbus_backend_t _modbus_mux_backend = {
+    _MODBUS_BACKEND_TYPE_MUX,
+    _MODBUS_MUX_HEADER_LENGTH,
+    _MODBUS_MUX_CHECKSUM_LENGTH,
+    MODBUS_TCP_MAX_ADU_LENGTH,
+    _modbus_set_slave,
+    _modbus_mux_build_request_basis,
+    _modbus_mux_build_response_basis,
+    _modbus_mux_prepare_response_tid,
+    _modbus_mux_send_msg_pre,
+    _modbus_mux_send,
+    _modbus_mux_receive,
+    _modbus_mux_recv,
+    _modbus_mux_check_integrity,
+    _modbus_mux_pre_check_confirmation,
+    _modbus_mux_connect,
+    _modbus_mux_is_connected,
+    _modbus_mux_close,
+    _modbus_mux_flush,
+    _modbus_mux_select,
+    _modbus_mux_free
+};
+// clang-format on
+
+/* The connection is established by the first request of a device or by
+   modbus_connect() on one of them, and again after it has been lost */
+modbus_mux_t *modbus_mux_new(const char *ip, int port, int max_in_flight)
+{
+    modbus_mux_t *mux;
+
+    if (max_in_flight < 1) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    mux = (modbus_mux_t *) calloc(1, sizeof(modbus_mux_t));
+    if (mux == NULL) {
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    mux->in_flight =
+        (modbus_mux_device_t **) calloc(max_in_flight, sizeof(modbus_mux_device_t *));
+    if (mux->in_flight == NULL) {
+        free(mux);
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    /* Checks the IP address */
+    mux->tcp = modbus_new_tcp(ip, port);
+    if (mux->tcp == NULL) {
+        free(mux->in_flight);
+        free(mux);
+        return NULL;
+    }
+    mux->max_in_flight = max_in_flight;
+
+    _modbus_lock_init(&mux->lock, &mux->cond);
+
+    return mux;
+}
+
+/* The device is freed with modbus_free(), before its connection */
+modbus_t *modbus_mux_new_device(modbus_mux_t *mux, int slave)
+{
+    modbus_t *ctx;
+    modbus_mux_device_t *dev;
+
+    if (mux == NULL) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    ctx = (modbus_t *) malloc(sizeof(modbus_t));
+    if (ctx == NULL) {
+        return NULL;
+    }
+    _modbus_init_common(ctx);
+    ctx->backend = &_modbus_mux_backend;
+
+    ctx->backend_data = (modbus_mux_device_t *) calloc(1, sizeof(modbus_mux_device_t));
+    if (ctx->backend_data == NULL) {
+        modbus_free(ctx);
+        errno = ENOMEM;
+        return NULL;
+    }
+    dev = (modbus_mux_device_t *) ctx->backend_data;
+    dev->mux = mux;
+
+    if (_modbus_set_slave(ctx, slave) == -1) {
+        modbus_free(ctx);
+        return NULL;
+    }
+
+    return ctx;
+}
+
+int modbus_mux_get_stats(modbus_mux_t *mux, modbus_mux_stats_t *stats)
+{
+    if (mux == NULL || stats == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    _modbus_lock(&mux->lock);
+    *stats = mux->stats;
+    _modbus_unlock(&mux->lock);
+
+    return 0;
+}
+
+void modbus_mux_free(modbus_mux_t *mux)
+{
+    if (mux == NULL) {
+        return;
+    }
+
+    modbus_close(mux->tcp);
+    modbus_free(mux->tcp);
+    _modbus_lock_destroy(&mux->lock, &mux->cond);
+    free(mux->in_flight);
+    free(mux);
+}
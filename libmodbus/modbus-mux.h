@@ -0,0 +1,38 @@
+/*
+ * Copyright © Stéphane Raimbault <stephane.raimbault@gmail.com>
+ *
+ * SPDX-License-Identifier: LGPL-2.1-or-later
+ */
+
+#ifndef MODBUS_MUX_H
+#define MODBUS_MUX_H
+
+#include "modbus.h"
+
+MODBUS_BEGIN_DECLS
+
+/* Requests sent on the connection without their response yet, by default */
+#define MODBUS_MUX_DEFAULT_MAX_IN_FLIGHT 4
+
+typedef struct _modbus_mux modbus_mux_t;
+
+typedef struct _modbus_mux_stats {
+    uint32_t nb_requests;
+    uint32_t nb_responses;
+    /* Responses to a transaction no longer waited for (e.g. timed out) */
+    uint32_t nb_dropped;
+    /* Requests which had to wait for a free in-flight slot */
+    uint32_t nb_waits;
+    uint32_t nb_connects;
+    /* Highest number of requests in flight at once */
+    int max_in_flight;
+} modbus_mux_stats_t;
+
+MODBUS_API modbus_mux_t *modbus_mux_new(const char *ip_address, int port, int max_in_flight);
+MODBUS_API modbus_t *modbus_mux_new_device(modbus_mux_t *mux, int slave);
+MODBUS_API int modbus_mux_get_stats(modbus_mux_t *mux, modbus_mux_stats_t *stats);
+MODBUS_API void modbus_mux_free(modbus_mux_t *mux);
+
+MODBUS_END_DECLS
+
+#endif /* MODBUS_MUX_H */
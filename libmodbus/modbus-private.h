@@ -43,7 +43,9 @@ MODBUS_BEGIN_DECLS
 
 typedef enum {
     _MODBUS_BACKEND_TYPE_RTU = 0,
-    _MODBUS_BACKEND_TYPE_TCP
+    _MODBUS_BACKEND_TYPE_TCP,
+    _MODBUS_BACKEND_TYPE_UDP,
+    _MODBUS_BACKEND_TYPE_MUX
 } modbus_backend_type_t;
 
 /*
@@ -93,6 +95,46 @@ typedef struct _modbus_backend {
     void (*free)(modbus_t *ctx);
 } modbus_backend_t;
 
+/* A [start, start + nb) range of one table with its own storage or, when tab
+ * is NULL, served by handlers */
+typedef struct _modbus_segment {
+    int start;
+    int nb;
+    void *tab;
+    modbus_read_handler_t read_handler;
+    modbus_write_handler_t write_handler;
+    void *user_data;
+} modbus_segment_t;
+
+/* Segments are kept sorted by start address and never overlap so a lookup is
+ * a binary search. Adjacent storage segments are merged when they are added.
+ * They are kept out of modbus_mapping_t, a mapping built by the caller doesn't
+ * know about them, in a list of the mappings having segments. */
+struct _modbus_mapping_segments {
+    const modbus_mapping_t *mapping;
+    struct _modbus_mapping_segments *next;
+    modbus_segment_t *segments[MODBUS_TABLE_MAX];
+    int nb_segments[MODBUS_TABLE_MAX];
+};
+
+/* Indexed by unit identifier so the dispatch is a single lookup. The
+ * mappings are owned by the caller. */
+struct _modbus_unit_table {
+    modbus_mapping_t *mappings[MODBUS_MAX_UNITS];
+    modbus_unit_stats_t stats[MODBUS_MAX_UNITS];
+};
+
+/* Output buffer of the responses built by modbus_reply() from one burst of
+ * pipelined requests, sent with a single call */
+typedef struct _modbus_reply_batch {
+    uint8_t *buf;
+    int length;
+    int size;
+    /* The next request was found readable after the last response, the next
+       receive doesn't wait for it again */
+    int pending;
+} modbus_reply_batch_t;
+
 struct _modbus {
     /* Slave address */
     int slave;
@@ -106,9 +148,15 @@ struct _modbus {
     struct timeval indication_timeout;
     const modbus_backend_t *backend;
     void *backend_data;
+    modbus_reply_batch_t *batch;
+    modbus_io_stats_t io_stats;
+    /* Response of the last modbus_read_*_view() call */
+    uint8_t view_rsp[MODBUS_MAX_ADU_LENGTH];
 };
 
 void _modbus_init_common(modbus_t *ctx);
+uint64_t _modbus_monotonic_us(void);
+void _modbus_wait_until_us(uint64_t deadline_us);
 void _error_print(modbus_t *ctx, const char *context);
 int _modbus_receive_msg(modbus_t *ctx, uint8_t *msg, msg_type_t msg_type);
 
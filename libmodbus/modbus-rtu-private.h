@@ -72,6 +72,16 @@ typedef struct _modbus_rtu {
 #endif
     /* To handle many slaves on the same link */
     int confirmation_to_ignore;
+    /* Time to transmit one character and the silence between 2 frames */
+    int char_time_ns;
+    int t35_us;
+    /* End of the last frame sent or received */
+    uint64_t idle_since_us;
+    /* Bus usage since stats_since_us */
+    uint64_t stats_since_us;
+    uint64_t busy_ns;
+    uint32_t nb_bytes_sent;
+    uint32_t nb_bytes_received;
 } modbus_rtu_t;
 
 #endif /* MODBUS_RTU_PRIVATE_H */
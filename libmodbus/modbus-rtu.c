@@ -26,50 +26,6 @@
 #include <linux/serial.h>
 #endif
 
-/* Table of CRC values for high-order byte */
-static const uint8_t table_crc_hi[] = {
-    0x00, 0xC1, 0x81, 0x40, 0x01, 0xC0, 0x80, 0x41, 0x01, 0xC0, 0x80, 0x41, 0x00, 0xC1,
-    0x81, 0x40, 0x01, 0xC0, 0x80, 0x41, 0x00, 0xC1, 0x81, 0x40, 0x00, 0xC1, 0x81, 0x40,
-    0x01, 0xC0, 0x80, 0x41, 0x01, 0xC0, 0x80, 0x41, 0x00, 0xC1, 0x81, 0x40, 0x00, 0xC1,
-    0x81, 0x40, 0x01, 0xC0, 0x80, 0x41, 0x00, 0xC1, 0x81, 0x40, 0x01, 0xC0, 0x80, 0x41,
-    0x01, 0xC0, 0x80, 0x41, 0x00, 0xC1, 0x81, 0x40, 0x01, 0xC0, 0x80, 0x41, 0x00, 0xC1,
-    0x81, 0x40, 0x00, 0xC1, 0x81, 0x40, 0x01, 0xC0, 0x80, 0x41, 0x00, 0xC1, 0x81, 0x40,
-    0x01, 0xC0, 0x80, 0x41, 0x01, 0xC0, 0x80, 0x41, 0x00, 0xC1, 0x81, 0x40, 0x00, 0xC1,
-    0x81, 0x40, 0x01, 0xC0, 0x80, 0x41, 0x01, 0xC0, 0x80, 0x41, 0x00, 0xC1, 0x81, 0x40,
-    0x01, 0xC0, 0x80, 0x41, 0x00, 0xC1, 0x81, 0x40, 0x00, 0xC1, 0x81, 0x40, 0x01, 0xC0,
-    0x80, 0x41, 0x01, 0xC0, 0x80, 0x41, 0x00, 0xC1, 0x81, 0x40, 0x00, 0xC1, 0x81, 0x40,
-    0x01, 0xC0, 0x80, 0x41, 0x00, 0xC1, 0x81, 0x40, 0x01, 0xC0, 0x80, 0x41, 0x01, 0xC0,
-    0x80, 0x41, 0x00, 0xC1, 0x81, 0x40, 0x00, 0xC1, 0x81, 0x40, 0x01, 0xC0, 0x80, 0x41,
-    0x01, 0xC0, 0x80, 0x41, 0x00, 0xC1, 0x81, 0x40, 0x01, 0xC0, 0x80, 0x41, 0x00, 0xC1,
-    0x81, 0x40, 0x00, 0xC1, 0x81, 0x40, 0x01, 0xC0, 0x80, 0x41, 0x00, 0xC1, 0x81, 0x40,
-    0x01, 0xC0, 0x80, 0x41, 0x01, 0xC0, 0x80, 0x41, 0x00, 0xC1, 0x81, 0x40, 0x01, 0xC0,
-    0x80, 0x41, 0x00, 0xC1, 0x81, 0x40, 0x00, 0xC1, 0x81, 0x40, 0x01, 0xC0, 0x80, 0x41,
-    0x01, 0xC0, 0x80, 0x41, 0x00, 0xC1, 0x81, 0x40, 0x00, 0xC1, 0x81, 0x40, 0x01, 0xC0,
-    0x80, 0x41, 0x00, 0xC1, 0x81, 0x40, 0x01, 0xC0, 0x80, 0x41, 0x01, 0xC0, 0x80, 0x41,
-    0x00, 0xC1, 0x81, 0x40};
-
-/* Table of CRC values for low-order byte */
-static const uint8_t table_crc_lo[] = {
-    0x00, 0xC0, 0xC1, 0x01, 0xC3, 0x03, 0x02, 0xC2, 0xC6, 0x06, 0x07, 0xC7, 0x05, 0xC5,
-    0xC4, 0x04, 0xCC, 0x0C, 0x0D, 0xCD, 0x0F, 0xCF, 0xCE, 0x0E, 0x0A, 0xCA, 0xCB, 0x0B,
-    0xC9, 0x09, 0x08, 0xC8, 0xD8, 0x18, 0x19, 0xD9, 0x1B, 0xDB, 0xDA, 0x1A, 0x1E, 0xDE,
-    0xDF, 0x1F, 0xDD, 0x1D, 0x1C, 0xDC, 0x14, 0xD4, 0xD5, 0x15, 0xD7, 0x17, 0x16, 0xD6,
-    0xD2, 0x12, 0x13, 0xD3, 0x11, 0xD1, 0xD0, 0x10, 0xF0, 0x30, 0x31, 0xF1, 0x33, 0xF3,
-    0xF2, 0x32, 0x36, 0xF6, 0xF7, 0x37, 0xF5, 0x35, 0x34, 0xF4, 0x3C, 0xFC, 0xFD, 0x3D,
-    0xFF, 0x3F, 0x3E, 0xFE, 0xFA, 0x3A, 0x3B, 0xFB, 0x39, 0xF9, 0xF8, 0x38, 0x28, 0xE8,
-    0xE9, 0x29, 0xEB, 0x2B, 0x2A, 0xEA, 0xEE, 0x2E, 0x2F, 0xEF, 0x2D, 0xED, 0xEC, 0x2C,
-    0xE4, 0x24, 0x25, 0xE5, 0x27, 0xE7, 0xE6, 0x26, 0x22, 0xE2, 0xE3, 0x23, 0xE1, 0x21,
-    0x20, 0xE0, 0xA0, 0x60, 0x61, 0xA1, 0x63, 0xA3, 0xA2, 0x62, 0x66, 0xA6, 0xA7, 0x67,
-    0xA5, 0x65, 0x64, 0xA4, 0x6C, 0xAC, 0xAD, 0x6D, 0xAF, 0x6F, 0x6E, 0xAE, 0xAA, 0x6A,
-    0x6B, 0xAB, 0x69, 0xA9, 0xA8, 0x68, 0x78, 0xB8, 0xB9, 0x79, 0xBB, 0x7B, 0x7A, 0xBA,
-    0xBE, 0x7E, 0x7F, 0xBF, 0x7D, 0xBD, 0xBC, 0x7C, 0xB4, 0x74, 0x75, 0xB5, 0x77, 0xB7,
-    0xB6, 0x76, 0x72, 0xB2, 0xB3, 0x73, 0xB1, 0x71, 0x70, 0xB0, 0x50, 0x90, 0x91, 0x51,
-    0x93, 0x53, 0x52, 0x92, 0x96, 0x56, 0x57, 0x97, 0x55, 0x95, 0x94, 0x54, 0x9C, 0x5C,
-    0x5D, 0x9D, 0x5F, 0x9F, 0x9E, 0x5E, 0x5A, 0x9A, 0x9B, 0x5B, 0x99, 0x59, 0x58, 0x98,
-    0x88, 0x48, 0x49, 0x89, 0x4B, 0x8B, 0x8A, 0x4A, 0x4E, 0x8E, 0x8F, 0x4F, 0x8D, 0x4D,
-    0x4C, 0x8C, 0x44, 0x84, 0x85, 0x45, 0x87, 0x47, 0x46, 0x86, 0x82, 0x42, 0x43, 0x83,
-    0x41, 0x81, 0x80, 0x40};
-
 /* Define the slave ID of the remote device to talk in master mode or set the
  * internal slave ID in slave mode */
 static int _modbus_set_slave(modbus_t *ctx, int slave)
@@ -113,22 +69,6 @@ static int _modbus_rtu_build_response_basis(sft_t *sft, uint8_t *rsp)
     return _MODBUS_RTU_PRESET_RSP_LENGTH;
 }
 
-static uint16_t crc16(uint8_t *buffer, uint16_t buffer_length)
-{
-    uint8_t crc_hi = 0xFF; /* high CRC byte initialized */
-    uint8_t crc_lo = 0xFF; /* low CRC byte initialized */
-    unsigned int i;        /* will index into CRC lookup */
-
-    /* pass through message buffer */
-    while (buffer_length--) {
-        i = crc_lo ^ *buffer++; /* calculate the CRC  */
-        crc_lo = crc_hi ^ table_crc_hi[i];
-        crc_hi = table_crc_lo[i];
-    }
-
-    return (crc_hi << 8 | crc_lo);
-}
-
 static int _modbus_rtu_prepare_response_tid(const uint8_t *req, int *req_length)
 {
     (*req_length) -= _MODBUS_RTU_CHECKSUM_LENGTH;
@@ -138,7 +78,7 @@ static int _modbus_rtu_prepare_response_tid(const uint8_t *req, int *req_length)
 
 static int _modbus_rtu_send_msg_pre(uint8_t *req, int req_length)
 {
-    uint16_t crc = crc16(req, req_length);
+    uint16_t crc = modbus_crc16(req, req_length);
 
     /* According to the MODBUS specs (p. 14), the low order byte of the CRC comes
      * first in the RTU message */
@@ -252,7 +192,13 @@ static void _modbus_rtu_ioctl_rts(modbus_t *ctx, int on)
 }
 #endif
 
-static ssize_t _modbus_rtu_send(modbus_t *ctx, const uint8_t *req, int req_length)
+/* Time on the wire of length characters */
+static uint64_t _modbus_rtu_frame_time_us(const modbus_rtu_t *ctx_rtu, int length)
+{
+    return ((uint64_t) ctx_rtu->char_time_ns * length + 999) / 1000;
+}
+
+static ssize_t _modbus_rtu_write(modbus_t *ctx, const uint8_t *req, int req_length)
 {
 #if defined(_WIN32)
     modbus_rtu_t *ctx_rtu = ctx->backend_data;
@@ -264,6 +210,7 @@ static ssize_t _modbus_rtu_send(modbus_t *ctx, const uint8_t *req, int req_lengt
 #if HAVE_DECL_TIOCM_RTS
     modbus_rtu_t *ctx_rtu = ctx->backend_data;
     if (ctx_rtu->rts != MODBUS_RTU_RTS_NONE) {
+        uint64_t start;
         ssize_t size;
 
         if (ctx->debug) {
@@ -271,11 +218,14 @@ static ssize_t _modbus_rtu_send(modbus_t *ctx, const uint8_t *req, int req_lengt
         }
 
         ctx_rtu->set_rts(ctx, ctx_rtu->rts == MODBUS_RTU_RTS_UP);
-        usleep(ctx_rtu->rts_delay);
+        _modbus_wait_until_us(_modbus_monotonic_us() + ctx_rtu->rts_delay);
 
+        start = _modbus_monotonic_us();
         size = write(ctx->s, req, req_length);
 
-        usleep(ctx_rtu->onebyte_time * req_length + ctx_rtu->rts_delay);
+        /* Until the last character has left the UART */
+        _modbus_wait_until_us(start + _modbus_rtu_frame_time_us(ctx_rtu, req_length) +
+                              ctx_rtu->rts_delay);
         ctx_rtu->set_rts(ctx, ctx_rtu->rts != MODBUS_RTU_RTS_UP);
 
         return size;
@@ -288,6 +238,30 @@ static ssize_t _modbus_rtu_send(modbus_t *ctx, const uint8_t *req, int req_lengt
 #endif
 }
 
+static ssize_t _modbus_rtu_send(modbus_t *ctx, const uint8_t *req, int req_length)
+{
+    modbus_rtu_t *ctx_rtu = ctx->backend_data;
+    uint64_t start;
+    ssize_t size;
+
+    /* A frame must follow 3.5 characters of silence */
+    _modbus_wait_until_us(ctx_rtu->idle_since_us + ctx_rtu->t35_us);
+
+    start = _modbus_monotonic_us();
+    size = _modbus_rtu_write(ctx, req, req_length);
+    if (size > 0) {
+        uint64_t end = start + _modbus_rtu_frame_time_us(ctx_rtu, size);
+
+        /* The write may return before the UART has sent the frame */
+        ctx_rtu->idle_since_us = (end > _modbus_monotonic_us()) ? end
+                                                                : _modbus_monotonic_us();
+        ctx_rtu->busy_ns += (uint64_t) ctx_rtu->char_time_ns * size;
+        ctx_rtu->nb_bytes_sent += size;
+    }
+
+    return size;
+}
+
 static int _modbus_rtu_receive(modbus_t *ctx, uint8_t *req)
 {
     int rc;
@@ -313,11 +287,22 @@ static int _modbus_rtu_receive(modbus_t *ctx, uint8_t *req)
 
 static ssize_t _modbus_rtu_recv(modbus_t *ctx, uint8_t *rsp, int rsp_length)
 {
+    modbus_rtu_t *ctx_rtu = ctx->backend_data;
+    ssize_t size;
+
 #if defined(_WIN32)
-    return win32_ser_read(&((modbus_rtu_t *) ctx->backend_data)->w_ser, rsp, rsp_length);
+    size = win32_ser_read(&ctx_rtu->w_ser, rsp, rsp_length);
 #else
-    return read(ctx->s, rsp, rsp_length);
+    size = read(ctx->s, rsp, rsp_length);
 #endif
+    if (size > 0) {
+        /* The last character has just been received */
+        ctx_rtu->idle_since_us = _modbus_monotonic_us();
+        ctx_rtu->busy_ns += (uint64_t) ctx_rtu->char_time_ns * size;
+        ctx_rtu->nb_bytes_received += size;
+    }
+
+    return size;
 }
 
 static int _modbus_rtu_flush(modbus_t *);
@@ -362,7 +347,7 @@ static int _modbus_rtu_check_integrity(modbus_t *ctx, uint8_t *msg, const int ms
         return 0;
     }
 
-    crc_calculated = crc16(msg, msg_length - 2);
+    crc_calculated = modbus_crc16(msg, msg_length - 2);
     crc_received = (msg[msg_length - 1] << 8) | msg[msg_length - 2];
 
     /* Check CRC of msg */
@@ -1065,6 +1050,65 @@ int modbus_rtu_get_rts_delay(modbus_t *ctx)
     }
 }
 
+/* Returns the minimal silence between 2 frames in microseconds */
+int modbus_rtu_get_t35(modbus_t *ctx)
+{
+    if (ctx == NULL || ctx->backend->backend_type != _MODBUS_BACKEND_TYPE_RTU) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    return ((modbus_rtu_t *) ctx->backend_data)->t35_us;
+}
+
+/* Bus usage since the creation of the context or the last reset. The busy
+   time is the time on the wire of the bytes sent and received. */
+int modbus_rtu_get_bus_stats(modbus_t *ctx, modbus_rtu_bus_stats_t *stats)
+{
+    modbus_rtu_t *ctx_rtu;
+
+    if (ctx == NULL || ctx->backend->backend_type != _MODBUS_BACKEND_TYPE_RTU ||
+        stats == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    ctx_rtu = (modbus_rtu_t *) ctx->backend_data;
+    stats->nb_bytes_sent = ctx_rtu->nb_bytes_sent;
+    stats->nb_bytes_received = ctx_rtu->nb_bytes_received;
+    stats->busy_us = ctx_rtu->busy_ns / 1000;
+    stats->elapsed_us = _modbus_monotonic_us() - ctx_rtu->stats_since_us;
+    if (stats->elapsed_us > 0) {
+        stats->utilization = (float) (100.0 * stats->busy_us / stats->elapsed_us);
+        /* A link faster than the configured baud rate (e.g. a pseudo-terminal) */
+        if (stats->utilization > 100) {
+            stats->utilization = 100;
+        }
+    } else {
+        stats->utilization = 0;
+    }
+
+    return 0;
+}
+
+int modbus_rtu_reset_bus_stats(modbus_t *ctx)
+{
+    modbus_rtu_t *ctx_rtu;
+
+    if (ctx == NULL || ctx->backend->backend_type != _MODBUS_BACKEND_TYPE_RTU) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    ctx_rtu = (modbus_rtu_t *) ctx->backend_data;
+    ctx_rtu->stats_since_us = _modbus_monotonic_us();
+    ctx_rtu->busy_ns = 0;
+    ctx_rtu->nb_bytes_sent = 0;
+    ctx_rtu->nb_bytes_received = 0;
+
+    return 0;
+}
+
 int modbus_rtu_set_rts_delay(modbus_t *ctx, int us)
 {
     if (ctx == NULL || us < 0) {
@@ -1109,6 +1153,8 @@ static void _modbus_rtu_close(modbus_t *ctx)
                 "ERROR Error while closing handle (LastError %d)\n",
                 (int) GetLastError());
     }
+    /* Not connected until opened again */
+    ctx_rtu->w_ser.fd = INVALID_HANDLE_VALUE;
 #else
     if (ctx->s >= 0) {
         tcsetattr(ctx->s, TCSANOW, &ctx_rtu->old_tios);
@@ -1286,5 +1332,21 @@ modbus_new_rtu(const char *device, int baud, char parity, int data_bit, int stop
 
     ctx_rtu->confirmation_to_ignore = FALSE;
 
+    /* Start, data, parity and stop bits of a character */
+    ctx_rtu->char_time_ns = (int) (1000000000LL *
+                                   (1 + data_bit + (parity == 'N' ? 0 : 1) + stop_bit) /
+                                   baud);
+    /* Fixed to 1.75 ms above 19200 bauds (Modbus over serial line, 2.5.1.1) */
+    if (baud > 19200) {
+        ctx_rtu->t35_us = 1750;
+    } else {
+        ctx_rtu->t35_us = (int) ((uint64_t) ctx_rtu->char_time_ns * 7 / 2000);
+    }
+    ctx_rtu->idle_since_us = 0;
+    ctx_rtu->stats_since_us = _modbus_monotonic_us();
+    ctx_rtu->busy_ns = 0;
+    ctx_rtu->nb_bytes_sent = 0;
+    ctx_rtu->nb_bytes_received = 0;
+
     return ctx;
 }
@@ -38,6 +38,33 @@ MODBUS_API int modbus_rtu_set_custom_rts(modbus_t *ctx,
 MODBUS_API int modbus_rtu_set_rts_delay(modbus_t *ctx, int us);
 MODBUS_API int modbus_rtu_get_rts_delay(modbus_t *ctx);
 
+typedef struct _modbus_rtu_bus_stats {
+    uint32_t nb_bytes_sent;
+    uint32_t nb_bytes_received;
+    uint64_t busy_us;
+    uint64_t elapsed_us;
+    /* Part of the elapsed time the bus carried a frame, in percent */
+    float utilization;
+} modbus_rtu_bus_stats_t;
+
+MODBUS_API int modbus_rtu_get_t35(modbus_t *ctx);
+MODBUS_API int modbus_rtu_get_bus_stats(modbus_t *ctx, modbus_rtu_bus_stats_t *stats);
+MODBUS_API int modbus_rtu_reset_bus_stats(modbus_t *ctx);
+
+#define MODBUS_CRC16_AUTO   0
+#define MODBUS_CRC16_TABLE  1
+#define MODBUS_CRC16_SLICE4 2
+#define MODBUS_CRC16_SLICE8 3
+#define MODBUS_CRC16_CLMUL  4
+
+MODBUS_API int modbus_crc16_set_implementation(int impl);
+MODBUS_API int modbus_crc16_get_implementation(void);
+MODBUS_API uint16_t modbus_crc16(const uint8_t *buffer, int length);
+MODBUS_API int modbus_crc16_check_frames(const uint8_t *buffer,
+                                         const uint16_t *lengths,
+                                         int nb_frames,
+                                         uint8_t *valid);
+
 MODBUS_END_DECLS
 
 #endif /* MODBUS_RTU_H */
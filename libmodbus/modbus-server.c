@@ -0,0 +1,974 @@
+/*
+ * Copyright © Stéphane Raimbault <stephane.raimbault@gmail.com>
+ *
+ * SPDX-License-Identifier: LGPL-2.1-or-later
+ *
+ * A single threaded TCP server answering many clients fairly: the ready
+ * connections are served in round-robin, one request per turn, and the
+ * requests over the per-client limits are answered with the busy exception
+ * instead of being queued.
+ *
+ * The units routed to a RTU port are served as a gateway: their requests are
+ * queued per port and forwarded at the end of the poll, the concurrent reads
+ * of the same registers being merged into a single serial transaction. A poll
+ * makes at most one serial transaction, so the TCP clients are served between
+ * two transactions and a slave that doesn't answer delays them by one
+ * response timeout at most.
+ */
+
+// clang-format off
+#if defined(_WIN32)
+# define OS_WIN32
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#ifndef _MSC_VER
+#include <unistd.h>
+#endif
+
+#if defined(_WIN32)
+# include <winsock2.h>
+# include <ws2tcpip.h>
+# define close closesocket
+#else
+# include <sys/socket.h>
+# include <sys/select.h>
+#endif
+// clang-format on
+
+#include "modbus-private.h"
+
+#include "modbus-server.h"
+#include "modbus-tcp.h"
+
+/* MBAP header without the unit identifier */
+#define _MODBUS_SERVER_MBAP_LENGTH 6
+
+/* Room for a few pipelined requests per client */
+#define _MODBUS_SERVER_BUFFER_LENGTH (4 * MODBUS_TCP_MAX_ADU_LENGTH)
+
+#define _MODBUS_GATEWAY_MAX_PORTS    16
+#define _MODBUS_GATEWAY_QUEUE_LENGTH 64
+/* Delay before opening again a port that failed */
+#define _MODBUS_GATEWAY_RETRY_US 1000000
+
+typedef struct _modbus_client {
+    int s;
+    /* Number of the connection, a reused slot gets another one */
+    uint32_t id;
+    /* Received bytes, the first request always starts at index 0 */
+    uint8_t buf[_MODBUS_SERVER_BUFFER_LENGTH];
+    int length;
+    /* Token bucket of the rate limit */
+    double tokens;
+    uint64_t refill_us;
+    uint64_t activity_us;
+    modbus_client_stats_t stats;
+} modbus_client_t;
+
+typedef struct _modbus_gateway_request {
+    /* Slot of the client and its connection when queued, the slot may be
+       reused */
+    int client;
+    uint32_t id;
+    uint8_t req[MODBUS_TCP_MAX_ADU_LENGTH];
+    int length;
+    int done;
+} modbus_gateway_request_t;
+
+typedef struct _modbus_gateway_port {
+    modbus_t *ctx;
+    modbus_gateway_request_t queue[_MODBUS_GATEWAY_QUEUE_LENGTH];
+    int nb_queued;
+    /* Next attempt to open the port when it isn't connected */
+    uint64_t retry_us;
+    modbus_gateway_stats_t stats;
+} modbus_gateway_port_t;
+
+struct _modbus_server {
+    modbus_t *ctx;
+    int server_socket;
+    modbus_client_t *clients;
+    int max_clients;
+    int nb_clients;
+    /* First slot served by the next poll */
+    int next;
+    modbus_mapping_t *mb_mapping;
+    modbus_unit_table_t *units;
+    int rate;
+    int burst;
+    int max_in_flight;
+    uint64_t idle_timeout_us;
+    modbus_gateway_port_t *ports[_MODBUS_GATEWAY_MAX_PORTS];
+    int nb_ports;
+    /* First port served by the next poll */
+    int next_port;
+    /* Port of each unit or -1 to answer locally */
+    int routes[MODBUS_MAX_UNITS];
+    /* Number of the last accepted connection */
+    uint32_t last_id;
+    modbus_server_stats_t stats;
+};
+
+/* Uses the listening socket of modbus_tcp_listen() or modbus_tcp_pi_listen().
+   ctx is only used to build the responses, its socket is changed by
+   modbus_server_poll(). */
+modbus_server_t *modbus_server_new(modbus_t *ctx, int server_socket, int max_clients)
+{
+    modbus_server_t *server;
+    int i;
+
+    /* The clients and the listening socket have to fit in an fd_set */
+    if (ctx == NULL || ctx->backend->backend_type != _MODBUS_BACKEND_TYPE_TCP ||
+        server_socket < 0 || max_clients < 1 || max_clients >= FD_SETSIZE) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    server = (modbus_server_t *) calloc(1, sizeof(modbus_server_t));
+    if (server == NULL) {
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    server->clients = (modbus_client_t *) calloc(max_clients, sizeof(modbus_client_t));
+    if (server->clients == NULL) {
+        free(server);
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    for (i = 0; i < max_clients; i++) {
+        server->clients[i].s = -1;
+        server->clients[i].stats.s = -1;
+    }
+
+    for (i = 0; i < MODBUS_MAX_UNITS; i++) {
+        server->routes[i] = -1;
+    }
+
+    server->ctx = ctx;
+    server->server_socket = server_socket;
+    server->max_clients = max_clients;
+    /* No limits by default */
+    server->max_in_flight = 0;
+    server->rate = 0;
+    server->idle_timeout_us = 0;
+
+    return server;
+}
+
+static void close_client(modbus_server_t *server, modbus_client_t *client)
+{
+    if (server->ctx->debug) {
+        printf("Closing the connection on socket %d\n", client->s);
+    }
+
+    close(client->s);
+    client->s = -1;
+    client->stats.s = -1;
+    client->length = 0;
+    server->nb_clients--;
+}
+
+/* Closes the client connections but neither the listening socket nor the RTU
+   contexts of the gateway */
+void modbus_server_free(modbus_server_t *server)
+{
+    int i;
+
+    if (server == NULL)
+        return;
+
+    for (i = 0; i < server->max_clients; i++) {
+        if (server->clients[i].s != -1) {
+            close_client(server, &server->clients[i]);
+        }
+    }
+    for (i = 0; i < server->nb_ports; i++) {
+        free(server->ports[i]);
+    }
+    free(server->clients);
+    free(server);
+}
+
+int modbus_server_set_mapping(modbus_server_t *server, modbus_mapping_t *mb_mapping)
+{
+    if (server == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    server->mb_mapping = mb_mapping;
+    return 0;
+}
+
+/* The unit table has precedence over the mapping */
+int modbus_server_set_units(modbus_server_t *server, modbus_unit_table_t *units)
+{
+    if (server == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    server->units = units;
+    return 0;
+}
+
+/* Allows nb_per_sec requests per second to each client with bursts of burst
+   requests, 0 disables the limit */
+int modbus_server_set_rate_limit(modbus_server_t *server, int nb_per_sec, int burst)
+{
+    int i;
+
+    if (server == NULL || nb_per_sec < 0 || (nb_per_sec > 0 && burst < 1)) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    server->rate = nb_per_sec;
+    server->burst = burst;
+    for (i = 0; i < server->max_clients; i++) {
+        server->clients[i].tokens = burst;
+    }
+
+    return 0;
+}
+
+/* Maximum number of requests of a client waiting to be answered, 0 for no
+   limit other than the size of the receive buffer */
+int modbus_server_set_max_in_flight(modbus_server_t *server, int max_in_flight)
+{
+    if (server == NULL || max_in_flight < 0) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    server->max_in_flight = max_in_flight;
+    return 0;
+}
+
+/* Closes the connections without request during the timeout, 0 disables the
+   eviction */
+int modbus_server_set_idle_timeout(modbus_server_t *server, uint32_t to_sec, uint32_t to_usec)
+{
+    if (server == NULL || to_usec > 999999) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    server->idle_timeout_us = (uint64_t) to_sec * 1000000 + to_usec;
+    return 0;
+}
+
+/* Adds a RTU port to the gateway, the context keeps its response timeout. A
+   port not connected or failing is opened again once per second, its requests
+   are answered with the gateway path exception meanwhile. Returns the index of
+   the port. */
+int modbus_server_add_gateway(modbus_server_t *server, modbus_t *rtu_ctx)
+{
+    modbus_gateway_port_t *port;
+
+    if (server == NULL || rtu_ctx == NULL ||
+        rtu_ctx->backend->backend_type != _MODBUS_BACKEND_TYPE_RTU) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (server->nb_ports == _MODBUS_GATEWAY_MAX_PORTS) {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    port = (modbus_gateway_port_t *) calloc(1, sizeof(modbus_gateway_port_t));
+    if (port == NULL) {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    port->ctx = rtu_ctx;
+    server->ports[server->nb_ports] = port;
+    return server->nb_ports++;
+}
+
+/* Forwards the requests for unit to the port, -1 to answer them locally */
+int modbus_server_set_route(modbus_server_t *server, int unit, int port)
+{
+    if (server == NULL || unit < 1 || unit > 247 || port < -1 || port >= server->nb_ports) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    server->routes[unit] = port;
+    return 0;
+}
+
+int modbus_server_get_gateway_stats(modbus_server_t *server,
+                                    int port,
+                                    modbus_gateway_stats_t *stats)
+{
+    if (server == NULL || port < 0 || port >= server->nb_ports || stats == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    *stats = server->ports[port]->stats;
+    return 0;
+}
+
+int modbus_server_get_max_clients(modbus_server_t *server)
+{
+    if (server == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    return server->max_clients;
+}
+
+/* The s field of stats is -1 when the slot at index isn't used */
+int modbus_server_get_client_stats(modbus_server_t *server,
+                                   int index,
+                                   modbus_client_stats_t *stats)
+{
+    modbus_client_t *client;
+
+    if (server == NULL || index < 0 || index >= server->max_clients || stats == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    client = &server->clients[index];
+    *stats = client->stats;
+    if (client->s != -1) {
+        stats->idle_ms =
+            (uint32_t) ((_modbus_monotonic_us() - client->activity_us) / 1000);
+    }
+
+    return 0;
+}
+
+int modbus_server_get_stats(modbus_server_t *server, modbus_server_stats_t *stats)
+{
+    if (server == NULL || stats == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    *stats = server->stats;
+    return 0;
+}
+
+static void accept_client(modbus_server_t *server, uint64_t now)
+{
+    struct sockaddr_storage addr;
+    socklen_t addrlen = sizeof(addr);
+    modbus_client_t *client = NULL;
+    int s;
+    int i;
+
+    s = accept(server->server_socket, (struct sockaddr *) &addr, &addrlen);
+    if (s < 0) {
+        return;
+    }
+
+    for (i = 0; i < server->max_clients; i++) {
+        if (server->clients[i].s == -1) {
+            client = &server->clients[i];
+            break;
+        }
+    }
+
+    /* A Winsock fd_set holds up to FD_SETSIZE handles of any value, the slots
+       are the limit there */
+#ifdef OS_WIN32
+    if (client == NULL) {
+#else
+    if (client == NULL || s >= FD_SETSIZE) {
+#endif
+        /* Overloaded, the connection is refused rather than left waiting */
+        if (server->ctx->debug) {
+            fprintf(stderr, "Too many clients, connection on socket %d refused\n", s);
+        }
+        close(s);
+        server->stats.nb_rejected++;
+        return;
+    }
+
+    memset(client, 0, sizeof(modbus_client_t));
+    client->s = s;
+    client->id = ++server->last_id;
+    client->tokens = server->burst;
+    client->refill_us = now;
+    client->activity_us = now;
+    client->stats.s = s;
+    server->nb_clients++;
+    server->stats.nb_accepted++;
+
+    if (server->ctx->debug) {
+        printf("Client connection accepted on socket %d\n", s);
+    }
+}
+
+/* Returns the length of the request at offset, 0 if it isn't complete yet or
+   -1 if the MBAP header is invalid */
+static int request_length(const modbus_client_t *client, int offset)
+{
+    const uint8_t *req = client->buf + offset;
+    int length;
+
+    if (client->length - offset < _MODBUS_SERVER_MBAP_LENGTH) {
+        return 0;
+    }
+
+    /* Protocol identifier and length of the unit identifier and the PDU */
+    length = (req[4] << 8) + req[5];
+    if (req[2] != 0 || req[3] != 0 || length < 2 ||
+        length > MODBUS_TCP_MAX_ADU_LENGTH - _MODBUS_SERVER_MBAP_LENGTH) {
+        return -1;
+    }
+
+    length += _MODBUS_SERVER_MBAP_LENGTH;
+    if (client->length - offset < length) {
+        return 0;
+    }
+
+    return length;
+}
+
+/* Removes length bytes at offset of the receive buffer */
+static void drop_bytes(modbus_client_t *client, int offset, int length)
+{
+    memmove(client->buf + offset,
+            client->buf + offset + length,
+            client->length - offset - length);
+    client->length -= length;
+}
+
+static int reply_busy(modbus_server_t *server, modbus_client_t *client, int offset)
+{
+    client->stats.nb_busy++;
+    modbus_set_socket(server->ctx, client->s);
+    return modbus_reply_exception(
+        server->ctx, client->buf + offset, MODBUS_EXCEPTION_SLAVE_OR_SERVER_BUSY);
+}
+
+/* Queues the request for the RTU port of its unit, the busy exception is
+   returned when the queue is full */
+static int queue_gateway_request(modbus_server_t *server, modbus_client_t *client, int length)
+{
+    modbus_gateway_port_t *port =
+        server->ports[server->routes[client->buf[_MODBUS_SERVER_MBAP_LENGTH]]];
+    modbus_gateway_request_t *request;
+
+    if (port->nb_queued == _MODBUS_GATEWAY_QUEUE_LENGTH) {
+        return reply_busy(server, client, 0);
+    }
+
+    request = &port->queue[port->nb_queued++];
+    request->client = (int) (client - server->clients);
+    request->id = client->id;
+    memcpy(request->req, client->buf, length);
+    request->length = length;
+    request->done = FALSE;
+    port->stats.nb_requests++;
+
+    return 0;
+}
+
+/* Reads the available bytes and sheds the requests over the in-flight limit.
+   Returns -1 when the connection must be closed. */
+static int receive_client(modbus_server_t *server, modbus_client_t *client, uint64_t now)
+{
+    int nb_requests = 0;
+    int offset = 0;
+    int length;
+    int rc;
+
+    rc = recv(client->s,
+              (char *) client->buf + client->length,
+              _MODBUS_SERVER_BUFFER_LENGTH - client->length,
+              0);
+    if (rc <= 0) {
+        return -1;
+    }
+
+    client->length += rc;
+    client->stats.nb_bytes_received += rc;
+    client->activity_us = now;
+
+    while ((length = request_length(client, offset)) > 0) {
+        nb_requests++;
+        if (server->max_in_flight > 0 && nb_requests > server->max_in_flight) {
+            if (reply_busy(server, client, offset) == -1) {
+                return -1;
+            }
+            drop_bytes(client, offset, length);
+        } else {
+            offset += length;
+        }
+    }
+
+    return length;
+}
+
+/* Answers the first request of the client, returns 1 if a request has been
+   handled, 0 if none is complete or -1 when the connection must be closed */
+static int serve_client(modbus_server_t *server, modbus_client_t *client, uint64_t now)
+{
+    int length;
+    int rc;
+
+    length = request_length(client, 0);
+    if (length <= 0) {
+        return length;
+    }
+
+    if (server->rate > 0) {
+        client->tokens += (double) (now - client->refill_us) * server->rate / 1000000;
+        if (client->tokens > server->burst) {
+            client->tokens = server->burst;
+        }
+        client->refill_us = now;
+    }
+
+    if (server->rate > 0 && client->tokens < 1) {
+        rc = reply_busy(server, client, 0);
+    } else {
+        if (server->rate > 0) {
+            client->tokens -= 1;
+        }
+        client->stats.nb_requests++;
+        if (server->routes[client->buf[_MODBUS_SERVER_MBAP_LENGTH]] != -1) {
+            rc = queue_gateway_request(server, client, length);
+        } else {
+            modbus_set_socket(server->ctx, client->s);
+            if (server->units == NULL && server->mb_mapping == NULL) {
+                /* Gateway only, the unit isn't routed */
+                rc = modbus_reply_exception(
+                    server->ctx, client->buf, MODBUS_EXCEPTION_GATEWAY_PATH);
+            } else if (server->units != NULL) {
+                rc = modbus_reply_unit(server->ctx, client->buf, length, server->units);
+            } else {
+                rc = modbus_reply(server->ctx, client->buf, length, server->mb_mapping);
+            }
+        }
+    }
+
+    drop_bytes(client, 0, length);
+    return (rc == -1) ? -1 : 1;
+}
+
+/* True when the connection that queued the request has been closed */
+static int is_request_orphan(modbus_server_t *server, const modbus_gateway_request_t *request)
+{
+    const modbus_client_t *client = &server->clients[request->client];
+
+    return client->s == -1 || client->id != request->id;
+}
+
+/* Sends the response PDU to the client of the request if it's still connected */
+static void reply_gateway(modbus_server_t *server,
+                          modbus_gateway_request_t *request,
+                          const uint8_t *pdu,
+                          int pdu_length)
+{
+    modbus_client_t *client = &server->clients[request->client];
+    uint8_t rsp[MODBUS_TCP_MAX_ADU_LENGTH];
+    int length = _MODBUS_SERVER_MBAP_LENGTH + 1 + pdu_length;
+
+    request->done = TRUE;
+    if (is_request_orphan(server, request)) {
+        return;
+    }
+    /* Waiting for the serial port isn't being idle */
+    client->activity_us = _modbus_monotonic_us();
+
+    /* Same transaction and protocol identifiers, the length covers the unit */
+    memcpy(rsp, request->req, 4);
+    rsp[4] = (pdu_length + 1) >> 8;
+    rsp[5] = (pdu_length + 1) & 0xFF;
+    rsp[6] = request->req[_MODBUS_SERVER_MBAP_LENGTH];
+    memcpy(rsp + _MODBUS_SERVER_MBAP_LENGTH + 1, pdu, pdu_length);
+
+    /* The batched local responses go first */
+    modbus_set_socket(server->ctx, client->s);
+    if (modbus_flush_replies(server->ctx) == -1 ||
+        server->ctx->backend->send(server->ctx, rsp, length) != length) {
+        server->stats.nb_closed++;
+        close_client(server, client);
+    }
+}
+
+static void reply_gateway_exception(modbus_server_t *server,
+                                    modbus_gateway_request_t *request,
+                                    int exception_code)
+{
+    uint8_t pdu[2];
+
+    pdu[0] = request->req[_MODBUS_SERVER_MBAP_LENGTH + 1] | 0x80;
+    pdu[1] = exception_code;
+    reply_gateway(server, request, pdu, 2);
+}
+
+/* Opens the port again if the last attempt is old enough */
+static int connect_port(modbus_gateway_port_t *port)
+{
+    uint64_t now = _modbus_monotonic_us();
+
+    if (now < port->retry_us) {
+        errno = EAGAIN;
+        return -1;
+    }
+
+    port->retry_us = now + _MODBUS_GATEWAY_RETRY_US;
+    port->stats.nb_reconnects++;
+    return modbus_connect(port->ctx);
+}
+
+/* Sends the request (unit, function and data) on the RTU port and copies the
+   response PDU, exceptions included. Returns its length or minus the gateway
+   exception code. */
+static int gateway_transaction(modbus_gateway_port_t *port,
+                               const uint8_t *raw_req,
+                               int raw_req_length,
+                               uint8_t *pdu)
+{
+    modbus_t *ctx = port->ctx;
+    uint8_t rsp[MODBUS_MAX_ADU_LENGTH];
+    int offset = ctx->backend->header_length;
+    int rc;
+
+    port->stats.nb_transactions++;
+    if (!ctx->backend->is_connected(ctx) && connect_port(port) == -1) {
+        port->stats.nb_errors++;
+        return -MODBUS_EXCEPTION_GATEWAY_PATH;
+    }
+    if (modbus_set_slave(ctx, raw_req[0]) == -1 ||
+        modbus_send_raw_request(ctx, raw_req, raw_req_length) == -1) {
+        /* Adapter removed or port failure, opened again later */
+        port->stats.nb_errors++;
+        modbus_close(ctx);
+        return -MODBUS_EXCEPTION_GATEWAY_PATH;
+    }
+
+    rc = modbus_receive_confirmation(ctx, rsp);
+    if (rc == -1) {
+        /* No response or a bad CRC, slave or data */
+        if (errno == ETIMEDOUT) {
+            port->stats.nb_timeouts++;
+        } else {
+            port->stats.nb_errors++;
+            modbus_flush(ctx);
+        }
+        return -MODBUS_EXCEPTION_GATEWAY_TARGET;
+    }
+    if (rc < offset + 2 + (int) ctx->backend->checksum_length ||
+        (rsp[offset] & 0x7F) != raw_req[1]) {
+        /* Corrupted or unrelated response */
+        port->stats.nb_errors++;
+        modbus_flush(ctx);
+        return -MODBUS_EXCEPTION_GATEWAY_TARGET;
+    }
+
+    rc -= offset + (int) ctx->backend->checksum_length;
+    memcpy(pdu, rsp + offset, rc);
+    return rc;
+}
+
+static int is_read_function(int function)
+{
+    return function == MODBUS_FC_READ_COILS || function == MODBUS_FC_READ_DISCRETE_INPUTS ||
+           function == MODBUS_FC_READ_HOLDING_REGISTERS ||
+           function == MODBUS_FC_READ_INPUT_REGISTERS;
+}
+
+/* Gives the addresses [start, end) of a valid read request, FALSE for the
+   other requests */
+static int read_range(const modbus_gateway_request_t *request, int *start, int *end, int *max)
+{
+    const uint8_t *req = request->req + _MODBUS_SERVER_MBAP_LENGTH;
+    int nb;
+
+    if (request->length != _MODBUS_SERVER_MBAP_LENGTH + 6 || !is_read_function(req[1])) {
+        return FALSE;
+    }
+
+    *max = (req[1] == MODBUS_FC_READ_COILS || req[1] == MODBUS_FC_READ_DISCRETE_INPUTS)
+               ? MODBUS_MAX_READ_BITS
+               : MODBUS_MAX_READ_REGISTERS;
+    *start = (req[2] << 8) + req[3];
+    nb = (req[4] << 8) + req[5];
+    if (nb < 1 || nb > *max || *start + nb > 0x10000) {
+        return FALSE;
+    }
+
+    *end = *start + nb;
+    return TRUE;
+}
+
+/* Answers a read request with its part of the response of the merged read
+   starting at start */
+static void reply_read(modbus_server_t *server,
+                       modbus_gateway_request_t *request,
+                       int start,
+                       const uint8_t *pdu,
+                       int pdu_length)
+{
+    uint8_t rsp[MODBUS_MAX_PDU_LENGTH];
+    int offset;
+    int end;
+    int max;
+    int i;
+
+    if (pdu_length < 0) {
+        reply_gateway_exception(server, request, -pdu_length);
+        return;
+    }
+
+    if (pdu[0] & 0x80) {
+        reply_gateway(server, request, pdu, pdu_length);
+        return;
+    }
+
+    read_range(request, &offset, &end, &max);
+    rsp[0] = pdu[0];
+    if (max == MODBUS_MAX_READ_BITS) {
+        rsp[1] = (end - offset + 7) / 8;
+        memset(rsp + 2, 0, rsp[1]);
+        for (i = 0; i < end - offset; i++) {
+            int bit = offset - start + i;
+
+            if (pdu[2 + bit / 8] & (1 << (bit % 8))) {
+                rsp[2 + i / 8] |= 1 << (i % 8);
+            }
+        }
+    } else {
+        rsp[1] = (end - offset) * 2;
+        memcpy(rsp + 2, pdu + 2 + (offset - start) * 2, rsp[1]);
+    }
+    reply_gateway(server, request, rsp, 2 + rsp[1]);
+}
+
+/* Forwards the oldest queued request of the port. The reads of the same unit
+   and table overlapping or adjacent to it are merged, up to the first write
+   to the unit which must be seen by the following reads. The answered
+   requests are removed from the queue. */
+static void serve_gateway(modbus_server_t *server, modbus_gateway_port_t *port)
+{
+    uint8_t pdu[MODBUS_MAX_PDU_LENGTH];
+    int members[_MODBUS_GATEWAY_QUEUE_LENGTH];
+    modbus_gateway_request_t *request = &port->queue[0];
+    const uint8_t *req = request->req + _MODBUS_SERVER_MBAP_LENGTH;
+    uint8_t raw_req[6];
+    int nb_members = 0;
+    int start, end, max;
+    int rc;
+    int i, j;
+
+    /* The requests of the closed connections aren't forwarded */
+    for (i = 0, j = 0; i < port->nb_queued; i++) {
+        if (!is_request_orphan(server, &port->queue[i])) {
+            if (i != j) {
+                port->queue[j] = port->queue[i];
+            }
+            j++;
+        }
+    }
+    port->nb_queued = j;
+    if (port->nb_queued == 0) {
+        return;
+    }
+
+    if (!read_range(request, &start, &end, &max)) {
+        rc = gateway_transaction(port, req, request->length - _MODBUS_SERVER_MBAP_LENGTH, pdu);
+        if (rc < 0) {
+            reply_gateway_exception(server, request, -rc);
+        } else {
+            reply_gateway(server, request, pdu, rc);
+        }
+    } else {
+        members[nb_members++] = 0;
+        for (j = 1; j < port->nb_queued; j++) {
+            modbus_gateway_request_t *other = &port->queue[j];
+            const uint8_t *other_req = other->req + _MODBUS_SERVER_MBAP_LENGTH;
+            int other_start, other_end, other_max;
+
+            if (other_req[0] != req[0]) {
+                continue;
+            }
+
+            if (!read_range(other, &other_start, &other_end, &other_max)) {
+                if (!is_read_function(other_req[1])) {
+                    break;
+                }
+                continue;
+            }
+
+            if (other_req[1] != req[1] || other_start > end || other_end < start ||
+                (other_end > end ? other_end : end) -
+                        (other_start < start ? other_start : start) >
+                    max) {
+                continue;
+            }
+
+            start = (other_start < start) ? other_start : start;
+            end = (other_end > end) ? other_end : end;
+            members[nb_members++] = j;
+        }
+
+        raw_req[0] = req[0];
+        raw_req[1] = req[1];
+        raw_req[2] = start >> 8;
+        raw_req[3] = start & 0xFF;
+        raw_req[4] = (end - start) >> 8;
+        raw_req[5] = (end - start) & 0xFF;
+        rc = gateway_transaction(port, raw_req, 6, pdu);
+        if (rc > 0 && !(pdu[0] & 0x80)) {
+            int byte_count = (max == MODBUS_MAX_READ_BITS) ? (end - start + 7) / 8
+                                                           : (end - start) * 2;
+
+            if (rc != 2 + byte_count || pdu[1] != byte_count) {
+                port->stats.nb_errors++;
+                rc = -MODBUS_EXCEPTION_GATEWAY_TARGET;
+            }
+        }
+
+        port->stats.nb_coalesced += nb_members - 1;
+        for (j = 0; j < nb_members; j++) {
+            reply_read(server, &port->queue[members[j]], start, pdu, rc);
+        }
+    }
+
+    /* The remaining requests keep their order */
+    for (i = 0, j = 0; i < port->nb_queued; i++) {
+        if (!port->queue[i].done) {
+            if (i != j) {
+                port->queue[j] = port->queue[i];
+            }
+            j++;
+        }
+    }
+    port->nb_queued = j;
+}
+
+/* Waits up to the timeout for connections and requests then answers all the
+   received requests, one per client and per turn starting with a different
+   client at each call. The gateway requests are queued and one serial
+   transaction is made last, on each port in turn; the wait is skipped while
+   gateway requests are queued. Returns the number of handled requests or -1
+   if an error occurred on the listening socket. */
+int modbus_server_poll(modbus_server_t *server, uint32_t to_sec, uint32_t to_usec)
+{
+    struct timeval tv;
+    fd_set rset;
+    uint64_t now;
+    int fdmax;
+    int nb_handled = 0;
+    int served;
+    int rc;
+    int i;
+
+    if (server == NULL || to_usec > 999999) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    now = _modbus_monotonic_us();
+    FD_ZERO(&rset);
+    FD_SET(server->server_socket, &rset);
+    fdmax = server->server_socket;
+    for (i = 0; i < server->max_clients; i++) {
+        modbus_client_t *client = &server->clients[i];
+
+        if (client->s == -1) {
+            continue;
+        }
+
+        if (server->idle_timeout_us > 0 &&
+            now - client->activity_us > server->idle_timeout_us) {
+            server->stats.nb_evicted++;
+            close_client(server, client);
+            continue;
+        }
+
+        /* A full buffer stops the reads until the requests are answered */
+        if (client->length < _MODBUS_SERVER_BUFFER_LENGTH) {
+            FD_SET(client->s, &rset);
+            if (client->s > fdmax) {
+                fdmax = client->s;
+            }
+        }
+    }
+
+    tv.tv_sec = to_sec;
+    tv.tv_usec = to_usec;
+    for (i = 0; i < server->nb_ports; i++) {
+        if (server->ports[i]->nb_queued > 0) {
+            tv.tv_sec = 0;
+            tv.tv_usec = 0;
+            break;
+        }
+    }
+    rc = select(fdmax + 1, &rset, NULL, NULL, &tv);
+    if (rc == -1) {
+        if (errno == EINTR) {
+            return 0;
+        }
+        return -1;
+    }
+
+    now = _modbus_monotonic_us();
+    for (i = 0; rc > 0 && i < server->max_clients; i++) {
+        modbus_client_t *client = &server->clients[i];
+
+        if (client->s != -1 && FD_ISSET(client->s, &rset) &&
+            receive_client(server, client, now) == -1) {
+            server->stats.nb_closed++;
+            close_client(server, client);
+        }
+    }
+
+    if (rc > 0 && FD_ISSET(server->server_socket, &rset)) {
+        accept_client(server, now);
+    }
+
+    /* Round-robin, a pipelining client doesn't delay the others */
+    do {
+        served = 0;
+        for (i = 0; i < server->max_clients; i++) {
+            modbus_client_t *client =
+                &server->clients[(server->next + i) % server->max_clients];
+
+            if (client->s == -1) {
+                continue;
+            }
+
+            rc = serve_client(server, client, now);
+            if (rc == -1) {
+                server->stats.nb_closed++;
+                close_client(server, client);
+            } else {
+                served += rc;
+            }
+        }
+        nb_handled += served;
+    } while (served > 0);
+
+    for (i = 0; i < server->nb_ports; i++) {
+        int index = (server->next_port + i) % server->nb_ports;
+
+        if (server->ports[index]->nb_queued > 0) {
+            serve_gateway(server, server->ports[index]);
+            server->next_port = (index + 1) % server->nb_ports;
+            break;
+        }
+    }
+
+    server->next = (server->next + 1) % server->max_clients;
+
+    return nb_handled;
+}
@@ -0,0 +1,76 @@
+/*
+ * Copyright © Stéphane Raimbault <stephane.raimbault@gmail.com>
+ *
+ * SPDX-License-Identifier: LGPL-2.1-or-later
+ */
+
+#ifndef MODBUS_SERVER_H
+#define MODBUS_SERVER_H
+
+#include "modbus.h"
+
+MODBUS_BEGIN_DECLS
+
+/* Scheduling of the requests of many TCP clients by a single thread */
+typedef struct _modbus_server modbus_server_t;
+
+typedef struct _modbus_client_stats {
+    /* Socket of the client or -1 when the slot is free */
+    int s;
+    uint32_t nb_requests;
+    uint32_t nb_busy;
+    uint32_t nb_bytes_received;
+    uint32_t idle_ms;
+} modbus_client_stats_t;
+
+typedef struct _modbus_server_stats {
+    uint32_t nb_accepted;
+    uint32_t nb_rejected;
+    uint32_t nb_evicted;
+    uint32_t nb_closed;
+} modbus_server_stats_t;
+
+/* Forwarded requests of a RTU port of the gateway */
+typedef struct _modbus_gateway_stats {
+    uint32_t nb_requests;
+    /* Serial transactions, fewer than the requests when reads are merged */
+    uint32_t nb_transactions;
+    uint32_t nb_coalesced;
+    uint32_t nb_timeouts;
+    uint32_t nb_errors;
+    /* Attempts to open the port again */
+    uint32_t nb_reconnects;
+} modbus_gateway_stats_t;
+
+MODBUS_API modbus_server_t *
+modbus_server_new(modbus_t *ctx, int server_socket, int max_clients);
+MODBUS_API void modbus_server_free(modbus_server_t *server);
+
+MODBUS_API int modbus_server_set_mapping(modbus_server_t *server,
+                                         modbus_mapping_t *mb_mapping);
+MODBUS_API int modbus_server_set_units(modbus_server_t *server,
+                                       modbus_unit_table_t *units);
+MODBUS_API int
+modbus_server_set_rate_limit(modbus_server_t *server, int nb_per_sec, int burst);
+MODBUS_API int modbus_server_set_max_in_flight(modbus_server_t *server, int max_in_flight);
+MODBUS_API int
+modbus_server_set_idle_timeout(modbus_server_t *server, uint32_t to_sec, uint32_t to_usec);
+
+MODBUS_API int modbus_server_add_gateway(modbus_server_t *server, modbus_t *rtu_ctx);
+MODBUS_API int modbus_server_set_route(modbus_server_t *server, int unit, int port);
+MODBUS_API int modbus_server_get_gateway_stats(modbus_server_t *server,
+                                               int port,
+                                               modbus_gateway_stats_t *stats);
+
+MODBUS_API int modbus_server_poll(modbus_server_t *server, uint32_t to_sec, uint32_t to_usec);
+
+MODBUS_API int modbus_server_get_max_clients(modbus_server_t *server);
+MODBUS_API int modbus_server_get_client_stats(modbus_server_t *server,
+                                              int index,
+                                              modbus_client_stats_t *stats);
+MODBUS_API int modbus_server_get_stats(modbus_server_t *server,
+                                       modbus_server_stats_t *stats);
+
+MODBUS_END_DECLS
+
+#endif /* MODBUS_SERVER_H */
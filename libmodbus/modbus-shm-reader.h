@@ -0,0 +1,284 @@
+/*
+ * Copyright © Stéphane Raimbault <stephane.raimbault@gmail.com>
+ *
+ * SPDX-License-Identifier: LGPL-2.1-or-later
+ */
+
+#ifndef MODBUS_SHM_READER_H
+#define MODBUS_SHM_READER_H
+
+/* Reader of the shared register image of modbus-shm.h, entirely in this
+   header: the readers don't link with libmodbus. Once the segment is open,
+   a read is a few loads and a copy of the requested registers, without
+   system calls or locks, and never blocks the writer.
+
+   modbus_shm_reader_read() copies consistent registers of a device. To read
+   in place instead, load the slot between modbus_shm_read_begin() and
+   modbus_shm_read_retry() and start again while the latter is true. */
+
+#include <errno.h>
+#include <string.h>
+
+// clang-format off
+#if defined(_WIN32)
+# include <windows.h>
+#else
+# include <fcntl.h>
+# include <sys/mman.h>
+# include <sys/stat.h>
+# include <unistd.h>
+#endif
+#if defined(_MSC_VER)
+# include <intrin.h>
+#endif
+// clang-format on
+
+#include "modbus-shm.h"
+
+typedef struct _modbus_shm_reader {
+    const modbus_shm_header_t *header;
+    size_t length;
+#if defined(_WIN32)
+    HANDLE mapping;
+#endif
+} modbus_shm_reader_t;
+
+/* Ordering of seq with the slot between the processes. On x86 the loads and
+   the stores are not reordered with each other, only the compiler has to be
+   kept from it. */
+static inline uint32_t modbus_shm_load_acquire(const uint32_t *p)
+{
+#if defined(_MSC_VER)
+    uint32_t value = *(const volatile uint32_t *) p;
+# if defined(_M_ARM64)
+    __dmb(_ARM64_BARRIER_ISH);
+# else
+    _ReadWriteBarrier();
+# endif
+    return value;
+#else
+    return __atomic_load_n(p, __ATOMIC_ACQUIRE);
+#endif
+}
+
+static inline void modbus_shm_store_release(uint32_t *p, uint32_t value)
+{
+#if defined(_MSC_VER)
+# if defined(_M_ARM64)
+    __dmb(_ARM64_BARRIER_ISH);
+# else
+    _ReadWriteBarrier();
+# endif
+    *(volatile uint32_t *) p = value;
+#else
+    __atomic_store_n(p, value, __ATOMIC_RELEASE);
+#endif
+}
+
+/* Keeps the loads of the slot before the load of seq checking them, and the
+   stores to the slot after the store making seq odd */
+static inline void modbus_shm_fence(void)
+{
+#if defined(_MSC_VER)
+# if defined(_M_ARM64)
+    __dmb(_ARM64_BARRIER_ISH);
+# else
+    _ReadWriteBarrier();
+# endif
+#else
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+#endif
+}
+
+/* Returns the seq to give to modbus_shm_read_retry() once the slot has been
+   read, waits while the writer updates it */
+static inline uint32_t modbus_shm_read_begin(const modbus_shm_device_t *dev)
+{
+    uint32_t seq;
+
+    do {
+        seq = modbus_shm_load_acquire(&dev->seq);
+    } while (seq & 1);
+
+    return seq;
+}
+
+/* True if the slot was updated since modbus_shm_read_begin(), what was read
+   must be read again */
+static inline int modbus_shm_read_retry(const modbus_shm_device_t *dev, uint32_t seq)
+{
+    modbus_shm_fence();
+    return modbus_shm_load_acquire(&dev->seq) != seq;
+}
+
+static inline const uint8_t *modbus_shm_device_valid(const modbus_shm_device_t *dev)
+{
+    return (const uint8_t *) (dev + 1);
+}
+
+static inline const uint16_t *modbus_shm_device_values(const modbus_shm_header_t *header,
+                                                       const modbus_shm_device_t *dev)
+{
+    return (const uint16_t *) (modbus_shm_device_valid(dev) +
+                               MODBUS_SHM_VALID_LENGTH(header->nb_registers));
+}
+
+static inline int modbus_shm_reader_open(modbus_shm_reader_t *reader, const char *name)
+{
+    const modbus_shm_header_t *header;
+
+    memset(reader, 0, sizeof(modbus_shm_reader_t));
+
+#if defined(_WIN32)
+    reader->mapping = OpenFileMappingA(FILE_MAP_READ, FALSE, name);
+    if (reader->mapping == NULL) {
+        errno = ENOENT;
+        return -1;
+    }
+    header = (const modbus_shm_header_t *) MapViewOfFile(
+        reader->mapping, FILE_MAP_READ, 0, 0, 0);
+    if (header == NULL) {
+        CloseHandle(reader->mapping);
+        errno = ENOMEM;
+        return -1;
+    }
+#else
+    {
+        struct stat st;
+        void *p;
+        int fd = shm_open(name, O_RDONLY, 0);
+
+        if (fd == -1) {
+            return -1;
+        }
+        if (fstat(fd, &st) == -1 || (size_t) st.st_size < sizeof(modbus_shm_header_t)) {
+            close(fd);
+            errno = EINVAL;
+            return -1;
+        }
+        p = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        close(fd);
+        if (p == MAP_FAILED) {
+            return -1;
+        }
+        header = (const modbus_shm_header_t *) p;
+        reader->length = st.st_size;
+    }
+#endif
+
+    reader->header = header;
+    if (modbus_shm_load_acquire(&header->magic) != MODBUS_SHM_MAGIC ||
+        header->version != MODBUS_SHM_VERSION) {
+#if defined(_WIN32)
+        UnmapViewOfFile(header);
+        CloseHandle(reader->mapping);
+#else
+        munmap((void *) header, reader->length);
+#endif
+        reader->header = NULL;
+        errno = EINVAL;
+        return -1;
+    }
+
+    return 0;
+}
+
+static inline void modbus_shm_reader_close(modbus_shm_reader_t *reader)
+{
+    if (reader->header == NULL)
+        return;
+
+#if defined(_WIN32)
+    UnmapViewOfFile(reader->header);
+    CloseHandle(reader->mapping);
+#else
+    munmap((void *) reader->header, reader->length);
+#endif
+    reader->header = NULL;
+}
+
+/* Slot of the device or NULL if it hasn't been published yet */
+static inline const modbus_shm_device_t *
+modbus_shm_reader_device(const modbus_shm_reader_t *reader, int device)
+{
+    const modbus_shm_header_t *header = reader->header;
+    uint32_t nb_devices = modbus_shm_load_acquire(&header->nb_devices);
+    uint32_t i;
+
+    for (i = 0; i < nb_devices && i < header->max_devices; i++) {
+        const modbus_shm_device_t *dev =
+            (const modbus_shm_device_t *) ((const uint8_t *) (header + 1) +
+                                           i * header->device_length);
+
+        if (dev->device == device) {
+            return dev;
+        }
+    }
+
+    return NULL;
+}
+
+/* Copies the registers addr to addr + nb - 1 of the device, all from the same
+   scan, and the slot header (scan number and times) if info isn't NULL.
+   Returns 1 if they are all valid, 0 if some were never read or their last
+   read failed (their last known value is copied) and -1 with errno set to
+   ENOENT if the device isn't published, EINVAL if the range is out of the
+   image or EPIPE if the writer closed the segment. */
+static inline int modbus_shm_reader_read(const modbus_shm_reader_t *reader,
+                                         int device,
+                                         int addr,
+                                         int nb,
+                                         uint16_t *dest,
+                                         modbus_shm_device_t *info)
+{
+    const modbus_shm_header_t *header = reader->header;
+    const modbus_shm_device_t *dev;
+    uint32_t seq;
+    int valid;
+    int i;
+
+    if (modbus_shm_load_acquire(&header->magic) != MODBUS_SHM_MAGIC) {
+        errno = EPIPE;
+        return -1;
+    }
+    if (addr < 0 || nb < 1 || (uint32_t) (addr + nb) > header->nb_registers) {
+        errno = EINVAL;
+        return -1;
+    }
+    dev = modbus_shm_reader_device(reader, device);
+    if (dev == NULL) {
+        errno = ENOENT;
+        return -1;
+    }
+
+    do {
+        const uint8_t *bits = modbus_shm_device_valid(dev);
+
+        seq = modbus_shm_read_begin(dev);
+        memcpy(dest, modbus_shm_device_values(header, dev) + addr, nb * sizeof(uint16_t));
+        if (info != NULL) {
+            memcpy(info, dev, sizeof(modbus_shm_device_t));
+        }
+        valid = 1;
+        for (i = addr; i < addr + nb;) {
+            /* 8 registers at a time when aligned */
+            if (i % 8 == 0 && i + 8 <= addr + nb) {
+                if (bits[i / 8] != 0xFF) {
+                    valid = 0;
+                    break;
+                }
+                i += 8;
+            } else {
+                if (!(bits[i / 8] & (1 << (i % 8)))) {
+                    valid = 0;
+                    break;
+                }
+                i++;
+            }
+        }
+    } while (modbus_shm_read_retry(dev, seq));
+
+    return valid;
+}
+
+#endif /* MODBUS_SHM_READER_H */
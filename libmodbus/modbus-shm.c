@@ -0,0 +1,237 @@
+/*
+ * Copyright © Stéphane Raimbault <stephane.raimbault@gmail.com>
+ *
+ * SPDX-License-Identifier: LGPL-2.1-or-later
+ *
+ * Writer of the shared register image. Each publication replaces the whole
+ * slot of the device under its seqlock, the readers of other processes never
+ * wait for the writer nor the writer for them.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+
+#include "modbus-private.h"
+#include "modbus-thread-private.h"
+
+#include "modbus-shm-reader.h"
+
+struct _modbus_shm {
+    char name[256];
+    modbus_shm_header_t *header;
+    size_t length;
+#if defined(_WIN32)
+    HANDLE mapping;
+#endif
+    /* Publications of several threads */
+    _modbus_lock_t lock;
+    _modbus_cond_t cond;
+};
+
+static modbus_shm_device_t *get_device(modbus_shm_t *shm, uint32_t index)
+{
+    return (modbus_shm_device_t *) ((uint8_t *) (shm->header + 1) +
+                                    index * shm->header->device_length);
+}
+
+/* Creates the segment for max_devices devices of the registers 0 to
+   nb_registers - 1. A segment left by a previous writer is marked as closed
+   for its readers and replaced. */
+modbus_shm_t *modbus_shm_new(const char *name, int max_devices, int nb_registers)
+{
+    modbus_shm_t *shm;
+    modbus_shm_header_t *header;
+    uint32_t device_length;
+    size_t length;
+
+    if (name == NULL || strlen(name) >= sizeof(shm->name) || max_devices < 1 ||
+        max_devices > 0x10000 || nb_registers < 1 || nb_registers > 0x10000) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    /* Slots aligned on cache lines, a publication doesn't touch its
+       neighbours */
+    device_length = sizeof(modbus_shm_device_t) + MODBUS_SHM_VALID_LENGTH(nb_registers) +
+                    nb_registers * sizeof(uint16_t);
+    device_length = (device_length + 63) / 64 * 64;
+    length = sizeof(modbus_shm_header_t) + (size_t) max_devices * device_length;
+
+    shm = (modbus_shm_t *) calloc(1, sizeof(modbus_shm_t));
+    if (shm == NULL) {
+        errno = ENOMEM;
+        return NULL;
+    }
+
+#if defined(_WIN32)
+    /* Backed by the paging file, the segment lives as long as a process
+       (writer or reader) has it open */
+    shm->mapping = CreateFileMappingA(INVALID_HANDLE_VALUE,
+                                      NULL,
+                                      PAGE_READWRITE,
+                                      (DWORD) ((uint64_t) length >> 32),
+                                      (DWORD) length,
+                                      name);
+    if (shm->mapping == NULL) {
+        free(shm);
+        errno = EACCES;
+        return NULL;
+    }
+    header = (modbus_shm_header_t *) MapViewOfFile(
+        shm->mapping, FILE_MAP_ALL_ACCESS, 0, 0, length);
+    if (header == NULL) {
+        /* Still open by the readers of a writer with a smaller image */
+        CloseHandle(shm->mapping);
+        free(shm);
+        errno = ENOMEM;
+        return NULL;
+    }
+    modbus_shm_store_release(&header->magic, 0);
+#else
+    {
+        int fd;
+        void *p;
+
+        /* The readers of the previous segment keep it mapped after the
+           unlink, they are told to open the new one */
+        fd = shm_open(name, O_RDWR, 0);
+        if (fd != -1) {
+            p = mmap(NULL, sizeof(modbus_shm_header_t), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+            if (p != MAP_FAILED) {
+                modbus_shm_store_release(&((modbus_shm_header_t *) p)->magic, 0);
+                munmap(p, sizeof(modbus_shm_header_t));
+            }
+            close(fd);
+            shm_unlink(name);
+        }
+
+        fd = shm_open(name, O_CREAT | O_EXCL | O_RDWR, 0644);
+        if (fd == -1) {
+            free(shm);
+            return NULL;
+        }
+        if (ftruncate(fd, length) == -1) {
+            int saved_errno = errno;
+
+            close(fd);
+            shm_unlink(name);
+            free(shm);
+            errno = saved_errno;
+            return NULL;
+        }
+        p = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        close(fd);
+        if (p == MAP_FAILED) {
+            int saved_errno = errno;
+
+            shm_unlink(name);
+            free(shm);
+            errno = saved_errno;
+            return NULL;
+        }
+        header = (modbus_shm_header_t *) p;
+    }
+#endif
+
+    memset(header, 0, length);
+    header->version = MODBUS_SHM_VERSION;
+    header->max_devices = max_devices;
+    header->nb_registers = nb_registers;
+    header->device_length = device_length;
+    modbus_shm_store_release(&header->magic, MODBUS_SHM_MAGIC);
+
+    strcpy(shm->name, name);
+    shm->header = header;
+    shm->length = length;
+    _modbus_lock_init(&shm->lock, &shm->cond);
+
+    return shm;
+}
+
+/* Marks the segment as closed for the readers and removes it */
+void modbus_shm_free(modbus_shm_t *shm)
+{
+    if (shm == NULL)
+        return;
+
+    modbus_shm_store_release(&shm->header->magic, 0);
+#if defined(_WIN32)
+    UnmapViewOfFile(shm->header);
+    CloseHandle(shm->mapping);
+#else
+    munmap(shm->header, shm->length);
+    shm_unlink(shm->name);
+#endif
+    _modbus_lock_destroy(&shm->lock, &shm->cond);
+    free(shm);
+}
+
+/* Replaces the image of the device with the nb_registers values and the
+   validity bitmap (all valid if NULL) of the scan. */
+int modbus_shm_publish(modbus_shm_t *shm,
+                       int device,
+                       const uint16_t *values,
+                       const uint8_t *valid,
+                       uint64_t scan,
+                       uint64_t started_ms,
+                       uint64_t finished_ms)
+{
+    modbus_shm_header_t *header;
+    modbus_shm_device_t *dev = NULL;
+    uint8_t *bits;
+    uint32_t seq;
+    uint32_t i;
+
+    if (shm == NULL || device < 0 || device > 0xFFFF || values == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    header = shm->header;
+    _modbus_lock(&shm->lock);
+
+    for (i = 0; i < header->nb_devices; i++) {
+        if (get_device(shm, i)->device == device) {
+            dev = get_device(shm, i);
+            break;
+        }
+    }
+    if (dev == NULL) {
+        if (header->nb_devices == header->max_devices) {
+            _modbus_unlock(&shm->lock);
+            errno = ENOSPC;
+            return -1;
+        }
+        /* Visible to the readers once initialized, as a device without valid
+           registers */
+        dev = get_device(shm, header->nb_devices);
+        dev->device = device;
+        modbus_shm_store_release(&header->nb_devices, header->nb_devices + 1);
+    }
+
+    seq = dev->seq;
+    modbus_shm_store_release(&dev->seq, seq + 1);
+    modbus_shm_fence();
+
+    dev->scan = scan;
+    dev->started_ms = started_ms;
+    dev->finished_ms = finished_ms;
+    bits = (uint8_t *) modbus_shm_device_valid(dev);
+    if (valid != NULL) {
+        memcpy(bits, valid, (header->nb_registers + 7) / 8);
+    } else {
+        memset(bits, 0xFF, (header->nb_registers + 7) / 8);
+    }
+    memcpy((uint16_t *) modbus_shm_device_values(header, dev),
+           values,
+           header->nb_registers * sizeof(uint16_t));
+
+    modbus_shm_store_release(&dev->seq, seq + 2);
+
+    _modbus_unlock(&shm->lock);
+
+    return 0;
+}
@@ -0,0 +1,70 @@
+/*
+ * Copyright © Stéphane Raimbault <stephane.raimbault@gmail.com>
+ *
+ * SPDX-License-Identifier: LGPL-2.1-or-later
+ */
+
+#ifndef MODBUS_SHM_H
+#define MODBUS_SHM_H
+
+#include "modbus.h"
+
+MODBUS_BEGIN_DECLS
+
+/* Latest register image of each device in a named shared memory segment,
+   read by the local processes without system calls (modbus-shm-reader.h).
+
+   The segment starts with modbus_shm_header_t, followed by max_devices slots
+   of device_length bytes. A slot is a modbus_shm_device_t followed by the
+   validity bitmap (bit i of byte i / 8 set when register i was read and its
+   last read succeeded), padded to 8 bytes, then the nb_registers values of
+   the registers 0 to nb_registers - 1.
+
+   Each slot is a seqlock: seq is odd while the writer updates the slot, a
+   reader copies what it needs between two loads of seq and starts again if
+   they differ. magic is set to 0 when the writer closes the segment, the
+   readers have to open it again. */
+#define MODBUS_SHM_MAGIC   0x4D534842 /* "BHSM" */
+#define MODBUS_SHM_VERSION 1
+
+typedef struct _modbus_shm_header {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t max_devices;
+    uint32_t nb_registers;
+    uint32_t device_length;
+    /* Slots in use, only grows */
+    uint32_t nb_devices;
+    uint32_t reserved[10];
+} modbus_shm_header_t;
+
+typedef struct _modbus_shm_device {
+    uint32_t seq;
+    uint16_t device;
+    uint16_t reserved;
+    /* Number of the published scan */
+    uint64_t scan;
+    /* Acquisition of the scan, ms since 1970-01-01 UTC */
+    uint64_t started_ms;
+    uint64_t finished_ms;
+} modbus_shm_device_t;
+
+/* Bytes of the validity bitmap in a slot */
+#define MODBUS_SHM_VALID_LENGTH(nb_registers) ((((nb_registers) + 63) / 64) * 8)
+
+typedef struct _modbus_shm modbus_shm_t;
+
+MODBUS_API modbus_shm_t *modbus_shm_new(const char *name, int max_devices, int nb_registers);
+MODBUS_API void modbus_shm_free(modbus_shm_t *shm);
+
+MODBUS_API int modbus_shm_publish(modbus_shm_t *shm,
+                                  int device,
+                                  const uint16_t *values,
+                                  const uint8_t *valid,
+                                  uint64_t scan,
+                                  uint64_t started_ms,
+                                  uint64_t finished_ms);
+
+MODBUS_END_DECLS
+
+#endif /* MODBUS_SHM_H */
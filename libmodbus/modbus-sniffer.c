@@ -0,0 +1,636 @@
+/*
+ * Copyright © Stéphane Raimbault <stephane.raimbault@gmail.com>
+ *
+ * SPDX-License-Identifier: LGPL-2.1-or-later
+ *
+ * Passive monitor of a RTU bus: the received bytes are cut into frames on the
+ * inter-frame silence or, when the timestamps are too coarse, on the expected
+ * length with a valid CRC. Each request is paired with its response and the
+ * values seen are kept in a segmented mapping per slave.
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "modbus-private.h"
+
+#include "modbus-rtu.h"
+#include "modbus-sniffer.h"
+
+/* Room for a frame and the beginning of the next one */
+#define _MODBUS_SNIFFER_BUFFER_LENGTH (2 * MODBUS_RTU_MAX_ADU_LENGTH)
+
+struct _modbus_sniffer {
+    /* Bytes of the frames not decoded yet */
+    uint8_t buf[_MODBUS_SNIFFER_BUFFER_LENGTH];
+    int length;
+    uint64_t first_time_us;
+    uint64_t last_time_us;
+    /* Bytes are skipped to find the start of a frame */
+    int resync;
+    /* Silence ending a frame */
+    int silence_us;
+    /* Last request waiting for its response */
+    uint8_t req[MODBUS_RTU_MAX_ADU_LENGTH];
+    int req_length;
+    uint64_t req_time_us;
+    /* Values seen per slave */
+    modbus_mapping_t *mappings[MODBUS_MAX_UNITS];
+    modbus_sniffer_callback_t callback;
+    void *user_data;
+    modbus_sniffer_stats_t stats;
+};
+
+/* The serial settings give the time of a character. The frames are separated
+   by 3.5 characters (1.75 ms above 19200 bauds). */
+modbus_sniffer_t *modbus_sniffer_new(int baud, char parity, int data_bit, int stop_bit)
+{
+    modbus_sniffer_t *sniffer;
+    int char_time_us;
+
+    if (baud <= 0 || (parity != 'N' && parity != 'E' && parity != 'O')) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    sniffer = (modbus_sniffer_t *) calloc(1, sizeof(modbus_sniffer_t));
+    if (sniffer == NULL) {
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    char_time_us = 1000000 * (1 + data_bit + (parity == 'N' ? 0 : 1) + stop_bit) / baud;
+    sniffer->silence_us = (baud > 19200) ? 1750 : char_time_us * 7 / 2;
+
+    return sniffer;
+}
+
+void modbus_sniffer_free(modbus_sniffer_t *sniffer)
+{
+    int i;
+
+    if (sniffer == NULL)
+        return;
+
+    for (i = 0; i < MODBUS_MAX_UNITS; i++) {
+        modbus_mapping_free(sniffer->mappings[i]);
+    }
+    free(sniffer);
+}
+
+/* The callback is called for each request, answered or not */
+int modbus_sniffer_set_callback(modbus_sniffer_t *sniffer,
+                                modbus_sniffer_callback_t callback,
+                                void *user_data)
+{
+    if (sniffer == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    sniffer->callback = callback;
+    sniffer->user_data = user_data;
+    return 0;
+}
+
+/* USB adapters deliver the bytes by packets so a longer silence than t3.5 may
+   be needed to not cut the frames */
+int modbus_sniffer_set_silence(modbus_sniffer_t *sniffer, int us)
+{
+    if (sniffer == NULL || us <= 0) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    sniffer->silence_us = us;
+    return 0;
+}
+
+/* Length of the request at the start of msg, 0 if more bytes are needed or
+   -1 for an unknown function */
+static int request_length(const uint8_t *msg, int length)
+{
+    if (length < 2) {
+        return 0;
+    }
+
+    switch (msg[1]) {
+    case MODBUS_FC_READ_COILS:
+    case MODBUS_FC_READ_DISCRETE_INPUTS:
+    case MODBUS_FC_READ_HOLDING_REGISTERS:
+    case MODBUS_FC_READ_INPUT_REGISTERS:
+    case MODBUS_FC_WRITE_SINGLE_COIL:
+    case MODBUS_FC_WRITE_SINGLE_REGISTER:
+        return 8;
+    case MODBUS_FC_WRITE_MULTIPLE_COILS:
+    case MODBUS_FC_WRITE_MULTIPLE_REGISTERS:
+        return (length < 7) ? 0 : 9 + msg[6];
+    case MODBUS_FC_MASK_WRITE_REGISTER:
+        return 10;
+    case MODBUS_FC_WRITE_AND_READ_REGISTERS:
+        return (length < 11) ? 0 : 13 + msg[10];
+    case MODBUS_FC_READ_EXCEPTION_STATUS:
+    case MODBUS_FC_REPORT_SLAVE_ID:
+        return 4;
+    default:
+        return -1;
+    }
+}
+
+/* Same for a response */
+static int response_length(const uint8_t *msg, int length)
+{
+    if (length < 2) {
+        return 0;
+    }
+
+    if (msg[1] & 0x80) {
+        return 5;
+    }
+
+    switch (msg[1]) {
+    case MODBUS_FC_READ_COILS:
+    case MODBUS_FC_READ_DISCRETE_INPUTS:
+    case MODBUS_FC_READ_HOLDING_REGISTERS:
+    case MODBUS_FC_READ_INPUT_REGISTERS:
+    case MODBUS_FC_WRITE_AND_READ_REGISTERS:
+    case MODBUS_FC_REPORT_SLAVE_ID:
+        return (length < 3) ? 0 : 5 + msg[2];
+    case MODBUS_FC_WRITE_SINGLE_COIL:
+    case MODBUS_FC_WRITE_SINGLE_REGISTER:
+    case MODBUS_FC_WRITE_MULTIPLE_COILS:
+    case MODBUS_FC_WRITE_MULTIPLE_REGISTERS:
+        return 8;
+    case MODBUS_FC_MASK_WRITE_REGISTER:
+        return 10;
+    case MODBUS_FC_READ_EXCEPTION_STATUS:
+        return 5;
+    default:
+        return -1;
+    }
+}
+
+static int crc_valid(const uint8_t *msg, int length)
+{
+    uint16_t crc;
+
+    if (length < 4) {
+        return FALSE;
+    }
+
+    crc = modbus_crc16(msg, length - 2);
+    return msg[length - 2] == (crc & 0xFF) && msg[length - 1] == (crc >> 8);
+}
+
+/* TRUE if msg answers the pending request */
+static int is_response(const modbus_sniffer_t *sniffer, const uint8_t *msg, int length)
+{
+    const uint8_t *req = sniffer->req;
+
+    if (sniffer->req_length == 0 || msg[0] != req[0] || (msg[1] & 0x7F) != req[1]) {
+        return FALSE;
+    }
+
+    if (msg[1] & 0x80) {
+        return length == 5;
+    }
+
+    switch (req[1]) {
+    case MODBUS_FC_READ_COILS:
+    case MODBUS_FC_READ_DISCRETE_INPUTS: {
+        int nb = (req[4] << 8) + req[5];
+        return length == 5 + (nb / 8) + ((nb % 8) ? 1 : 0);
+    }
+    case MODBUS_FC_READ_HOLDING_REGISTERS:
+    case MODBUS_FC_READ_INPUT_REGISTERS:
+        return length == 5 + 2 * ((req[4] << 8) + req[5]);
+    case MODBUS_FC_WRITE_AND_READ_REGISTERS:
+        return length == 5 + 2 * ((req[4] << 8) + req[5]);
+    default:
+        return length == response_length(msg, length);
+    }
+}
+
+/* Registers the range in the mapping of the slave and returns its values */
+static void *image_range(modbus_sniffer_t *sniffer,
+                         int slave,
+                         modbus_table_type table,
+                         int addr,
+                         int nb)
+{
+    int is_bits = (table == MODBUS_TABLE_BITS || table == MODBUS_TABLE_INPUT_BITS);
+    modbus_mapping_t *mb_mapping = sniffer->mappings[slave];
+    int i = addr;
+
+    if (mb_mapping == NULL) {
+        mb_mapping = modbus_mapping_new_segmented();
+        if (mb_mapping == NULL) {
+            return NULL;
+        }
+        sniffer->mappings[slave] = mb_mapping;
+    }
+
+    /* Maps the holes, the adjacent segments are merged */
+    while (i < addr + nb) {
+        int start = i;
+
+        while (i < addr + nb &&
+               (is_bits ? (void *) modbus_mapping_get_bits(mb_mapping, table, i, 1)
+                        : (void *) modbus_mapping_get_registers(mb_mapping, table, i, 1)) ==
+                   NULL) {
+            i++;
+        }
+        if (i > start && modbus_mapping_add_segment(mb_mapping, table, start, i - start) == -1) {
+            return NULL;
+        }
+        i++;
+    }
+
+    if (is_bits) {
+        return modbus_mapping_get_bits(mb_mapping, table, addr, nb);
+    } else {
+        return modbus_mapping_get_registers(mb_mapping, table, addr, nb);
+    }
+}
+
+static void image_set_bits(modbus_sniffer_t *sniffer,
+                           int slave,
+                           modbus_table_type table,
+                           int addr,
+                           int nb,
+                           const uint8_t *bytes)
+{
+    uint8_t *tab = image_range(sniffer, slave, table, addr, nb);
+    int i;
+
+    if (tab != NULL) {
+        for (i = 0; i < nb; i++) {
+            tab[i] = (bytes[i / 8] >> (i % 8)) & 1;
+        }
+    }
+}
+
+static void image_set_registers(modbus_sniffer_t *sniffer,
+                                int slave,
+                                modbus_table_type table,
+                                int addr,
+                                int nb,
+                                const uint8_t *bytes)
+{
+    uint16_t *tab = image_range(sniffer, slave, table, addr, nb);
+
+    if (tab != NULL) {
+        modbus_get_registers_from_bytes(tab, bytes, nb);
+    }
+}
+
+/* TRUE if the nb values at addr are within the protocol limit and the
+   address space */
+static int quantity_valid(int addr, int nb, int max)
+{
+    return nb >= 1 && nb <= max && addr + nb <= 0x10000;
+}
+
+/* TRUE if the byte count at offset of the request matches the nb values and
+   they are all in the frame. A valid CRC doesn't mean a consistent frame. */
+static int byte_count_valid(const modbus_sniffer_t *sniffer, int offset, int nb, int is_bits)
+{
+    int count = is_bits ? (nb / 8) + ((nb % 8) ? 1 : 0) : 2 * nb;
+
+    return sniffer->req[offset] == count && sniffer->req_length >= offset + 1 + count + 2;
+}
+
+/* Updates the image of the slave with the values read or written, the
+   inconsistent requests are ignored */
+static void
+apply_transaction(modbus_sniffer_t *sniffer, const uint8_t *req, const uint8_t *rsp)
+{
+    int slave = req[0];
+    int addr = (req[2] << 8) + req[3];
+    int nb = (req[4] << 8) + req[5];
+
+    switch (req[1]) {
+    case MODBUS_FC_READ_COILS:
+    case MODBUS_FC_READ_DISCRETE_INPUTS:
+        if (!quantity_valid(addr, nb, MODBUS_MAX_READ_BITS)) {
+            break;
+        }
+        image_set_bits(sniffer,
+                       slave,
+                       req[1] == MODBUS_FC_READ_COILS ? MODBUS_TABLE_BITS
+                                                      : MODBUS_TABLE_INPUT_BITS,
+                       addr,
+                       nb,
+                       rsp + 3);
+        break;
+    case MODBUS_FC_READ_HOLDING_REGISTERS:
+    case MODBUS_FC_READ_INPUT_REGISTERS:
+        if (!quantity_valid(addr, nb, MODBUS_MAX_READ_REGISTERS)) {
+            break;
+        }
+        image_set_registers(sniffer,
+                            slave,
+                            req[1] == MODBUS_FC_READ_HOLDING_REGISTERS
+                                ? MODBUS_TABLE_REGISTERS
+                                : MODBUS_TABLE_INPUT_REGISTERS,
+                            addr,
+                            nb,
+                            rsp + 3);
+        break;
+    case MODBUS_FC_WRITE_SINGLE_COIL: {
+        uint8_t bit = (req[4] == 0xFF) ? 1 : 0;
+        image_set_bits(sniffer, slave, MODBUS_TABLE_BITS, addr, 1, &bit);
+    } break;
+    case MODBUS_FC_WRITE_SINGLE_REGISTER:
+        image_set_registers(sniffer, slave, MODBUS_TABLE_REGISTERS, addr, 1, req + 4);
+        break;
+    case MODBUS_FC_WRITE_MULTIPLE_COILS:
+        if (!quantity_valid(addr, nb, MODBUS_MAX_WRITE_BITS) ||
+            !byte_count_valid(sniffer, 6, nb, TRUE)) {
+            break;
+        }
+        image_set_bits(sniffer, slave, MODBUS_TABLE_BITS, addr, nb, req + 7);
+        break;
+    case MODBUS_FC_WRITE_MULTIPLE_REGISTERS:
+        if (!quantity_valid(addr, nb, MODBUS_MAX_WRITE_REGISTERS) ||
+            !byte_count_valid(sniffer, 6, nb, FALSE)) {
+            break;
+        }
+        image_set_registers(sniffer, slave, MODBUS_TABLE_REGISTERS, addr, nb, req + 7);
+        break;
+    case MODBUS_FC_MASK_WRITE_REGISTER: {
+        /* Only when the previous value is known */
+        modbus_mapping_t *mb_mapping = sniffer->mappings[slave];
+        uint16_t *tab = mb_mapping == NULL ? NULL
+                                           : modbus_mapping_get_registers(
+                                                 mb_mapping, MODBUS_TABLE_REGISTERS, addr, 1);
+        if (tab != NULL) {
+            uint16_t and_mask = (req[4] << 8) + req[5];
+            uint16_t or_mask = (req[6] << 8) + req[7];
+            *tab = (*tab & and_mask) | (or_mask & (~and_mask));
+        }
+    } break;
+    case MODBUS_FC_WRITE_AND_READ_REGISTERS: {
+        int write_addr = (req[6] << 8) + req[7];
+        int write_nb = (req[8] << 8) + req[9];
+
+        if (!quantity_valid(addr, nb, MODBUS_MAX_WR_READ_REGISTERS) ||
+            !quantity_valid(write_addr, write_nb, MODBUS_MAX_WR_WRITE_REGISTERS) ||
+            !byte_count_valid(sniffer, 10, write_nb, FALSE)) {
+            break;
+        }
+        /* Written first then read */
+        image_set_registers(
+            sniffer, slave, MODBUS_TABLE_REGISTERS, write_addr, write_nb, req + 11);
+        image_set_registers(sniffer, slave, MODBUS_TABLE_REGISTERS, addr, nb, rsp + 3);
+    } break;
+    default:
+        break;
+    }
+}
+
+static void emit_transaction(modbus_sniffer_t *sniffer,
+                             const uint8_t *rsp,
+                             int rsp_length,
+                             uint64_t rsp_time_us)
+{
+    modbus_sniffer_transaction_t transaction;
+
+    sniffer->stats.nb_transactions++;
+    if (rsp == NULL) {
+        if (sniffer->req[0] != MODBUS_BROADCAST_ADDRESS) {
+            sniffer->stats.nb_unanswered++;
+        }
+    } else if (rsp[1] & 0x80) {
+        sniffer->stats.nb_exceptions++;
+    } else {
+        apply_transaction(sniffer, sniffer->req, rsp);
+    }
+
+    if (sniffer->callback != NULL) {
+        transaction.req = sniffer->req;
+        transaction.req_length = sniffer->req_length;
+        transaction.rsp = rsp;
+        transaction.rsp_length = rsp_length;
+        transaction.req_time_us = sniffer->req_time_us;
+        transaction.rsp_time_us = rsp_time_us;
+        sniffer->callback(sniffer->user_data, &transaction);
+    }
+
+    sniffer->req_length = 0;
+}
+
+/* A frame with a valid CRC is either the response of the pending request or a
+   new request */
+static void handle_frame(modbus_sniffer_t *sniffer, const uint8_t *msg, int length)
+{
+    sniffer->stats.nb_frames++;
+
+    if (is_response(sniffer, msg, length)) {
+        emit_transaction(sniffer, msg, length, sniffer->first_time_us);
+        return;
+    }
+
+    if (sniffer->req_length > 0) {
+        /* The previous request hasn't been answered */
+        emit_transaction(sniffer, NULL, 0, 0);
+    }
+
+    memcpy(sniffer->req, msg, length);
+    sniffer->req_length = length;
+    sniffer->req_time_us = sniffer->first_time_us;
+
+    if (msg[0] == MODBUS_BROADCAST_ADDRESS) {
+        /* No response to wait for */
+        emit_transaction(sniffer, NULL, 0, 0);
+    }
+}
+
+static void drop_bytes(modbus_sniffer_t *sniffer, int length)
+{
+    memmove(sniffer->buf, sniffer->buf + length, sniffer->length - length);
+    sniffer->length -= length;
+    /* The next frame has been received with the last bytes */
+    sniffer->first_time_us = sniffer->last_time_us;
+}
+
+/* Decodes the complete frames of the buffer. With end_of_frame, a silence has
+   been seen so the remaining bytes are a frame on their own. */
+static void parse_frames(modbus_sniffer_t *sniffer, int end_of_frame)
+{
+    while (sniffer->length > 0) {
+        int candidates[2];
+        int found = FALSE;
+        int incomplete = FALSE;
+        int i;
+
+        /* Expected length as a response of the pending request then as a request */
+        candidates[0] = (sniffer->req_length > 0 && sniffer->buf[0] == sniffer->req[0])
+                            ? response_length(sniffer->buf, sniffer->length)
+                            : -1;
+        candidates[1] = request_length(sniffer->buf, sniffer->length);
+
+        for (i = 0; i < 2 && !found; i++) {
+            int length = candidates[i];
+
+            if (length >= 4 && length <= sniffer->length &&
+                crc_valid(sniffer->buf, length)) {
+                handle_frame(sniffer, sniffer->buf, length);
+                drop_bytes(sniffer, length);
+                sniffer->resync = FALSE;
+                found = TRUE;
+            } else if (length == 0 ||
+                       (length > sniffer->length && length <= MODBUS_RTU_MAX_ADU_LENGTH)) {
+                incomplete = TRUE;
+            }
+        }
+
+        if (found) {
+            continue;
+        }
+
+        if (end_of_frame) {
+            if (crc_valid(sniffer->buf, sniffer->length) &&
+                sniffer->length <= MODBUS_RTU_MAX_ADU_LENGTH) {
+                handle_frame(sniffer, sniffer->buf, sniffer->length);
+            } else if (!sniffer->resync) {
+                sniffer->stats.nb_crc_errors++;
+            }
+            sniffer->length = 0;
+            sniffer->resync = FALSE;
+        } else if (!incomplete || sniffer->length >= _MODBUS_SNIFFER_BUFFER_LENGTH) {
+            /* Not a frame start, skips a byte to find the next one. A run of
+               skipped bytes counts as a single error. */
+            if (!sniffer->resync) {
+                sniffer->stats.nb_crc_errors++;
+                sniffer->resync = TRUE;
+            }
+            drop_bytes(sniffer, 1);
+            continue;
+        }
+        break;
+    }
+}
+
+/* Adds the bytes received at time_us (monotonic clock or the timestamps of a
+   capture). Returns the number of frames decoded so far. */
+int modbus_sniffer_feed(modbus_sniffer_t *sniffer,
+                        const uint8_t *data,
+                        int length,
+                        uint64_t time_us)
+{
+    if (sniffer == NULL || data == NULL || length < 0) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    modbus_sniffer_flush(sniffer, time_us);
+
+    while (length > 0) {
+        int n = _MODBUS_SNIFFER_BUFFER_LENGTH - sniffer->length;
+
+        if (n > length) {
+            n = length;
+        }
+        if (sniffer->length == 0) {
+            sniffer->first_time_us = time_us;
+        }
+        memcpy(sniffer->buf + sniffer->length, data, n);
+        sniffer->length += n;
+        sniffer->last_time_us = time_us;
+        data += n;
+        length -= n;
+
+        parse_frames(sniffer, FALSE);
+    }
+
+    return sniffer->stats.nb_frames;
+}
+
+/* Ends the pending frame when the bus is silent since long enough at time_us */
+int modbus_sniffer_flush(modbus_sniffer_t *sniffer, uint64_t time_us)
+{
+    if (sniffer == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (sniffer->length > 0 && time_us >= sniffer->last_time_us + sniffer->silence_us) {
+        parse_frames(sniffer, TRUE);
+    }
+
+    return sniffer->stats.nb_frames;
+}
+
+/* Decodes the traffic received by the RTU context for timeout_ms without ever
+   sending. Returns the number of frames decoded or -1 on a port error. */
+int modbus_sniffer_listen(modbus_sniffer_t *sniffer, modbus_t *ctx, int timeout_ms)
+{
+    uint8_t buf[MODBUS_RTU_MAX_ADU_LENGTH];
+    uint32_t nb_frames;
+    uint64_t deadline;
+    uint64_t now;
+
+    if (sniffer == NULL || ctx == NULL ||
+        ctx->backend->backend_type != _MODBUS_BACKEND_TYPE_RTU || timeout_ms < 0) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    nb_frames = sniffer->stats.nb_frames;
+    deadline = _modbus_monotonic_us() + (uint64_t) timeout_ms * 1000;
+    do {
+        struct timeval tv;
+        fd_set rset;
+        int rc;
+
+        /* Short waits to see the silence ending a frame */
+        FD_ZERO(&rset);
+        FD_SET(ctx->s, &rset);
+        tv.tv_sec = 0;
+        tv.tv_usec = sniffer->silence_us;
+
+        rc = ctx->backend->select(ctx, &rset, &tv, sizeof(buf));
+        now = _modbus_monotonic_us();
+        if (rc == -1) {
+            if (errno != ETIMEDOUT) {
+                return -1;
+            }
+            modbus_sniffer_flush(sniffer, now);
+            continue;
+        }
+
+        rc = ctx->backend->recv(ctx, buf, sizeof(buf));
+        if (rc == -1) {
+            return -1;
+        }
+        modbus_sniffer_feed(sniffer, buf, rc, now);
+    } while (now < deadline);
+
+    return sniffer->stats.nb_frames - nb_frames;
+}
+
+/* Values seen for the slave, NULL if it hasn't been seen yet. Use
+   modbus_mapping_get_bits() and modbus_mapping_get_registers() to read them. */
+modbus_mapping_t *modbus_sniffer_get_mapping(modbus_sniffer_t *sniffer, int slave)
+{
+    if (sniffer == NULL || slave < 0 || slave >= MODBUS_MAX_UNITS) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    return sniffer->mappings[slave];
+}
+
+int modbus_sniffer_get_stats(modbus_sniffer_t *sniffer, modbus_sniffer_stats_t *stats)
+{
+    if (sniffer == NULL || stats == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    *stats = sniffer->stats;
+    return 0;
+}
@@ -0,0 +1,61 @@
+/*
+ * Copyright © Stéphane Raimbault <stephane.raimbault@gmail.com>
+ *
+ * SPDX-License-Identifier: LGPL-2.1-or-later
+ */
+
+#ifndef MODBUS_SNIFFER_H
+#define MODBUS_SNIFFER_H
+
+#include "modbus.h"
+
+MODBUS_BEGIN_DECLS
+
+/* Passive decoding of the traffic of a RTU bus owned by another master */
+typedef struct _modbus_sniffer modbus_sniffer_t;
+
+typedef struct _modbus_sniffer_transaction {
+    const uint8_t *req;
+    int req_length;
+    /* NULL when the request wasn't answered (broadcast or timeout) */
+    const uint8_t *rsp;
+    int rsp_length;
+    uint64_t req_time_us;
+    uint64_t rsp_time_us;
+} modbus_sniffer_transaction_t;
+
+typedef void (*modbus_sniffer_callback_t)(void *user_data,
+                                          const modbus_sniffer_transaction_t *transaction);
+
+typedef struct _modbus_sniffer_stats {
+    uint32_t nb_frames;
+    uint32_t nb_crc_errors;
+    uint32_t nb_transactions;
+    uint32_t nb_exceptions;
+    uint32_t nb_unanswered;
+} modbus_sniffer_stats_t;
+
+MODBUS_API modbus_sniffer_t *
+modbus_sniffer_new(int baud, char parity, int data_bit, int stop_bit);
+MODBUS_API void modbus_sniffer_free(modbus_sniffer_t *sniffer);
+
+MODBUS_API int modbus_sniffer_set_callback(modbus_sniffer_t *sniffer,
+                                           modbus_sniffer_callback_t callback,
+                                           void *user_data);
+MODBUS_API int modbus_sniffer_set_silence(modbus_sniffer_t *sniffer, int us);
+
+MODBUS_API int modbus_sniffer_feed(modbus_sniffer_t *sniffer,
+                                   const uint8_t *data,
+                                   int length,
+                                   uint64_t time_us);
+MODBUS_API int modbus_sniffer_flush(modbus_sniffer_t *sniffer, uint64_t time_us);
+MODBUS_API int modbus_sniffer_listen(modbus_sniffer_t *sniffer, modbus_t *ctx, int timeout_ms);
+
+MODBUS_API modbus_mapping_t *modbus_sniffer_get_mapping(modbus_sniffer_t *sniffer,
+                                                        int slave);
+MODBUS_API int modbus_sniffer_get_stats(modbus_sniffer_t *sniffer,
+                                        modbus_sniffer_stats_t *stats);
+
+MODBUS_END_DECLS
+
+#endif /* MODBUS_SNIFFER_H */
@@ -0,0 +1,117 @@
+/*
+ * Copyright © Stéphane Raimbault <stephane.raimbault@gmail.com>
+ *
+ * SPDX-License-Identifier: LGPL-2.1-or-later
+ */
+
+#ifndef MODBUS_THREAD_PRIVATE_H
+#define MODBUS_THREAD_PRIVATE_H
+
+/* Lock and condition variable of the objects shared between threads, SRW
+   locks on Windows and pthreads elsewhere. Included after modbus-private.h. */
+
+// clang-format off
+#ifdef _WIN32
+# ifndef _WIN32_WINNT
+#   define _WIN32_WINNT 0x0600
+# endif
+# include <winsock2.h>
+# include <windows.h>
+typedef SRWLOCK _modbus_lock_t;
+typedef CONDITION_VARIABLE _modbus_cond_t;
+# define _MODBUS_LOCK_INITIALIZER SRWLOCK_INIT
+#else
+# include <pthread.h>
+# include <time.h>
+typedef pthread_mutex_t _modbus_lock_t;
+typedef pthread_cond_t _modbus_cond_t;
+# define _MODBUS_LOCK_INITIALIZER PTHREAD_MUTEX_INITIALIZER
+#endif
+// clang-format on
+
+static inline void _modbus_lock_init(_modbus_lock_t *lock, _modbus_cond_t *cond)
+{
+#ifdef _WIN32
+    InitializeSRWLock(lock);
+    InitializeConditionVariable(cond);
+#else
+    pthread_condattr_t attr;
+
+    pthread_mutex_init(lock, NULL);
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(cond, &attr);
+    pthread_condattr_destroy(&attr);
+#endif
+}
+
+static inline void _modbus_lock_destroy(_modbus_lock_t *lock, _modbus_cond_t *cond)
+{
+#ifndef _WIN32
+    pthread_cond_destroy(cond);
+    pthread_mutex_destroy(lock);
+#endif
+}
+
+static inline void _modbus_lock(_modbus_lock_t *lock)
+{
+#ifdef _WIN32
+    AcquireSRWLockExclusive(lock);
+#else
+    pthread_mutex_lock(lock);
+#endif
+}
+
+static inline void _modbus_unlock(_modbus_lock_t *lock)
+{
+#ifdef _WIN32
+    ReleaseSRWLockExclusive(lock);
+#else
+    pthread_mutex_unlock(lock);
+#endif
+}
+
+static inline void _modbus_cond_broadcast(_modbus_cond_t *cond)
+{
+#ifdef _WIN32
+    WakeAllConditionVariable(cond);
+#else
+    pthread_cond_broadcast(cond);
+#endif
+}
+
+/* Waits for a broadcast, with the lock held, until deadline_us (UINT64_MAX
+   for no limit). Returns FALSE when the deadline has passed. */
+static inline int
+_modbus_cond_wait_until(_modbus_cond_t *cond, _modbus_lock_t *lock, uint64_t deadline_us)
+{
+    uint64_t now_us = _modbus_monotonic_us();
+
+    if (now_us >= deadline_us) {
+        return FALSE;
+    }
+
+#ifdef _WIN32
+    SleepConditionVariableSRW(cond,
+                              lock,
+                              deadline_us == UINT64_MAX
+                                  ? INFINITE
+                                  : (DWORD) ((deadline_us - now_us + 999) / 1000),
+                              0);
+#else
+    if (deadline_us == UINT64_MAX) {
+        pthread_cond_wait(cond, lock);
+    } else {
+        /* The condition uses the clock of _modbus_monotonic_us() */
+        struct timespec ts;
+
+        ts.tv_sec = (time_t) (deadline_us / 1000000);
+        ts.tv_nsec = (long) (deadline_us % 1000000) * 1000;
+        pthread_cond_timedwait(cond, lock, &ts);
+    }
+#endif
+
+    return TRUE;
+}
+
+#endif /* MODBUS_THREAD_PRIVATE_H */
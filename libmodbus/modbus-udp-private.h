@@ -0,0 +1,42 @@
+/*
+ * Copyright © Stéphane Raimbault <stephane.raimbault@gmail.com>
+ *
+ * SPDX-License-Identifier: LGPL-2.1-or-later
+ */
+
+#ifndef MODBUS_UDP_PRIVATE_H
+#define MODBUS_UDP_PRIVATE_H
+
+#define _MODBUS_UDP_HEADER_LENGTH     7
+#define _MODBUS_UDP_PRESET_REQ_LENGTH 12
+#define _MODBUS_UDP_PRESET_RSP_LENGTH 8
+
+#define _MODBUS_UDP_CHECKSUM_LENGTH 0
+
+/* Datagrams sent or received by one sendmmsg()/recvmmsg() call */
+#define _MODBUS_UDP_BURST_LENGTH 64
+
+typedef struct _modbus_udp {
+    /* Transaction ID, first as in modbus_tcp_t */
+    uint16_t t_id;
+    /* UDP port */
+    int port;
+    /* IP address */
+    char ip[16];
+    /* Address of the server, or of the client of the last indication once
+       modbus_udp_listen() has been called */
+    struct sockaddr_in peer;
+    int server;
+    int nb_retries;
+    int retries_left;
+    /* Last request, sent again with the same transaction ID on timeout */
+    uint8_t req[MODBUS_UDP_MAX_ADU_LENGTH];
+    int req_length;
+    /* Datagram being read by _modbus_receive_msg() */
+    uint8_t rx[MODBUS_UDP_MAX_ADU_LENGTH];
+    int rx_length;
+    int rx_offset;
+    modbus_udp_stats_t stats;
+} modbus_udp_t;
+
+#endif /* MODBUS_UDP_PRIVATE_H */
@@ -0,0 +1,992 @@
+/*
+ * Copyright © Stéphane Raimbault <stephane.raimbault@gmail.com>
+ *
+ * SPDX-License-Identifier: LGPL-2.1-or-later
+ *
+ * Modbus over UDP: the MBAP framing of TCP with one ADU per datagram. There is
+ * no connection to establish or lose, a request without response is sent
+ * again with the same transaction ID and the responses to older transactions
+ * are dropped. Many devices can be read with a few system calls by
+ * modbus_udp_read_registers_batch().
+ */
+
+// clang-format off
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+/* sendmmsg() and recvmmsg() */
+# define _GNU_SOURCE
+#endif
+
+#if defined(_WIN32)
+# define OS_WIN32
+# ifndef WINVER
+#   define WINVER 0x0501
+# endif
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#ifndef _MSC_VER
+#include <unistd.h>
+#endif
+#include <sys/types.h>
+
+#if defined(_WIN32)
+# include <winsock2.h>
+# include <ws2tcpip.h>
+# define close closesocket
+#else
+# include <sys/socket.h>
+# include <sys/ioctl.h>
+# include <netinet/in.h>
+# include <arpa/inet.h>
+#endif
+
+#if defined(__linux__)
+# define HAVE_SENDMMSG 1
+#endif
+// clang-format on
+
+#include "modbus-private.h"
+
+#include "modbus-udp.h"
+#include "modbus-udp-private.h"
+
+#ifdef OS_WIN32
+static int _modbus_udp_init_win32(void)
+{
+    /* Initialise Windows Socket API */
+    WSADATA wsaData;
+
+    if (WSAStartup(MAKEWORD(2, 2), &wsaData) != 0) {
+        fprintf(stderr,
+                "WSAStartup() returned error code %d\n",
+                (unsigned int) GetLastError());
+        errno = EIO;
+        return -1;
+    }
+    return 0;
+}
+#endif
+
+static int _modbus_set_slave(modbus_t *ctx, int slave)
+{
+    int max_slave = (ctx->quirks & MODBUS_QUIRK_MAX_SLAVE) ? 255 : 247;
+
+    /* Broadcast address is 0 (MODBUS_BROADCAST_ADDRESS) */
+    if (slave >= 0 && slave <= max_slave) {
+        ctx->slave = slave;
+    } else if (slave == MODBUS_TCP_SLAVE) {
+        ctx->slave = slave;
+    } else {
+        errno = EINVAL;
+        return -1;
+    }
+
+    return 0;
+}
+
+static uint16_t next_t_id(modbus_udp_t *ctx_udp)
+{
+    if (ctx_udp->t_id < UINT16_MAX)
+        ctx_udp->t_id++;
+    else
+        ctx_udp->t_id = 0;
+
+    return ctx_udp->t_id;
+}
+
+/* Builds a UDP request header, the same as in TCP */
+static int _modbus_udp_build_request_basis(
+    modbus_t *ctx, int function, int addr, int nb, uint8_t *req)
+{
+    uint16_t t_id = next_t_id(ctx->backend_data);
+
+    req[0] = t_id >> 8;
+    req[1] = t_id & 0x00ff;
+
+    /* Protocol Modbus */
+    req[2] = 0;
+    req[3] = 0;
+
+    /* Length will be defined later by _modbus_udp_send_msg_pre at offsets 4
+       and 5 */
+
+    req[6] = ctx->slave;
+    req[7] = function;
+    req[8] = addr >> 8;
+    req[9] = addr & 0x00ff;
+    req[10] = nb >> 8;
+    req[11] = nb & 0x00ff;
+
+    return _MODBUS_UDP_PRESET_REQ_LENGTH;
+}
+
+/* Builds a UDP response header */
+static int _modbus_udp_build_response_basis(sft_t *sft, uint8_t *rsp)
+{
+    rsp[0] = sft->t_id >> 8;
+    rsp[1] = sft->t_id & 0x00ff;
+
+    /* Protocol Modbus */
+    rsp[2] = 0;
+    rsp[3] = 0;
+
+    /* Length will be set later by send_msg (4 and 5) */
+
+    /* The slave ID is copied from the indication */
+    rsp[6] = sft->slave;
+    rsp[7] = sft->function;
+
+    return _MODBUS_UDP_PRESET_RSP_LENGTH;
+}
+
+static int _modbus_udp_prepare_response_tid(const uint8_t *req, int *req_length)
+{
+    (void) req_length;
+    return (req[0] << 8) + req[1];
+}
+
+static int _modbus_udp_send_msg_pre(uint8_t *req, int req_length)
+{
+    /* Subtract the header length to the message length */
+    int mbap_length = req_length - 6;
+
+    req[4] = mbap_length >> 8;
+    req[5] = mbap_length & 0x00FF;
+
+    return req_length;
+}
+
+static ssize_t
+send_datagram(modbus_t *ctx, const uint8_t *msg, int length, const struct sockaddr_in *addr)
+{
+    return sendto(ctx->s,
+                  (const char *) msg,
+                  length,
+                  0,
+                  (const struct sockaddr *) addr,
+                  sizeof(struct sockaddr_in));
+}
+
+static ssize_t _modbus_udp_send(modbus_t *ctx, const uint8_t *req, int req_length)
+{
+    modbus_udp_t *ctx_udp = ctx->backend_data;
+
+    if (!ctx_udp->server) {
+        /* Kept to be sent again if the response doesn't come */
+        if (req_length > MODBUS_UDP_MAX_ADU_LENGTH) {
+            errno = EMBBADDATA;
+            return -1;
+        }
+        memcpy(ctx_udp->req, req, req_length);
+        ctx_udp->req_length = req_length;
+        ctx_udp->retries_left = ctx_udp->nb_retries;
+    }
+
+    /* A new transaction, what's left of the previous datagram is dropped */
+    ctx_udp->rx_length = 0;
+    ctx_udp->rx_offset = 0;
+
+    return send_datagram(ctx, req, req_length, &ctx_udp->peer);
+}
+
+static int _modbus_udp_receive(modbus_t *ctx, uint8_t *req)
+{
+    return _modbus_receive_msg(ctx, req, MSG_INDICATION);
+}
+
+/* Hands out the datagram received by _modbus_udp_select() */
+static ssize_t _modbus_udp_recv(modbus_t *ctx, uint8_t *rsp, int rsp_length)
+{
+    modbus_udp_t *ctx_udp = ctx->backend_data;
+    int length = ctx_udp->rx_length - ctx_udp->rx_offset;
+
+    if (length > rsp_length) {
+        length = rsp_length;
+    }
+    memcpy(rsp, ctx_udp->rx + ctx_udp->rx_offset, length);
+    ctx_udp->rx_offset += length;
+
+    return length;
+}
+
+static int _modbus_udp_check_integrity(modbus_t *ctx, uint8_t *msg, const int msg_length)
+{
+    (void) ctx;
+    (void) msg;
+    return msg_length;
+}
+
+static int _modbus_udp_pre_check_confirmation(modbus_t *ctx,
+                                              const uint8_t *req,
+                                              const uint8_t *rsp,
+                                              int rsp_length)
+{
+    unsigned int protocol_id;
+
+    (void) rsp_length;
+
+    /* Check transaction ID */
+    if (req[0] != rsp[0] || req[1] != rsp[1]) {
+        if (ctx->debug) {
+            fprintf(stderr,
+                    "Invalid transaction ID received 0x%X (not 0x%X)\n",
+                    (rsp[0] << 8) + rsp[1],
+                    (req[0] << 8) + req[1]);
+        }
+        errno = EMBBADDATA;
+        return -1;
+    }
+
+    /* Check protocol ID */
+    protocol_id = (rsp[2] << 8) + rsp[3];
+    if (protocol_id != 0x0) {
+        if (ctx->debug) {
+            fprintf(stderr, "Invalid protocol ID received 0x%X (not 0x0)\n", protocol_id);
+        }
+        errno = EMBBADDATA;
+        return -1;
+    }
+
+    return 0;
+}
+
+/* A datagram holds exactly one ADU, its MBAP length gives the size of the
+   rest of the datagram */
+static int is_valid_mbap(const uint8_t *msg, int length)
+{
+    return length > _MODBUS_UDP_HEADER_LENGTH && msg[2] == 0 && msg[3] == 0 &&
+           ((msg[4] << 8) | msg[5]) == length - 6;
+}
+
+static int same_address(const struct sockaddr_in *a, const struct sockaddr_in *b)
+{
+    return a->sin_addr.s_addr == b->sin_addr.s_addr && a->sin_port == b->sin_port;
+}
+
+static int set_non_blocking(int s)
+{
+#ifdef OS_WIN32
+    /* Setting FIONBIO expects an unsigned long according to MSDN */
+    u_long loption = 1;
+
+    return ioctlsocket(s, FIONBIO, &loption) == 0 ? 0 : -1;
+#else
+    int option = 1;
+
+    return ioctl(s, FIONBIO, &option);
+#endif
+}
+
+static int open_socket(void)
+{
+    int flags = SOCK_DGRAM;
+    int s;
+
+#ifdef SOCK_CLOEXEC
+    flags |= SOCK_CLOEXEC;
+#endif
+
+    s = socket(PF_INET, flags, IPPROTO_UDP);
+    if (s < 0) {
+        return -1;
+    }
+
+    /* Reads never block, the datagrams are waited for with select() */
+    if (set_non_blocking(s) == -1) {
+        close(s);
+        return -1;
+    }
+
+    return s;
+}
+
+/* Doesn't connect the socket so it can also reach the devices of a batch,
+   the responses are filtered by address instead */
+static int _modbus_udp_connect(modbus_t *ctx)
+{
+    modbus_udp_t *ctx_udp = ctx->backend_data;
+
+#ifdef OS_WIN32
+    if (_modbus_udp_init_win32() == -1) {
+        return -1;
+    }
+#endif
+
+    memset(&ctx_udp->peer, 0, sizeof(ctx_udp->peer));
+    ctx_udp->peer.sin_family = AF_INET;
+    ctx_udp->peer.sin_port = htons(ctx_udp->port);
+    if (inet_pton(AF_INET, ctx_udp->ip, &ctx_udp->peer.sin_addr) <= 0) {
+        if (ctx->debug) {
+            fprintf(stderr, "Invalid IP address: %s\n", ctx_udp->ip);
+        }
+        errno = EINVAL;
+        return -1;
+    }
+
+    ctx->s = open_socket();
+    if (ctx->s < 0) {
+        return -1;
+    }
+
+    if (ctx->debug) {
+        printf("Sending to %s:%d\n", ctx_udp->ip, ctx_udp->port);
+    }
+
+    ctx_udp->server = FALSE;
+    ctx_udp->req_length = 0;
+    ctx_udp->rx_length = 0;
+    ctx_udp->rx_offset = 0;
+
+    return 0;
+}
+
+static unsigned int _modbus_udp_is_connected(modbus_t *ctx)
+{
+    return ctx->s >= 0;
+}
+
+static void _modbus_udp_close(modbus_t *ctx)
+{
+    if (ctx->s >= 0) {
+        close(ctx->s);
+        ctx->s = -1;
+    }
+}
+
+static int _modbus_udp_flush(modbus_t *ctx)
+{
+    modbus_udp_t *ctx_udp = ctx->backend_data;
+    char devnull[MODBUS_UDP_MAX_ADU_LENGTH];
+    int rc_sum = ctx_udp->rx_length - ctx_udp->rx_offset;
+    int rc;
+
+    ctx_udp->rx_length = 0;
+    ctx_udp->rx_offset = 0;
+
+    /* The socket doesn't block */
+    while ((rc = recv(ctx->s, devnull, sizeof(devnull), 0)) > 0) {
+        rc_sum += rc;
+    }
+
+    return rc_sum;
+}
+
+/* Reads one datagram and keeps it if it's the response to the pending
+   request (client) or a request (server). Returns 1 when kept, 0 when
+   dropped or nothing was there. */
+static int receive_datagram(modbus_t *ctx)
+{
+    modbus_udp_t *ctx_udp = ctx->backend_data;
+    struct sockaddr_in src;
+    socklen_t src_length = sizeof(src);
+    int rc;
+
+    rc = recvfrom(ctx->s,
+                  (char *) ctx_udp->rx,
+                  sizeof(ctx_udp->rx),
+                  0,
+                  (struct sockaddr *) &src,
+                  &src_length);
+    if (rc <= 0) {
+        return 0;
+    }
+
+    if (!is_valid_mbap(ctx_udp->rx, rc) ||
+        (!ctx_udp->server &&
+         (!same_address(&src, &ctx_udp->peer) ||
+          (ctx_udp->req_length > 0 &&
+           (ctx_udp->rx[0] != ctx_udp->req[0] || ctx_udp->rx[1] != ctx_udp->req[1]))))) {
+        if (ctx->debug) {
+            fprintf(stderr, "Datagram of %d bytes dropped\n", rc);
+        }
+        ctx_udp->stats.nb_dropped++;
+        return 0;
+    }
+
+    if (ctx_udp->server) {
+        /* The response goes back to the sender of the indication */
+        ctx_udp->peer = src;
+    }
+    ctx_udp->rx_length = rc;
+    ctx_udp->rx_offset = 0;
+
+    return 1;
+}
+
+/* Waits for a datagram to read. The request is sent again each time the
+   response timeout expires, as long as retries are left. */
+static int
+_modbus_udp_select(modbus_t *ctx, fd_set *rset, struct timeval *tv, int length_to_read)
+{
+    modbus_udp_t *ctx_udp = ctx->backend_data;
+    uint64_t deadline_us = 0;
+
+    (void) length_to_read;
+
+    if (ctx_udp->rx_offset < ctx_udp->rx_length) {
+        /* The rest of the datagram being read */
+        return 1;
+    }
+
+    if (ctx_udp->rx_length > 0 && !ctx_udp->server) {
+        /* The response was shorter than its function requires */
+        errno = EMBBADDATA;
+        return -1;
+    }
+
+    if (tv != NULL) {
+        deadline_us = _modbus_monotonic_us() + (uint64_t) tv->tv_sec * 1000000 + tv->tv_usec;
+    }
+
+    for (;;) {
+        struct timeval left;
+        int s_rc;
+
+        if (tv != NULL) {
+            uint64_t now_us = _modbus_monotonic_us();
+            uint64_t left_us = now_us < deadline_us ? deadline_us - now_us : 0;
+
+            left.tv_sec = (long) (left_us / 1000000);
+            left.tv_usec = (long) (left_us % 1000000);
+        }
+
+        FD_ZERO(rset);
+        FD_SET(ctx->s, rset);
+        s_rc = select(ctx->s + 1, rset, NULL, NULL, tv != NULL ? &left : NULL);
+        if (s_rc == -1) {
+            if (errno == EINTR) {
+                if (ctx->debug) {
+                    fprintf(stderr, "A non blocked signal was caught\n");
+                }
+                continue;
+            }
+            return -1;
+        }
+
+        if (s_rc == 0) {
+            if (ctx_udp->server || ctx_udp->req_length == 0 || ctx_udp->retries_left == 0) {
+                errno = ETIMEDOUT;
+                return -1;
+            }
+
+            /* Lost request or response, same transaction ID so a late
+               response to the first one is still accepted */
+            ctx_udp->retries_left--;
+            ctx_udp->stats.nb_retransmits++;
+            if (ctx->debug) {
+                fprintf(stderr, "No response, request sent again\n");
+            }
+            ctx->io_stats.nb_send_calls++;
+            if (send_datagram(ctx, ctx_udp->req, ctx_udp->req_length, &ctx_udp->peer) ==
+                -1) {
+                return -1;
+            }
+            deadline_us = _modbus_monotonic_us() +
+                          (uint64_t) ctx->response_timeout.tv_sec * 1000000 +
+                          ctx->response_timeout.tv_usec;
+            continue;
+        }
+
+        if (receive_datagram(ctx)) {
+            return 1;
+        }
+    }
+}
+
+static void _modbus_udp_free(modbus_t *ctx)
+{
+    if (ctx->backend_data) {
+        free(ctx->backend_data);
+    }
+    free(ctx);
+}
+
+// clang-format off
+const modbus_backend_t _modbus_udp_backend = {
+    _MODBUS_BACKEND_TYPE_UDP,
+    _MODBUS_UDP_HEADER_LENGTH,
+    _MODBUS_UDP_CHECKSUM_LENGTH,
+    MODBUS_UDP_MAX_ADU_LENGTH,
+    _modbus_set_slave,
+    _modbus_udp_build_request_basis,
+    _modbus_udp_build_response_basis,
+    _modbus_udp_prepare_response_tid,
+    _modbus_udp_send_msg_pre,
+    _modbus_udp_send,
+    _modbus_udp_receive,
+    _modbus_udp_recv,
+    _modbus_udp_check_integrity,
+    _modbus_udp_pre_check_confirmation,
+    _modbus_udp_connect,
+    _modbus_udp_is_connected,
+    _modbus_udp_close,
+    _modbus_udp_flush,
+    _modbus_udp_select,
+    _modbus_udp_free
+};
+// clang-format on
+
+modbus_t *modbus_new_udp(const char *ip, int port)
+{
+    modbus_t *ctx;
+    modbus_udp_t *ctx_udp;
+    size_t dest_size;
+    size_t ret_size;
+
+    ctx = (modbus_t *) malloc(sizeof(modbus_t));
+    if (ctx == NULL) {
+        return NULL;
+    }
+    _modbus_init_common(ctx);
+
+    /* Could be changed after to reach a remote serial Modbus device */
+    ctx->slave = MODBUS_TCP_SLAVE;
+
+    ctx->backend = &_modbus_udp_backend;
+
+    ctx->backend_data = (modbus_udp_t *) calloc(1, sizeof(modbus_udp_t));
+    if (ctx->backend_data == NULL) {
+        modbus_free(ctx);
+        errno = ENOMEM;
+        return NULL;
+    }
+    ctx_udp = (modbus_udp_t *) ctx->backend_data;
+
+    if (ip != NULL) {
+        dest_size = sizeof(char) * 16;
+        ret_size = strlcpy(ctx_udp->ip, ip, dest_size);
+        if (ret_size == 0) {
+            fprintf(stderr, "The IP string is empty\n");
+            modbus_free(ctx);
+            errno = EINVAL;
+            return NULL;
+        }
+
+        if (ret_size >= dest_size) {
+            fprintf(stderr, "The IP string has been truncated\n");
+            modbus_free(ctx);
+            errno = EINVAL;
+            return NULL;
+        }
+    } else {
+        ctx_udp->ip[0] = '0';
+    }
+    ctx_udp->port = port;
+    ctx_udp->t_id = 0;
+    ctx_udp->nb_retries = MODBUS_UDP_DEFAULT_RETRIES;
+
+    return ctx;
+}
+
+/* Binds the socket to serve the requests with modbus_receive() and
+   modbus_reply(), each response is sent to the sender of the request */
+int modbus_udp_listen(modbus_t *ctx)
+{
+    modbus_udp_t *ctx_udp;
+    struct sockaddr_in addr;
+    int enable;
+    int s;
+
+    if (ctx == NULL || ctx->backend->backend_type != _MODBUS_BACKEND_TYPE_UDP) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    ctx_udp = ctx->backend_data;
+
+#ifdef OS_WIN32
+    if (_modbus_udp_init_win32() == -1) {
+        return -1;
+    }
+#endif
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(ctx_udp->port);
+    if (ctx_udp->ip[0] == '0') {
+        /* Listen any addresses */
+        addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    } else if (inet_pton(AF_INET, ctx_udp->ip, &addr.sin_addr) <= 0) {
+        if (ctx->debug) {
+            fprintf(stderr, "Invalid IP address: %s\n", ctx_udp->ip);
+        }
+        errno = EINVAL;
+        return -1;
+    }
+
+    s = open_socket();
+    if (s < 0) {
+        return -1;
+    }
+
+    enable = 1;
+    if (setsockopt(s, SOL_SOCKET, SO_REUSEADDR, (const char *) &enable, sizeof(enable)) ==
+            -1 ||
+        bind(s, (struct sockaddr *) &addr, sizeof(addr)) == -1) {
+        close(s);
+        return -1;
+    }
+
+    if (ctx->s >= 0) {
+        close(ctx->s);
+    }
+    ctx->s = s;
+    ctx_udp->server = TRUE;
+    ctx_udp->rx_length = 0;
+    ctx_udp->rx_offset = 0;
+
+    return s;
+}
+
+int modbus_udp_set_retries(modbus_t *ctx, int nb_retries)
+{
+    if (ctx == NULL || ctx->backend->backend_type != _MODBUS_BACKEND_TYPE_UDP ||
+        nb_retries < 0) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    ((modbus_udp_t *) ctx->backend_data)->nb_retries = nb_retries;
+    return 0;
+}
+
+int modbus_udp_get_stats(modbus_t *ctx, modbus_udp_stats_t *stats)
+{
+    if (ctx == NULL || ctx->backend->backend_type != _MODBUS_BACKEND_TYPE_UDP ||
+        stats == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    *stats = ((modbus_udp_t *) ctx->backend_data)->stats;
+    return 0;
+}
+
+/* State of a read of a batch */
+typedef struct _udp_transaction {
+    uint8_t req[_MODBUS_UDP_PRESET_REQ_LENGTH];
+    struct sockaddr_in addr;
+    int pending;
+} udp_transaction_t;
+
+typedef struct _udp_burst {
+    uint8_t buf[_MODBUS_UDP_BURST_LENGTH][MODBUS_UDP_MAX_ADU_LENGTH];
+    struct sockaddr_in src[_MODBUS_UDP_BURST_LENGTH];
+    int length[_MODBUS_UDP_BURST_LENGTH];
+} udp_burst_t;
+
+static int wait_socket(int s, int write, uint64_t deadline_us)
+{
+    uint64_t now_us = _modbus_monotonic_us();
+    uint64_t left_us = now_us < deadline_us ? deadline_us - now_us : 0;
+    struct timeval tv;
+    fd_set set;
+    int rc;
+
+    tv.tv_sec = (long) (left_us / 1000000);
+    tv.tv_usec = (long) (left_us % 1000000);
+    FD_ZERO(&set);
+    FD_SET(s, &set);
+    rc = select(s + 1, write ? NULL : &set, write ? &set : NULL, NULL, &tv);
+    if (rc == -1 && errno == EINTR) {
+        rc = 0;
+    }
+
+    return rc;
+}
+
+/* Sends the requests of the pending transactions, up to
+   _MODBUS_UDP_BURST_LENGTH datagrams per system call */
+static int send_pending(modbus_t *ctx,
+                        udp_transaction_t *transactions,
+                        int nb_transactions,
+                        uint64_t deadline_us)
+{
+    int indexes[_MODBUS_UDP_BURST_LENGTH];
+    int i = 0;
+
+    while (i < nb_transactions) {
+        int nb = 0;
+        int sent = 0;
+
+        for (; i < nb_transactions && nb < _MODBUS_UDP_BURST_LENGTH; i++) {
+            if (transactions[i].pending) {
+                indexes[nb++] = i;
+            }
+        }
+
+        while (sent < nb) {
+            int rc;
+#ifdef HAVE_SENDMMSG
+            struct mmsghdr msgs[_MODBUS_UDP_BURST_LENGTH];
+            struct iovec iovs[_MODBUS_UDP_BURST_LENGTH];
+            int j;
+
+            for (j = sent; j < nb; j++) {
+                udp_transaction_t *t = &transactions[indexes[j]];
+
+                iovs[j - sent].iov_base = t->req;
+                iovs[j - sent].iov_len = sizeof(t->req);
+                memset(&msgs[j - sent], 0, sizeof(struct mmsghdr));
+                msgs[j - sent].msg_hdr.msg_name = &t->addr;
+                msgs[j - sent].msg_hdr.msg_namelen = sizeof(t->addr);
+                msgs[j - sent].msg_hdr.msg_iov = &iovs[j - sent];
+                msgs[j - sent].msg_hdr.msg_iovlen = 1;
+            }
+            ctx->io_stats.nb_send_calls++;
+            rc = sendmmsg(ctx->s, msgs, nb - sent, 0);
+#else
+            udp_transaction_t *t = &transactions[indexes[sent]];
+
+            ctx->io_stats.nb_send_calls++;
+            rc = send_datagram(ctx, t->req, sizeof(t->req), &t->addr) == -1 ? -1 : 1;
+#endif
+            if (rc > 0) {
+                sent += rc;
+            } else if (errno == EAGAIN || errno == EWOULDBLOCK || errno == ENOBUFS) {
+                /* Socket buffer full */
+                if (wait_socket(ctx->s, TRUE, deadline_us) <= 0) {
+                    errno = ETIMEDOUT;
+                    return -1;
+                }
+            } else {
+                return -1;
+            }
+        }
+    }
+
+    return 0;
+}
+
+/* Reads the datagrams already received, returns how many */
+static int receive_burst(modbus_t *ctx, udp_burst_t *burst)
+{
+    int nb = 0;
+#ifdef HAVE_SENDMMSG
+    struct mmsghdr msgs[_MODBUS_UDP_BURST_LENGTH];
+    struct iovec iovs[_MODBUS_UDP_BURST_LENGTH];
+    int i;
+
+    for (i = 0; i < _MODBUS_UDP_BURST_LENGTH; i++) {
+        iovs[i].iov_base = burst->buf[i];
+        iovs[i].iov_len = MODBUS_UDP_MAX_ADU_LENGTH;
+        memset(&msgs[i], 0, sizeof(struct mmsghdr));
+        msgs[i].msg_hdr.msg_name = &burst->src[i];
+        msgs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+        msgs[i].msg_hdr.msg_iov = &iovs[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+    ctx->io_stats.nb_recv_calls++;
+    nb = recvmmsg(ctx->s, msgs, _MODBUS_UDP_BURST_LENGTH, MSG_DONTWAIT, NULL);
+    if (nb < 0) {
+        return 0;
+    }
+    for (i = 0; i < nb; i++) {
+        burst->length[i] = msgs[i].msg_len;
+    }
+#else
+    while (nb < _MODBUS_UDP_BURST_LENGTH) {
+        socklen_t src_length = sizeof(struct sockaddr_in);
+        int rc;
+
+        ctx->io_stats.nb_recv_calls++;
+        rc = recvfrom(ctx->s,
+                      (char *) burst->buf[nb],
+                      MODBUS_UDP_MAX_ADU_LENGTH,
+                      0,
+                      (struct sockaddr *) &burst->src[nb],
+                      &src_length);
+        if (rc <= 0) {
+            break;
+        }
+        burst->length[nb++] = rc;
+    }
+#endif
+
+    return nb;
+}
+
+/* Completes the read answered by the datagram, returns TRUE if it did */
+static int complete_read(modbus_udp_read_t *reads,
+                         udp_transaction_t *transactions,
+                         int nb_reads,
+                         uint16_t base_t_id,
+                         const uint8_t *rsp,
+                         int length,
+                         const struct sockaddr_in *src)
+{
+    uint16_t index;
+    modbus_udp_read_t *read;
+    udp_transaction_t *t;
+
+    if (!is_valid_mbap(rsp, length) || length < 9) {
+        return FALSE;
+    }
+
+    /* The transaction IDs of the batch follow each other */
+    index = (uint16_t) (((rsp[0] << 8) | rsp[1]) - base_t_id);
+    if (index >= nb_reads) {
+        return FALSE;
+    }
+
+    read = &reads[index];
+    t = &transactions[index];
+    if (!t->pending || !same_address(src, &t->addr) || rsp[6] != t->req[6]) {
+        return FALSE;
+    }
+
+    if (rsp[7] == (t->req[7] | 0x80)) {
+        read->rc = -1;
+        read->error = MODBUS_ENOBASE + rsp[8];
+    } else if (rsp[7] == t->req[7] && rsp[8] == 2 * read->nb && length == 9 + 2 * read->nb) {
+        modbus_get_registers_from_bytes(read->dest, rsp + 9, read->nb);
+        read->rc = read->nb;
+        read->error = 0;
+    } else {
+        return FALSE;
+    }
+    t->pending = FALSE;
+
+    return TRUE;
+}
+
+/* Reads holding registers of many devices at once: all the requests are sent
+   in a few system calls, then the responses are collected in any order until
+   the response timeout of ctx, the requests still unanswered being sent
+   again up to the number of retries of ctx. ctx must be connected, its
+   socket, transaction IDs and timeouts are used. The result of each read is
+   set in its rc and error fields. Returns the number of successful reads or
+   -1 if the socket failed. */
+int modbus_udp_read_registers_batch(modbus_t *ctx, modbus_udp_read_t *reads, int nb_reads)
+{
+    modbus_udp_t *ctx_udp;
+    udp_transaction_t *transactions;
+    udp_burst_t *burst;
+    uint64_t timeout_us;
+    uint64_t deadline_us;
+    uint16_t base_t_id;
+    int nb_pending = nb_reads;
+    int nb_ok = 0;
+    int failed = FALSE;
+    int retries;
+    int i;
+
+    if (ctx == NULL || ctx->backend->backend_type != _MODBUS_BACKEND_TYPE_UDP ||
+        ctx->s < 0 || reads == NULL || nb_reads <= 0 || nb_reads > UINT16_MAX) {
+        errno = EINVAL;
+        return -1;
+    }
+    ctx_udp = ctx->backend_data;
+
+    for (i = 0; i < nb_reads; i++) {
+        if (reads[i].ip == NULL || reads[i].dest == NULL || reads[i].nb < 1 ||
+            reads[i].nb > MODBUS_MAX_READ_REGISTERS) {
+            errno = EINVAL;
+            return -1;
+        }
+    }
+
+    transactions = (udp_transaction_t *) calloc(nb_reads, sizeof(udp_transaction_t));
+    burst = (udp_burst_t *) malloc(sizeof(udp_burst_t));
+    if (transactions == NULL || burst == NULL) {
+        free(transactions);
+        free(burst);
+        errno = ENOMEM;
+        return -1;
+    }
+
+    base_t_id = (uint16_t) (ctx_udp->t_id + 1);
+    for (i = 0; i < nb_reads; i++) {
+        udp_transaction_t *t = &transactions[i];
+        uint16_t t_id = next_t_id(ctx_udp);
+
+        reads[i].rc = -1;
+        reads[i].error = ETIMEDOUT;
+
+        t->addr.sin_family = AF_INET;
+        t->addr.sin_port = htons(reads[i].port);
+        if (inet_pton(AF_INET, reads[i].ip, &t->addr.sin_addr) <= 0) {
+            reads[i].error = EINVAL;
+            nb_pending--;
+            continue;
+        }
+
+        t->req[0] = t_id >> 8;
+        t->req[1] = t_id & 0x00ff;
+        t->req[2] = 0;
+        t->req[3] = 0;
+        t->req[4] = 0;
+        t->req[5] = 6;
+        t->req[6] = reads[i].slave;
+        t->req[7] = MODBUS_FC_READ_HOLDING_REGISTERS;
+        t->req[8] = reads[i].addr >> 8;
+        t->req[9] = reads[i].addr & 0x00ff;
+        t->req[10] = reads[i].nb >> 8;
+        t->req[11] = reads[i].nb & 0x00ff;
+        t->pending = TRUE;
+    }
+
+    timeout_us =
+        (uint64_t) ctx->response_timeout.tv_sec * 1000000 + ctx->response_timeout.tv_usec;
+    retries = ctx_udp->nb_retries;
+
+    deadline_us = _modbus_monotonic_us() + timeout_us;
+    if (send_pending(ctx, transactions, nb_reads, deadline_us) == -1) {
+        failed = TRUE;
+        goto out;
+    }
+
+    while (nb_pending > 0) {
+        int rc = wait_socket(ctx->s, FALSE, deadline_us);
+        int nb;
+
+        if (rc == -1) {
+            failed = TRUE;
+            goto out;
+        }
+
+        if (rc == 0) {
+            if (retries == 0) {
+                break;
+            }
+            retries--;
+            for (i = 0; i < nb_reads; i++) {
+                ctx_udp->stats.nb_retransmits += transactions[i].pending;
+            }
+            deadline_us = _modbus_monotonic_us() + timeout_us;
+            if (send_pending(ctx, transactions, nb_reads, deadline_us) == -1) {
+                failed = TRUE;
+                goto out;
+            }
+            continue;
+        }
+
+        nb = receive_burst(ctx, burst);
+        for (i = 0; i < nb; i++) {
+            if (complete_read(reads,
+                              transactions,
+                              nb_reads,
+                              base_t_id,
+                              burst->buf[i],
+                              burst->length[i],
+                              &burst->src[i])) {
+                nb_pending--;
+            } else {
+                ctx_udp->stats.nb_dropped++;
+            }
+        }
+    }
+
+out:
+    for (i = 0; i < nb_reads; i++) {
+        nb_ok += reads[i].rc != -1;
+    }
+    free(transactions);
+    free(burst);
+
+    return failed ? -1 : nb_ok;
+}
@@ -0,0 +1,52 @@
+/*
+ * Copyright © Stéphane Raimbault <stephane.raimbault@gmail.com>
+ *
+ * SPDX-License-Identifier: LGPL-2.1-or-later
+ */
+
+#ifndef MODBUS_UDP_H
+#define MODBUS_UDP_H
+
+#include "modbus.h"
+
+MODBUS_BEGIN_DECLS
+
+#define MODBUS_UDP_DEFAULT_PORT 502
+
+/* Same MBAP framing as TCP, one ADU per datagram */
+#define MODBUS_UDP_MAX_ADU_LENGTH 260
+
+/* Number of retransmissions of a request without response, by default */
+#define MODBUS_UDP_DEFAULT_RETRIES 2
+
+typedef struct _modbus_udp_stats {
+    uint32_t nb_retransmits;
+    /* Datagrams of another sender, with an invalid MBAP header or answering an
+       older transaction (e.g. the late response to a retransmitted request) */
+    uint32_t nb_dropped;
+} modbus_udp_stats_t;
+
+/* One read of modbus_udp_read_registers_batch() */
+typedef struct _modbus_udp_read {
+    const char *ip;
+    int port;
+    int slave;
+    int addr;
+    int nb;
+    uint16_t *dest;
+    /* Set by the batch: number of registers read or -1 with the errno value
+       in error */
+    int rc;
+    int error;
+} modbus_udp_read_t;
+
+MODBUS_API modbus_t *modbus_new_udp(const char *ip_address, int port);
+MODBUS_API int modbus_udp_listen(modbus_t *ctx);
+MODBUS_API int modbus_udp_set_retries(modbus_t *ctx, int nb_retries);
+MODBUS_API int modbus_udp_get_stats(modbus_t *ctx, modbus_udp_stats_t *stats);
+MODBUS_API int
+modbus_udp_read_registers_batch(modbus_t *ctx, modbus_udp_read_t *reads, int nb_reads);
+
+MODBUS_END_DECLS
+
+#endif /* MODBUS_UDP_H */
@@ -22,6 +22,11 @@
 
 #include "modbus-private.h"
 #include "modbus.h"
+#include "modbus-thread-private.h"
+
+#ifdef _WIN32
+#include <windows.h>
+#endif
 
 /* Internal use */
 #define MSG_LENGTH_UNDEFINED -1
@@ -184,6 +189,7 @@ static int send_msg(modbus_t *ctx, uint8_t *msg, int msg_length)
     /* In recovery mode, the write command will be issued until to be
        successful! Disabled by default. */
     do {
+        ctx->io_stats.nb_send_calls++;
         rc = ctx->backend->send(ctx, msg, msg_length);
         if (rc == -1) {
             _error_print(ctx, NULL);
@@ -419,7 +425,19 @@ int _modbus_receive_msg(modbus_t *ctx, uint8_t *msg, msg_type_t msg_type)
     }
 
     while (length_to_read != 0) {
-        rc = ctx->backend->select(ctx, &rset, p_tv, length_to_read);
+        if (ctx->batch != NULL && ctx->batch->pending) {
+            /* Found readable after the previous response */
+            ctx->batch->pending = FALSE;
+            rc = 1;
+        } else {
+            /* The batched responses don't wait for the next request */
+            if (ctx->batch != NULL && msg_length == 0 && ctx->batch->length > 0 &&
+                modbus_flush_replies(ctx) == -1) {
+                return -1;
+            }
+            ctx->io_stats.nb_select_calls++;
+            rc = ctx->backend->select(ctx, &rset, p_tv, length_to_read);
+        }
         if (rc == -1) {
             _error_print(ctx, "select");
             if (ctx->error_recovery & MODBUS_ERROR_RECOVERY_LINK) {
@@ -447,6 +465,7 @@ int _modbus_receive_msg(modbus_t *ctx, uint8_t *msg, msg_type_t msg_type)
             return -1;
         }
 
+        ctx->io_stats.nb_recv_calls++;
         rc = ctx->backend->recv(ctx, msg + msg_length, length_to_read);
         if (rc == 0) {
             errno = ECONNRESET;
@@ -780,22 +799,217 @@ static int response_exception(modbus_t *ctx,
     return rsp_length;
 }
 
-/* Send a response to the received request.
-   Analyses the request and constructs a response.
+static size_t mapping_element_size(int table)
+{
+    if (table == MODBUS_TABLE_BITS || table == MODBUS_TABLE_INPUT_BITS)
+        return sizeof(uint8_t);
+    else
+        return sizeof(uint16_t);
+}
 
-   If an error occurs, this function construct the response
-   accordingly.
-*/
-int modbus_reply(modbus_t *ctx,
-                 const uint8_t *req,
-                 int req_length,
-                 modbus_mapping_t *mb_mapping)
+/* Segments of the mappings, one entry per mapping having segments */
+static struct _modbus_mapping_segments *mapping_segments_list = NULL;
+static _modbus_lock_t mapping_segments_lock = _MODBUS_LOCK_INITIALIZER;
+
+/* Returns the segments of the mapping or NULL when it only has the contiguous
+   tables */
+static struct _modbus_mapping_segments *
+mapping_segments(const modbus_mapping_t *mb_mapping)
+{
+    struct _modbus_mapping_segments *ms;
+
+    _modbus_lock(&mapping_segments_lock);
+    ms = mapping_segments_list;
+    while (ms != NULL && ms->mapping != mb_mapping) {
+        ms = ms->next;
+    }
+    _modbus_unlock(&mapping_segments_lock);
+
+    return ms;
+}
+
+/* Returns the index of the segment holding addr. Otherwise it returns
+   -(i + 1) where i is the index at which a segment starting at addr would be
+   inserted. */
+static int
+mapping_find_segment(const struct _modbus_mapping_segments *ms, int table, int addr)
+{
+    const modbus_segment_t *segments = ms->segments[table];
+    int low = 0;
+    int high = ms->nb_segments[table] - 1;
+
+    while (low <= high) {
+        int mid = (low + high) / 2;
+
+        if (addr < segments[mid].start) {
+            high = mid - 1;
+        } else if (addr >= segments[mid].start + segments[mid].nb) {
+            low = mid + 1;
+        } else {
+            return mid;
+        }
+    }
+
+    return -(low + 1);
+}
+
+/* Returns the contiguous table of the mapping with its start address and its
+   number of values */
+static uint8_t *
+mapping_contiguous(modbus_mapping_t *mb_mapping, int table, int *start, int *count)
+{
+    switch (table) {
+    case MODBUS_TABLE_BITS:
+        *start = mb_mapping->start_bits;
+        *count = mb_mapping->nb_bits;
+        return mb_mapping->tab_bits;
+    case MODBUS_TABLE_INPUT_BITS:
+        *start = mb_mapping->start_input_bits;
+        *count = mb_mapping->nb_input_bits;
+        return mb_mapping->tab_input_bits;
+    case MODBUS_TABLE_REGISTERS:
+        *start = mb_mapping->start_registers;
+        *count = mb_mapping->nb_registers;
+        return (uint8_t *) mb_mapping->tab_registers;
+    default:
+        *start = mb_mapping->start_input_registers;
+        *count = mb_mapping->nb_input_registers;
+        return (uint8_t *) mb_mapping->tab_input_registers;
+    }
+}
+
+/* Returns the storage of the nb values starting at addr in the table or NULL
+   if the range isn't entirely mapped. Segments are looked up first, then the
+   contiguous table of the mapping. */
+static void *mapping_resolve(modbus_mapping_t *mb_mapping, int table, int addr, int nb)
+{
+    const size_t size = mapping_element_size(table);
+    const struct _modbus_mapping_segments *ms = mapping_segments(mb_mapping);
+    int start;
+    int count;
+    uint8_t *tab;
+    int mapping_address;
+
+    if (ms != NULL) {
+        int i = mapping_find_segment(ms, table, addr);
+
+        if (i >= 0) {
+            const modbus_segment_t *segment = &ms->segments[table][i];
+
+            if (segment->tab == NULL || addr + nb > segment->start + segment->nb) {
+                /* Served by handlers or crosses the end of the segment */
+                return NULL;
+            }
+            return (uint8_t *) segment->tab + (addr - segment->start) * size;
+        }
+
+        /* Starts in a hole, it must not reach the next segment */
+        i = -i - 1;
+        if (i < ms->nb_segments[table] && addr + nb > ms->segments[table][i].start) {
+            return NULL;
+        }
+    }
+
+    tab = mapping_contiguous(mb_mapping, table, &start, &count);
+
+    /* The mapping can be shifted to reduce memory consumption and it
+       doesn't always start at address zero. */
+    mapping_address = addr - start;
+    if (tab == NULL || mapping_address < 0 || (mapping_address + nb) > count) {
+        return NULL;
+    }
+
+    return tab + mapping_address * size;
+}
+
+/* Returns the handler segment holding the nb values starting at addr or NULL */
+static const modbus_segment_t *
+mapping_find_handler(modbus_mapping_t *mb_mapping, int table, int addr, int nb)
+{
+    const struct _modbus_mapping_segments *ms = mapping_segments(mb_mapping);
+    const modbus_segment_t *segment;
+    int i;
+
+    if (ms == NULL) {
+        return NULL;
+    }
+
+    i = mapping_find_segment(ms, table, addr);
+    if (i < 0) {
+        return NULL;
+    }
+
+    segment = &ms->segments[table][i];
+    if (segment->tab != NULL || addr + nb > segment->start + segment->nb) {
+        return NULL;
+    }
+
+    return segment;
+}
+
+/* Handlers return a Modbus exception code, anything else is a server failure */
+static int handler_exception_code(int rc)
+{
+    if (rc > 0 && rc < MODBUS_EXCEPTION_MAX) {
+        return rc;
+    } else {
+        return MODBUS_EXCEPTION_SLAVE_OR_SERVER_FAILURE;
+    }
+}
+
+/* Returns TRUE when the next request is already readable. The result is kept
+   so the next receive doesn't check it again: a batched response costs this
+   select instead of a send. */
+static int indication_pending(modbus_t *ctx)
+{
+    fd_set rset;
+    struct timeval tv;
+
+    FD_ZERO(&rset);
+    FD_SET(ctx->s, &rset);
+    tv.tv_sec = 0;
+    tv.tv_usec = 0;
+
+    ctx->io_stats.nb_select_calls++;
+    ctx->batch->pending = ctx->backend->select(ctx, &rset, &tv, 1) > 0;
+    return ctx->batch->pending;
+}
+
+/* Appends the response built in the output buffer. The buffer is sent when
+   no other request of the burst is waiting to be answered. */
+static int batch_msg(modbus_t *ctx, uint8_t *msg, int msg_length)
+{
+    int i;
+
+    msg_length = ctx->backend->send_msg_pre(msg, msg_length);
+
+    if (ctx->debug) {
+        for (i = 0; i < msg_length; i++)
+            printf("[%.2X]", msg[i]);
+        printf("\n");
+    }
+
+    ctx->batch->length += msg_length;
+    if (!indication_pending(ctx) && modbus_flush_replies(ctx) == -1) {
+        return -1;
+    }
+
+    return msg_length;
+}
+
+/* Counts the request and its outcome in stats when not NULL */
+static int _modbus_reply(modbus_t *ctx,
+                         const uint8_t *req,
+                         int req_length,
+                         modbus_mapping_t *mb_mapping,
+                         modbus_unit_stats_t *stats)
 {
     unsigned int offset;
     int slave;
     int function;
     uint16_t address;
-    uint8_t rsp[MAX_MESSAGE_LENGTH];
+    uint8_t rsp_buf[MAX_MESSAGE_LENGTH];
+    uint8_t *rsp = rsp_buf;
     int rsp_length = 0;
     sft_t sft;
 
@@ -804,6 +1018,15 @@ int modbus_reply(modbus_t *ctx,
         return -1;
     }
 
+    if (ctx->batch != NULL) {
+        /* The response is encoded straight into the output buffer */
+        if (ctx->batch->size - ctx->batch->length < MAX_MESSAGE_LENGTH &&
+            modbus_flush_replies(ctx) == -1) {
+            return -1;
+        }
+        rsp = ctx->batch->buf + ctx->batch->length;
+    }
+
     offset = ctx->backend->header_length;
     slave = req[offset - 1];
     function = req[offset];
@@ -818,14 +1041,14 @@ int modbus_reply(modbus_t *ctx,
     case MODBUS_FC_READ_COILS:
     case MODBUS_FC_READ_DISCRETE_INPUTS: {
         unsigned int is_input = (function == MODBUS_FC_READ_DISCRETE_INPUTS);
-        int start_bits = is_input ? mb_mapping->start_input_bits : mb_mapping->start_bits;
-        int nb_bits = is_input ? mb_mapping->nb_input_bits : mb_mapping->nb_bits;
-        uint8_t *tab_bits = is_input ? mb_mapping->tab_input_bits : mb_mapping->tab_bits;
+        int table = is_input ? MODBUS_TABLE_INPUT_BITS : MODBUS_TABLE_BITS;
         const char *const name = is_input ? "read_input_bits" : "read_bits";
         int nb = (req[offset + 3] << 8) + req[offset + 4];
-        /* The mapping can be shifted to reduce memory consumption and it
-           doesn't always start at address zero. */
-        int mapping_address = address - start_bits;
+        uint8_t *tab_bits = NULL;
+
+        if (nb >= 1 && nb <= MODBUS_MAX_READ_BITS) {
+            tab_bits = mapping_resolve(mb_mapping, table, address, nb);
+        }
 
         if (nb < 1 || MODBUS_MAX_READ_BITS < nb) {
             rsp_length = response_exception(ctx,
@@ -837,36 +1060,36 @@ int modbus_reply(modbus_t *ctx,
                                             nb,
                                             name,
                                             MODBUS_MAX_READ_BITS);
-        } else if (mapping_address < 0 || (mapping_address + nb) > nb_bits) {
+        } else if (tab_bits == NULL) {
             rsp_length = response_exception(ctx,
                                             &sft,
                                             MODBUS_EXCEPTION_ILLEGAL_DATA_ADDRESS,
                                             rsp,
                                             FALSE,
                                             "Illegal data address 0x%0X in %s\n",
-                                            mapping_address < 0 ? address : address + nb,
+                                            address,
                                             name);
         } else {
             rsp_length = ctx->backend->build_response_basis(&sft, rsp);
             rsp[rsp_length++] = (nb / 8) + ((nb % 8) ? 1 : 0);
-            rsp_length =
-                response_io_status(tab_bits, mapping_address, nb, rsp, rsp_length);
+            rsp_length = response_io_status(tab_bits, 0, nb, rsp, rsp_length);
         }
     } break;
     case MODBUS_FC_READ_HOLDING_REGISTERS:
     case MODBUS_FC_READ_INPUT_REGISTERS: {
         unsigned int is_input = (function == MODBUS_FC_READ_INPUT_REGISTERS);
-        int start_registers =
-            is_input ? mb_mapping->start_input_registers : mb_mapping->start_registers;
-        int nb_registers =
-            is_input ? mb_mapping->nb_input_registers : mb_mapping->nb_registers;
-        uint16_t *tab_registers =
-            is_input ? mb_mapping->tab_input_registers : mb_mapping->tab_registers;
+        int table = is_input ? MODBUS_TABLE_INPUT_REGISTERS : MODBUS_TABLE_REGISTERS;
         const char *const name = is_input ? "read_input_registers" : "read_registers";
         int nb = (req[offset + 3] << 8) + req[offset + 4];
-        /* The mapping can be shifted to reduce memory consumption and it
-           doesn't always start at address zero. */
-        int mapping_address = address - start_registers;
+        uint16_t *tab_registers = NULL;
+        const modbus_segment_t *handler = NULL;
+
+        if (nb >= 1 && nb <= MODBUS_MAX_READ_REGISTERS) {
+            tab_registers = mapping_resolve(mb_mapping, table, address, nb);
+            if (tab_registers == NULL) {
+                handler = mapping_find_handler(mb_mapping, table, address, nb);
+            }
+        }
 
         if (nb < 1 || MODBUS_MAX_READ_REGISTERS < nb) {
             rsp_length = response_exception(ctx,
@@ -878,30 +1101,51 @@ int modbus_reply(modbus_t *ctx,
                                             nb,
                                             name,
                                             MODBUS_MAX_READ_REGISTERS);
-        } else if (mapping_address < 0 || (mapping_address + nb) > nb_registers) {
+        } else if (tab_registers == NULL &&
+                   (handler == NULL || handler->read_handler == NULL)) {
             rsp_length = response_exception(ctx,
                                             &sft,
                                             MODBUS_EXCEPTION_ILLEGAL_DATA_ADDRESS,
                                             rsp,
                                             FALSE,
                                             "Illegal data address 0x%0X in %s\n",
-                                            mapping_address < 0 ? address : address + nb,
+                                            address,
                                             name);
+        } else if (handler != NULL) {
+            int rc;
+
+            rsp_length = ctx->backend->build_response_basis(&sft, rsp);
+            rsp[rsp_length++] = nb << 1;
+            /* The values are computed straight into the response */
+            rc = handler->read_handler(handler->user_data, address, nb, rsp + rsp_length);
+            if (rc == 0) {
+                rsp_length += nb << 1;
+            } else {
+                rsp_length = response_exception(ctx,
+                                                &sft,
+                                                handler_exception_code(rc),
+                                                rsp,
+                                                FALSE,
+                                                "Handler error %d at address 0x%0X in %s\n",
+                                                rc,
+                                                address,
+                                                name);
+            }
         } else {
             int i;
 
             rsp_length = ctx->backend->build_response_basis(&sft, rsp);
             rsp[rsp_length++] = nb << 1;
-            for (i = mapping_address; i < mapping_address + nb; i++) {
+            for (i = 0; i < nb; i++) {
                 rsp[rsp_length++] = tab_registers[i] >> 8;
                 rsp[rsp_length++] = tab_registers[i] & 0xFF;
             }
         }
     } break;
     case MODBUS_FC_WRITE_SINGLE_COIL: {
-        int mapping_address = address - mb_mapping->start_bits;
+        uint8_t *tab_bits = mapping_resolve(mb_mapping, MODBUS_TABLE_BITS, address, 1);
 
-        if (mapping_address < 0 || mapping_address >= mb_mapping->nb_bits) {
+        if (tab_bits == NULL) {
             rsp_length = response_exception(ctx,
                                             &sft,
                                             MODBUS_EXCEPTION_ILLEGAL_DATA_ADDRESS,
@@ -913,7 +1157,7 @@ int modbus_reply(modbus_t *ctx,
             int data = (req[offset + 3] << 8) + req[offset + 4];
 
             if (data == 0xFF00 || data == 0x0) {
-                mb_mapping->tab_bits[mapping_address] = data ? ON : OFF;
+                *tab_bits = data ? ON : OFF;
                 memcpy(rsp, req, req_length);
                 rsp_length = req_length;
             } else {
@@ -930,9 +1174,14 @@ int modbus_reply(modbus_t *ctx,
         }
     } break;
     case MODBUS_FC_WRITE_SINGLE_REGISTER: {
-        int mapping_address = address - mb_mapping->start_registers;
+        uint16_t *tab_registers =
+            mapping_resolve(mb_mapping, MODBUS_TABLE_REGISTERS, address, 1);
+        const modbus_segment_t *handler =
+            tab_registers == NULL
+                ? mapping_find_handler(mb_mapping, MODBUS_TABLE_REGISTERS, address, 1)
+                : NULL;
 
-        if (mapping_address < 0 || mapping_address >= mb_mapping->nb_registers) {
+        if (tab_registers == NULL && (handler == NULL || handler->write_handler == NULL)) {
             rsp_length =
                 response_exception(ctx,
                                    &sft,
@@ -941,10 +1190,27 @@ int modbus_reply(modbus_t *ctx,
                                    FALSE,
                                    "Illegal data address 0x%0X in write_register\n",
                                    address);
+        } else if (handler != NULL) {
+            int rc = handler->write_handler(handler->user_data, address, 1, &req[offset + 3]);
+
+            if (rc == 0) {
+                memcpy(rsp, req, req_length);
+                rsp_length = req_length;
+            } else {
+                rsp_length = response_exception(
+                    ctx,
+                    &sft,
+                    handler_exception_code(rc),
+                    rsp,
+                    FALSE,
+                    "Handler error %d at address 0x%0X in write_register\n",
+                    rc,
+                    address);
+            }
         } else {
             int data = (req[offset + 3] << 8) + req[offset + 4];
 
-            mb_mapping->tab_registers[mapping_address] = data;
+            *tab_registers = data;
             memcpy(rsp, req, req_length);
             rsp_length = req_length;
         }
@@ -952,7 +1218,11 @@ int modbus_reply(modbus_t *ctx,
     case MODBUS_FC_WRITE_MULTIPLE_COILS: {
         int nb = (req[offset + 3] << 8) + req[offset + 4];
         int nb_bits = req[offset + 5];
-        int mapping_address = address - mb_mapping->start_bits;
+        uint8_t *tab_bits = NULL;
+
+        if (nb >= 1 && nb <= MODBUS_MAX_WRITE_BITS) {
+            tab_bits = mapping_resolve(mb_mapping, MODBUS_TABLE_BITS, address, nb);
+        }
 
         if (nb < 1 || MODBUS_MAX_WRITE_BITS < nb || nb_bits * 8 < nb) {
             /* May be the indication has been truncated on reading because of
@@ -967,18 +1237,17 @@ int modbus_reply(modbus_t *ctx,
                                    "Illegal number of values %d in write_bits (max %d)\n",
                                    nb,
                                    MODBUS_MAX_WRITE_BITS);
-        } else if (mapping_address < 0 || (mapping_address + nb) > mb_mapping->nb_bits) {
+        } else if (tab_bits == NULL) {
             rsp_length = response_exception(ctx,
                                             &sft,
                                             MODBUS_EXCEPTION_ILLEGAL_DATA_ADDRESS,
                                             rsp,
                                             FALSE,
                                             "Illegal data address 0x%0X in write_bits\n",
-                                            mapping_address < 0 ? address : address + nb);
+                                            address);
         } else {
             /* 6 = byte count */
-            modbus_set_bits_from_bytes(
-                mb_mapping->tab_bits, mapping_address, nb, &req[offset + 6]);
+            modbus_set_bits_from_bytes(tab_bits, 0, nb, &req[offset + 6]);
 
             rsp_length = ctx->backend->build_response_basis(&sft, rsp);
             /* 4 to copy the bit address (2) and the quantity of bits */
@@ -989,7 +1258,17 @@ int modbus_reply(modbus_t *ctx,
     case MODBUS_FC_WRITE_MULTIPLE_REGISTERS: {
         int nb = (req[offset + 3] << 8) + req[offset + 4];
         int nb_bytes = req[offset + 5];
-        int mapping_address = address - mb_mapping->start_registers;
+        uint16_t *tab_registers = NULL;
+        const modbus_segment_t *handler = NULL;
+
+        if (nb >= 1 && nb <= MODBUS_MAX_WRITE_REGISTERS) {
+            tab_registers =
+                mapping_resolve(mb_mapping, MODBUS_TABLE_REGISTERS, address, nb);
+            if (tab_registers == NULL) {
+                handler =
+                    mapping_find_handler(mb_mapping, MODBUS_TABLE_REGISTERS, address, nb);
+            }
+        }
 
         if (nb < 1 || MODBUS_MAX_WRITE_REGISTERS < nb || nb_bytes != nb * 2) {
             rsp_length = response_exception(
@@ -1001,8 +1280,8 @@ int modbus_reply(modbus_t *ctx,
                 "Illegal number of values %d in write_registers (max %d)\n",
                 nb,
                 MODBUS_MAX_WRITE_REGISTERS);
-        } else if (mapping_address < 0 ||
-                   (mapping_address + nb) > mb_mapping->nb_registers) {
+        } else if (tab_registers == NULL &&
+                   (handler == NULL || handler->write_handler == NULL)) {
             rsp_length =
                 response_exception(ctx,
                                    &sft,
@@ -1010,13 +1289,32 @@ int modbus_reply(modbus_t *ctx,
                                    rsp,
                                    FALSE,
                                    "Illegal data address 0x%0X in write_registers\n",
-                                   mapping_address < 0 ? address : address + nb);
+                                   address);
+        } else if (handler != NULL) {
+            /* 6 = first value */
+            int rc =
+                handler->write_handler(handler->user_data, address, nb, &req[offset + 6]);
+
+            if (rc == 0) {
+                rsp_length = ctx->backend->build_response_basis(&sft, rsp);
+                memcpy(rsp + rsp_length, req + rsp_length, 4);
+                rsp_length += 4;
+            } else {
+                rsp_length = response_exception(
+                    ctx,
+                    &sft,
+                    handler_exception_code(rc),
+                    rsp,
+                    FALSE,
+                    "Handler error %d at address 0x%0X in write_registers\n",
+                    rc,
+                    address);
+            }
         } else {
             int i, j;
-            for (i = mapping_address, j = 6; i < mapping_address + nb; i++, j += 2) {
+            for (i = 0, j = 6; i < nb; i++, j += 2) {
                 /* 6 and 7 = first value */
-                mb_mapping->tab_registers[i] =
-                    (req[offset + j] << 8) + req[offset + j + 1];
+                tab_registers[i] = (req[offset + j] << 8) + req[offset + j + 1];
             }
 
             rsp_length = ctx->backend->build_response_basis(&sft, rsp);
@@ -1045,13 +1343,24 @@ int modbus_reply(modbus_t *ctx,
         if (ctx->debug) {
             fprintf(stderr, "FIXME Not implemented\n");
         }
+        /* No response, the batched ones don't wait for it */
+        if (modbus_flush_replies(ctx) == -1) {
+            return -1;
+        }
         errno = ENOPROTOOPT;
         return -1;
         break;
     case MODBUS_FC_MASK_WRITE_REGISTER: {
-        int mapping_address = address - mb_mapping->start_registers;
-
-        if (mapping_address < 0 || mapping_address >= mb_mapping->nb_registers) {
+        uint16_t *tab_registers =
+            mapping_resolve(mb_mapping, MODBUS_TABLE_REGISTERS, address, 1);
+        const modbus_segment_t *handler =
+            tab_registers == NULL
+                ? mapping_find_handler(mb_mapping, MODBUS_TABLE_REGISTERS, address, 1)
+                : NULL;
+
+        if (tab_registers == NULL &&
+            (handler == NULL || handler->read_handler == NULL ||
+             handler->write_handler == NULL)) {
             rsp_length =
                 response_exception(ctx,
                                    &sft,
@@ -1061,14 +1370,45 @@ int modbus_reply(modbus_t *ctx,
                                    "Illegal data address 0x%0X in write_register\n",
                                    address);
         } else {
-            uint16_t data = mb_mapping->tab_registers[mapping_address];
+            uint16_t data;
             uint16_t and = (req[offset + 3] << 8) + req[offset + 4];
             uint16_t or = (req[offset + 5] << 8) + req[offset + 6];
+            uint8_t value[2];
+            int rc = 0;
+
+            if (handler != NULL) {
+                rc = handler->read_handler(handler->user_data, address, 1, value);
+                data = (value[0] << 8) + value[1];
+            } else {
+                data = *tab_registers;
+            }
 
             data = (data & and) | (or &(~and) );
-            mb_mapping->tab_registers[mapping_address] = data;
-            memcpy(rsp, req, req_length);
-            rsp_length = req_length;
+
+            if (handler != NULL) {
+                if (rc == 0) {
+                    value[0] = data >> 8;
+                    value[1] = data & 0xFF;
+                    rc = handler->write_handler(handler->user_data, address, 1, value);
+                }
+            } else {
+                *tab_registers = data;
+            }
+
+            if (rc == 0) {
+                memcpy(rsp, req, req_length);
+                rsp_length = req_length;
+            } else {
+                rsp_length =
+                    response_exception(ctx,
+                                       &sft,
+                                       handler_exception_code(rc),
+                                       rsp,
+                                       FALSE,
+                                       "Handler error %d at address 0x%0X in mask_write\n",
+                                       rc,
+                                       address);
+            }
         }
     } break;
     case MODBUS_FC_WRITE_AND_READ_REGISTERS: {
@@ -1076,8 +1416,26 @@ int modbus_reply(modbus_t *ctx,
         uint16_t address_write = (req[offset + 5] << 8) + req[offset + 6];
         int nb_write = (req[offset + 7] << 8) + req[offset + 8];
         int nb_write_bytes = req[offset + 9];
-        int mapping_address = address - mb_mapping->start_registers;
-        int mapping_address_write = address_write - mb_mapping->start_registers;
+        uint16_t *tab_registers = NULL;
+        uint16_t *tab_registers_write = NULL;
+        const modbus_segment_t *handler = NULL;
+        const modbus_segment_t *handler_write = NULL;
+
+        if (nb >= 1 && nb <= MODBUS_MAX_WR_READ_REGISTERS && nb_write >= 1 &&
+            nb_write <= MODBUS_MAX_WR_WRITE_REGISTERS) {
+            tab_registers =
+                mapping_resolve(mb_mapping, MODBUS_TABLE_REGISTERS, address, nb);
+            if (tab_registers == NULL) {
+                handler =
+                    mapping_find_handler(mb_mapping, MODBUS_TABLE_REGISTERS, address, nb);
+            }
+            tab_registers_write = mapping_resolve(
+                mb_mapping, MODBUS_TABLE_REGISTERS, address_write, nb_write);
+            if (tab_registers_write == NULL) {
+                handler_write = mapping_find_handler(
+                    mb_mapping, MODBUS_TABLE_REGISTERS, address_write, nb_write);
+            }
+        }
 
         if (nb_write < 1 || MODBUS_MAX_WR_WRITE_REGISTERS < nb_write || nb < 1 ||
             MODBUS_MAX_WR_READ_REGISTERS < nb || nb_write_bytes != nb_write * 2) {
@@ -1093,10 +1451,10 @@ int modbus_reply(modbus_t *ctx,
                 nb,
                 MODBUS_MAX_WR_WRITE_REGISTERS,
                 MODBUS_MAX_WR_READ_REGISTERS);
-        } else if (mapping_address < 0 ||
-                   (mapping_address + nb) > mb_mapping->nb_registers ||
-                   mapping_address_write < 0 ||
-                   (mapping_address_write + nb_write) > mb_mapping->nb_registers) {
+        } else if ((tab_registers == NULL &&
+                    (handler == NULL || handler->read_handler == NULL)) ||
+                   (tab_registers_write == NULL &&
+                    (handler_write == NULL || handler_write->write_handler == NULL))) {
             rsp_length = response_exception(
                 ctx,
                 &sft,
@@ -1105,25 +1463,49 @@ int modbus_reply(modbus_t *ctx,
                 FALSE,
                 "Illegal data read address 0x%0X or write address 0x%0X "
                 "write_and_read_registers\n",
-                mapping_address < 0 ? address : address + nb,
-                mapping_address_write < 0 ? address_write : address_write + nb_write);
+                address,
+                address_write);
         } else {
             int i, j;
+            int rc = 0;
             rsp_length = ctx->backend->build_response_basis(&sft, rsp);
             rsp[rsp_length++] = nb << 1;
 
             /* Write first.
                10 and 11 are the offset of the first values to write */
-            for (i = mapping_address_write, j = 10; i < mapping_address_write + nb_write;
-                 i++, j += 2) {
-                mb_mapping->tab_registers[i] =
-                    (req[offset + j] << 8) + req[offset + j + 1];
+            if (handler_write != NULL) {
+                rc = handler_write->write_handler(
+                    handler_write->user_data, address_write, nb_write, &req[offset + 10]);
+            } else {
+                for (i = 0, j = 10; i < nb_write; i++, j += 2) {
+                    tab_registers_write[i] =
+                        (req[offset + j] << 8) + req[offset + j + 1];
+                }
             }
 
             /* and read the data for the response */
-            for (i = mapping_address; i < mapping_address + nb; i++) {
-                rsp[rsp_length++] = mb_mapping->tab_registers[i] >> 8;
-                rsp[rsp_length++] = mb_mapping->tab_registers[i] & 0xFF;
+            if (rc != 0) {
+                /* Write failed */
+            } else if (handler != NULL) {
+                rc = handler->read_handler(
+                    handler->user_data, address, nb, rsp + rsp_length);
+                rsp_length += nb << 1;
+            } else {
+                for (i = 0; i < nb; i++) {
+                    rsp[rsp_length++] = tab_registers[i] >> 8;
+                    rsp[rsp_length++] = tab_registers[i] & 0xFF;
+                }
+            }
+
+            if (rc != 0) {
+                rsp_length = response_exception(
+                    ctx,
+                    &sft,
+                    handler_exception_code(rc),
+                    rsp,
+                    FALSE,
+                    "Handler error %d in write_and_read_registers\n",
+                    rc);
             }
         }
     } break;
@@ -1139,6 +1521,13 @@ int modbus_reply(modbus_t *ctx,
         break;
     }
 
+    if (stats != NULL) {
+        stats->nb_requests++;
+        if (sft.function & 0x80) {
+            stats->nb_exceptions++;
+        }
+    }
+
     /* Suppress any responses in RTU when the request was a broadcast, excepted when quirk
      * is enabled. */
     if (ctx->backend->backend_type == _MODBUS_BACKEND_TYPE_RTU &&
@@ -1146,9 +1535,61 @@ int modbus_reply(modbus_t *ctx,
         !(ctx->quirks & MODBUS_QUIRK_REPLY_TO_BROADCAST)) {
         return 0;
     }
+
+    ctx->io_stats.nb_replies++;
+    if (ctx->batch != NULL) {
+        return batch_msg(ctx, rsp, rsp_length);
+    }
     return send_msg(ctx, rsp, rsp_length);
 }
 
+/* Send a response to the received request.
+   Analyses the request and constructs a response.
+
+   If an error occurs, this function construct the response
+   accordingly.
+*/
+int modbus_reply(modbus_t *ctx,
+                 const uint8_t *req,
+                 int req_length,
+                 modbus_mapping_t *mb_mapping)
+{
+    return _modbus_reply(ctx, req, req_length, mb_mapping, NULL);
+}
+
+/* Same as modbus_reply() with the mapping of the unit identifier of the
+   request, so one server answers for many slaves. A unit without mapping is
+   answered with a gateway target exception in TCP and ignored in RTU (the RTU
+   backend only receives the indications for the slave of the context). */
+int modbus_reply_unit(modbus_t *ctx,
+                      const uint8_t *req,
+                      int req_length,
+                      modbus_unit_table_t *units)
+{
+    int unit_id;
+
+    if (ctx == NULL || units == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    unit_id = req[ctx->backend->header_length - 1];
+    if (units->mappings[unit_id] == NULL) {
+        units->stats[unit_id].nb_requests++;
+        units->stats[unit_id].nb_exceptions++;
+        if (ctx->debug) {
+            fprintf(stderr, "No mapping for unit %d\n", unit_id);
+        }
+        if (ctx->backend->backend_type == _MODBUS_BACKEND_TYPE_RTU) {
+            return 0;
+        }
+        return modbus_reply_exception(ctx, req, MODBUS_EXCEPTION_GATEWAY_TARGET);
+    }
+
+    return _modbus_reply(
+        ctx, req, req_length, units->mappings[unit_id], &units->stats[unit_id]);
+}
+
 int modbus_reply_exception(modbus_t *ctx, const uint8_t *req, unsigned int exception_code)
 {
     unsigned int offset;
@@ -1176,6 +1617,10 @@ int modbus_reply_exception(modbus_t *ctx, const uint8_t *req, unsigned int excep
     /* Positive exception code */
     if (exception_code < MODBUS_EXCEPTION_MAX) {
         rsp[rsp_length++] = exception_code;
+        /* Keeps the order of the responses */
+        if (modbus_flush_replies(ctx) == -1) {
+            return -1;
+        }
         return send_msg(ctx, rsp, rsp_length);
     } else {
         errno = EINVAL;
@@ -1285,13 +1730,13 @@ int modbus_read_input_bits(modbus_t *ctx, int addr, int nb, uint8_t *dest)
         return nb;
 }
 
-/* Reads the data from a remote device and put that data into an array */
-static int read_registers(modbus_t *ctx, int function, int addr, int nb, uint16_t *dest)
+/* Sends the request and leaves the validated response in rsp, the registers
+   start at rsp + header_length + 2. Returns the number of registers. */
+static int read_registers_raw(modbus_t *ctx, int function, int addr, int nb, uint8_t *rsp)
 {
     int rc;
     int req_length;
     uint8_t req[_MIN_REQ_LENGTH];
-    uint8_t rsp[MAX_MESSAGE_LENGTH];
 
     if (nb > MODBUS_MAX_READ_REGISTERS) {
         if (ctx->debug) {
@@ -1308,25 +1753,53 @@ static int read_registers(modbus_t *ctx, int function, int addr, int nb, uint16_
 
     rc = send_msg(ctx, req, req_length);
     if (rc > 0) {
-        unsigned int offset;
-        int i;
-
         rc = _modbus_receive_msg(ctx, rsp, MSG_CONFIRMATION);
         if (rc == -1)
             return -1;
 
         rc = check_confirmation(ctx, req, rsp, rc);
-        if (rc == -1)
-            return -1;
+    }
 
-        offset = ctx->backend->header_length;
+    return rc;
+}
 
-        for (i = 0; i < rc; i++) {
-            /* shift reg hi_byte to temp OR with lo_byte */
-            dest[i] = (rsp[offset + 2 + (i << 1)] << 8) | rsp[offset + 3 + (i << 1)];
-        }
+/* Reads the data from a remote device and put that data into an array */
+static int read_registers(modbus_t *ctx, int function, int addr, int nb, uint16_t *dest)
+{
+    int rc;
+    uint8_t rsp[MAX_MESSAGE_LENGTH];
+
+    rc = read_registers_raw(ctx, function, addr, nb, rsp);
+    if (rc > 0) {
+        modbus_get_registers_from_bytes(dest, rsp + ctx->backend->header_length + 2, rc);
+    }
+
+    return rc;
+}
+
+/* Reads the registers without copying nor converting them, view points to
+   the response in the context and is valid until its next view read */
+static int read_registers_view(
+    modbus_t *ctx, int function, int addr, int nb, modbus_register_view_t *view)
+{
+    int rc;
+
+    if (ctx == NULL || view == NULL) {
+        errno = EINVAL;
+        return -1;
     }
 
+    rc = read_registers_raw(ctx, function, addr, nb, ctx->view_rsp);
+    if (rc == -1) {
+        view->data = NULL;
+        view->nb = 0;
+        return -1;
+    }
+
+    view->data = ctx->view_rsp + ctx->backend->header_length + 2;
+    view->addr = addr;
+    view->nb = rc;
+
     return rc;
 }
 
@@ -1382,6 +1855,22 @@ int modbus_read_input_registers(modbus_t *ctx, int addr, int nb, uint16_t *dest)
     return status;
 }
 
+int modbus_read_registers_view(modbus_t *ctx,
+                               int addr,
+                               int nb,
+                               modbus_register_view_t *view)
+{
+    return read_registers_view(ctx, MODBUS_FC_READ_HOLDING_REGISTERS, addr, nb, view);
+}
+
+int modbus_read_input_registers_view(modbus_t *ctx,
+                                     int addr,
+                                     int nb,
+                                     modbus_register_view_t *view)
+{
+    return read_registers_view(ctx, MODBUS_FC_READ_INPUT_REGISTERS, addr, nb, view);
+}
+
 /* Write a value to the specified register of the remote device.
    Used by write_bit and write_register */
 static int write_single(modbus_t *ctx, int function, int addr, const uint16_t value)
@@ -1656,10 +2145,7 @@ int modbus_write_and_read_registers(modbus_t *ctx,
             return -1;
 
         offset = ctx->backend->header_length;
-        for (i = 0; i < rc; i++) {
-            /* shift reg hi_byte to temp OR with lo_byte */
-            dest[i] = (rsp[offset + 2 + (i << 1)] << 8) | rsp[offset + 3 + (i << 1)];
-        }
+        modbus_get_registers_from_bytes(dest, rsp + offset + 2, rc);
     }
 
     return rc;
@@ -1710,6 +2196,83 @@ int modbus_report_slave_id(modbus_t *ctx, int max_dest, uint8_t *dest)
     return rc;
 }
 
+/* Microseconds of a monotonic clock, for the delays which must not follow the
+   changes of the wall clock */
+uint64_t _modbus_monotonic_us(void)
+{
+#ifdef _WIN32
+    static LARGE_INTEGER frequency;
+    LARGE_INTEGER counter;
+
+    if (frequency.QuadPart == 0) {
+        QueryPerformanceFrequency(&frequency);
+    }
+    QueryPerformanceCounter(&counter);
+    return (uint64_t) (counter.QuadPart / frequency.QuadPart) * 1000000 +
+           (uint64_t) (counter.QuadPart % frequency.QuadPart) * 1000000 /
+               frequency.QuadPart;
+#else
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+#endif
+}
+
+/* The waits spin on the clock for the last microseconds before the deadline,
+   a sleep doesn't wake up closer than that */
+#define _MODBUS_WAIT_SPIN_US 100
+
+#ifndef CREATE_WAITABLE_TIMER_HIGH_RESOLUTION
+#define CREATE_WAITABLE_TIMER_HIGH_RESOLUTION 0x00000002
+#endif
+
+static void _modbus_sleep_us(uint64_t delay_us)
+{
+#ifdef _WIN32
+    /* Sleep() counts in ticks of the system timer (1 to 15.6 ms), the high
+       resolution timer exists since Windows 10 1803 */
+    HANDLE timer = CreateWaitableTimerExW(
+        NULL, NULL, CREATE_WAITABLE_TIMER_HIGH_RESOLUTION, TIMER_ALL_ACCESS);
+
+    if (timer != NULL) {
+        LARGE_INTEGER due;
+
+        /* Relative time in units of 100 ns */
+        due.QuadPart = -(LONGLONG) (delay_us * 10);
+        if (SetWaitableTimer(timer, &due, 0, NULL, NULL, FALSE)) {
+            WaitForSingleObject(timer, INFINITE);
+        }
+        CloseHandle(timer);
+    } else if (delay_us > 2000) {
+        Sleep((DWORD) ((delay_us - 1000) / 1000));
+    }
+#else
+    struct timespec request, remaining;
+
+    request.tv_sec = (time_t) (delay_us / 1000000);
+    request.tv_nsec = (long) (delay_us % 1000000) * 1000;
+    while (nanosleep(&request, &remaining) == -1 && errno == EINTR) {
+        request = remaining;
+    }
+#endif
+}
+
+/* Sleeps until _MODBUS_WAIT_SPIN_US before the deadline then spins on the
+   clock as the inter-frame delays of a serial bus need a better precision
+   than the sleeps of the system */
+void _modbus_wait_until_us(uint64_t deadline_us)
+{
+    uint64_t now = _modbus_monotonic_us();
+
+    if (now + _MODBUS_WAIT_SPIN_US < deadline_us) {
+        _modbus_sleep_us(deadline_us - now - _MODBUS_WAIT_SPIN_US);
+    }
+
+    while (_modbus_monotonic_us() < deadline_us) {
+    }
+}
+
 void _modbus_init_common(modbus_t *ctx)
 {
     /* Slave and socket are initialized to -1 */
@@ -1728,6 +2291,9 @@ void _modbus_init_common(modbus_t *ctx)
 
     ctx->indication_timeout.tv_sec = 0;
     ctx->indication_timeout.tv_usec = 0;
+
+    ctx->batch = NULL;
+    memset(&ctx->io_stats, 0, sizeof(modbus_io_stats_t));
 }
 
 /* Define the slave number */
@@ -1771,6 +2337,14 @@ int modbus_set_socket(modbus_t *ctx, int s)
         return -1;
     }
 
+    /* The pending responses belong to the previous socket */
+    if (ctx->batch != NULL && ctx->s != s && modbus_flush_replies(ctx) == -1) {
+        return -1;
+    }
+    if (ctx->batch != NULL) {
+        ctx->batch->pending = FALSE;
+    }
+
     ctx->s = s;
     return 0;
 }
@@ -1911,6 +2485,15 @@ void modbus_close(modbus_t *ctx)
     if (ctx == NULL)
         return;
 
+    if (ctx->batch != NULL) {
+        /* The responses already built are sent, the rest isn't for the next
+           connection */
+        int saved_errno = errno;
+
+        modbus_flush_replies(ctx);
+        ctx->batch->pending = FALSE;
+        errno = saved_errno;
+    }
     ctx->backend->close(ctx);
 }
 
@@ -1919,9 +2502,118 @@ void modbus_free(modbus_t *ctx)
     if (ctx == NULL)
         return;
 
+    if (ctx->batch != NULL) {
+        free(ctx->batch->buf);
+        free(ctx->batch);
+    }
     ctx->backend->free(ctx);
 }
 
+/* Gathers the responses of modbus_reply() in an output buffer of size bytes
+   (at least MAX_MESSAGE_LENGTH) when the client has pipelined several
+   requests. They are sent with a single call once the last readable request
+   has been answered, so a burst costs one send instead of one per response
+   plus one select to find its end. It only pays off with pipelining clients.
+   The responses still in the buffer are sent before modbus_receive() waits
+   for a request; a caller that stops receiving (e.g. polls another socket)
+   has to call modbus_flush_replies() first.
+   A size of 0 sends the pending responses and disables the batching.
+   Only available with the TCP backends. */
+int modbus_set_reply_batching(modbus_t *ctx, int size)
+{
+    modbus_reply_batch_t *batch;
+
+    if (ctx == NULL || ctx->backend->backend_type != _MODBUS_BACKEND_TYPE_TCP ||
+        (size != 0 && size < MAX_MESSAGE_LENGTH)) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (ctx->batch != NULL) {
+        if (modbus_flush_replies(ctx) == -1) {
+            return -1;
+        }
+        free(ctx->batch->buf);
+        free(ctx->batch);
+        ctx->batch = NULL;
+    }
+
+    if (size == 0) {
+        return 0;
+    }
+
+    batch = malloc(sizeof(modbus_reply_batch_t));
+    if (batch == NULL) {
+        errno = ENOMEM;
+        return -1;
+    }
+    batch->buf = malloc(size);
+    if (batch->buf == NULL) {
+        free(batch);
+        errno = ENOMEM;
+        return -1;
+    }
+    batch->length = 0;
+    batch->size = size;
+    batch->pending = FALSE;
+    ctx->batch = batch;
+
+    return 0;
+}
+
+/* Sends the responses gathered in the output buffer */
+int modbus_flush_replies(modbus_t *ctx)
+{
+    int sent = 0;
+    int rc;
+
+    if (ctx == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (ctx->batch == NULL) {
+        return 0;
+    }
+
+    while (sent < ctx->batch->length) {
+        ctx->io_stats.nb_send_calls++;
+        rc = ctx->backend->send(ctx, ctx->batch->buf + sent, ctx->batch->length - sent);
+        if (rc == -1) {
+            _error_print(ctx, NULL);
+            /* The unsent responses are dropped as the connection is lost */
+            ctx->batch->length = 0;
+            return -1;
+        }
+        sent += rc;
+    }
+    ctx->batch->length = 0;
+
+    return sent;
+}
+
+int modbus_get_io_stats(modbus_t *ctx, modbus_io_stats_t *stats)
+{
+    if (ctx == NULL || stats == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    *stats = ctx->io_stats;
+    return 0;
+}
+
+int modbus_reset_io_stats(modbus_t *ctx)
+{
+    if (ctx == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    memset(&ctx->io_stats, 0, sizeof(modbus_io_stats_t));
+    return 0;
+}
+
 int modbus_set_debug(modbus_t *ctx, int flag)
 {
     if (ctx == NULL) {
@@ -2031,13 +2723,40 @@ modbus_mapping_t *modbus_mapping_new(int nb_bits,
         0, nb_bits, 0, nb_input_bits, 0, nb_registers, 0, nb_input_registers);
 }
 
-/* Frees the 4 arrays */
+/* Frees the 4 arrays and the segments */
 void modbus_mapping_free(modbus_mapping_t *mb_mapping)
 {
+    struct _modbus_mapping_segments **link;
+    struct _modbus_mapping_segments *ms;
+
     if (mb_mapping == NULL) {
         return;
     }
 
+    _modbus_lock(&mapping_segments_lock);
+    link = &mapping_segments_list;
+    while (*link != NULL && (*link)->mapping != mb_mapping) {
+        link = &(*link)->next;
+    }
+    ms = *link;
+    if (ms != NULL) {
+        *link = ms->next;
+    }
+    _modbus_unlock(&mapping_segments_lock);
+
+    if (ms != NULL) {
+        int table;
+        int i;
+
+        for (table = 0; table < MODBUS_TABLE_MAX; table++) {
+            for (i = 0; i < ms->nb_segments[table]; i++) {
+                free(ms->segments[table][i].tab);
+            }
+            free(ms->segments[table]);
+        }
+        free(ms);
+    }
+
     free(mb_mapping->tab_input_registers);
     free(mb_mapping->tab_registers);
     free(mb_mapping->tab_input_bits);
@@ -2045,6 +2764,312 @@ void modbus_mapping_free(modbus_mapping_t *mb_mapping)
     free(mb_mapping);
 }
 
+/* Allocates an empty mapping to be filled with modbus_mapping_add_segment().
+   Only the mapped ranges consume memory so registers at 200 and 40000 can be
+   served without allocating the addresses in between. */
+modbus_mapping_t *modbus_mapping_new_segmented(void)
+{
+    return modbus_mapping_new_start_address(0, 0, 0, 0, 0, 0, 0, 0);
+}
+
+/* Inserts a storage segment (no handlers) or a handler segment */
+static int mapping_add_segment(modbus_mapping_t *mb_mapping,
+                               modbus_table_type table,
+                               unsigned int start,
+                               unsigned int nb,
+                               modbus_read_handler_t read_handler,
+                               modbus_write_handler_t write_handler,
+                               void *user_data)
+{
+    int has_handler = (read_handler != NULL || write_handler != NULL);
+    struct _modbus_mapping_segments *ms;
+    modbus_segment_t *segments;
+    modbus_segment_t *prev = NULL;
+    modbus_segment_t *next = NULL;
+    size_t size;
+    int new_start = start;
+    int new_nb = nb;
+    int contiguous_start;
+    int contiguous_nb;
+    uint8_t *tab = NULL;
+    int i;
+
+    if (mb_mapping == NULL || (int) table < 0 || table >= MODBUS_TABLE_MAX || nb == 0 ||
+        start > UINT16_MAX || nb > UINT16_MAX + 1 - start) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    /* Must not overlap the contiguous table */
+    if (mapping_contiguous(mb_mapping, table, &contiguous_start, &contiguous_nb) !=
+            NULL &&
+        (int) start < contiguous_start + contiguous_nb &&
+        (int) (start + nb) > contiguous_start) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    ms = mapping_segments(mb_mapping);
+    if (ms == NULL) {
+        ms = calloc(1, sizeof(struct _modbus_mapping_segments));
+        if (ms == NULL) {
+            errno = ENOMEM;
+            return -1;
+        }
+        ms->mapping = mb_mapping;
+        _modbus_lock(&mapping_segments_lock);
+        ms->next = mapping_segments_list;
+        mapping_segments_list = ms;
+        _modbus_unlock(&mapping_segments_lock);
+    }
+
+    i = mapping_find_segment(ms, table, start);
+    if (i >= 0) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    /* The start address is in a hole, the range must end before the next segment */
+    i = -i - 1;
+    if (i < ms->nb_segments[table] &&
+        (int) (start + nb) > ms->segments[table][i].start) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    /* Only storage segments are merged */
+    if (!has_handler && i > 0 && ms->segments[table][i - 1].tab != NULL &&
+        ms->segments[table][i - 1].start + ms->segments[table][i - 1].nb ==
+            (int) start) {
+        prev = &ms->segments[table][i - 1];
+        new_start = prev->start;
+        new_nb += prev->nb;
+    }
+    if (!has_handler && i < ms->nb_segments[table] &&
+        ms->segments[table][i].tab != NULL &&
+        ms->segments[table][i].start == (int) (start + nb)) {
+        next = &ms->segments[table][i];
+        new_nb += next->nb;
+    }
+
+    size = mapping_element_size(table);
+    if (!has_handler) {
+        tab = calloc(new_nb, size);
+        if (tab == NULL) {
+            errno = ENOMEM;
+            return -1;
+        }
+    }
+
+    if (prev == NULL && next == NULL) {
+        /* A brand new segment is inserted at i */
+        segments = realloc(ms->segments[table],
+                           (ms->nb_segments[table] + 1) * sizeof(modbus_segment_t));
+        if (segments == NULL) {
+            free(tab);
+            errno = ENOMEM;
+            return -1;
+        }
+        memmove(&segments[i + 1],
+                &segments[i],
+                (ms->nb_segments[table] - i) * sizeof(modbus_segment_t));
+        segments[i].start = new_start;
+        segments[i].nb = new_nb;
+        segments[i].tab = tab;
+        segments[i].read_handler = read_handler;
+        segments[i].write_handler = write_handler;
+        segments[i].user_data = user_data;
+        ms->segments[table] = segments;
+        ms->nb_segments[table]++;
+        return 0;
+    }
+
+    /* Merges the previous and/or the next segment with the new range */
+    if (prev != NULL) {
+        memcpy(tab, prev->tab, prev->nb * size);
+    }
+    if (next != NULL) {
+        memcpy(tab + (new_nb - next->nb) * size, next->tab, next->nb * size);
+    }
+
+    if (prev != NULL) {
+        free(prev->tab);
+        prev->nb = new_nb;
+        prev->tab = tab;
+        if (next != NULL) {
+            /* The next segment is now part of the previous one */
+            free(next->tab);
+            memmove(next,
+                    next + 1,
+                    (ms->nb_segments[table] - i - 1) * sizeof(modbus_segment_t));
+            ms->nb_segments[table]--;
+        }
+    } else {
+        free(next->tab);
+        next->start = new_start;
+        next->nb = new_nb;
+        next->tab = tab;
+    }
+
+    return 0;
+}
+
+/* Maps the [start, start + nb) range of the table. The values are initialized
+   to zero. A segment adjacent to an existing one is merged with it so the
+   pointers previously returned by modbus_mapping_get_bits() and
+   modbus_mapping_get_registers() for the table must be requested again. The
+   segments are released by modbus_mapping_free(), a mapping having segments
+   must not be released otherwise.
+
+   The function shall return 0 if successful. Otherwise it shall return -1 and
+   set errno to EINVAL when the range overlaps an already mapped one or ENOMEM. */
+int modbus_mapping_add_segment(modbus_mapping_t *mb_mapping,
+                               modbus_table_type table,
+                               unsigned int start,
+                               unsigned int nb)
+{
+    return mapping_add_segment(mb_mapping, table, start, nb, NULL, NULL, NULL);
+}
+
+/* Maps the [start, start + nb) range of a registers table to handlers called
+   by modbus_reply() instead of a storage, e.g. to compute the values on demand
+   or to forward the writes to a device. A request is served by the handlers
+   only when its whole range lies within the handler range. A NULL handler
+   makes the matching requests fail with an illegal data address exception and
+   the write handler is only used for the holding registers.
+
+   The function shall return 0 if successful. Otherwise it shall return -1 and
+   set errno to EINVAL when the table isn't a registers table, no handler is
+   given or the range overlaps an already mapped one, or ENOMEM. */
+int modbus_mapping_add_handler(modbus_mapping_t *mb_mapping,
+                               modbus_table_type table,
+                               unsigned int start,
+                               unsigned int nb,
+                               modbus_read_handler_t read_handler,
+                               modbus_write_handler_t write_handler,
+                               void *user_data)
+{
+    if ((table != MODBUS_TABLE_REGISTERS && table != MODBUS_TABLE_INPUT_REGISTERS) ||
+        (read_handler == NULL && write_handler == NULL)) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    return mapping_add_segment(
+        mb_mapping, table, start, nb, read_handler, write_handler, user_data);
+}
+
+modbus_unit_table_t *modbus_unit_table_new(void)
+{
+    modbus_unit_table_t *units;
+
+    units = (modbus_unit_table_t *) calloc(1, sizeof(modbus_unit_table_t));
+    if (units == NULL) {
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    return units;
+}
+
+/* The mappings aren't freed */
+void modbus_unit_table_free(modbus_unit_table_t *units)
+{
+    free(units);
+}
+
+/* Serves the unit with mb_mapping, NULL removes the unit. The same mapping can
+   be shared by several units. */
+int modbus_unit_table_set(modbus_unit_table_t *units,
+                          int unit_id,
+                          modbus_mapping_t *mb_mapping)
+{
+    if (units == NULL || unit_id < 0 || unit_id >= MODBUS_MAX_UNITS) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    units->mappings[unit_id] = mb_mapping;
+    return 0;
+}
+
+modbus_mapping_t *modbus_unit_table_get(modbus_unit_table_t *units, int unit_id)
+{
+    if (units == NULL || unit_id < 0 || unit_id >= MODBUS_MAX_UNITS) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    return units->mappings[unit_id];
+}
+
+int modbus_unit_table_get_stats(modbus_unit_table_t *units,
+                                int unit_id,
+                                modbus_unit_stats_t *stats)
+{
+    if (units == NULL || unit_id < 0 || unit_id >= MODBUS_MAX_UNITS || stats == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    *stats = units->stats[unit_id];
+    return 0;
+}
+
+int modbus_unit_table_reset_stats(modbus_unit_table_t *units)
+{
+    if (units == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    memset(units->stats, 0, sizeof(units->stats));
+    return 0;
+}
+
+/* Returns a pointer to the nb values of a bits table starting at addr (segment
+   or contiguous table). Otherwise it shall return NULL and set errno. */
+uint8_t *modbus_mapping_get_bits(modbus_mapping_t *mb_mapping,
+                                 modbus_table_type table,
+                                 int addr,
+                                 int nb)
+{
+    uint8_t *tab;
+
+    if (mb_mapping == NULL || nb < 1 ||
+        (table != MODBUS_TABLE_BITS && table != MODBUS_TABLE_INPUT_BITS)) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    tab = mapping_resolve(mb_mapping, table, addr, nb);
+    if (tab == NULL) {
+        errno = EMBXILADD;
+    }
+    return tab;
+}
+
+/* Same as modbus_mapping_get_bits for the registers tables */
+uint16_t *modbus_mapping_get_registers(modbus_mapping_t *mb_mapping,
+                                       modbus_table_type table,
+                                       int addr,
+                                       int nb)
+{
+    uint16_t *tab;
+
+    if (mb_mapping == NULL || nb < 1 ||
+        (table != MODBUS_TABLE_REGISTERS && table != MODBUS_TABLE_INPUT_REGISTERS)) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    tab = mapping_resolve(mb_mapping, table, addr, nb);
+    if (tab == NULL) {
+        errno = EMBXILADD;
+    }
+    return tab;
+}
+
 #ifndef HAVE_STRLCPY
 /*
  * Function strlcpy was originally developed by
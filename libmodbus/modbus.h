@@ -156,6 +156,25 @@ extern const unsigned int libmodbus_version_micro;
 
 typedef struct _modbus modbus_t;
 
+/* Tables of the Modbus data model, used to address the segments of a mapping */
+typedef enum {
+    MODBUS_TABLE_BITS = 0,
+    MODBUS_TABLE_INPUT_BITS,
+    MODBUS_TABLE_REGISTERS,
+    MODBUS_TABLE_INPUT_REGISTERS,
+    MODBUS_TABLE_MAX
+} modbus_table_type;
+
+/* Handlers of computed registers. The read handler fills dest with the nb
+ * registers starting at addr and the write handler stores the nb registers of
+ * src, 2 bytes per register in big-endian (use MODBUS_GET_INT16_FROM_INT8 and
+ * MODBUS_SET_INT16_TO_INT8). Both return 0 or a Modbus exception code. */
+typedef int (*modbus_read_handler_t)(void *user_data, int addr, int nb, uint8_t *dest);
+typedef int (*modbus_write_handler_t)(void *user_data,
+                                      int addr,
+                                      int nb,
+                                      const uint8_t *src);
+
 typedef struct _modbus_mapping_t {
     int nb_bits;
     int start_bits;
@@ -184,6 +203,35 @@ typedef enum {
     MODBUS_QUIRK_ALL = 0xFF
 } modbus_quirks;
 
+/* Registers of a response kept in a buffer of the context for the views,
+   valid until the next view read (modbus_read_*registers_view()) on it, other
+   requests don't touch it. Only the fields read through the
+   modbus_view_get_*() accessors are decoded. */
+typedef struct _modbus_register_view {
+    /* Big-endian payload, 2 bytes per register */
+    const uint8_t *data;
+    int addr;
+    int nb;
+} modbus_register_view_t;
+
+/* Syscall counters to measure the cost of a request */
+typedef struct _modbus_io_stats {
+    uint32_t nb_replies;
+    uint32_t nb_recv_calls;
+    uint32_t nb_send_calls;
+    uint32_t nb_select_calls;
+} modbus_io_stats_t;
+
+/* Dispatch of the requests to one mapping per unit identifier */
+#define MODBUS_MAX_UNITS 256
+
+typedef struct _modbus_unit_stats {
+    uint32_t nb_requests;
+    uint32_t nb_exceptions;
+} modbus_unit_stats_t;
+
+typedef struct _modbus_unit_table modbus_unit_table_t;
+
 MODBUS_API int modbus_set_slave(modbus_t *ctx, int slave);
 MODBUS_API int modbus_get_slave(modbus_t *ctx);
 MODBUS_API int modbus_set_error_recovery(modbus_t *ctx,
@@ -215,6 +263,11 @@ MODBUS_API void modbus_free(modbus_t *ctx);
 MODBUS_API int modbus_flush(modbus_t *ctx);
 MODBUS_API int modbus_set_debug(modbus_t *ctx, int flag);
 
+MODBUS_API int modbus_set_reply_batching(modbus_t *ctx, int size);
+MODBUS_API int modbus_flush_replies(modbus_t *ctx);
+MODBUS_API int modbus_get_io_stats(modbus_t *ctx, modbus_io_stats_t *stats);
+MODBUS_API int modbus_reset_io_stats(modbus_t *ctx);
+
 MODBUS_API const char *modbus_strerror(int errnum);
 
 MODBUS_API int modbus_read_bits(modbus_t *ctx, int addr, int nb, uint8_t *dest);
@@ -222,6 +275,14 @@ MODBUS_API int modbus_read_input_bits(modbus_t *ctx, int addr, int nb, uint8_t *
 MODBUS_API int modbus_read_registers(modbus_t *ctx, int addr, int nb, uint16_t *dest);
 MODBUS_API int
 modbus_read_input_registers(modbus_t *ctx, int addr, int nb, uint16_t *dest);
+MODBUS_API int modbus_read_registers_view(modbus_t *ctx,
+                                          int addr,
+                                          int nb,
+                                          modbus_register_view_t *view);
+MODBUS_API int modbus_read_input_registers_view(modbus_t *ctx,
+                                                int addr,
+                                                int nb,
+                                                modbus_register_view_t *view);
 MODBUS_API int modbus_write_bit(modbus_t *ctx, int coil_addr, int status);
 MODBUS_API int modbus_write_register(modbus_t *ctx, int reg_addr, const uint16_t value);
 MODBUS_API int modbus_write_bits(modbus_t *ctx, int addr, int nb, const uint8_t *data);
@@ -254,6 +315,39 @@ MODBUS_API modbus_mapping_t *modbus_mapping_new(int nb_bits,
                                                 int nb_input_registers);
 MODBUS_API void modbus_mapping_free(modbus_mapping_t *mb_mapping);
 
+MODBUS_API modbus_mapping_t *modbus_mapping_new_segmented(void);
+MODBUS_API int modbus_mapping_add_segment(modbus_mapping_t *mb_mapping,
+                                          modbus_table_type table,
+                                          unsigned int start,
+                                          unsigned int nb);
+MODBUS_API int modbus_mapping_add_handler(modbus_mapping_t *mb_mapping,
+                                          modbus_table_type table,
+                                          unsigned int start,
+                                          unsigned int nb,
+                                          modbus_read_handler_t read_handler,
+                                          modbus_write_handler_t write_handler,
+                                          void *user_data);
+MODBUS_API uint8_t *modbus_mapping_get_bits(modbus_mapping_t *mb_mapping,
+                                            modbus_table_type table,
+                                            int addr,
+                                            int nb);
+MODBUS_API uint16_t *modbus_mapping_get_registers(modbus_mapping_t *mb_mapping,
+                                                  modbus_table_type table,
+                                                  int addr,
+                                                  int nb);
+
+MODBUS_API modbus_unit_table_t *modbus_unit_table_new(void);
+MODBUS_API void modbus_unit_table_free(modbus_unit_table_t *units);
+MODBUS_API int modbus_unit_table_set(modbus_unit_table_t *units,
+                                     int unit_id,
+                                     modbus_mapping_t *mb_mapping);
+MODBUS_API modbus_mapping_t *modbus_unit_table_get(modbus_unit_table_t *units,
+                                                   int unit_id);
+MODBUS_API int modbus_unit_table_get_stats(modbus_unit_table_t *units,
+                                           int unit_id,
+                                           modbus_unit_stats_t *stats);
+MODBUS_API int modbus_unit_table_reset_stats(modbus_unit_table_t *units);
+
 MODBUS_API int
 modbus_send_raw_request(modbus_t *ctx, const uint8_t *raw_req, int raw_req_length);
 
@@ -270,6 +364,10 @@ MODBUS_API int modbus_reply(modbus_t *ctx,
                             const uint8_t *req,
                             int req_length,
                             modbus_mapping_t *mb_mapping);
+MODBUS_API int modbus_reply_unit(modbus_t *ctx,
+                                 const uint8_t *req,
+                                 int req_length,
+                                 modbus_unit_table_t *units);
 MODBUS_API int
 modbus_reply_exception(modbus_t *ctx, const uint8_t *req, unsigned int exception_code);
 MODBUS_API int modbus_enable_quirks(modbus_t *ctx, unsigned int quirks_mask);
@@ -326,8 +424,58 @@ MODBUS_API void modbus_set_float_dcba(float f, uint16_t *dest);
 MODBUS_API void modbus_set_float_badc(float f, uint16_t *dest);
 MODBUS_API void modbus_set_float_cdab(float f, uint16_t *dest);
 
+/* Order of the bytes of a 32-bit value held in two registers, A being the
+   most significant byte and the first one sent in ABCD */
+typedef enum {
+    MODBUS_ORDER_ABCD = 0,
+    MODBUS_ORDER_DCBA,
+    MODBUS_ORDER_BADC,
+    MODBUS_ORDER_CDAB
+} modbus_byte_order_t;
+
+/* Implementations of the decoding of register arrays */
+#define MODBUS_DECODE_AUTO   0
+#define MODBUS_DECODE_SCALAR 1
+#define MODBUS_DECODE_SSSE3  2
+#define MODBUS_DECODE_AVX2   3
+#define MODBUS_DECODE_NEON   4
+
+MODBUS_API int modbus_decode_set_implementation(int impl);
+MODBUS_API int modbus_decode_get_implementation(void);
+MODBUS_API void modbus_get_registers_from_bytes(uint16_t *dest, const uint8_t *src, int nb);
+MODBUS_API int modbus_get_float_array(float *dest,
+                                      const uint16_t *src,
+                                      int nb,
+                                      modbus_byte_order_t order);
+MODBUS_API int modbus_get_uint32_array(uint32_t *dest,
+                                       const uint16_t *src,
+                                       int nb,
+                                       modbus_byte_order_t order);
+MODBUS_API int modbus_get_int32_array(int32_t *dest,
+                                      const uint16_t *src,
+                                      int nb,
+                                      modbus_byte_order_t order);
+
+MODBUS_API int
+modbus_view_get_u16(const modbus_register_view_t *view, int addr, uint16_t *value);
+MODBUS_API int modbus_view_get_u32(const modbus_register_view_t *view,
+                                   int addr,
+                                   modbus_byte_order_t order,
+                                   uint32_t *value);
+MODBUS_API int modbus_view_get_float(const modbus_register_view_t *view,
+                                     int addr,
+                                     modbus_byte_order_t order,
+                                     float *value);
+
 #include "modbus-rtu.h"
+#include "modbus-server.h"
+#include "modbus-sniffer.h"
 #include "modbus-tcp.h"
+#include "modbus-udp.h"
+#include "modbus-mux.h"
+#include "modbus-cache.h"
+#include "modbus-feed.h"
+#include "modbus-shm.h"
 
 MODBUS_END_DECLS
 
@@ -0,0 +1,56 @@
+// libmodbus の拡張のベンチマーク
+// 使い方: ModBench [名前...]（省略するとすべて実行）
+
+#include <cstdio>
+#include <cstring>
+
+#include "ModBench.h"
+
+struct Bench {
+    const char* name;
+    const char* summary;
+    int (*run)();
+};
+
+static const Bench BENCHES[] = {
+    { "reply", "pipelined requests answered with and without reply batching", bench_reply },
+    { "crc", "CRC16 of 8 to 256 byte RTU frames with each implementation", bench_crc },
+    { "decode", "register decoding and 32-bit array conversions with each implementation", bench_decode },
+    { "udp", "scans of 64-register reads over UDP, one by one and batched", bench_udp },
+    { "shm", "shared register image publish and reads, idle and from another process with a nonstop writer", bench_shm },
+};
+
+int main(int argc, char** argv)
+{
+    int failed = 0;
+    int nb_run = 0;
+
+    if (argc == 2 && std::strcmp(argv[1], BENCH_SHM_READER_ARG) == 0) {
+        return bench_shm_reader();
+    }
+
+    for (const Bench& bench : BENCHES) {
+        bool selected = (argc < 2);
+        for (int i = 1; i < argc; ++i) {
+            if (std::strcmp(argv[i], bench.name) == 0) selected = true;
+        }
+        if (!selected) continue;
+
+        std::printf("== %s: %s\n", bench.name, bench.summary);
+        if (bench.run() != 0) {
+            std::printf("%s FAILED\n", bench.name);
+            failed++;
+        }
+        std::printf("\n");
+        nb_run++;
+    }
+
+    if (nb_run == 0) {
+        std::printf("Usage: ModBench [name...]\n");
+        for (const Bench& bench : BENCHES) {
+            std::printf("  %-8s %s\n", bench.name, bench.summary);
+        }
+        return 1;
+    }
+    return failed;
+}
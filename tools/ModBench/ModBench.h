@@ -0,0 +1,34 @@
+#pragma once
+
+#include <chrono>
+
+extern "C" {
+#include "../../libmodbus/modbus.h"
+}
+
+// ===== ベンチマーク共通 =====
+
+// 各ベンチマーク（結果は標準出力に表で出す。失敗したら 0 以外を返す）
+int bench_reply();
+int bench_crc();
+int bench_decode();
+int bench_udp();
+int bench_shm();
+
+// bench_shm が別プロセスの読み手として起動するときの引数と、その読み手
+constexpr const char* BENCH_SHM_READER_ARG = "shm-reader";
+int bench_shm_reader();
+
+// 経過時間の計測
+class BenchTimer {
+public:
+    BenchTimer() : start_(std::chrono::steady_clock::now()) {}
+
+    double seconds() const
+    {
+        return std::chrono::duration<double>(std::chrono::steady_clock::now() - start_).count();
+    }
+
+private:
+    std::chrono::steady_clock::time_point start_;
+};
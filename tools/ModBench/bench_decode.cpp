@@ -0,0 +1,196 @@
+// レジスタ配列のデコード（modbus_decode_set_implementation）
+// 応答のビッグエンディアンのバイト列→レジスタ（modbus_get_registers_from_bytes）と、
+// 2レジスタ→float の一括変換（modbus_get_float_array）を、各実装（スカラー・SSSE3・
+// AVX2・NEON）と自動選択で、1応答分（124）・16Ki・1Mi レジスタについて Mregs/s で比べる。
+// 比較用に、modbus.c にあったシフトと OR のループと、1値ずつの modbus_get_float_abcd も測る。
+// 計測の前に、どの実装もどのバイト順でも1値ずつの関数と同じ結果になることを確かめる。
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <iterator>   // std::size
+#include <vector>
+
+#include "ModBench.h"
+
+namespace {
+
+constexpr long long BENCH_DECODE_REGISTERS = 64LL * 1024 * 1024;    // 1回の計測で変換するレジスタ数
+
+struct DecodeImpl {
+    int impl;
+    const char* name;
+};
+
+constexpr DecodeImpl DECODE_IMPLS[] = {
+    { MODBUS_DECODE_SCALAR, "scalar" },
+    { MODBUS_DECODE_SSSE3, "SSSE3" },
+    { MODBUS_DECODE_AVX2, "AVX2" },
+    { MODBUS_DECODE_NEON, "NEON" },
+    { MODBUS_DECODE_AUTO, "auto" },
+};
+
+constexpr int REGISTER_COUNTS[] = { MODBUS_MAX_READ_REGISTERS - 1, 16 * 1024, 1024 * 1024 };
+
+// modbus.c の read_registers() が使っていたループ
+void old_loop(uint16_t* dest, const uint8_t* src, int nb)
+{
+    for (int i = 0; i < nb; i++) {
+        dest[i] = (src[i * 2] << 8) | src[i * 2 + 1];
+    }
+}
+
+// 最適化で変換を省かれないように結果を混ぜる（NaN もあるので値ではなくビットで）
+uint16_t float_bits(float value)
+{
+    uint32_t bits;
+    std::memcpy(&bits, &value, sizeof(bits));
+    return static_cast<uint16_t>(bits);
+}
+
+float get_float(const uint16_t* src, modbus_byte_order_t order)
+{
+    switch (order) {
+    case MODBUS_ORDER_DCBA: return modbus_get_float_dcba(src);
+    case MODBUS_ORDER_BADC: return modbus_get_float_badc(src);
+    case MODBUS_ORDER_CDAB: return modbus_get_float_cdab(src);
+    default: return modbus_get_float_abcd(src);
+    }
+}
+
+bool check(const uint8_t* bytes, const uint16_t* regs)
+{
+    uint16_t expected[200];
+    uint16_t got[200];
+    float values[100];
+
+    for (const DecodeImpl& impl : DECODE_IMPLS) {
+        if (modbus_decode_set_implementation(impl.impl) == -1) continue;
+        for (int nb = 0; nb <= 200; ++nb) {
+            // 1バイトずらして、揃っていないバッファも試す
+            old_loop(expected, bytes + 1, nb);
+            modbus_get_registers_from_bytes(got, bytes + 1, nb);
+            if (std::memcmp(expected, got, nb * sizeof(uint16_t)) != 0) {
+                std::printf("%s: registers differ for %d\n", impl.name, nb);
+                return false;
+            }
+        }
+        for (int order = MODBUS_ORDER_ABCD; order <= MODBUS_ORDER_CDAB; ++order) {
+            for (int nb = 0; nb <= 100; ++nb) {
+                modbus_get_float_array(values, regs, nb, static_cast<modbus_byte_order_t>(order));
+                for (int i = 0; i < nb; ++i) {
+                    float value = get_float(regs + i * 2, static_cast<modbus_byte_order_t>(order));
+                    if (std::memcmp(&value, &values[i], sizeof(float)) != 0) {
+                        std::printf("%s: float %d of %d differs in order %d\n", impl.name, i, nb, order);
+                        return false;
+                    }
+                }
+            }
+        }
+    }
+    return true;
+}
+
+// nb レジスタの変換を合計 BENCH_DECODE_REGISTERS レジスタ分繰り返した Mregs/s
+template <typename F>
+double mregs_per_second(int nb, F&& convert)
+{
+    const long long rounds = BENCH_DECODE_REGISTERS / nb;
+    BenchTimer timer;
+    for (long long i = 0; i < rounds; ++i) {
+        convert();
+    }
+    return rounds * nb / timer.seconds() / 1e6;
+}
+
+void print_row(const char* name, const double* rates)
+{
+    std::printf("%-22s", name);
+    for (size_t i = 0; i < std::size(REGISTER_COUNTS); ++i) {
+        if (rates[i] < 0) {
+            std::printf(" %11s", "n/a");
+        } else {
+            std::printf(" %11.0f", rates[i]);
+        }
+    }
+    std::printf("\n");
+}
+
+} // namespace
+
+int bench_decode()
+{
+    const int max_nb = REGISTER_COUNTS[std::size(REGISTER_COUNTS) - 1];
+    std::vector<uint8_t> bytes(max_nb * 2 + 1);
+    std::vector<uint16_t> regs(max_nb);
+    std::vector<float> floats(max_nb / 2);
+
+    uint32_t seed = 12345;
+    for (uint8_t& byte : bytes) {
+        seed = seed * 1103515245 + 12345;
+        byte = static_cast<uint8_t>(seed >> 16);
+    }
+    old_loop(regs.data(), bytes.data(), max_nb);
+
+    if (!check(bytes.data(), regs.data())) {
+        modbus_decode_set_implementation(MODBUS_DECODE_AUTO);
+        return 1;
+    }
+
+    std::printf("%-22s", "Mregs/s, Mfloats/s");
+    for (int nb : REGISTER_COUNTS) std::printf(" %6d regs", nb);
+    std::printf("\n");
+
+    double rates[std::size(REGISTER_COUNTS)];
+    volatile uint16_t sink = 0;
+
+    for (size_t i = 0; i < std::size(REGISTER_COUNTS); ++i) {
+        int nb = REGISTER_COUNTS[i];
+        rates[i] = mregs_per_second(nb, [&] {
+            old_loop(regs.data(), bytes.data() + 1, nb);
+            sink = sink + regs[0];
+        });
+    }
+    print_row("old loop in modbus.c", rates);
+
+    for (const DecodeImpl& impl : DECODE_IMPLS) {
+        bool supported = modbus_decode_set_implementation(impl.impl) == 0;
+        for (size_t i = 0; i < std::size(REGISTER_COUNTS); ++i) {
+            int nb = REGISTER_COUNTS[i];
+            rates[i] = !supported ? -1.0 : mregs_per_second(nb, [&] {
+                modbus_get_registers_from_bytes(regs.data(), bytes.data() + 1, nb);
+                sink = sink + regs[0];
+            });
+        }
+        print_row(impl.name, rates);
+    }
+
+    modbus_decode_set_implementation(MODBUS_DECODE_AUTO);
+    for (size_t i = 0; i < std::size(REGISTER_COUNTS); ++i) {
+        int nb = REGISTER_COUNTS[i] / 2;
+        rates[i] = mregs_per_second(nb, [&] {
+            for (int j = 0; j < nb; ++j) {
+                floats[j] = modbus_get_float_abcd(&regs[j * 2]);
+            }
+            sink = sink + float_bits(floats[0]);
+        });
+    }
+    print_row("per-call get_float", rates);
+
+    for (const DecodeImpl& impl : DECODE_IMPLS) {
+        bool supported = modbus_decode_set_implementation(impl.impl) == 0;
+        for (size_t i = 0; i < std::size(REGISTER_COUNTS); ++i) {
+            int nb = REGISTER_COUNTS[i] / 2;
+            rates[i] = !supported ? -1.0 : mregs_per_second(nb, [&] {
+                modbus_get_float_array(floats.data(), regs.data(), nb, MODBUS_ORDER_ABCD);
+                sink = sink + float_bits(floats[0]);
+            });
+        }
+        char name[32];
+        std::snprintf(name, sizeof(name), "float ABCD, %s", impl.name);
+        print_row(name, rates);
+    }
+
+    modbus_decode_set_implementation(MODBUS_DECODE_AUTO);
+    return 0;
+}
@@ -0,0 +1,125 @@
+// 応答のまとめ送り（modbus_set_reply_batching）
+// ループバックの TCP で、クライアントが depth 個ずつパイプラインで送った読み取り要求に
+// サーバーが modbus_receive / modbus_reply で答える。サーバー側の select・recv・send の
+// 回数（modbus_get_io_stats）を要求数で割り、まとめ送りあり・なしで比べる。
+// 受けたソケットは modbus_connect() 側と同じく TCP_NODELAY にする（まとめないときの
+// 応答が Nagle で遅れて、システムコール以外の差が混ざらないように）。
+
+#include <cerrno>
+#include <cstdio>
+#include <functional>   // std::ref
+#include <thread>
+
+#if defined(_WIN32)
+#include <winsock2.h>
+#else
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#endif
+
+#include "ModBench.h"
+
+namespace {
+
+constexpr int BENCH_REPLY_PORT = 15028;
+constexpr int BENCH_REPLY_REQUESTS = 20000;    // 1回の計測の要求数
+constexpr int BENCH_REPLY_BATCH_SIZE = 16384;
+
+struct ReplyResult {
+    modbus_io_stats_t stats {};
+    double seconds = 0.0;
+    bool ok = false;
+};
+
+// 1接続だけ受けて、切断されるまで答える
+void serve(modbus_t* ctx, int server_socket, bool batching, ReplyResult& result)
+{
+    modbus_mapping_t* mapping = modbus_mapping_new(0, 0, 100, 0);
+    uint8_t req[MODBUS_TCP_MAX_ADU_LENGTH];
+
+    if (modbus_tcp_accept(ctx, &server_socket) == -1) {
+        modbus_mapping_free(mapping);
+        return;
+    }
+    int option = 1;
+    setsockopt(modbus_get_socket(ctx), IPPROTO_TCP, TCP_NODELAY,
+        reinterpret_cast<const char*>(&option), sizeof(option));
+    if (batching) {
+        modbus_set_reply_batching(ctx, BENCH_REPLY_BATCH_SIZE);
+    }
+    modbus_reset_io_stats(ctx);
+    while (true) {
+        int rc = modbus_receive(ctx, req);
+        if (rc == -1) break;
+        if (rc > 0 && modbus_reply(ctx, req, rc, mapping) == -1) break;
+    }
+    modbus_get_io_stats(ctx, &result.stats);
+    modbus_set_reply_batching(ctx, 0);
+    modbus_close(ctx);
+    modbus_mapping_free(mapping);
+}
+
+ReplyResult run(int depth, bool batching)
+{
+    ReplyResult result;
+    modbus_t* server = modbus_new_tcp("127.0.0.1", BENCH_REPLY_PORT);
+    int server_socket = modbus_tcp_listen(server, 1);
+    if (server_socket == -1) {
+        std::printf("Unable to listen on port %d: %s\n", BENCH_REPLY_PORT, modbus_strerror(errno));
+        modbus_free(server);
+        return result;
+    }
+    std::thread thread(serve, server, server_socket, batching, std::ref(result));
+
+    modbus_t* client = modbus_new_tcp("127.0.0.1", BENCH_REPLY_PORT);
+    bool ok = modbus_connect(client) == 0;
+    const uint8_t raw_req[] = { 1, MODBUS_FC_READ_HOLDING_REGISTERS, 0, 0, 0, 10 };
+    uint8_t rsp[MODBUS_TCP_MAX_ADU_LENGTH];
+
+    BenchTimer timer;
+    for (int sent = 0; ok && sent < BENCH_REPLY_REQUESTS; sent += depth) {
+        for (int i = 0; ok && i < depth; ++i) {
+            ok = modbus_send_raw_request_tid(client, raw_req, sizeof(raw_req), sent + i) != -1;
+        }
+        for (int i = 0; ok && i < depth; ++i) {
+            ok = modbus_receive_confirmation(client, rsp) > 0;
+        }
+    }
+    result.seconds = timer.seconds();
+    modbus_close(client);
+    modbus_free(client);
+
+    thread.join();
+    // 待ち受けソケットを閉じる
+    modbus_set_socket(server, server_socket);
+    modbus_close(server);
+    modbus_free(server);
+
+    result.ok = ok && result.stats.nb_replies > 0;
+    return result;
+}
+
+} // namespace
+
+int bench_reply()
+{
+    std::printf("%5s %8s %9s %9s %9s %9s %10s\n",
+        "depth", "batching", "select/rq", "recv/rq", "send/rq", "total/rq", "req/s");
+    for (int depth : { 1, 4, 16, 64 }) {
+        for (bool batching : { false, true }) {
+            ReplyResult result = run(depth, batching);
+            if (!result.ok) return 1;
+
+            const modbus_io_stats_t& stats = result.stats;
+            double replies = stats.nb_replies;
+            std::printf("%5d %8s %9.2f %9.2f %9.2f %9.2f %10.0f\n",
+                depth, batching ? "on" : "off",
+                stats.nb_select_calls / replies, stats.nb_recv_calls / replies,
+                stats.nb_send_calls / replies,
+                (stats.nb_select_calls + stats.nb_recv_calls + stats.nb_send_calls) / replies,
+                stats.nb_replies / result.seconds);
+        }
+    }
+    return 0;
+}
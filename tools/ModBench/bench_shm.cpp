@@ -0,0 +1,224 @@
+// 共有メモリのレジスタイメージ（modbus-shm.h / modbus-shm-reader.h）
+// 400 レジスタの装置 2 台分のセグメントで、書き込み（modbus_shm_publish）1回と、
+// 読み取り（全 400 レジスタ・26 レジスタのコピー、その場で 2 レジスタ）1回の時間を測る。
+// 読み取りは、書き手が止まっているときと、書き続けているときの両方で測る。
+// 書き続けている間の読み手は、自分自身を読み手として起動した別のプロセスで、共有メモリを名前で開く
+// （seqlock をアドレス空間をまたいで確かめる）。書き手は全レジスタに同じ番号を書くので、
+// 混ざった値を読んだ回数（0 でなければ失敗）と、書き込みと重なってその場の読み取りをやり直した回数も数える。
+
+#include <cerrno>
+#include <cstdio>
+#include <string>
+
+#include "ModBench.h"
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <sys/wait.h>
+#include <unistd.h>
+#endif
+
+extern "C" {
+#include "../../libmodbus/modbus-shm-reader.h"
+}
+
+namespace {
+
+constexpr const char* BENCH_SHM_NAME = "Local\\ModBenchImage";
+constexpr int BENCH_SHM_DEVICES = 2;
+constexpr int BENCH_SHM_REGISTERS = 400;
+constexpr int BENCH_SHM_ROUNDS = 2000000;    // 1回の計測の回数
+
+struct ReadResult {
+    double full_ns = 0.0;
+    double flags_ns = 0.0;
+    double in_place_ns = 0.0;
+    long long nb_reads = 0;
+    long long nb_mixed = 0;
+    long long nb_retries = 0;
+    bool ok = false;
+};
+
+ReadResult read_image(const modbus_shm_reader_t& reader)
+{
+    ReadResult result;
+    uint16_t values[BENCH_SHM_REGISTERS];
+    const modbus_shm_device_t* dev = modbus_shm_reader_device(&reader, 1);
+
+    if (dev == nullptr) return result;
+
+    // 全レジスタ。書き手が同じ番号を書くので、1つでも違えば混ざっている（時間にはこの確認も入る）
+    BenchTimer timer;
+    for (int i = 0; i < BENCH_SHM_ROUNDS; ++i) {
+        if (modbus_shm_reader_read(&reader, 1, 0, BENCH_SHM_REGISTERS, values, nullptr) == -1) {
+            return result;
+        }
+        for (uint16_t value : values) {
+            if (value != values[0]) {
+                result.nb_mixed++;
+                break;
+            }
+        }
+    }
+    result.full_ns = timer.seconds() * 1e9 / BENCH_SHM_ROUNDS;
+    result.nb_reads = BENCH_SHM_ROUNDS;
+
+    // エラーフラグの 26 レジスタ
+    timer = BenchTimer();
+    for (int i = 0; i < BENCH_SHM_ROUNDS; ++i) {
+        if (modbus_shm_reader_read(&reader, 1, 300, 26, values, nullptr) == -1) return result;
+    }
+    result.flags_ns = timer.seconds() * 1e9 / BENCH_SHM_ROUNDS;
+
+    // その場で 2 レジスタ
+    const uint16_t* in_place = modbus_shm_device_values(reader.header, dev);
+    volatile uint32_t sink = 0;
+    timer = BenchTimer();
+    for (int i = 0; i < BENCH_SHM_ROUNDS; ++i) {
+        uint32_t seq;
+        uint32_t value;
+        bool first = true;
+        do {
+            if (!first) result.nb_retries++;
+            first = false;
+            seq = modbus_shm_read_begin(dev);
+            value = (static_cast<uint32_t>(in_place[10]) << 16) | in_place[11];
+        } while (modbus_shm_read_retry(dev, seq));
+        sink = value;
+    }
+    result.in_place_ns = timer.seconds() * 1e9 / BENCH_SHM_ROUNDS;
+    (void)sink;
+
+    result.ok = true;
+    return result;
+}
+
+void print_reads(const char* writer, const ReadResult& result)
+{
+    std::printf("%-14s %9.0f %9.0f %9.0f %10lld/%lld %9lld\n", writer,
+        result.full_ns, result.flags_ns, result.in_place_ns,
+        result.nb_mixed, result.nb_reads, result.nb_retries);
+}
+
+#ifdef _WIN32
+using ReaderProcess = HANDLE;
+#else
+using ReaderProcess = pid_t;
+#endif
+
+// 自分自身を ModBench shm-reader として起動する
+bool start_reader(ReaderProcess& process)
+{
+    std::fflush(stdout);
+#ifdef _WIN32
+    char path[MAX_PATH];
+    if (GetModuleFileNameA(nullptr, path, MAX_PATH) == 0) return false;
+    std::string command = std::string("\"") + path + "\" " + BENCH_SHM_READER_ARG;
+    STARTUPINFOA startup = { sizeof(startup) };
+    PROCESS_INFORMATION info;
+    if (!CreateProcessA(path, command.data(), nullptr, nullptr, FALSE, 0, nullptr, nullptr,
+            &startup, &info)) {
+        return false;
+    }
+    CloseHandle(info.hThread);
+    process = info.hProcess;
+    return true;
+#else
+    process = fork();
+    if (process == -1) return false;
+    if (process == 0) {
+        execl("/proc/self/exe", "ModBench", BENCH_SHM_READER_ARG, static_cast<char*>(nullptr));
+        _exit(127);
+    }
+    return true;
+#endif
+}
+
+// 読み手が終わっていれば終了コードを返す（まだ動いていれば -1）
+int reader_exit_code(ReaderProcess process)
+{
+#ifdef _WIN32
+    if (WaitForSingleObject(process, 0) != WAIT_OBJECT_0) return -1;
+    DWORD code = 1;
+    GetExitCodeProcess(process, &code);
+    CloseHandle(process);
+    return static_cast<int>(code);
+#else
+    int status;
+    pid_t rc = waitpid(process, &status, WNOHANG);
+    if (rc == 0) return -1;
+    if (rc == -1) return 1;
+    return WIFEXITED(status) ? WEXITSTATUS(status) : 1;
+#endif
+}
+
+} // namespace
+
+int bench_shm_reader()
+{
+    modbus_shm_reader_t reader;
+    if (modbus_shm_reader_open(&reader, BENCH_SHM_NAME) == -1) {
+        std::printf("Unable to open %s: %s\n", BENCH_SHM_NAME, modbus_strerror(errno));
+        return 1;
+    }
+
+    ReadResult busy = read_image(reader);
+    modbus_shm_reader_close(&reader);
+    if (busy.ok) print_reads("nonstop", busy);
+    return busy.ok && busy.nb_mixed == 0 ? 0 : 1;
+}
+
+int bench_shm()
+{
+    modbus_shm_t* shm = modbus_shm_new(BENCH_SHM_NAME, BENCH_SHM_DEVICES, BENCH_SHM_REGISTERS);
+    if (shm == nullptr) {
+        std::printf("Unable to create %s: %s\n", BENCH_SHM_NAME, modbus_strerror(errno));
+        return 1;
+    }
+
+    uint16_t values[BENCH_SHM_REGISTERS] = {};
+    uint64_t scan = 0;
+
+    // 書き込み 1 回
+    BenchTimer timer;
+    for (int i = 0; i < BENCH_SHM_ROUNDS; ++i) {
+        modbus_shm_publish(shm, 1 + i % BENCH_SHM_DEVICES, values, nullptr, ++scan, 0, 0);
+    }
+    std::printf("publish (whole slot of %d registers): %.0f ns\n\n", BENCH_SHM_REGISTERS,
+        timer.seconds() * 1e9 / BENCH_SHM_ROUNDS);
+
+    modbus_shm_reader_t reader;
+    if (modbus_shm_reader_open(&reader, BENCH_SHM_NAME) == -1) {
+        std::printf("Unable to open %s: %s\n", BENCH_SHM_NAME, modbus_strerror(errno));
+        modbus_shm_free(shm);
+        return 1;
+    }
+
+    std::printf("%-14s %9s %9s %9s %15s %9s\n", "writer", "400 regs", "26 regs", "in place", "mixed/reads", "retries");
+    ReadResult idle = read_image(reader);
+    if (idle.ok) print_reads("idle", idle);
+
+    modbus_shm_reader_close(&reader);
+
+    // 読み手のプロセスが終わるまで、全レジスタに同じ番号を書き続ける（表の行は読み手が出す）
+    ReaderProcess process;
+    if (!start_reader(process)) {
+        std::printf("Unable to start the reader process\n");
+        modbus_shm_free(shm);
+        return 1;
+    }
+    uint16_t image[BENCH_SHM_REGISTERS];
+    uint16_t counter = 0;
+    int reader_code;
+    do {
+        for (int i = 0; i < 1000; ++i) {
+            ++counter;
+            for (uint16_t& value : image) value = counter;
+            modbus_shm_publish(shm, 1, image, nullptr, ++scan, 0, 0);
+        }
+    } while ((reader_code = reader_exit_code(process)) == -1);
+
+    modbus_shm_free(shm);
+    return idle.ok && reader_code == 0 ? 0 : 1;
+}
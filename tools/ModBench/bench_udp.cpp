@@ -0,0 +1,127 @@
+// Modbus/UDP の一括読み取り（modbus_udp_read_registers_batch）
+// ループバックの UDP サーバー（modbus_udp_listen + modbus_receive / modbus_reply）を
+// 装置 n 台分（ユニット 1〜n）に見立て、各装置の 64 レジスタを読む1周を
+// 1台ずつの modbus_read_registers と一括読み取りで比べる。
+// 1周あたりの時間と、クライアント側の send・recv のシステムコール回数を出す。
+// サーバーは1スレッドなので、台数が多いときはサーバー側が律速になる。
+
+#include <atomic>
+#include <cerrno>
+#include <cstdio>
+#include <thread>
+#include <vector>
+
+#include "ModBench.h"
+
+namespace {
+
+constexpr int BENCH_UDP_PORT = 15041;
+constexpr int BENCH_UDP_REGISTERS = 64;
+constexpr int BENCH_UDP_SCANS = 200;    // 1回の計測の周回数
+
+struct ScanResult {
+    double us_per_scan = 0.0;
+    double send_per_scan = 0.0;
+    double recv_per_scan = 0.0;
+    bool ok = false;
+};
+
+// stop が立つまで、どのユニット宛ての要求にも同じレジスタで答える
+void serve(modbus_t* ctx, const std::atomic<bool>& stop)
+{
+    modbus_mapping_t* mapping = modbus_mapping_new(0, 0, BENCH_UDP_REGISTERS, 0);
+    uint8_t req[MODBUS_UDP_MAX_ADU_LENGTH];
+
+    for (int i = 0; i < BENCH_UDP_REGISTERS; ++i) {
+        mapping->tab_registers[i] = static_cast<uint16_t>(i);
+    }
+    // 止めるときに受信待ちから抜けるため
+    modbus_set_indication_timeout(ctx, 0, 100000);
+    while (!stop) {
+        int rc = modbus_receive(ctx, req);
+        if (rc > 0) modbus_reply(ctx, req, rc, mapping);
+    }
+    modbus_mapping_free(mapping);
+}
+
+ScanResult scan(modbus_t* client, int nb_devices, bool batch)
+{
+    ScanResult result;
+    std::vector<uint16_t> dest(nb_devices * BENCH_UDP_REGISTERS);
+    std::vector<modbus_udp_read_t> reads(nb_devices);
+    modbus_io_stats_t stats;
+
+    for (int i = 0; i < nb_devices; ++i) {
+        reads[i] = {};
+        reads[i].ip = "127.0.0.1";
+        reads[i].port = BENCH_UDP_PORT;
+        reads[i].slave = i + 1;
+        reads[i].addr = 0;
+        reads[i].nb = BENCH_UDP_REGISTERS;
+        reads[i].dest = &dest[i * BENCH_UDP_REGISTERS];
+    }
+
+    modbus_reset_io_stats(client);
+    BenchTimer timer;
+    for (int n = 0; n < BENCH_UDP_SCANS; ++n) {
+        if (batch) {
+            if (modbus_udp_read_registers_batch(client, reads.data(), nb_devices) == -1) return result;
+            for (const modbus_udp_read_t& read : reads) {
+                if (read.rc != BENCH_UDP_REGISTERS) return result;
+            }
+        } else {
+            for (const modbus_udp_read_t& read : reads) {
+                modbus_set_slave(client, read.slave);
+                if (modbus_read_registers(client, read.addr, read.nb, read.dest) != BENCH_UDP_REGISTERS) {
+                    return result;
+                }
+            }
+        }
+    }
+    double seconds = timer.seconds();
+    modbus_get_io_stats(client, &stats);
+
+    result.us_per_scan = seconds * 1e6 / BENCH_UDP_SCANS;
+    result.send_per_scan = static_cast<double>(stats.nb_send_calls) / BENCH_UDP_SCANS;
+    result.recv_per_scan = static_cast<double>(stats.nb_recv_calls) / BENCH_UDP_SCANS;
+    result.ok = dest[BENCH_UDP_REGISTERS - 1] == BENCH_UDP_REGISTERS - 1;
+    return result;
+}
+
+} // namespace
+
+int bench_udp()
+{
+    modbus_t* server = modbus_new_udp("127.0.0.1", BENCH_UDP_PORT);
+    if (modbus_udp_listen(server) == -1) {
+        std::printf("Unable to listen on UDP port %d: %s\n", BENCH_UDP_PORT, modbus_strerror(errno));
+        modbus_free(server);
+        return 1;
+    }
+    std::atomic<bool> stop = false;
+    std::thread thread(serve, server, std::cref(stop));
+
+    modbus_t* client = modbus_new_udp("127.0.0.1", BENCH_UDP_PORT);
+    bool ok = modbus_connect(client) == 0;
+    modbus_set_response_timeout(client, 0, 200000);
+
+    std::printf("%7s %8s %10s %10s %10s\n", "devices", "mode", "us/scan", "send/scan", "recv/scan");
+    for (int nb_devices : { 1, 16, 64 }) {
+        for (bool batch : { false, true }) {
+            if (!ok) break;
+            ScanResult result = scan(client, nb_devices, batch);
+            ok = result.ok;
+            if (!ok) break;
+            std::printf("%7d %8s %10.1f %10.1f %10.1f\n", nb_devices, batch ? "batch" : "one/one",
+                result.us_per_scan, result.send_per_scan, result.recv_per_scan);
+        }
+    }
+
+    modbus_close(client);
+    modbus_free(client);
+    stop = true;
+    thread.join();
+    modbus_close(server);
+    modbus_free(server);
+    return ok ? 0 : 1;
+}